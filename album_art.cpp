@@ -0,0 +1,345 @@
+#include "album_art.hpp"
+#include "content_hash.hpp"
+#include "metrics.hpp"
+#include "tag_functions.hpp"
+#include "misc.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+
+namespace {
+
+/**
+ * Returns the file extension for an encoded image, judged by its signature.
+ */
+const char *getImageExtension(const std::string &picture) {
+    const char *data = picture.data();
+    size_t size = picture.size();
+
+    if (size >= 8 && memcmp(data, "\x89PNG\r\n\x1A\n", 8) == 0)
+        return "png";
+    if (size >= 3 && memcmp(data, "\xFF\xD8\xFF", 3) == 0)
+        return "jpg";
+    if (size >= 6 && (memcmp(data, "GIF87a", 6) == 0 || memcmp(data, "GIF89a", 6) == 0))
+        return "gif";
+    if (size >= 12 && memcmp(data, "RIFF", 4) == 0 && memcmp(data + 8, "WEBP", 4) == 0)
+        return "webp";
+    if (size >= 2 && memcmp(data, "BM", 2) == 0)
+        return "bmp";
+    return "img";
+}
+
+}
+
+/**
+ * Constructs an extractor, opens its own connection to the database and starts
+ * its worker threads.
+ *
+ * \param db_path The path to the database file.
+ * \param cache_directory The directory to store images in. It is created if
+ *                        it does not exist.
+ * \param options The number of worker threads and how many songs of an album
+ *                to look at.
+ * \param callback If set, called with the album ID and art location (empty if
+ *                 the album has none) each time an album is extracted.
+ *
+ * Albums whose art was extracted before are remembered, unless their image
+ * has disappeared from the cache. If the database cannot be opened or the
+ * cache directory cannot be created, the error is logged and isValid()
+ * returns \c false.
+ */
+AlbumArtExtractor::AlbumArtExtractor(const std::string &db_path, const std::string &cache_directory, const ArtOptions &options,
+                                     Callback callback)
+    : cache_directory(cache_directory), options(options), callback(callback), db(nullptr), select_songs(nullptr),
+      update_album(nullptr), stopping(false), generation(0), sequence(0) {
+    std::error_code error;
+    sqlite3_stmt *stmt;
+
+    std::filesystem::create_directories(cache_directory, error);
+    if (error) {
+        logAt(LogLevel::Error, "Unable to create album art cache %s: %s\n", cache_directory.c_str(), error.message().c_str());
+        return;
+    }
+    if (sqlite3_open(db_path.c_str(), &db) != SQLITE_OK) {
+        logAt(LogLevel::Error, "Can't open database %s: %s\n", db_path.c_str(), sqlite3_errmsg(db));
+        sqlite3_close(db);
+        db = nullptr;
+        return;
+    }
+    // Ingest may be writing at the same time.
+    sqlite3_busy_timeout(db, 5000);
+    if (sqlite3_prepare_v3(db, "SELECT location FROM Songs WHERE album_id = ?1 ORDER BY disc_number, track_number LIMIT ?2;", -1,
+                           SQLITE_PREPARE_PERSISTENT, &select_songs, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v3(db, "UPDATE Albums SET album_art_location = ?1 WHERE id = ?2;", -1, SQLITE_PREPARE_PERSISTENT,
+                           &update_album, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(db, "SELECT id, album_art_location FROM Albums WHERE album_art_location IS NOT NULL;", -1, &stmt,
+                           NULL) != SQLITE_OK) {
+        logAt(LogLevel::Error, "Error while preparing album art statements: %s\n", sqlite3_errmsg(db));
+        sqlite3_close_v2(db);
+        db = nullptr;
+        return;
+    }
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        const char *location = (const char *)sqlite3_column_text(stmt, 1);
+        if (*location == '\0' || std::filesystem::exists(location, error))
+            locations[sqlite3_column_int(stmt, 0)] = location;
+    }
+    sqlite3_finalize(stmt);
+
+    for (unsigned int i = 0; i < std::max(1u, options.worker_threads); i++)
+        workers.emplace_back(&AlbumArtExtractor::work, this);
+}
+
+/**
+ * Stops the workers and closes the database connection.
+ */
+AlbumArtExtractor::~AlbumArtExtractor() {
+    stop();
+    sqlite3_finalize(select_songs);
+    sqlite3_finalize(update_album);
+    sqlite3_close(db);
+}
+
+/**
+ * Checks if the extractor was started successfully.
+ *
+ * \return \c true if the extractor can be used and \c false otherwise.
+ */
+bool AlbumArtExtractor::isValid() const {
+    return db != nullptr;
+}
+
+/**
+ * Looks up the art of an album, requesting it if it has not been extracted yet.
+ *
+ * \param album_id The ID of the album.
+ * \param location Receives the path of the album's image, if there is one.
+ * \return \c 1 if the art is available, \c 0 if it has been requested, or
+ *         \c -1 if the album has no art.
+ *
+ * This never waits for disk or database access, so it can be called for
+ * every album a view draws. New requests wait behind visible albums.
+ */
+int AlbumArtExtractor::getArtLocation(int album_id, std::string &location) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto known = locations.find(album_id);
+    if (known != locations.end()) {
+        location = known->second;
+        return location.empty() ? -1 : 1;
+    }
+    if (!queued.count(album_id) && !extracting.count(album_id))
+        enqueue(album_id, 0);
+    return 0;
+}
+
+/**
+ * Requests the art of an album in the background, unless it is already known
+ * or requested.
+ *
+ * \param album_id The ID of the album.
+ */
+void AlbumArtExtractor::request(int album_id) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!locations.count(album_id) && !queued.count(album_id) && !extracting.count(album_id))
+        enqueue(album_id, 0);
+}
+
+/**
+ * Moves the albums on screen to the front of the queue.
+ *
+ * \param album_ids The albums now visible, in the order they should be served
+ *                  (usually top to bottom).
+ *
+ * Albums from earlier calls keep their place ahead of background requests,
+ * but behind these.
+ */
+void AlbumArtExtractor::setVisibleAlbums(const std::vector<int> &album_ids) {
+    std::lock_guard<std::mutex> lock(mutex);
+    generation++;
+    for (int album_id : album_ids)
+        if (!locations.count(album_id) && !extracting.count(album_id))
+            enqueue(album_id, generation);
+}
+
+/**
+ * Requests the art of every album that has not been searched for art yet.
+ *
+ * \return The number of albums requested, or \c -1 if an error occurs.
+ */
+int AlbumArtExtractor::requestMissingArt() {
+    std::vector<int> album_ids;
+    sqlite3_stmt *stmt;
+    int rc;
+
+    if (!isValid())
+        return -1;
+    {
+        std::lock_guard<std::mutex> db_lock(db_mutex);
+        if (sqlite3_prepare_v2(db, "SELECT id FROM Albums WHERE album_art_location IS NULL ORDER BY id;", -1, &stmt, NULL) != SQLITE_OK) {
+            logAt(LogLevel::Error, "Error while listing albums without art: %s\n", sqlite3_errmsg(db));
+            return -1;
+        }
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+            album_ids.push_back(sqlite3_column_int(stmt, 0));
+        sqlite3_finalize(stmt);
+        if (rc != SQLITE_DONE) {
+            logAt(LogLevel::Error, "Error while listing albums without art: %s\n", sqlite3_errmsg(db));
+            return -1;
+        }
+    }
+    for (int album_id : album_ids)
+        request(album_id);
+    return (int)album_ids.size();
+}
+
+/**
+ * Stops the workers, abandoning queued requests. Albums being extracted are
+ * finished first.
+ */
+void AlbumArtExtractor::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto &worker : workers)
+        worker.join();
+    workers.clear();
+}
+
+/**
+ * Queues an album, or raises its priority if it is queued with a lower one.
+ * Must be called with mutex held.
+ */
+void AlbumArtExtractor::enqueue(int album_id, uint64_t priority) {
+    auto existing = queued.find(album_id);
+    if (existing != queued.end()) {
+        if (existing->second->priority >= priority)
+            return;
+        queue.erase(existing->second);
+    }
+    queued[album_id] = queue.insert({ priority, sequence++, album_id }).first;
+    wake.notify_one();
+}
+
+/**
+ * The loop of a worker thread: extracts the most urgent album until stopped.
+ */
+void AlbumArtExtractor::work() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        wake.wait(lock, [this] { return stopping || !queue.empty(); });
+        if (stopping)
+            return;
+        int album_id = queue.begin()->album_id;
+        queue.erase(queue.begin());
+        queued.erase(album_id);
+        extracting.insert(album_id);
+
+        lock.unlock();
+        std::string location;
+        int rc = extract(album_id, location);
+        lock.lock();
+
+        extracting.erase(album_id);
+        if (rc != 0)
+            continue;
+        locations[album_id] = location;
+        if (callback) {
+            lock.unlock();
+            callback(album_id, location);
+            lock.lock();
+        }
+    }
+}
+
+/**
+ * Finds the first song of an album with a picture, caches the picture and
+ * records its location.
+ *
+ * \return \c 0 on success, including for albums without art, or \c -1 if the
+ *         album's songs cannot be looked up, a song that might hold its art
+ *         cannot be read, or the art cannot be stored or recorded. The album
+ *         is left unrecorded then, so it is tried again later.
+ */
+int AlbumArtExtractor::extract(int album_id, std::string &location) {
+    ScopedTimer timer(MetricStage::ExtractArt);
+    std::vector<std::string> songs;
+    std::string picture;
+    bool all_read = true;
+    int rc;
+
+    {
+        std::lock_guard<std::mutex> db_lock(db_mutex);
+        sqlite3_bind_int(select_songs, 1, album_id);
+        sqlite3_bind_int(select_songs, 2, (int)options.songs_per_album);
+        while ((rc = sqlite3_step(select_songs)) == SQLITE_ROW)
+            songs.emplace_back((const char *)sqlite3_column_text(select_songs, 0));
+        sqlite3_reset(select_songs);
+        if (rc != SQLITE_DONE) {
+            logAt(LogLevel::Error, "Error while looking up songs of album %d: %s\n", album_id, sqlite3_errmsg(db));
+            return -1;
+        }
+    }
+
+    location.clear();
+    for (auto &song : songs) {
+        rc = readPicture(song, picture);
+        if (rc < 0)
+            all_read = false;
+        else if (rc == 0) {
+            if (storePicture(picture, location) != 0)
+                return -1;
+            break;
+        }
+    }
+    // An album is only recorded as having no art if every song was looked at.
+    if (location.empty() && !all_read) {
+        logAt(LogLevel::Warning, "Unable to read every song of album %d while looking for its art\n", album_id);
+        return -1;
+    }
+
+    std::lock_guard<std::mutex> db_lock(db_mutex);
+    sqlite3_bind_text(update_album, 1, location.c_str(), (int)location.size(), SQLITE_TRANSIENT);
+    sqlite3_bind_int(update_album, 2, album_id);
+    rc = sqlite3_step(update_album);
+    sqlite3_reset(update_album);
+    if (rc != SQLITE_DONE) {
+        logAt(LogLevel::Error, "Error while storing art location of album %d: %s\n", album_id, sqlite3_errmsg(db));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Writes an image to the cache under its hash, unless it is there already.
+ *
+ * The image is written to a temporary file first and renamed into place, so
+ * readers never see a partial image.
+ */
+int AlbumArtExtractor::storePicture(const std::string &picture, std::string &location) {
+    char name[32];
+    std::error_code error;
+
+    snprintf(name, sizeof(name), "%016llx.", (unsigned long long)xxHash64(picture.data(), picture.size()));
+    std::filesystem::path path = std::filesystem::path(cache_directory) / (std::string(name) + getImageExtension(picture));
+    if (!std::filesystem::exists(path, error)) {
+        std::filesystem::path temporary = path;
+        temporary += "." + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) + ".tmp";
+        std::ofstream out(temporary, std::ios::binary);
+        out.write(picture.data(), (std::streamsize)picture.size());
+        out.close();
+        if (out)
+            std::filesystem::rename(temporary, path, error);
+        if (!out || error) {
+            logAt(LogLevel::Error, "Unable to write album art %s\n", path.string().c_str());
+            std::filesystem::remove(temporary, error);
+            return -1;
+        }
+    }
+    location = path.string();
+    return 0;
+}
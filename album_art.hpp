@@ -0,0 +1,94 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <sqlite3.h>
+
+struct ArtOptions {
+    unsigned int worker_threads = 2;        // threads reading pictures and writing the cache
+    unsigned int songs_per_album = 8;       // songs of an album tried before it is deemed to have no art
+};
+
+/**
+ * Extracts album art on demand into a content-addressed cache directory.
+ *
+ * Each album's art is read once, through readPicture(), from the first of its
+ * songs that has an embedded picture. The image is stored as
+ * <cache directory>/<XXH64 of the image>.<format>, so albums that share a
+ * cover share one file, and its path is recorded in Albums.album_art_location.
+ * Albums whose songs could all be read and hold no picture are recorded with
+ * an empty location, so they are not searched again. An album whose songs
+ * could not all be read, or whose art could not be stored, is left as it was
+ * and searched again the next time it is requested.
+ *
+ * Requests are served by worker threads from a priority queue. Albums marked
+ * visible with setVisibleAlbums() go first, the most recently marked screen
+ * ahead of older ones, and in the order they were given. Other requests wait
+ * behind them in the order they arrived. The callback, if any, is invoked from
+ * a worker thread as each album finishes.
+ */
+class AlbumArtExtractor {
+    public:
+        typedef std::function<void(int album_id, const std::string &location)> Callback;
+
+        AlbumArtExtractor(const std::string &db_path, const std::string &cache_directory, const ArtOptions &options = ArtOptions(),
+                          Callback callback = Callback());
+        ~AlbumArtExtractor();
+
+        AlbumArtExtractor(const AlbumArtExtractor &) = delete;
+        AlbumArtExtractor &operator=(const AlbumArtExtractor &) = delete;
+
+        bool isValid() const;
+        int getArtLocation(int album_id, std::string &location);
+        void request(int album_id);
+        void setVisibleAlbums(const std::vector<int> &album_ids);
+        int requestMissingArt();
+        void stop();
+
+    private:
+        struct QueueEntry {
+            uint64_t priority;          // 0 for background requests, the screen generation for visible ones
+            uint64_t sequence;          // order within the same priority
+            int album_id;
+
+            bool operator<(const QueueEntry &other) const {
+                if (priority != other.priority)
+                    return priority > other.priority;
+                if (sequence != other.sequence)
+                    return sequence < other.sequence;
+                return album_id < other.album_id;
+            }
+        };
+
+        void enqueue(int album_id, uint64_t priority);
+        void work();
+        int extract(int album_id, std::string &location);
+        int storePicture(const std::string &picture, std::string &location);
+
+        std::string cache_directory;
+        ArtOptions options;
+        Callback callback;
+        sqlite3 *db;
+        sqlite3_stmt *select_songs;
+        sqlite3_stmt *update_album;
+        std::mutex db_mutex;                // guards db and its statements
+
+        std::mutex mutex;                   // guards everything below
+        std::condition_variable wake;
+        bool stopping;
+        uint64_t generation;
+        uint64_t sequence;
+        std::set<QueueEntry> queue;
+        std::unordered_map<int, std::set<QueueEntry>::iterator> queued;     // album ID -> its queue entry
+        std::unordered_set<int> extracting;                                 // albums a worker is busy with
+        std::unordered_map<int, std::string> locations;                     // albums already extracted
+        std::vector<std::thread> workers;
+};
@@ -0,0 +1,293 @@
+#include "synthetic_library.hpp"
+#include "database_functions.hpp"
+#include "directory_walker.hpp"
+#include "ingest.hpp"
+#include "trie.hpp"
+#include "misc.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <set>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+/**
+ * The wall-clock times of every repetition of one benchmark, and how many
+ * items (files, strings, names, words) each repetition processed.
+ */
+struct Timing {
+    std::string name;
+    size_t items = 0;
+    std::vector<double> seconds;
+
+    double getMedian() const {
+        std::vector<double> sorted = seconds;
+        std::sort(sorted.begin(), sorted.end());
+        size_t middle = sorted.size() / 2;
+        return sorted.size() % 2 ? sorted[middle] : (sorted[middle - 1] + sorted[middle]) / 2;
+    }
+};
+
+/**
+ * Runs a benchmark repeats times. run() does the work once and returns the
+ * number of items it processed.
+ */
+template <typename F>
+Timing measure(const char *name, size_t repeats, F run) {
+    Timing timing;
+    timing.name = name;
+    for (size_t i = 0; i < repeats; i++) {
+        auto start = std::chrono::steady_clock::now();
+        timing.items = run();
+        auto end = std::chrono::steady_clock::now();
+        timing.seconds.push_back(std::chrono::duration<double>(end - start).count());
+    }
+    std::cerr << name << ": " << timing.getMedian() * 1000 << " ms for " << timing.items << " items" << std::endl;
+    return timing;
+}
+
+/**
+ * Creates an empty database, replacing any file already at db_path.
+ */
+sqlite3 *openFreshDatabase(const std::string &db_path) {
+    sqlite3 *db;
+    std::error_code ec;
+
+    std::filesystem::remove(db_path, ec);
+    if (createDatabase(db_path.c_str()) != 0 || sqlite3_open(db_path.c_str(), &db) != SQLITE_OK) {
+        std::cerr << "Unable to create database " << db_path << std::endl;
+        exit(1);
+    }
+    return db;
+}
+
+void writeJson(std::ostream &out, size_t files, size_t repeats, unsigned int seed, unsigned long long library_bytes,
+               const std::vector<Timing> &timings, size_t trie_words, size_t trie_memory) {
+    out << "{\n";
+    out << "  \"files\": " << files << ",\n";
+    out << "  \"repeat\": " << repeats << ",\n";
+    out << "  \"seed\": " << seed << ",\n";
+    out << "  \"library_bytes\": " << library_bytes << ",\n";
+    out << "  \"benchmarks\": [\n";
+    for (size_t i = 0; i < timings.size(); i++) {
+        const Timing &timing = timings[i];
+        double median = timing.getMedian();
+        out << "    {\"name\": \"" << timing.name << "\", \"items\": " << timing.items
+            << ", \"median_seconds\": " << median
+            << ", \"min_seconds\": " << *std::min_element(timing.seconds.begin(), timing.seconds.end())
+            << ", \"max_seconds\": " << *std::max_element(timing.seconds.begin(), timing.seconds.end())
+            << ", \"items_per_second\": " << (median > 0 ? timing.items / median : 0) << "}"
+            << (i + 1 < timings.size() ? "," : "") << "\n";
+    }
+    out << "  ],\n";
+    out << "  \"trie\": {\"words\": " << trie_words << ", \"memory_bytes\": " << trie_memory << "}\n";
+    out << "}" << std::endl;
+}
+
+int main(int argc, char **argv) {
+    size_t file_count = 3000, repeats = 5;
+    unsigned int seed = 42;
+    std::string root, output;
+    bool keep = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--files") == 0 && i + 1 < argc)
+            file_count = (size_t)atol(argv[++i]);
+        else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc)
+            repeats = std::max(1L, atol(argv[++i]));
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+            seed = (unsigned int)atol(argv[++i]);
+        else if (strcmp(argv[i], "--dir") == 0 && i + 1 < argc)
+            root = argv[++i];
+        else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc)
+            output = argv[++i];
+        else if (strcmp(argv[i], "--keep") == 0)
+            keep = true;
+        else {
+            std::cout << "Usage: " << argv[0] << " [--files N] [--repeat N] [--seed N] [--dir library directory] [--output JSON file] [--keep]" << std::endl;
+            return 1;
+        }
+    }
+    std::filesystem::path temp = std::filesystem::temp_directory_path();
+    std::string tag = "project_dbs_bench_" + std::to_string(getpid());
+    if (root.empty())
+        root = (temp / tag).string();
+    std::string db_path = (temp / (tag + ".sqlite")).string();
+    // Only warnings and errors, so the log file does not fill up with one line per run.
+    setLogLevel(LogLevel::Warning);
+
+    std::vector<Timing> timings;
+    std::vector<std::string> files;
+    std::error_code ec;
+    // The library is deleted afterwards, so it must not share the directory with anything else.
+    bool created_root = !std::filesystem::exists(root, ec);
+    if (!created_root && !std::filesystem::is_empty(root, ec)) {
+        std::cerr << "Refusing to generate a library in " << root << ": the directory is not empty" << std::endl;
+        return 1;
+    }
+    timings.push_back(measure("generate", 1, [&] {
+        if (generateSyntheticLibrary(root, file_count, seed, &files) != 0) {
+            std::cerr << "Unable to generate a library in " << root << std::endl;
+            exit(1);
+        }
+        return files.size();
+    }));
+    unsigned long long library_bytes = 0;
+    for (auto &file : files)
+        library_bytes += std::filesystem::file_size(file, ec);
+
+    timings.push_back(measure("getFiles", repeats, [&] { return getFiles(root).size(); }));
+    timings.push_back(measure("walkDirectory_stat", repeats, [&] {
+        // As ingest walks: several threads, audio files only, each file stat'ed.
+        WalkOptions walk_options;
+        size_t found = 0;
+        walk_options.threads = IngestOptions().traversal_threads;
+        walk_options.audio_files_only = true;
+        walk_options.stat_files = true;
+        walkDirectory(root, walk_options, [&](const std::string &, const FileStat &) { found++; });
+        return found;
+    }));
+
+    std::vector<Metadata> songs;
+    timings.push_back(measure("getMetadata", repeats, [&] {
+        songs.clear();
+        for (auto &file : files)
+            songs.push_back(getMetadata(file));
+        return songs.size();
+    }));
+    timings.push_back(measure("getMetadata_taglib", repeats, [&] {
+        size_t read = 0;
+        for (auto &file : files) {
+            Metadata metadata;
+            read += readTagLibMetadata(file, metadata) == 0;
+        }
+        return read;
+    }));
+
+    // The tag strings as TagLib returns them, before splitting.
+    std::vector<std::string> tag_strings;
+    for (auto &song : songs) {
+        std::string artists, genres;
+        for (auto &artist : song.contributing_artists)
+            artists += (artists.empty() ? "" : " & ") + artist;
+        for (auto &genre : song.genres)
+            genres += (genres.empty() ? "" : "; ") + genre;
+        tag_strings.push_back(artists);
+        tag_strings.push_back(genres);
+    }
+    size_t found = 0;
+    timings.push_back(measure("splitString", repeats, [&] {
+        size_t calls = 0;
+        while (calls < 200000 && !tag_strings.empty()) {
+            for (auto &s : tag_strings)
+                found += splitString(s).size();
+            calls += tag_strings.size();
+        }
+        return calls;
+    }));
+
+    std::set<std::string> artist_set;
+    for (auto &song : songs)
+        artist_set.insert(song.contributing_artists.begin(), song.contributing_artists.end());
+    std::vector<std::string> artists(artist_set.begin(), artist_set.end());
+    // Every new name is its own transaction, so the list is capped to keep the run short.
+    if (artists.size() > 500)
+        artists.resize(500);
+    sqlite3 *db = nullptr;
+    timings.push_back(measure("getEntityId_insert", repeats, [&] {
+        if (db != nullptr)
+            closeDatabase(db);
+        db = openFreshDatabase(db_path);
+        for (auto &artist : artists)
+            getEntityId(db, EntityType::Artist, artist);
+        return artists.size();
+    }));
+    timings.push_back(measure("getEntityId_lookup", repeats, [&] {
+        for (auto &artist : artists)
+            getEntityId(db, EntityType::Artist, artist);
+        return artists.size();
+    }));
+    closeDatabase(db);
+    db = nullptr;
+
+    timings.push_back(measure("ingest", repeats, [&] {
+        IngestStats stats;
+        if (db != nullptr)
+            sqlite3_close(db);
+        db = openFreshDatabase(db_path);
+        ingestLibrary(db, root, IngestOptions(), &stats);
+        return stats.songs_written;
+    }));
+    timings.push_back(measure("rescan_unchanged", repeats, [&] {
+        IngestOptions options;
+        IngestStats stats;
+        options.incremental = true;
+        ingestLibrary(db, root, options, &stats);
+        return stats.files_unchanged;
+    }));
+    sqlite3_close(db);
+
+    std::set<std::string> word_set;
+    for (auto &song : songs) {
+        word_set.insert(toSearchKey(song.title));
+        word_set.insert(toSearchKey(song.album));
+        for (auto &artist : song.contributing_artists)
+            word_set.insert(toSearchKey(artist));
+    }
+    std::vector<std::string> words(word_set.begin(), word_set.end());
+    Trie trie;
+    timings.push_back(measure("trie_insert", repeats, [&] {
+        trie = Trie();
+        for (size_t i = 0; i < words.size(); i++)
+            trie.insert(words[i], TrieEntry{(int)i, EntityType::Song, (int)(i % 100)});
+        return words.size();
+    }));
+    trie.compact();
+    timings.push_back(measure("trie_lookup", repeats, [&] {
+        for (auto &word : words)
+            found += trie.contains(word);
+        return words.size();
+    }));
+    timings.push_back(measure("trie_complete", repeats, [&] {
+        size_t queries = std::min<size_t>(words.size(), 2000);
+        for (size_t i = 0; i < queries; i++)
+            found += trie.completePrefix(words[i].substr(0, 2), 10).size();
+        return queries;
+    }));
+    timings.push_back(measure("trie_fuzzy", repeats, [&] {
+        size_t queries = std::min<size_t>(words.size(), 200);
+        for (size_t i = 0; i < queries; i++)
+            found += trie.fuzzySearch(words[i] + "x", 1, 10).size();
+        return queries;
+    }));
+
+    if (output.empty())
+        writeJson(std::cout, files.size(), repeats, seed, library_bytes, timings, words.size(), trie.getMemoryUsage());
+    else {
+        std::ofstream out(output);
+        writeJson(out, files.size(), repeats, seed, library_bytes, timings, words.size(), trie.getMemoryUsage());
+    }
+
+    std::filesystem::remove(db_path, ec);
+    // Everything in root was generated by the benchmark, but root itself is only removed if it created it.
+    if (!keep && created_root)
+        std::filesystem::remove_all(root, ec);
+    else if (!keep)
+        for (auto &entry : std::filesystem::directory_iterator(root, ec))
+            std::filesystem::remove_all(entry.path(), ec);
+    shutdownLog();
+    return found > 0 ? 0 : 1;
+}
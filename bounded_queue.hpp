@@ -0,0 +1,99 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+
+/**
+ * A fixed-capacity, multi-producer multi-consumer FIFO queue.
+ *
+ * push() blocks while the queue is full and pop() blocks while it is empty,
+ * which gives the stages of a pipeline natural back-pressure. Once close() is
+ * called, pending items can still be popped, but no new items are accepted,
+ * and pop() returns \c false when the queue has drained.
+ */
+template <typename T>
+class BoundedQueue {
+    public:
+        explicit BoundedQueue(size_t capacity) : capacity(capacity > 0 ? capacity : 1), closed(false) {}
+
+        BoundedQueue(const BoundedQueue &) = delete;
+        BoundedQueue &operator=(const BoundedQueue &) = delete;
+
+        /**
+         * Appends an item, waiting for free space if necessary.
+         *
+         * \param item The item to append.
+         * \return \c true if the item was queued, \c false if the queue is closed.
+         */
+        bool push(T item) {
+            std::unique_lock<std::mutex> lock(mutex);
+            not_full.wait(lock, [this] { return closed || items.size() < capacity; });
+            if (closed)
+                return false;
+            items.push_back(std::move(item));
+            lock.unlock();
+            not_empty.notify_one();
+            return true;
+        }
+
+        /**
+         * Appends an item if there is free space, without waiting.
+         *
+         * \param item The item to append.
+         * \return \c true if the item was queued, \c false if the queue is full or closed.
+         */
+        bool tryPush(T item) {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (closed || items.size() >= capacity)
+                return false;
+            items.push_back(std::move(item));
+            lock.unlock();
+            not_empty.notify_one();
+            return true;
+        }
+
+        /**
+         * Removes the oldest item, waiting for one to arrive if necessary.
+         *
+         * \param item Receives the removed item.
+         * \return \c true if an item was removed, \c false if the queue is closed and empty.
+         */
+        bool pop(T &item) {
+            std::unique_lock<std::mutex> lock(mutex);
+            not_empty.wait(lock, [this] { return closed || !items.empty(); });
+            if (items.empty())
+                return false;
+            item = std::move(items.front());
+            items.pop_front();
+            lock.unlock();
+            not_full.notify_one();
+            return true;
+        }
+
+        /**
+         * Stops accepting new items and wakes up every waiting thread.
+         */
+        void close() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                closed = true;
+            }
+            not_empty.notify_all();
+            not_full.notify_all();
+        }
+
+        size_t size() const {
+            std::lock_guard<std::mutex> lock(mutex);
+            return items.size();
+        }
+
+    private:
+        const size_t capacity;
+        bool closed;
+        std::deque<T> items;
+        mutable std::mutex mutex;
+        std::condition_variable not_empty;
+        std::condition_variable not_full;
+};
@@ -0,0 +1,402 @@
+#include "catalog.hpp"
+#include "database_functions.hpp"
+#include "metrics.hpp"
+#include "misc.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+namespace {
+
+const size_t SECTION_ALIGNMENT = 8;
+const size_t RECORD_SIZES[CATALOG_SECTION_COUNT] = {
+    sizeof(CatalogSong), sizeof(CatalogAlbum), sizeof(CatalogArtist), sizeof(CatalogGenre), sizeof(uint32_t), sizeof(char)
+};
+
+// A link from the record at one index to the record at another.
+typedef std::pair<uint32_t, uint32_t> Link;
+
+/**
+ * Runs a query and calls callback for each row it returns.
+ */
+int forEachRow(sqlite3 *db, const char *sql, const std::function<void(sqlite3_stmt *)> &callback) {
+    sqlite3_stmt *stmt;
+    int rc;
+
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        logAt(LogLevel::Error, "Error while preparing catalog query \"%s\": %s\n", sql, sqlite3_errmsg(db));
+        return -1;
+    }
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+        callback(stmt);
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE) {
+        logAt(LogLevel::Error, "Error while running catalog query \"%s\": %s\n", sql, sqlite3_errmsg(db));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Appends a text column to the string pool and returns its offset. NULL and
+ * empty strings share offset 0.
+ */
+uint32_t addString(std::string &pool, sqlite3_stmt *stmt, int column) {
+    const char *text = (const char *)sqlite3_column_text(stmt, column);
+    if (text == nullptr || *text == '\0')
+        return 0;
+    uint32_t offset = (uint32_t)pool.size();
+    pool.append(text, (size_t)sqlite3_column_bytes(stmt, column));
+    pool.push_back('\0');
+    return offset;
+}
+
+/**
+ * Returns the index of an ID in a sorted list of IDs, or CATALOG_NO_INDEX.
+ */
+uint32_t findIndex(const std::vector<int32_t> &ids, int id) {
+    auto it = std::lower_bound(ids.begin(), ids.end(), id);
+    return it != ids.end() && *it == id ? (uint32_t)(it - ids.begin()) : CATALOG_NO_INDEX;
+}
+
+/**
+ * Returns the index of the record with an ID in an array sorted by ID, or
+ * CATALOG_NO_INDEX.
+ */
+template <typename Record>
+uint32_t findRecord(const Record *records, size_t count, int id) {
+    const Record *it = std::lower_bound(records, records + count, id, [](const Record &record, int value) { return record.id < value; });
+    return it != records + count && it->id == id ? (uint32_t)(it - records) : CATALOG_NO_INDEX;
+}
+
+/**
+ * Appends one list per record to links, from links sorted by the index of the
+ * record they start at, and records where each record's list is.
+ */
+template <typename Record>
+void appendLinks(const std::vector<Link> &record_links, std::vector<Record> &records, uint32_t Record::*first, uint32_t Record::*count,
+                 std::vector<uint32_t> &links) {
+    size_t i = 0;
+    for (uint32_t index = 0; index < records.size(); index++) {
+        records[index].*first = (uint32_t)links.size();
+        for (; i < record_links.size() && record_links[i].first == index; i++)
+            links.push_back(record_links[i].second);
+        records[index].*count = (uint32_t)links.size() - records[index].*first;
+    }
+}
+
+/**
+ * Returns the same links in the opposite direction, sorted.
+ */
+std::vector<Link> reverseLinks(const std::vector<Link> &record_links) {
+    std::vector<Link> reversed;
+    reversed.reserve(record_links.size());
+    for (auto &link : record_links)
+        reversed.emplace_back(link.second, link.first);
+    std::sort(reversed.begin(), reversed.end());
+    return reversed;
+}
+
+/**
+ * Reads the links stored in a table of (owner ID, target ID) rows, ordered by
+ * owner and then target, as indexes. Rows referring to missing records are
+ * left out.
+ */
+int readLinks(sqlite3 *db, const char *sql, const std::vector<int32_t> &owner_ids, const std::vector<int32_t> &target_ids,
+              std::vector<Link> &record_links) {
+    return forEachRow(db, sql, [&](sqlite3_stmt *stmt) {
+        uint32_t owner = findIndex(owner_ids, sqlite3_column_int(stmt, 0));
+        uint32_t target = findIndex(target_ids, sqlite3_column_int(stmt, 1));
+        if (owner != CATALOG_NO_INDEX && target != CATALOG_NO_INDEX)
+            record_links.emplace_back(owner, target);
+    });
+}
+
+/**
+ * Writes a section, preceded by the padding that aligns it.
+ */
+void writeSection(FILE *file, const void *data, size_t size, uint64_t &offset) {
+    static const char k_padding[SECTION_ALIGNMENT] = {};
+    size_t padding = (SECTION_ALIGNMENT - offset % SECTION_ALIGNMENT) % SECTION_ALIGNMENT;
+
+    fwrite(k_padding, 1, padding, file);
+    if (size > 0)
+        fwrite(data, 1, size, file);
+    offset += padding + size;
+}
+
+}
+
+/**
+ * Maps a snapshot file and checks its header.
+ *
+ * \param path The path to the snapshot.
+ *
+ * If the file is missing, was written by another format version or on a
+ * machine of the other byte order, or is damaged, isValid() returns \c false.
+ */
+CatalogSnapshot::CatalogSnapshot(const std::string &path) : file(path), header(nullptr) {
+    const CatalogHeader *candidate = (const CatalogHeader *)file.data;
+
+    if (file.data == nullptr || file.size < sizeof(CatalogHeader))
+        return;
+    if (memcmp(candidate->magic, CATALOG_MAGIC, sizeof(candidate->magic)) != 0 || candidate->format_version != CATALOG_FORMAT_VERSION ||
+        candidate->header_size != sizeof(CatalogHeader) || candidate->byte_order != CATALOG_BYTE_ORDER ||
+        candidate->file_size != file.size) {
+        logAt(LogLevel::Warning, "Catalog snapshot %s has an unknown format or is truncated\n", path.c_str());
+        return;
+    }
+    for (int i = 0; i < CATALOG_SECTION_COUNT; i++) {
+        const CatalogSection &section = candidate->sections[i];
+        if (section.offset < sizeof(CatalogHeader) || section.offset > file.size || section.offset % SECTION_ALIGNMENT != 0 ||
+            section.count > (file.size - section.offset) / RECORD_SIZES[i]) {
+            logAt(LogLevel::Warning, "Catalog snapshot %s is damaged\n", path.c_str());
+            return;
+        }
+    }
+    const CatalogSection &strings = candidate->sections[CatalogStrings];
+    if (strings.count == 0 || file.data[strings.offset + strings.count - 1] != '\0') {
+        logAt(LogLevel::Warning, "Catalog snapshot %s is damaged\n", path.c_str());
+        return;
+    }
+    header = candidate;
+}
+
+/**
+ * Checks if the snapshot was opened successfully.
+ *
+ * \return \c true if the snapshot can be used and \c false otherwise.
+ */
+bool CatalogSnapshot::isValid() const {
+    return header != nullptr;
+}
+
+/**
+ * Returns the library version of the database the snapshot was taken from,
+ * or \c 0 if the snapshot is not valid.
+ */
+uint64_t CatalogSnapshot::getLibraryVersion() const {
+    return header != nullptr ? header->library_version : 0;
+}
+
+/**
+ * Finds a song by its database ID.
+ *
+ * \return The index of the song, or \c CATALOG_NO_INDEX if it is not in the snapshot.
+ */
+uint32_t CatalogSnapshot::findSong(int id) const {
+    return findRecord(getSongs(), getSongCount(), id);
+}
+
+/**
+ * Finds an album by its database ID.
+ *
+ * \return The index of the album, or \c CATALOG_NO_INDEX if it is not in the snapshot.
+ */
+uint32_t CatalogSnapshot::findAlbum(int id) const {
+    return findRecord(getAlbums(), getAlbumCount(), id);
+}
+
+/**
+ * Finds an artist by its database ID.
+ *
+ * \return The index of the artist, or \c CATALOG_NO_INDEX if it is not in the snapshot.
+ */
+uint32_t CatalogSnapshot::findArtist(int id) const {
+    return findRecord(getArtists(), getArtistCount(), id);
+}
+
+/**
+ * Finds a genre by its database ID.
+ *
+ * \return The index of the genre, or \c CATALOG_NO_INDEX if it is not in the snapshot.
+ */
+uint32_t CatalogSnapshot::findGenre(int id) const {
+    return findRecord(getGenres(), getGenreCount(), id);
+}
+
+/**
+ * @brief Writes a catalog snapshot of the library to a file.
+ *
+ * @details Everything is read in one read transaction, so the snapshot is
+ *          consistent, and tagged with the library version it was taken at.
+ *          The file is written next to its destination first and renamed into
+ *          place, so readers never see a partial snapshot, and snapshots that
+ *          are mapped keep their old contents. See catalog.hpp for the format.
+ *
+ * @param[in] db A pointer to the SQLite database connection.
+ * @param[in] path The path to write the snapshot to.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int writeCatalog(sqlite3 *db, const std::string &path) {
+    ScopedTimer timer(MetricStage::BuildCatalog);
+    std::vector<CatalogSong> songs;
+    std::vector<CatalogAlbum> albums;
+    std::vector<CatalogArtist> artists;
+    std::vector<CatalogGenre> genres;
+    std::vector<int32_t> song_ids, album_ids, artist_ids, genre_ids;
+    std::vector<Link> song_artists, song_genres, album_artists, album_songs;
+    std::vector<uint32_t> links;
+    std::string strings(1, '\0');
+    uint64_t library_version;
+    int rc;
+
+    if (sqlite3_exec(db, "SAVEPOINT write_catalog;", NULL, NULL, NULL) != SQLITE_OK) {
+        logAt(LogLevel::Error, "Error while starting to read the catalog: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+    rc = getLibraryVersion(db, library_version);
+    if (rc == 0)
+        rc = forEachRow(db, "SELECT id, title, album_art_location FROM Albums ORDER BY id;", [&](sqlite3_stmt *stmt) {
+            album_ids.push_back(sqlite3_column_int(stmt, 0));
+            albums.push_back({ album_ids.back(), addString(strings, stmt, 1), addString(strings, stmt, 2), 0, 0, 0, 0 });
+        });
+    if (rc == 0)
+        rc = forEachRow(db, "SELECT id, name FROM Artists ORDER BY id;", [&](sqlite3_stmt *stmt) {
+            artist_ids.push_back(sqlite3_column_int(stmt, 0));
+            artists.push_back({ artist_ids.back(), addString(strings, stmt, 1), 0, 0, 0, 0 });
+        });
+    if (rc == 0)
+        rc = forEachRow(db, "SELECT id, name FROM Genres ORDER BY id;", [&](sqlite3_stmt *stmt) {
+            genre_ids.push_back(sqlite3_column_int(stmt, 0));
+            genres.push_back({ genre_ids.back(), addString(strings, stmt, 1), 0, 0 });
+        });
+    if (rc == 0)
+        rc = forEachRow(db, "SELECT id, title, location, album_id, track_number, disc_number, rating FROM Songs ORDER BY id;",
+                        [&](sqlite3_stmt *stmt) {
+            song_ids.push_back(sqlite3_column_int(stmt, 0));
+            uint32_t album = sqlite3_column_type(stmt, 3) != SQLITE_NULL ? findIndex(album_ids, sqlite3_column_int(stmt, 3)) : CATALOG_NO_INDEX;
+            songs.push_back({ song_ids.back(), addString(strings, stmt, 1), addString(strings, stmt, 2), album, sqlite3_column_int(stmt, 4),
+                              sqlite3_column_int(stmt, 5), sqlite3_column_int(stmt, 6), 0, 0, 0, 0 });
+            if (album != CATALOG_NO_INDEX)
+                album_songs.emplace_back(album, (uint32_t)(songs.size() - 1));
+        });
+    if (rc == 0)
+        rc = readLinks(db, "SELECT song_id, artist_id FROM ContributingArtists ORDER BY song_id, artist_id;", song_ids, artist_ids, song_artists);
+    if (rc == 0)
+        rc = readLinks(db, "SELECT song_id, genre_id FROM SongGenreMap ORDER BY song_id, genre_id;", song_ids, genre_ids, song_genres);
+    if (rc == 0)
+        rc = readLinks(db, "SELECT album_id, artist_id FROM AlbumArtists ORDER BY album_id, artist_id;", album_ids, artist_ids, album_artists);
+    sqlite3_exec(db, "RELEASE write_catalog;", NULL, NULL, NULL);
+    if (rc != 0)
+        return -1;
+    if (strings.size() > UINT32_MAX) {
+        logAt(LogLevel::Error, "Unable to write catalog snapshot %s: the library's strings take more than 4 GiB\n", path.c_str());
+        return -1;
+    }
+
+    std::sort(album_songs.begin(), album_songs.end(), [&songs](const Link &a, const Link &b) {
+        const CatalogSong &song_a = songs[a.second], &song_b = songs[b.second];
+        return std::make_tuple(a.first, song_a.disc_number, song_a.track_number, a.second) <
+               std::make_tuple(b.first, song_b.disc_number, song_b.track_number, b.second);
+    });
+    appendLinks(song_artists, songs, &CatalogSong::artists_first, &CatalogSong::artist_count, links);
+    appendLinks(song_genres, songs, &CatalogSong::genres_first, &CatalogSong::genre_count, links);
+    appendLinks(album_artists, albums, &CatalogAlbum::artists_first, &CatalogAlbum::artist_count, links);
+    appendLinks(album_songs, albums, &CatalogAlbum::songs_first, &CatalogAlbum::song_count, links);
+    appendLinks(reverseLinks(song_artists), artists, &CatalogArtist::songs_first, &CatalogArtist::song_count, links);
+    appendLinks(reverseLinks(album_artists), artists, &CatalogArtist::albums_first, &CatalogArtist::album_count, links);
+    appendLinks(reverseLinks(song_genres), genres, &CatalogGenre::songs_first, &CatalogGenre::song_count, links);
+
+    const void *section_data[CATALOG_SECTION_COUNT] = { songs.data(), albums.data(), artists.data(), genres.data(), links.data(), strings.data() };
+    size_t section_counts[CATALOG_SECTION_COUNT] = { songs.size(), albums.size(), artists.size(), genres.size(), links.size(), strings.size() };
+    CatalogHeader header;
+    uint64_t offset = sizeof(CatalogHeader);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CATALOG_MAGIC, sizeof(header.magic));
+    header.format_version = CATALOG_FORMAT_VERSION;
+    header.header_size = sizeof(CatalogHeader);
+    header.byte_order = CATALOG_BYTE_ORDER;
+    header.library_version = library_version;
+    for (int i = 0; i < CATALOG_SECTION_COUNT; i++) {
+        offset += (SECTION_ALIGNMENT - offset % SECTION_ALIGNMENT) % SECTION_ALIGNMENT;
+        header.sections[i].offset = offset;
+        header.sections[i].count = section_counts[i];
+        offset += section_counts[i] * RECORD_SIZES[i];
+    }
+    header.file_size = offset;
+
+    std::string temporary = path + ".tmp";
+    FILE *file = fopen(temporary.c_str(), "wb");
+    if (file == nullptr) {
+        logAt(LogLevel::Error, "Unable to create catalog snapshot %s\n", temporary.c_str());
+        return -1;
+    }
+    offset = 0;
+    writeSection(file, &header, sizeof(header), offset);
+    for (int i = 0; i < CATALOG_SECTION_COUNT; i++)
+        writeSection(file, section_data[i], section_counts[i] * RECORD_SIZES[i], offset);
+    bool failed = ferror(file) != 0;
+    failed = fclose(file) != 0 || failed;
+
+    std::error_code error;
+    if (!failed)
+        std::filesystem::rename(temporary, path, error);
+    if (failed || error) {
+        logAt(LogLevel::Error, "Unable to write catalog snapshot %s\n", path.c_str());
+        std::filesystem::remove(temporary, error);
+        return -1;
+    }
+    log("Wrote catalog snapshot %s: %zu songs, %zu albums, %zu artists, %zu genres, library version %llu\n", path.c_str(), songs.size(),
+        albums.size(), artists.size(), genres.size(), (unsigned long long)library_version);
+    return 0;
+}
+
+/**
+ * @brief Reads the library version a catalog snapshot was taken at, without
+ *        mapping the whole file.
+ *
+ * @param[in] path The path to the snapshot.
+ * @param[out] library_version Receives the version.
+ *
+ * @return 0 on success, -1 if the file is missing or is not a snapshot of the
+ *         current format.
+ */
+int readCatalogVersion(const std::string &path, uint64_t &library_version) {
+    CatalogHeader header;
+    FILE *file = fopen(path.c_str(), "rb");
+
+    if (file == nullptr)
+        return -1;
+    size_t read = fread(&header, 1, sizeof(header), file);
+    fclose(file);
+    if (read != sizeof(header) || memcmp(header.magic, CATALOG_MAGIC, sizeof(header.magic)) != 0 ||
+        header.format_version != CATALOG_FORMAT_VERSION || header.header_size != sizeof(CatalogHeader) ||
+        header.byte_order != CATALOG_BYTE_ORDER)
+        return -1;
+    library_version = header.library_version;
+    return 0;
+}
+
+/**
+ * @brief Rewrites a catalog snapshot if the library has changed since it was
+ *        taken.
+ *
+ * @details This costs one query when the snapshot is current, so it can be
+ *          called on every startup, or after every ingest. A missing snapshot,
+ *          or one of an older format or written on a machine of the other
+ *          byte order, is written anew. Databases without the
+ *          LibraryVersion table are upgraded first.
+ *
+ * @param[in] db A pointer to the SQLite database connection.
+ * @param[in] path The path to the snapshot.
+ *
+ * @return 1 if the snapshot was rewritten, 0 if it was current, or -1 on failure.
+ */
+int updateCatalog(sqlite3 *db, const std::string &path) {
+    uint64_t library_version, snapshot_version;
+
+    if (addLibraryVersion(db) != 0 || getLibraryVersion(db, library_version) != 0)
+        return -1;
+    if (readCatalogVersion(path, snapshot_version) == 0 && snapshot_version == library_version)
+        return 0;
+    return writeCatalog(db, path) == 0 ? 1 : -1;
+}
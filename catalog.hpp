@@ -0,0 +1,171 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <sqlite3.h>
+
+#include "mapped_file.hpp"
+
+/*
+ * The catalog snapshot file format.
+ *
+ * A snapshot holds the songs, albums, artists and genres of a library, and the
+ * links between them, in a form that can be used straight from a read-only
+ * memory mapping. It starts with a CatalogHeader, followed by the sections it
+ * lists. Each section is an array of fixed-width records, starting at a
+ * multiple of 8 bytes. Numbers are stored in the byte order of the machine that
+ * wrote the snapshot, so they can be used without conversion; the header's
+ * byte_order field tells a reader on a machine of the other byte order that
+ * the snapshot is not for it.
+ *
+ * Records refer to each other by index into their section, not by database
+ * ID, and each record array is sorted by ID, so an ID can be found with a
+ * binary search. Strings are offsets into the string pool, where each string
+ * is UTF-8 and NUL-terminated; offset 0 is the empty string, which also
+ * stands for NULL. Every list of linked records is a run of count indexes in
+ * the links section, starting at first:
+ *   - a song's contributing artists and genres, by ID;
+ *   - an album's album artists, by ID, and songs, by disc and track number;
+ *   - an artist's songs and the albums it is an album artist of, by ID;
+ *   - a genre's songs, by ID.
+ */
+
+#define CATALOG_MAGIC "DBSCATLG"
+#define CATALOG_FORMAT_VERSION 2
+#define CATALOG_BYTE_ORDER UINT64_C(0x0102030405060708)
+#define CATALOG_NO_INDEX UINT32_MAX
+
+enum CatalogSectionId {
+    CatalogSongs,
+    CatalogAlbums,
+    CatalogArtists,
+    CatalogGenres,
+    CatalogLinks,           // uint32_t indexes
+    CatalogStrings,         // chars
+    CATALOG_SECTION_COUNT
+};
+
+struct CatalogSection {
+    uint64_t offset;        // from the start of the file
+    uint64_t count;         // of records, not bytes
+};
+
+struct CatalogHeader {
+    char magic[8];                  // CATALOG_MAGIC, without a terminator
+    uint32_t format_version;        // CATALOG_FORMAT_VERSION
+    uint32_t header_size;           // sizeof(CatalogHeader)
+    uint64_t byte_order;            // CATALOG_BYTE_ORDER, as written by the machine that took the snapshot
+    uint64_t library_version;       // the database's LibraryVersion when the snapshot was taken
+    uint64_t file_size;
+    CatalogSection sections[CATALOG_SECTION_COUNT];
+};
+
+struct CatalogSong {
+    int32_t id;
+    uint32_t title;
+    uint32_t location;
+    uint32_t album;                 // CATALOG_NO_INDEX if the song has none
+    int32_t track_number;
+    int32_t disc_number;
+    int32_t rating;
+    uint32_t artists_first;
+    uint32_t artist_count;
+    uint32_t genres_first;
+    uint32_t genre_count;
+};
+
+struct CatalogAlbum {
+    int32_t id;
+    uint32_t title;
+    uint32_t art_location;
+    uint32_t artists_first;
+    uint32_t artist_count;
+    uint32_t songs_first;
+    uint32_t song_count;
+};
+
+struct CatalogArtist {
+    int32_t id;
+    uint32_t name;
+    uint32_t songs_first;
+    uint32_t song_count;
+    uint32_t albums_first;
+    uint32_t album_count;
+};
+
+struct CatalogGenre {
+    int32_t id;
+    uint32_t name;
+    uint32_t songs_first;
+    uint32_t song_count;
+};
+
+static_assert(sizeof(CatalogHeader) == 40 + 16 * CATALOG_SECTION_COUNT, "CatalogHeader must not be padded");
+static_assert(sizeof(CatalogSong) == 44 && sizeof(CatalogAlbum) == 28 && sizeof(CatalogArtist) == 24 && sizeof(CatalogGenre) == 16,
+              "catalog records must not be padded");
+
+/**
+ * A catalog snapshot file, mapped read-only.
+ *
+ * Opening a snapshot checks its header and that its sections lie within the
+ * file, and nothing else, so it takes the same time for any library size.
+ * Pages are read from disk as they are first touched. Snapshots are only ever
+ * replaced whole, by renaming a new file over the old one, so a mapped
+ * snapshot stays intact while a newer one is written.
+ */
+class CatalogSnapshot {
+    public:
+        explicit CatalogSnapshot(const std::string &path);
+
+        CatalogSnapshot(const CatalogSnapshot &) = delete;
+        CatalogSnapshot &operator=(const CatalogSnapshot &) = delete;
+
+        bool isValid() const;
+        uint64_t getLibraryVersion() const;
+
+        const CatalogSong *getSongs() const { return (const CatalogSong *)getSection(CatalogSongs); }
+        const CatalogAlbum *getAlbums() const { return (const CatalogAlbum *)getSection(CatalogAlbums); }
+        const CatalogArtist *getArtists() const { return (const CatalogArtist *)getSection(CatalogArtists); }
+        const CatalogGenre *getGenres() const { return (const CatalogGenre *)getSection(CatalogGenres); }
+        size_t getSongCount() const { return getCount(CatalogSongs); }
+        size_t getAlbumCount() const { return getCount(CatalogAlbums); }
+        size_t getArtistCount() const { return getCount(CatalogArtists); }
+        size_t getGenreCount() const { return getCount(CatalogGenres); }
+
+        /**
+         * Returns the first of a run of linked record indexes, see the record
+         * fields ending in _first.
+         */
+        const uint32_t *getLinks(uint32_t first) const { return (const uint32_t *)getSection(CatalogLinks) + first; }
+
+        /**
+         * Returns a string from the string pool.
+         */
+        const char *getString(uint32_t offset) const { return (const char *)getSection(CatalogStrings) + offset; }
+
+        uint32_t findSong(int id) const;
+        uint32_t findAlbum(int id) const;
+        uint32_t findArtist(int id) const;
+        uint32_t findGenre(int id) const;
+
+        /**
+         * Returns the start of a section, or null if the snapshot is not valid.
+         */
+        const unsigned char *getSection(CatalogSectionId section) const {
+            return header != nullptr ? file.data + header->sections[section].offset : nullptr;
+        }
+
+        /**
+         * Returns the number of records in a section.
+         */
+        size_t getCount(CatalogSectionId section) const { return header != nullptr ? (size_t)header->sections[section].count : 0; }
+
+    private:
+        MappedFile file;
+        const CatalogHeader *header;        // null if the snapshot could not be opened
+};
+
+int writeCatalog(sqlite3 *db, const std::string &path);
+int readCatalogVersion(const std::string &path, uint64_t &library_version);
+int updateCatalog(sqlite3 *db, const std::string &path);
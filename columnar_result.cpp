@@ -0,0 +1,82 @@
+#include "columnar_result.hpp"
+#include "metrics.hpp"
+#include "misc.hpp"
+
+#include <cstring>
+
+/**
+ * @brief Runs a prepared statement to completion and stores its rows column
+ *        by column.
+ *
+ * @details A column holds integers if its declared type contains "INT" (as
+ *          the INTEGER and SMALLINT columns of the schema do), or if it has no
+ *          declared type and its first value is an integer. Every other column
+ *          holds text. Values are converted by SQLite where a row does not
+ *          match its column's type, and NULLs are stored as 0 or an empty
+ *          string with their is_null flag set. The statement is reset
+ *          afterwards, keeping its bindings.
+ *
+ * @param[in] stmt The statement to run.
+ * @param[out] result Receives the rows. Any previous contents are replaced.
+ * @param[in] expected_rows A guess at the number of rows, used to size the
+ *                          buffers up front. 0 if unknown.
+ *
+ * @return 0 on success, -1 if the statement fails or a text column exceeds 4 GB.
+ */
+int fetchColumns(sqlite3_stmt *stmt, ColumnarResult &result, size_t expected_rows) {
+    ScopedTimer timer(MetricStage::FetchColumns);
+    int column_count = sqlite3_column_count(stmt);
+    int rc;
+
+    result.row_count = 0;
+    result.columns.assign(column_count, ColumnarColumn());
+    for (int i = 0; i < column_count; i++) {
+        ColumnarColumn &column = result.columns[i];
+        const char *name = sqlite3_column_name(stmt, i);
+        const char *declared_type = sqlite3_column_decltype(stmt, i);
+        column.name = name != nullptr ? name : "";
+        column.is_text = declared_type == nullptr || strstr(declared_type, "INT") == nullptr;
+        column.is_null.reserve(expected_rows);
+        if (column.is_text) {
+            column.offsets.reserve(expected_rows + 1);
+            column.offsets.push_back(0);
+        } else
+            column.integers.reserve(expected_rows);
+    }
+
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        for (int i = 0; i < column_count; i++) {
+            ColumnarColumn &column = result.columns[i];
+            // Expressions have no declared type, so their first value decides.
+            if (result.row_count == 0 && column.is_text && sqlite3_column_decltype(stmt, i) == nullptr &&
+                sqlite3_column_type(stmt, i) == SQLITE_INTEGER) {
+                column.is_text = false;
+                column.offsets.clear();
+                column.integers.reserve(expected_rows);
+            }
+            if (!column.is_text) {
+                column.is_null.push_back(sqlite3_column_type(stmt, i) == SQLITE_NULL);
+                column.integers.push_back(sqlite3_column_int64(stmt, i));
+                continue;
+            }
+            // Only NULL comes back as a null pointer; empty strings do not.
+            const char *text = (const char *)sqlite3_column_text(stmt, i);
+            column.is_null.push_back(text == nullptr);
+            if (text != nullptr)
+                column.text.append(text, (size_t)sqlite3_column_bytes(stmt, i));
+            if (column.text.size() > UINT32_MAX) {
+                logAt(LogLevel::Error, "Error while fetching column %s: more than 4 GB of text\n", column.name.c_str());
+                sqlite3_reset(stmt);
+                return -1;
+            }
+            column.offsets.push_back((uint32_t)column.text.size());
+        }
+        result.row_count++;
+    }
+    sqlite3_reset(stmt);
+    if (rc != SQLITE_DONE) {
+        logAt(LogLevel::Error, "Error while fetching rows: %s\n", sqlite3_errmsg(sqlite3_db_handle(stmt)));
+        return -1;
+    }
+    return 0;
+}
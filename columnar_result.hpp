@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <sqlite3.h>
+
+/**
+ * One result column, stored contiguously. Integer columns fill integers;
+ * text columns fill text with every value back to back, and offsets with
+ * row_count + 1 byte offsets, so row i is text[offsets[i], offsets[i + 1]).
+ */
+struct ColumnarColumn {
+    std::string name;
+    bool is_text = false;
+    std::vector<int64_t> integers;
+    std::vector<uint32_t> offsets;
+    std::string text;
+    std::vector<unsigned char> is_null;
+};
+
+struct ColumnarResult {
+    size_t row_count = 0;
+    std::vector<ColumnarColumn> columns;
+};
+
+int fetchColumns(sqlite3_stmt *stmt, ColumnarResult &result, size_t expected_rows = 0);
@@ -0,0 +1,483 @@
+#include "content_hash.hpp"
+#include "metrics.hpp"
+#include "misc.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+const uint64_t PRIME_1 = 0x9E3779B185EBCA87ULL;
+const uint64_t PRIME_2 = 0xC2B2AE3D27D4EB4FULL;
+const uint64_t PRIME_3 = 0x165667B19E3779F9ULL;
+const uint64_t PRIME_4 = 0x85EBCA77C2B2AE63ULL;
+const uint64_t PRIME_5 = 0x27D4EB2F165667C5ULL;
+
+uint64_t rotateLeft(uint64_t value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+uint64_t readLE64(const unsigned char *p) {
+    uint64_t value;
+    memcpy(&value, p, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    value = __builtin_bswap64(value);
+#endif
+    return value;
+}
+
+uint32_t readLE32(const unsigned char *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+uint32_t readBE32(const unsigned char *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+uint64_t accumulate(uint64_t accumulator, uint64_t input) {
+    accumulator += input * PRIME_2;
+    return rotateLeft(accumulator, 31) * PRIME_1;
+}
+
+uint64_t mergeRound(uint64_t hash, uint64_t accumulator) {
+    hash ^= accumulate(0, accumulator);
+    return hash * PRIME_1 + PRIME_4;
+}
+
+const size_t READ_SIZE = 256 * 1024;       // bytes read at a time
+
+/**
+ * A file read with positioned reads into a window of READ_SIZE bytes, so that
+ * the headers the parsers below step through cost one read per window. It is
+ * not mapped: a file cut short while it is hashed then makes a read come up
+ * short, instead of raising SIGBUS when a page past the new end is touched.
+ */
+class FileWindow {
+    public:
+        explicit FileWindow(const std::string &path);
+        ~FileWindow();
+
+        FileWindow(const FileWindow &) = delete;
+        FileWindow &operator=(const FileWindow &) = delete;
+
+        bool isOpen() const;
+        const unsigned char *get(size_t offset, size_t length);
+
+        size_t size;
+
+    private:
+        size_t readAt(size_t offset, unsigned char *data, size_t length);
+
+#ifdef _WIN32
+        HANDLE file;
+#else
+        int fd;
+#endif
+        std::vector<unsigned char> buffer;
+        size_t start;
+        size_t filled;          // bytes of buffer read from the file, starting at start
+};
+
+/**
+ * Opens a file, asking the system to read ahead, as it is read front to back.
+ *
+ * \param path The path to the file.
+ */
+FileWindow::FileWindow(const std::string &path) : size(0), start(0), filled(0) {
+#ifdef _WIN32
+    LARGE_INTEGER file_size;
+    file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING,
+                       FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file != INVALID_HANDLE_VALUE && GetFileSizeEx(file, &file_size))
+        size = (size_t)file_size.QuadPart;
+#else
+    struct stat st;
+    fd = open(path.c_str(), O_RDONLY);
+    if (fd >= 0 && fstat(fd, &st) == 0)
+        size = (size_t)st.st_size;
+#ifdef POSIX_FADV_SEQUENTIAL
+    if (fd >= 0)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+#endif
+}
+
+FileWindow::~FileWindow() {
+#ifdef _WIN32
+    if (file != INVALID_HANDLE_VALUE)
+        CloseHandle(file);
+#else
+    if (fd >= 0)
+        close(fd);
+#endif
+}
+
+bool FileWindow::isOpen() const {
+#ifdef _WIN32
+    return file != INVALID_HANDLE_VALUE;
+#else
+    return fd >= 0;
+#endif
+}
+
+/**
+ * Returns a pointer to bytes of the file, valid until the next call.
+ *
+ * \param offset Where the bytes start.
+ * \param length The number of bytes, at most READ_SIZE.
+ * \return The bytes, or \c nullptr if the file ends before them or cannot be read.
+ */
+const unsigned char *FileWindow::get(size_t offset, size_t length) {
+    if (offset >= start && length <= filled && offset - start <= filled - length)
+        return buffer.data() + (offset - start);
+    if (length > READ_SIZE || offset > size || length > size - offset)
+        return nullptr;
+    buffer.resize(READ_SIZE);
+    start = offset;
+    filled = readAt(offset, buffer.data(), std::min(READ_SIZE, size - offset));
+    return filled >= length ? buffer.data() : nullptr;
+}
+
+/**
+ * Reads up to length bytes at offset, stopping early at the end of the file
+ * or on an error.
+ *
+ * \return The number of bytes read.
+ */
+size_t FileWindow::readAt(size_t offset, unsigned char *data, size_t length) {
+    size_t done = 0;
+
+    while (done < length) {
+#ifdef _WIN32
+        OVERLAPPED position = {};
+        DWORD read = 0;
+        position.Offset = (DWORD)((uint64_t)(offset + done) & 0xFFFFFFFF);
+        position.OffsetHigh = (DWORD)((uint64_t)(offset + done) >> 32);
+        if (!ReadFile(file, data + done, (DWORD)(length - done), &read, &position) || read == 0)
+            break;
+#else
+        ssize_t read = pread(fd, data + done, length - done, (off_t)(offset + done));
+        if (read < 0 && errno == EINTR)
+            continue;
+        if (read <= 0)
+            break;
+#endif
+        done += (size_t)read;
+    }
+    return done;
+}
+
+/**
+ * A part of a file to be hashed, from begin up to end.
+ */
+struct ByteRange {
+    size_t begin;
+    size_t end;
+};
+
+/**
+ * Returns the offset just past an ID3v2 tag at offset, or offset if there is none.
+ */
+size_t skipId3v2(FileWindow &file, size_t offset) {
+    const unsigned char *header = file.get(offset, 10);
+    if (header == nullptr || memcmp(header, "ID3", 3) != 0)
+        return offset;
+    size_t tag_size = ((size_t)(header[6] & 0x7F) << 21) | ((size_t)(header[7] & 0x7F) << 14) |
+                      ((size_t)(header[8] & 0x7F) << 7) | (size_t)(header[9] & 0x7F);
+    tag_size += (header[5] & 0x10) ? 20 : 10;
+    return tag_size < file.size - offset ? offset + tag_size : file.size;
+}
+
+/**
+ * Returns the end of the file without the ID3v1 and APEv2 tags at its end.
+ */
+size_t trimTrailingTags(FileWindow &file, size_t begin, size_t end) {
+    const unsigned char *footer;
+    if (end - begin >= 128 && (footer = file.get(end - 128, 3)) != nullptr && memcmp(footer, "TAG", 3) == 0)
+        end -= 128;
+    if (end - begin >= 32 && (footer = file.get(end - 32, 32)) != nullptr && memcmp(footer, "APETAGEX", 8) == 0) {
+        size_t tag_size = readLE32(footer + 12);
+        if (readLE32(footer + 20) & 0x80000000u)
+            tag_size += 32;     // the tag also has a header
+        end = tag_size < end - begin ? end - tag_size : begin;
+    }
+    return end;
+}
+
+/**
+ * Finds the audio frames of a FLAC stream, which follow the last metadata block.
+ */
+bool findFlacAudio(FileWindow &file, size_t offset, std::vector<ByteRange> &ranges) {
+    const unsigned char *header = file.get(offset, 4);
+    if (header == nullptr || memcmp(header, "fLaC", 4) != 0)
+        return false;
+    offset += 4;
+    while ((header = file.get(offset, 4)) != nullptr) {
+        bool last = (header[0] & 0x80) != 0;
+        size_t block_size = ((size_t)header[1] << 16) | ((size_t)header[2] << 8) | header[3];
+        if (block_size > file.size - offset - 4)
+            return false;
+        offset += 4 + block_size;
+        if (last) {
+            ranges.push_back({ offset, trimTrailingTags(file, offset, file.size) });
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Finds the bodies of the Ogg pages that carry audio packets. The header
+ * packets (three for Vorbis, two for Opus) include the comments, so they are
+ * skipped. Page headers are skipped too, because their sequence numbers and
+ * checksums change when a larger comment pushes the audio onto other pages.
+ */
+bool findOggAudio(FileWindow &file, std::vector<ByteRange> &ranges) {
+    const unsigned char *header;
+    size_t offset = 0, packets = 0, header_packets = 0;
+    uint32_t serial = 0;
+
+    while ((header = file.get(offset, 27)) != nullptr && memcmp(header, "OggS", 4) == 0) {
+        size_t segments = header[26], body_size = 0, ended = 0;
+        uint32_t page_serial = readLE32(header + 14);
+        const unsigned char *lacing = file.get(offset + 27, segments);
+        if (lacing == nullptr)
+            return false;
+        for (size_t i = 0; i < segments; i++) {
+            body_size += lacing[i];
+            if (lacing[i] < 255)
+                ended++;
+        }
+        size_t body = offset + 27 + segments;
+        if (body_size > file.size - body)
+            return false;
+        if (offset == 0) {
+            const unsigned char *packet = file.get(body, std::min(body_size, (size_t)8));
+            serial = page_serial;
+            if (packet == nullptr)
+                return false;
+            if (body_size >= 7 && memcmp(packet, "\x01vorbis", 7) == 0)
+                header_packets = 3;
+            else if (body_size >= 8 && memcmp(packet, "OpusHead", 8) == 0)
+                header_packets = 2;
+            else
+                return false;
+        }
+        if (page_serial == serial) {
+            if (packets >= header_packets && body_size > 0)
+                ranges.push_back({ body, body + body_size });
+            packets += ended;
+        }
+        offset = body + body_size;
+    }
+    return !ranges.empty();
+}
+
+/**
+ * Finds the media data box of an MP4 file. Its tags live in the moov box.
+ */
+bool findMp4Audio(FileWindow &file, std::vector<ByteRange> &ranges) {
+    const unsigned char *header = file.get(0, 12);
+    size_t offset = 0;
+
+    if (header == nullptr || memcmp(header + 4, "ftyp", 4) != 0)
+        return false;
+    while ((header = file.get(offset, 8)) != nullptr) {
+        uint64_t box_size = readBE32(header);
+        size_t header_size = 8;
+        bool media = memcmp(header + 4, "mdat", 4) == 0;
+        if (box_size == 1) {
+            if ((header = file.get(offset, 16)) == nullptr)
+                return false;
+            box_size = ((uint64_t)readBE32(header + 8) << 32) | readBE32(header + 12);
+            header_size = 16;
+        } else if (box_size == 0)
+            box_size = file.size - offset;
+        if (box_size < header_size || box_size > file.size - offset)
+            return false;
+        if (media)
+            ranges.push_back({ offset + header_size, offset + (size_t)box_size });
+        offset += (size_t)box_size;
+    }
+    return !ranges.empty();
+}
+
+/**
+ * Splits a file into the ranges that hold its audio. Formats that are not
+ * recognised are hashed whole, less any ID3 and APE tags.
+ */
+void findAudioRanges(FileWindow &file, std::vector<ByteRange> &ranges) {
+    if (findOggAudio(file, ranges) || findMp4Audio(file, ranges))
+        return;
+    ranges.clear();
+    size_t begin = skipId3v2(file, 0);
+    if (findFlacAudio(file, begin, ranges))
+        return;
+    ranges.clear();
+    ranges.push_back({ begin, trimTrailingTags(file, begin, file.size) });
+}
+
+}
+
+/**
+ * Starts a new hash.
+ *
+ * \param seed The seed to hash with.
+ */
+XxHash64::XxHash64(uint64_t seed) {
+    this->seed = seed;
+    accumulators[0] = seed + PRIME_1 + PRIME_2;
+    accumulators[1] = seed + PRIME_2;
+    accumulators[2] = seed;
+    accumulators[3] = seed - PRIME_1;
+    total_size = 0;
+    buffered = 0;
+}
+
+/**
+ * Adds bytes to the hash.
+ *
+ * \param data The bytes to add.
+ * \param size The number of bytes.
+ */
+void XxHash64::update(const void *data, size_t size) {
+    const unsigned char *p = (const unsigned char *)data, *end = p + size;
+
+    total_size += size;
+    if (buffered + size < 32) {
+        if (size != 0)
+            memcpy(buffer + buffered, p, size);
+        buffered += size;
+        return;
+    }
+    if (buffered > 0) {
+        size_t fill = 32 - buffered;
+        memcpy(buffer + buffered, p, fill);
+        p += fill;
+        for (int i = 0; i < 4; i++)
+            accumulators[i] = accumulate(accumulators[i], readLE64(buffer + i * 8));
+        buffered = 0;
+    }
+    // The four lanes are independent, so the CPU can run them in parallel.
+    uint64_t v1 = accumulators[0], v2 = accumulators[1], v3 = accumulators[2], v4 = accumulators[3];
+    for (; end - p >= 32; p += 32) {
+        v1 = accumulate(v1, readLE64(p));
+        v2 = accumulate(v2, readLE64(p + 8));
+        v3 = accumulate(v3, readLE64(p + 16));
+        v4 = accumulate(v4, readLE64(p + 24));
+    }
+    accumulators[0] = v1;
+    accumulators[1] = v2;
+    accumulators[2] = v3;
+    accumulators[3] = v4;
+    buffered = (size_t)(end - p);
+    if (buffered != 0)
+        memcpy(buffer, p, buffered);
+}
+
+/**
+ * Computes the hash of all bytes added so far. More bytes can still be added.
+ *
+ * \return The hash.
+ */
+uint64_t XxHash64::digest() const {
+    const unsigned char *p = buffer, *end = buffer + buffered;
+    uint64_t hash;
+
+    if (total_size >= 32) {
+        hash = rotateLeft(accumulators[0], 1) + rotateLeft(accumulators[1], 7) + rotateLeft(accumulators[2], 12) +
+               rotateLeft(accumulators[3], 18);
+        for (int i = 0; i < 4; i++)
+            hash = mergeRound(hash, accumulators[i]);
+    } else
+        hash = seed + PRIME_5;
+    hash += total_size;
+
+    for (; end - p >= 8; p += 8)
+        hash = rotateLeft(hash ^ accumulate(0, readLE64(p)), 27) * PRIME_1 + PRIME_4;
+    if (end - p >= 4) {
+        hash = rotateLeft(hash ^ ((uint64_t)readLE32(p) * PRIME_1), 23) * PRIME_2 + PRIME_3;
+        p += 4;
+    }
+    for (; p < end; p++)
+        hash = rotateLeft(hash ^ (*p * PRIME_5), 11) * PRIME_1;
+
+    hash ^= hash >> 33;
+    hash *= PRIME_2;
+    hash ^= hash >> 29;
+    hash *= PRIME_3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+/**
+ * @brief Computes the XXH64 hash of a block of memory.
+ *
+ * @param[in] data The bytes to hash.
+ * @param[in] size The number of bytes.
+ * @param[in] seed The seed to hash with.
+ *
+ * @return The hash.
+ */
+uint64_t xxHash64(const void *data, size_t size, uint64_t seed) {
+    XxHash64 hasher(seed);
+    hasher.update(data, size);
+    return hasher.digest();
+}
+
+/**
+ * @brief Fingerprints the audio of a file, ignoring its tags.
+ *
+ * @details The audio is located without decoding it: the frames after the
+ *          metadata blocks of FLAC, the pages after the header packets of Ogg
+ *          Vorbis and Opus, the mdat box of MP4, and for anything else (MP3
+ *          included) the whole file less its ID3v2, ID3v1 and APEv2 tags.
+ *          Those bytes are read with positioned reads, not mapped, so a file
+ *          truncated while it is hashed fails the hash rather than the
+ *          process, and hashed with XXH64. Copies of a file that differ only
+ *          in their tags or album art get the same hash, while the same
+ *          recording encoded twice does not.
+ *
+ * @param[in] file_location The path to the audio file.
+ * @param[out] hash Receives the hash.
+ *
+ * @return 0 on success, -1 if the file is empty or cannot be read.
+ */
+int hashAudioContent(const std::string &file_location, uint64_t &hash) {
+    std::vector<ByteRange> ranges;
+    ScopedTimer timer(MetricStage::HashContent);
+    FileWindow file(file_location);
+    XxHash64 hasher;
+
+    if (!file.isOpen() || file.size == 0) {
+        logAt(LogLevel::Warning, "Unable to read %s for hashing\n", file_location.c_str());
+        return -1;
+    }
+    findAudioRanges(file, ranges);
+    for (auto &range : ranges) {
+        for (size_t offset = range.begin; offset < range.end;) {
+            size_t length = std::min(range.end - offset, READ_SIZE);
+            const unsigned char *data = file.get(offset, length);
+            if (data == nullptr) {
+                logAt(LogLevel::Warning, "Unable to read all of %s for hashing, it may have been truncated\n", file_location.c_str());
+                return -1;
+            }
+            hasher.update(data, length);
+            offset += length;
+        }
+        countMetric(MetricCounter::BytesHashed, range.end - range.begin);
+    }
+    hash = hasher.digest();
+    return 0;
+}
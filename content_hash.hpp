@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/**
+ * An incremental XXH64 hash.
+ *
+ * Feeding the same bytes through any number of update() calls gives the same
+ * digest as hashing them in one piece, and the same value as the reference
+ * XXH64 implementation.
+ */
+class XxHash64 {
+    public:
+        explicit XxHash64(uint64_t seed = 0);
+
+        void update(const void *data, size_t size);
+        uint64_t digest() const;
+
+    private:
+        uint64_t accumulators[4];
+        uint64_t seed;
+        uint64_t total_size;
+        unsigned char buffer[32];
+        size_t buffered;
+};
+
+uint64_t xxHash64(const void *data, size_t size, uint64_t seed = 0);
+int hashAudioContent(const std::string &file_location, uint64_t &hash);
@@ -1,5 +1,150 @@
 #include "database_functions.hpp"
+#include "metrics.hpp"
 #include "misc.hpp"
+#include "database_writer.hpp"
+#include "trie.hpp"
+
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+namespace {
+
+const char *CREATE_SEARCH_INDEX =
+    "CREATE VIRTUAL TABLE SongSearch USING fts5(title, album, artists, genres, "
+    "tokenize = 'unicode61 remove_diacritics 2', prefix = '2 3');";
+
+// Fills SongSearch from the other tables, for databases that had songs before it existed.
+const char *FILL_SEARCH_INDEX =
+    "INSERT INTO SongSearch (rowid, title, album, artists, genres) "
+    "SELECT Songs.id, Songs.title, Albums.title, "
+    "(SELECT group_concat(name, ' ') FROM Artists WHERE id IN "
+    "(SELECT artist_id FROM ContributingArtists WHERE song_id = Songs.id "
+    "UNION SELECT artist_id FROM AlbumArtists WHERE album_id = Songs.album_id)), "
+    "(SELECT group_concat(Genres.name, ' ') FROM SongGenreMap JOIN Genres ON Genres.id = SongGenreMap.genre_id "
+    "WHERE SongGenreMap.song_id = Songs.id) "
+    "FROM Songs LEFT JOIN Albums ON Albums.id = Songs.album_id;";
+
+#define BUMP_LIBRARY_VERSION " BEGIN UPDATE LibraryVersion SET version = version + 1; END; "
+
+// Every change to what a catalog snapshot holds bumps the version, so snapshots can tell they are stale.
+// DatabaseWriter, which writes all songs, their links and the entities they link to, bumps it itself, once per
+// transaction; the triggers cover the columns it never writes. A trigger on every song written made a statement
+// journal necessary, on which FTS5 flushes its pending index, and doubled the time ingest takes.
+const char *CREATE_LIBRARY_VERSION =
+    "CREATE TABLE LibraryVersion ( version INTEGER NOT NULL ); "
+    "INSERT INTO LibraryVersion (version) VALUES (1); "
+    "CREATE TRIGGER SongsRatingVersion AFTER UPDATE OF rating ON Songs" BUMP_LIBRARY_VERSION
+    "CREATE TRIGGER AlbumsDeleteVersion AFTER DELETE ON Albums" BUMP_LIBRARY_VERSION
+    "CREATE TRIGGER AlbumsUpdateVersion AFTER UPDATE OF title, album_art_location ON Albums" BUMP_LIBRARY_VERSION
+    "CREATE TRIGGER ArtistsDeleteVersion AFTER DELETE ON Artists" BUMP_LIBRARY_VERSION
+    "CREATE TRIGGER ArtistsUpdateVersion AFTER UPDATE OF name ON Artists" BUMP_LIBRARY_VERSION
+    "CREATE TRIGGER GenresDeleteVersion AFTER DELETE ON Genres" BUMP_LIBRARY_VERSION
+    "CREATE TRIGGER GenresUpdateVersion AFTER UPDATE OF name ON Genres" BUMP_LIBRARY_VERSION;
+
+// The rules of smart playlists, whose songs are kept in PlaylistSongs. member_count is the number of songs
+// in the playlist as of its last update, so a playlist with a limit can tell a song of it was deleted.
+const char *CREATE_SMART_PLAYLISTS =
+    "CREATE TABLE SmartPlaylists ( playlist_id INTEGER PRIMARY KEY, rule VARCHAR(2048) NOT NULL, "
+    "member_count INTEGER NOT NULL DEFAULT 0, FOREIGN KEY (playlist_id) REFERENCES Playlists(id) ); "
+    "CREATE INDEX IF NOT EXISTS PlaylistSongsPlaylistIndex ON PlaylistSongs (playlist_id, song_id); "
+    "CREATE INDEX IF NOT EXISTS PlaylistSongsSongIndex ON PlaylistSongs (song_id);";
+
+// Files an ingest found but could not read tags from, with the size and mtime they had, so an incremental
+// rescan only tries them again once they change.
+const char *CREATE_SKIPPED_FILES =
+    "CREATE TABLE SkippedFiles ( location VARCHAR(2048) PRIMARY KEY, file_size INTEGER, mtime INTEGER );";
+
+// Matches weigh title hits highest, then artists, album and genres.
+const char *SEARCH_SONGS =
+    "SELECT rowid FROM SongSearch WHERE SongSearch MATCH ?1 "
+    "ORDER BY bm25(SongSearch, 10.0, 4.0, 6.0, 1.0) LIMIT ?2 OFFSET ?3;";
+
+/**
+ * Turns what the user typed into an FTS5 query that matches songs containing
+ * every word, each as a prefix. Words are quoted, so FTS5 operators and
+ * punctuation in them are taken literally.
+ */
+std::string buildMatchExpression(const std::string &query) {
+    static const SplitDelimiters k_whitespace(" \t\r\n");
+    std::vector<std::string_view> words;
+    std::string expression;
+
+    splitStringView(query, words, k_whitespace);
+    for (auto word : words) {
+        if (!expression.empty())
+            expression += ' ';
+        expression += '"';
+        for (char c : word) {
+            if (c == '"')
+                expression += '"';
+            expression += c;
+        }
+        expression += "\"*";
+    }
+    return expression;
+}
+
+/**
+ * The writer the compatibility functions keep for a connection, so its
+ * statements are prepared once per connection rather than once per call.
+ */
+struct ConnectionWriter {
+    std::mutex mutex;                           // serializes the calls made on the connection
+    std::unique_ptr<DatabaseWriter> writer;     // null until first used, or if its statements failed to prepare
+};
+
+std::mutex connection_writers_mutex;            // guards connection_writers
+std::unordered_map<sqlite3 *, std::unique_ptr<ConnectionWriter>> connection_writers;
+
+/**
+ * Runs a write with the writer of a connection, as one unit: in a transaction
+ * of its own, or in a savepoint if the caller has a transaction open. If the
+ * write fails, everything it did is rolled back.
+ */
+template <class Write> int writeWithConnectionWriter(sqlite3 *db, Write write) {
+    ConnectionWriter *connection_writer;
+    bool own_transaction;
+    int result;
+
+    {
+        std::lock_guard<std::mutex> lock(connection_writers_mutex);
+        std::unique_ptr<ConnectionWriter> &entry = connection_writers[db];
+        if (entry == nullptr)
+            entry = std::make_unique<ConnectionWriter>();
+        connection_writer = entry.get();
+    }
+    std::lock_guard<std::mutex> lock(connection_writer->mutex);
+    if (connection_writer->writer == nullptr) {
+        // The writer's statements use columns that older databases lack.
+        if (addFileStatColumns(db) != 0 || addContentHashColumn(db) != 0)
+            return -1;
+        connection_writer->writer = std::make_unique<DatabaseWriter>(db, 1);
+        if (!connection_writer->writer->isValid()) {
+            connection_writer->writer.reset();
+            return -1;
+        }
+    }
+
+    // A transaction of its own takes the write lock up front, as DatabaseWriter does.
+    own_transaction = sqlite3_get_autocommit(db) != 0;
+    if (sqlite3_exec(db, own_transaction ? "BEGIN IMMEDIATE;" : "SAVEPOINT connection_writer;", NULL, NULL, NULL) != SQLITE_OK) {
+        logAt(LogLevel::Error, "Error while starting transaction: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+    result = write(*connection_writer->writer);
+    if (result >= 0 &&
+        sqlite3_exec(db, own_transaction ? "COMMIT;" : "RELEASE connection_writer;", NULL, NULL, NULL) != SQLITE_OK) {
+        logAt(LogLevel::Error, "Error while committing transaction: %s\n", sqlite3_errmsg(db));
+        result = -1;
+    }
+    // An error may have made SQLite roll back the whole transaction already.
+    if (result < 0 && !sqlite3_get_autocommit(db))
+        sqlite3_exec(db, own_transaction ? "ROLLBACK;" : "ROLLBACK TO connection_writer; RELEASE connection_writer;", NULL, NULL, NULL);
+    return result;
+}
+
+}
 
 /**
  * @brief Creates a new SQLite database file at the given path, and creates
@@ -18,7 +163,7 @@ int createDatabase(const char *db_path) {
     
     rc = sqlite3_open(db_path, &db);
     if (rc != SQLITE_OK) {
-        log("Can't open database %s: %s\n", db_path, sqlite3_errmsg(db));
+        logAt(LogLevel::Error, "Can't open database %s: %s\n", db_path, sqlite3_errmsg(db));
         sqlite3_close(db);
         return -1;
     }
@@ -30,7 +175,7 @@ int createDatabase(const char *db_path) {
 
     // Creating tables
     if (createTables(db) != 0) {
-        log("Unable to create tables for new database @ %s\n", db_path);
+        logAt(LogLevel::Error, "Unable to create tables for new database @ %s\n", db_path);
         sqlite3_close(db);
         return -1;
     }
@@ -39,38 +184,108 @@ int createDatabase(const char *db_path) {
     return 0;
 }
 
-int createTables(sqlite3 *db) {
-    int rc, i;
+/**
+ * @brief Creates the tables of the music library schema.
+ *
+ * @details If unique_indexes is true, unique indexes are also created on the
+ *          album title, artist name and genre name columns. They keep the
+ *          lookups done by getEntityId() from scanning the whole table, and
+ *          stop two writers from creating the same entity twice.
+ *
+ *          The SongSearch full-text index is created along with the tables.
+ *          Its rowid is the song ID, and DatabaseWriter keeps it in sync.
+ *          So is LibraryVersion, which counts changes to the tables a
+ *          catalog snapshot is built from, SmartPlaylists, which holds
+ *          the rules of smart playlists, and SkippedFiles, which remembers
+ *          the files ingest could not read.
+ *
+ * @param[in] db A pointer to the SQLite database connection.
+ * @param[in] unique_indexes Whether to create the unique name indexes.
+ *
+ * @return 0. Errors for individual statements are logged.
+ */
+int createTables(sqlite3 *db, bool unique_indexes) {
+    int rc;
+    size_t i;
     char *error_message;
     const char *k_create[] = {
         "CREATE TABLE Albums ( 	id INTEGER PRIMARY KEY AUTOINCREMENT, 	title VARCHAR(512), 	album_art_location VARCHAR(2048) );",
-        "CREATE TABLE Songs ( 	id INTEGER PRIMARY KEY AUTOINCREMENT, 	title VARCHAR(512), 	track_number INTEGER, 	disc_number INTEGER, 	rating SMALLINT DEFAULT 0, 	album_id INTEGER, 	location VARCHAR(2048), 	FOREIGN KEY (album_id) REFERENCES Albums(id) );",
+        "CREATE TABLE Songs ( 	id INTEGER PRIMARY KEY AUTOINCREMENT, 	title VARCHAR(512), 	track_number INTEGER, 	disc_number INTEGER, 	rating SMALLINT DEFAULT 0, 	album_id INTEGER, 	location VARCHAR(2048), 	file_size INTEGER, 	mtime INTEGER, 	inode INTEGER, 	device INTEGER, 	content_hash INTEGER, 	play_count INTEGER NOT NULL DEFAULT 0, 	FOREIGN KEY (album_id) REFERENCES Albums(id) );",
+        "CREATE INDEX SongsLocationIndex ON Songs (location);",
+        "CREATE INDEX SongsContentHashIndex ON Songs (content_hash);",
         "CREATE TABLE Artists ( 	id INTEGER PRIMARY KEY AUTOINCREMENT, 	name VARCHAR(512), 	description VARCHAR(1024), 	photo_location VARCHAR(2048) );",
         "CREATE TABLE Genres ( 	id INTEGER PRIMARY KEY AUTOINCREMENT, 	name VARCHAR(128) );",
         "CREATE TABLE ContributingArtists ( 	song_id INTEGER, 	artist_id INTEGER, 	PRIMARY KEY (song_id, artist_id), 	FOREIGN KEY (song_id) REFERENCES Songs(id), 	FOREIGN KEY (artist_id) REFERENCES Artists(id) );",
         "CREATE TABLE AlbumArtists ( 	album_id INTEGER, 	artist_id INTEGER, 	PRIMARY KEY (album_id, artist_id), 	FOREIGN KEY (album_id) REFERENCES Albums(id), 	FOREIGN KEY (artist_id) REFERENCES Artists(id) );",
         "CREATE TABLE SongGenreMap ( 	song_id INTEGER, 	genre_id INTEGER, 	PRIMARY KEY (song_id, genre_id), 	FOREIGN KEY (song_id) REFERENCES Songs(id), 	FOREIGN KEY (genre_id) REFERENCES Genres(id) );",
         "CREATE TABLE Playlists ( 	id INTEGER PRIMARY KEY AUTOINCREMENT, 	title VARCHAR(512) );",
-        "CREATE TABLE PlaylistSongs ( 	id INTEGER PRIMARY KEY AUTOINCREMENT, 	playlist_id INTEGER, 	song_id INTEGER, 	FOREIGN KEY (playlist_id) REFERENCES Playlists(id), 	FOREIGN KEY (song_id) REFERENCES Songs(id) );"
+        "CREATE TABLE PlaylistSongs ( 	id INTEGER PRIMARY KEY AUTOINCREMENT, 	playlist_id INTEGER, 	song_id INTEGER, 	FOREIGN KEY (playlist_id) REFERENCES Playlists(id), 	FOREIGN KEY (song_id) REFERENCES Songs(id) );",
+        CREATE_SEARCH_INDEX,
+        CREATE_LIBRARY_VERSION,
+        CREATE_SMART_PLAYLISTS,
+        CREATE_SKIPPED_FILES
+    };
+    const char *k_create_indexes[] = {
+        "CREATE UNIQUE INDEX AlbumsTitleIndex ON Albums (title);",
+        "CREATE UNIQUE INDEX ArtistsNameIndex ON Artists (name);",
+        "CREATE UNIQUE INDEX GenresNameIndex ON Genres (name);"
     };
 
-    for (i = 0; i < 9; i++) {
+    for (i = 0; i < sizeof(k_create) / sizeof(k_create[0]); i++) {
         rc = sqlite3_exec(db, k_create[i], NULL, NULL, &error_message);
         if (rc != SQLITE_OK) {
-            log("Error while creating table %d: %s\n", i, error_message);
+            logAt(LogLevel::Error, "Error while creating table %zu: %s\n", i, error_message);
+            sqlite3_free(error_message);
+        }
+    }
+    for (i = 0; unique_indexes && i < sizeof(k_create_indexes) / sizeof(k_create_indexes[0]); i++) {
+        rc = sqlite3_exec(db, k_create_indexes[i], NULL, NULL, &error_message);
+        if (rc != SQLITE_OK) {
+            logAt(LogLevel::Error, "Error while creating index %zu: %s\n", i, error_message);
             sqlite3_free(error_message);
         }
     }
     return 0;
 }
 
+/**
+ * @brief Looks up the table and name column that store entities of the given type.
+ *
+ * @param[in] entity_type The type of entity.
+ * @param[out] table_name Receives the name of the table.
+ * @param[out] column_name Receives the name of the column holding the entity name.
+ *
+ * @return 0 on success, -1 if the entity type is unknown.
+ */
+int getEntityTable(EntityType entity_type, const char **table_name, const char **column_name) {
+    switch (entity_type) {
+        case EntityType::Album:
+            *table_name = "Albums";
+            *column_name = "title";
+            return 0;
+        case EntityType::Artist:
+            *table_name = "Artists";
+            *column_name = "name";
+            return 0;
+        case EntityType::Genre:
+            *table_name = "Genres";
+            *column_name = "name";
+            return 0;
+        default:
+            return -1;
+    }
+}
+
 /**
  * @brief Retrieves the ID of an artist from the database, creating a new entry if the artist does not exist.
  *
  * @details This function queries the Artists table in the provided SQLite database to find the ID of the artist
  *          with the specified name. If the artist is not found, a new entry is created, and the ID of the newly
  *          created artist is returned. In case of any database operation errors, the function logs the error
- *          message and returns -1.
+ *          message and returns -1. The name is bound as a parameter, so it may contain any character.
+ *
+ *          The statements are prepared on the first call for a connection and kept until closeDatabase();
+ *          code that resolves many names should still use a DatabaseWriter, which batches its transactions.
  *
  * @param[in] db A pointer to the SQLite database connection.
  * @param[in] artist_name The name of the artist to retrieve or create.
@@ -78,81 +293,495 @@ int createTables(sqlite3 *db) {
  * @return The ID of the artist, or -1 if an error occurs.
  */
 int getEntityId(sqlite3 *db, EntityType entity_type, const std::string &entity_name) {
-    int entity_id = 0, rc;
-    char *sql_stmt, *error_message;
-    const char *table_name, *column_name;
+    return writeWithConnectionWriter(db, [&](DatabaseWriter &writer) {
+        return writer.getEntityId(entity_type, entity_name);
+    });
+}
 
-    switch (entity_type) {
-        case EntityType::Album:
-            table_name = "Albums";
-            column_name = "title";
-            break;
-        case EntityType::Artist:
-            table_name = "Artists";
-            column_name = "artist_name";
-            break;
-        case EntityType::Genre:
-            table_name = "Genres";
-            column_name = "genre";
-            break;
-        default:            
+/**
+ * @brief Inserts a song, along with its album, artists and genres, into the database.
+ *
+ * @details The album, contributing artists, album artists and genres are created if
+ *          they do not exist yet. All rows belonging to the song are written in one
+ *          transaction, or in one savepoint if the caller has a transaction open, so
+ *          a song that fails leaves nothing behind. The statements are prepared on the
+ *          first call for a connection and kept until closeDatabase(); code that
+ *          inserts many songs should still use a DatabaseWriter, which batches its
+ *          transactions.
+ *
+ * @param[in] db A pointer to the SQLite database connection.
+ * @param[in] metadata The metadata of the song to insert.
+ *
+ * @return The ID of the new song, or -1 if an error occurs.
+ */
+int insertSong(sqlite3 *db, const Metadata &metadata) {
+    return writeWithConnectionWriter(db, [&](DatabaseWriter &writer) {
+        return writer.insertSong(metadata);
+    });
+}
+
+/**
+ * @brief Closes a database connection, along with the statements getEntityId() and insertSong() kept for it.
+ *
+ * @details A connection those functions were used on must be closed with this function: while its statements
+ *          are kept, sqlite3_close() refuses to close it.
+ *
+ * @param[in] db A pointer to the SQLite database connection, which may be null.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int closeDatabase(sqlite3 *db) {
+    std::unique_ptr<ConnectionWriter> connection_writer;
+
+    {
+        std::lock_guard<std::mutex> lock(connection_writers_mutex);
+        auto it = connection_writers.find(db);
+        if (it != connection_writers.end()) {
+            connection_writer = std::move(it->second);
+            connection_writers.erase(it);
+        }
+    }
+    if (connection_writer != nullptr) {
+        std::lock_guard<std::mutex> lock(connection_writer->mutex);
+        connection_writer->writer.reset();
+    }
+    if (sqlite3_close(db) != SQLITE_OK) {
+        logAt(LogLevel::Error, "Error while closing database: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Fills a Trie with every song title, artist name and album title in the database.
+ *
+ * @details Each name is inserted under its search key (see toSearchKey()) with a
+ *          TrieEntry holding the entity's id and type. Songs are scored by their
+ *          rating, and artists and albums by the number of songs they have, so
+ *          Trie::completePrefix() ranks them by popularity. Each table is read in
+ *          a single query, and the Trie is compacted once loading is done.
+ *
+ * @param[in] db A pointer to the SQLite database connection.
+ * @param[out] trie The Trie to load the names into.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int loadSearchTrie(sqlite3 *db, Trie &trie) {
+    const struct {
+        EntityType entity_type;
+        const char *sql;
+    } k_sources[] = {
+        { EntityType::Song, "SELECT id, title, rating FROM Songs;" },
+        { EntityType::Artist, "SELECT Artists.id, Artists.name, COUNT(ContributingArtists.song_id) FROM Artists LEFT JOIN ContributingArtists ON ContributingArtists.artist_id = Artists.id GROUP BY Artists.id;" },
+        { EntityType::Album, "SELECT Albums.id, Albums.title, COUNT(Songs.id) FROM Albums LEFT JOIN Songs ON Songs.album_id = Albums.id GROUP BY Albums.id;" }
+    };
+    sqlite3_stmt *stmt;
+    int rc;
+
+    for (auto &source : k_sources) {
+        rc = sqlite3_prepare_v2(db, source.sql, -1, &stmt, NULL);
+        if (rc != SQLITE_OK) {
+            logAt(LogLevel::Error, "Error while preparing search trie query: %s\n", sqlite3_errmsg(db));
+            return -1;
+        }
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+            const char *name = (const char *)sqlite3_column_text(stmt, 1);
+            if (name == nullptr || *name == '\0')
+                continue;
+            trie.insert(toSearchKey(name), { sqlite3_column_int(stmt, 0), source.entity_type, sqlite3_column_int(stmt, 2) });
+        }
+        sqlite3_finalize(stmt);
+        if (rc != SQLITE_DONE) {
+            logAt(LogLevel::Error, "Error while loading search trie: %s\n", sqlite3_errmsg(db));
             return -1;
+        }
     }
+    trie.compact();
+    return 0;
+}
 
-    // Try to find entity id
-    sql_stmt = sqlite3_mprintf("SELECT id FROM %s WHERE %s = \"%s\";", table_name, column_name, entity_name.c_str());
-    rc = sqlite3_exec(db, sql_stmt, &__getArtistIdInternalCallback, &entity_id, &error_message);
+/**
+ * @brief Adds the SongSearch full-text index to a database that lacks it.
+ *
+ * @details Databases created before the index existed are upgraded by creating
+ *          it and filling it from the songs already stored, in one
+ *          transaction. Nothing is done if the index exists. A DatabaseWriter
+ *          only maintains the index if it existed when the writer was created.
+ *
+ * @param[in] db A pointer to the SQLite database connection.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int createSearchIndex(sqlite3 *db) {
+    sqlite3_stmt *stmt;
+    char *error_message;
+    int rc;
+
+    rc = sqlite3_prepare_v2(db, "SELECT 1 FROM sqlite_master WHERE name = 'SongSearch';", -1, &stmt, NULL);
     if (rc != SQLITE_OK) {
-        log("Error while executing query to get %s id of %s: %s\n", table_name, entity_name.c_str(), error_message);
-        sqlite3_free(sql_stmt);
+        logAt(LogLevel::Error, "Error while looking for the search index: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+    rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if (rc == SQLITE_ROW)
+        return 0;
+
+    std::string sql = std::string("SAVEPOINT create_search_index; ") + CREATE_SEARCH_INDEX + " " + FILL_SEARCH_INDEX +
+                      " RELEASE create_search_index;";
+    if (sqlite3_exec(db, sql.c_str(), NULL, NULL, &error_message) != SQLITE_OK) {
+        logAt(LogLevel::Error, "Error while creating the search index: %s\n", error_message);
         sqlite3_free(error_message);
+        sqlite3_exec(db, "ROLLBACK TO create_search_index; RELEASE create_search_index;", NULL, NULL, NULL);
         return -1;
     }
-    sqlite3_free(sql_stmt);
+    log("Created the search index\n");
+    return 0;
+}
 
-    // If entity does not exist, create it
-    if (entity_id == 0) {
-        // Creating the entity
-        sql_stmt = sqlite3_mprintf("INSERT INTO %s (id, %s) VALUES (NULL, \"%s\");", table_name, column_name, entity_name.c_str());
-        rc = sqlite3_exec(db, sql_stmt, NULL, NULL, &error_message);
-        if (rc != SQLITE_OK) {
-            log("Error while executing query to create %s %s: %s\n",table_name, entity_name.c_str(), error_message);
-            sqlite3_free(sql_stmt);
-            sqlite3_free(error_message);
-            return -1;
+/**
+ * @brief Searches song titles, album titles, artist names and genres.
+ *
+ * @details Every word of the query must match the start of a word in one of
+ *          those fields, ignoring case and diacritics, so "beat ab" finds
+ *          "Abbey Road" by The Beatles. Songs are ranked by BM25, with title
+ *          matches weighed highest, and returned a page at a time.
+ *
+ * @param[in] db A pointer to the SQLite database connection.
+ * @param[in] query The words to search for.
+ * @param[in] limit The maximum number of song IDs to return.
+ * @param[in] offset The number of best-ranked songs to skip, for later pages.
+ * @param[out] song_ids Receives the IDs of the matching songs, best first.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int searchSongs(sqlite3 *db, const std::string &query, size_t limit, size_t offset, std::vector<int> &song_ids) {
+    ScopedTimer timer(MetricStage::Search);
+    std::string expression = buildMatchExpression(query);
+    sqlite3_stmt *stmt;
+    int rc;
+
+    song_ids.clear();
+    if (expression.empty() || limit == 0)
+        return 0;
+    rc = sqlite3_prepare_v2(db, SEARCH_SONGS, -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+        logAt(LogLevel::Error, "Error while preparing search query: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+    sqlite3_bind_text(stmt, 1, expression.c_str(), (int)expression.size(), SQLITE_TRANSIENT);
+    sqlite3_bind_int64(stmt, 2, (sqlite3_int64)limit);
+    sqlite3_bind_int64(stmt, 3, (sqlite3_int64)offset);
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+        song_ids.push_back(sqlite3_column_int(stmt, 0));
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE) {
+        logAt(LogLevel::Error, "Error while searching for \"%s\": %s\n", query.c_str(), sqlite3_errmsg(db));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Adds the content_hash column and its index to a Songs table that lacks them.
+ *
+ * @details Databases created before audio fingerprinting existed are upgraded
+ *          in place. Their songs start without a hash, and get one the next
+ *          time the library is ingested with hashing enabled. Nothing is done
+ *          if the column exists.
+ *
+ * @param[in] db A pointer to the SQLite database connection.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int addContentHashColumn(sqlite3 *db) {
+    sqlite3_stmt *stmt;
+    char *error_message;
+
+    if (sqlite3_prepare_v2(db, "SELECT content_hash FROM Songs LIMIT 0;", -1, &stmt, NULL) == SQLITE_OK) {
+        sqlite3_finalize(stmt);
+        return 0;
+    }
+    if (sqlite3_exec(db, "ALTER TABLE Songs ADD COLUMN content_hash INTEGER; "
+                         "CREATE INDEX IF NOT EXISTS SongsContentHashIndex ON Songs (content_hash);",
+                     NULL, NULL, &error_message) != SQLITE_OK) {
+        logAt(LogLevel::Error, "Error while adding the content hash column: %s\n", error_message);
+        sqlite3_free(error_message);
+        return -1;
+    }
+    log("Added the content hash column\n");
+    return 0;
+}
+
+/**
+ * @brief Finds songs whose files hold the same audio.
+ *
+ * @details Songs are grouped by the content hash stored for them during
+ *          ingest (see hashAudioContent()), so only songs that have been
+ *          hashed are compared.
+ *
+ * @param[in] db A pointer to the SQLite database connection.
+ * @param[out] groups Receives one list of song IDs, in ascending order, for
+ *                    each hash shared by two or more songs.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int findDuplicateSongs(sqlite3 *db, std::vector<std::vector<int>> &groups) {
+    sqlite3_stmt *stmt;
+    sqlite3_int64 group_hash = 0;
+    int rc;
+
+    groups.clear();
+    rc = sqlite3_prepare_v2(db, FIND_DUPLICATES, -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+        logAt(LogLevel::Error, "Error while preparing duplicate query: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        sqlite3_int64 hash = sqlite3_column_int64(stmt, 0);
+        if (groups.empty() || hash != group_hash) {
+            groups.emplace_back();
+            group_hash = hash;
         }
-        sqlite3_free(sql_stmt);
-        // Getting the entity id, after it has been created
-        sql_stmt = sqlite3_mprintf("SELECT id FROM %s WHERE %s = \"%s\";", table_name, column_name, entity_name.c_str());
-        rc = sqlite3_exec(db, sql_stmt, &__getArtistIdInternalCallback, &entity_id, &error_message);
+        groups.back().push_back(sqlite3_column_int(stmt, 1));
+    }
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE) {
+        logAt(LogLevel::Error, "Error while finding duplicate songs: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Adds the LibraryVersion table and its triggers to a database that lacks them.
+ *
+ * @details Databases created before catalog snapshots existed are upgraded in
+ *          place. Nothing is done if the table exists.
+ *
+ * @param[in] db A pointer to the SQLite database connection.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int addLibraryVersion(sqlite3 *db) {
+    sqlite3_stmt *stmt;
+    char *error_message;
+
+    if (sqlite3_prepare_v2(db, "SELECT version FROM LibraryVersion LIMIT 0;", -1, &stmt, NULL) == SQLITE_OK) {
+        sqlite3_finalize(stmt);
+        return 0;
+    }
+    std::string sql = std::string("SAVEPOINT add_library_version; ") + CREATE_LIBRARY_VERSION + " RELEASE add_library_version;";
+    if (sqlite3_exec(db, sql.c_str(), NULL, NULL, &error_message) != SQLITE_OK) {
+        logAt(LogLevel::Error, "Error while adding the library version: %s\n", error_message);
+        sqlite3_free(error_message);
+        sqlite3_exec(db, "ROLLBACK TO add_library_version; RELEASE add_library_version;", NULL, NULL, NULL);
+        return -1;
+    }
+    log("Added the library version\n");
+    return 0;
+}
+
+/**
+ * @brief Reads the library version, which changes whenever a song, album,
+ *        artist or genre, or a link between them, is added, changed or removed.
+ *
+ * @param[in] db A pointer to the SQLite database connection.
+ * @param[out] version Receives the version.
+ *
+ * @return 0 on success, -1 on failure, including for databases without a
+ *         LibraryVersion table (see addLibraryVersion()).
+ */
+int getLibraryVersion(sqlite3 *db, uint64_t &version) {
+    sqlite3_stmt *stmt;
+    int rc;
+
+    if (sqlite3_prepare_v2(db, "SELECT version FROM LibraryVersion;", -1, &stmt, NULL) != SQLITE_OK) {
+        logAt(LogLevel::Error, "Error while reading the library version: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+    rc = sqlite3_step(stmt);
+    if (rc == SQLITE_ROW)
+        version = (uint64_t)sqlite3_column_int64(stmt, 0);
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_ROW) {
+        logAt(LogLevel::Error, "Error while reading the library version: %s\n", rc == SQLITE_DONE ? "no version stored" : sqlite3_errmsg(db));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Adds the SmartPlaylists table, and the PlaylistSongs indexes it relies
+ *        on, to a database that lacks them.
+ *
+ * @details Databases created before smart playlists existed are upgraded in
+ *          place. Nothing is done if the table exists.
+ *
+ * @param[in] db A pointer to the SQLite database connection.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int addSmartPlaylists(sqlite3 *db) {
+    sqlite3_stmt *stmt;
+    char *error_message;
+
+    if (sqlite3_prepare_v2(db, "SELECT playlist_id FROM SmartPlaylists LIMIT 0;", -1, &stmt, NULL) == SQLITE_OK) {
+        sqlite3_finalize(stmt);
+        return 0;
+    }
+    std::string sql = std::string("SAVEPOINT add_smart_playlists; ") + CREATE_SMART_PLAYLISTS + " RELEASE add_smart_playlists;";
+    if (sqlite3_exec(db, sql.c_str(), NULL, NULL, &error_message) != SQLITE_OK) {
+        logAt(LogLevel::Error, "Error while adding smart playlists: %s\n", error_message);
+        sqlite3_free(error_message);
+        sqlite3_exec(db, "ROLLBACK TO add_smart_playlists; RELEASE add_smart_playlists;", NULL, NULL, NULL);
+        return -1;
+    }
+    log("Added smart playlists\n");
+    return 0;
+}
+
+/**
+ * @brief Adds the play_count column to the Songs table of a database that
+ *        lacks it.
+ *
+ * @details Databases created before play counts were kept are upgraded in
+ *          place, with every count starting at 0. Nothing is done if the
+ *          column exists.
+ *
+ * @param[in] db A pointer to the SQLite database connection.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int addPlayCountColumn(sqlite3 *db) {
+    sqlite3_stmt *stmt;
+    char *error_message;
+
+    if (sqlite3_prepare_v2(db, "SELECT play_count FROM Songs LIMIT 0;", -1, &stmt, NULL) == SQLITE_OK) {
+        sqlite3_finalize(stmt);
+        return 0;
+    }
+    if (sqlite3_exec(db, "ALTER TABLE Songs ADD COLUMN play_count INTEGER NOT NULL DEFAULT 0;", NULL, NULL, &error_message) != SQLITE_OK) {
+        logAt(LogLevel::Error, "Error while adding the play count column: %s\n", error_message);
+        sqlite3_free(error_message);
+        return -1;
+    }
+    log("Added the play count column\n");
+    return 0;
+}
+
+/**
+ * @brief Adds the file_size, mtime, inode and device columns, and the index on
+ *        location, to a Songs table that lacks them.
+ *
+ * @details Databases created before incremental ingest existed are upgraded
+ *          in place. Their songs start without a file stat, so the next
+ *          incremental ingest sees every file as changed and writes it again,
+ *          filling the stat in. Columns that exist are left alone.
+ *
+ * @param[in] db A pointer to the SQLite database connection.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int addFileStatColumns(sqlite3 *db) {
+    const char *k_columns[] = { "file_size", "mtime", "inode", "device" };
+    sqlite3_stmt *stmt;
+    char *sql, *error_message;
+    int added = 0;
+
+    for (const char *column : k_columns) {
+        sql = sqlite3_mprintf("SELECT %s FROM Songs LIMIT 0;", column);
+        int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+        sqlite3_free(sql);
+        if (rc == SQLITE_OK) {
+            sqlite3_finalize(stmt);
+            continue;
+        }
+        sql = sqlite3_mprintf("ALTER TABLE Songs ADD COLUMN %s INTEGER;", column);
+        rc = sqlite3_exec(db, sql, NULL, NULL, &error_message);
+        sqlite3_free(sql);
         if (rc != SQLITE_OK) {
-            log("Error while executing query to get %s id (after creating) of %s: %s\n", table_name, entity_name.c_str(), error_message);
-            sqlite3_free(sql_stmt);
+            logAt(LogLevel::Error, "Error while adding the %s column: %s\n", column, error_message);
             sqlite3_free(error_message);
             return -1;
         }
-        sqlite3_free(sql_stmt);
+        added++;
     }
-
-    return entity_id;
+    if (sqlite3_exec(db, "CREATE INDEX IF NOT EXISTS SongsLocationIndex ON Songs (location);", NULL, NULL, &error_message) != SQLITE_OK) {
+        logAt(LogLevel::Error, "Error while indexing song locations: %s\n", error_message);
+        sqlite3_free(error_message);
+        return -1;
+    }
+    if (added > 0)
+        log("Added the file stat columns\n");
+    return 0;
 }
 
+/**
+ * @brief Switches a database to write-ahead logging.
+ *
+ * @details In WAL mode readers never block the writer and the writer never
+ *          blocks readers, so the UI can keep reading while an import or a
+ *          flush of queued song updates is writing. Commits also stop
+ *          syncing the database file itself: with synchronous set to NORMAL,
+ *          only checkpoints do. The mode is stored in the database file, so
+ *          it holds for every connection opened afterwards; synchronous is
+ *          set for this connection only. In-memory and temporary databases
+ *          are left as they are.
+ *
+ * @param[in] db A pointer to the SQLite database connection. It must not be
+ *               in a transaction.
+ *
+ * @return 0 on success, -1 if the database cannot be switched.
+ */
+int enableWriteAheadLog(sqlite3 *db) {
+    sqlite3_stmt *stmt;
+    const char *filename = sqlite3_db_filename(db, "main");
+    bool switched;
+
+    if (filename == nullptr || *filename == '\0')
+        return 0;
+    if (sqlite3_prepare_v2(db, "PRAGMA journal_mode = WAL;", -1, &stmt, NULL) != SQLITE_OK) {
+        logAt(LogLevel::Error, "Error while switching to write-ahead logging: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+    // The pragma reports the mode in effect, which stays as it was if the switch is refused.
+    switched = sqlite3_step(stmt) == SQLITE_ROW && sqlite3_stricmp((const char *)sqlite3_column_text(stmt, 0), "wal") == 0;
+    sqlite3_finalize(stmt);
+    if (!switched) {
+        logAt(LogLevel::Warning, "Unable to switch %s to write-ahead logging: %s\n", filename, sqlite3_errmsg(db));
+        return -1;
+    }
+    if (sqlite3_exec(db, "PRAGMA synchronous = NORMAL;", NULL, NULL, NULL) != SQLITE_OK) {
+        logAt(LogLevel::Error, "Error while setting synchronous mode: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+    return 0;
+}
 
 /**
- * Internal callback for getArtistId.
+ * @brief Adds the SkippedFiles table to a database that lacks it.
  *
- * This function is used as a callback for a SQLite query. It takes the result
- * of the query and stores it in the id parameter, which is a pointer to an int.
+ * @details Databases created before ingest remembered the files it could not
+ *          read are upgraded in place. Nothing is done if the table exists.
  *
- * \param id The id to store the result in.
- * \param argc The number of columns in the result.
- * \param argv The result of the query.
- * \param column_names The names of the columns.
+ * @param[in] db A pointer to the SQLite database connection.
  *
- * \return 0
+ * @return 0 on success, -1 on failure.
  */
-int __getArtistIdInternalCallback(void *id, int argc, char **argv, char **column_names) {
-    if (argc > 0)
-        *(int *)id = atoi(argv[0]);
+int addSkippedFiles(sqlite3 *db) {
+    sqlite3_stmt *stmt;
+    char *error_message;
+
+    if (sqlite3_prepare_v2(db, "SELECT location FROM SkippedFiles LIMIT 0;", -1, &stmt, NULL) == SQLITE_OK) {
+        sqlite3_finalize(stmt);
+        return 0;
+    }
+    if (sqlite3_exec(db, CREATE_SKIPPED_FILES, NULL, NULL, &error_message) != SQLITE_OK) {
+        logAt(LogLevel::Error, "Error while adding the skipped files table: %s\n", error_message);
+        sqlite3_free(error_message);
+        return -1;
+    }
+    log("Added the skipped files table\n");
     return 0;
-}
\ No newline at end of file
+}
@@ -1,20 +1,40 @@
+#pragma once
+
+#include <cstdint>
 #include <string>
+#include <vector>
 #include <sqlite3.h>
 
+#include "entity_type.hpp"
+
+struct Metadata;
+class Trie;
+
 #define CREATE_ALBUMS "CREATE TABLE Albums ( id INTEGER PRIMARY KEY, title VARCHAR(512), release_year INT );"
 #define CREATE_SONGS "CREATE TABLE Songs ( id INTEGER PRIMARY KEY, title VARCHAR(512), track_number INT, disc_number INT, album_id INT, rating SMALLINT DEFAULT -1, location VARCHAR(1024), FOREIGN KEY (album_id) REFERENCES Albums(id) );"
 #define CREATE_ARTISTS "CREATE TABLE Artists ( id INTEGER PRIMARY KEY, artist_name VARCHAR(256), about VARCHAR(10240) );"
 #define CREATE_CONTRIBUTING_ARTISTS "CREATE TABLE ContributingArtists ( song_id INT NOT NULL, artist_id INT NOT NULL, PRIMARY KEY (song_id, artist_id), FOREIGN KEY (song_id) REFERENCES Songs(id), FOREIGN KEY (artist_id) REFERENCES Artists(id) );"
 #define CREATE_ALBUM_ARTISTS "CREATE TABLE AlbumArtists ( album_id INT NOT NULL, artist_id INT NOT NULL, PRIMARY KEY (album_id, artist_id), FOREIGN KEY (album_id) REFERENCES Albums(id), FOREIGN KEY (artist_id) REFERENCES Artists(id) );"
 
-enum EntityType {
-    Album,
-    Artist,
-    Genre
-};
+// Every song whose content hash is shared by another song, with the songs of each set of duplicates adjacent.
+#define FIND_DUPLICATES "SELECT content_hash, id FROM Songs WHERE content_hash IN (SELECT content_hash FROM Songs WHERE content_hash IS NOT NULL GROUP BY content_hash HAVING COUNT(*) > 1) ORDER BY content_hash, id;"
 
 int createDatabase(const char *db_path);
-int createTables(sqlite3 *db);
+int createTables(sqlite3 *db, bool unique_indexes = true);
+int getEntityTable(EntityType entity_type, const char **table_name, const char **column_name);
 int getEntityId(sqlite3 *db, EntityType entity_type, const std::string &artist_name);
-int __getArtistIdInternalCallback(void *id, int argc, char **argv, char **column_names);
+int insertSong(sqlite3 *db, const Metadata &metadata);
+int closeDatabase(sqlite3 *db);
+int loadSearchTrie(sqlite3 *db, Trie &trie);
+int createSearchIndex(sqlite3 *db);
+int searchSongs(sqlite3 *db, const std::string &query, size_t limit, size_t offset, std::vector<int> &song_ids);
+int addContentHashColumn(sqlite3 *db);
+int findDuplicateSongs(sqlite3 *db, std::vector<std::vector<int>> &groups);
+int addLibraryVersion(sqlite3 *db);
+int getLibraryVersion(sqlite3 *db, uint64_t &version);
+int addSmartPlaylists(sqlite3 *db);
+int addPlayCountColumn(sqlite3 *db);
+int addFileStatColumns(sqlite3 *db);
+int enableWriteAheadLog(sqlite3 *db);
+int addSkippedFiles(sqlite3 *db);
 
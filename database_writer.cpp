@@ -0,0 +1,836 @@
+#include "database_writer.hpp"
+#include "metrics.hpp"
+#include "tag_functions.hpp"
+#include "misc.hpp"
+
+#include <algorithm>
+#include <string_view>
+
+namespace {
+
+/**
+ * Returns a name of a Metadata.
+ */
+std::string_view getName(const std::string &name, const StringPool *) {
+    return name;
+}
+
+/**
+ * Returns a name of a CompactMetadata.
+ */
+std::string_view getName(uint32_t name, const StringPool *pool) {
+    return pool->get(name);
+}
+
+void bindName(sqlite3_stmt *stmt, int index, std::string_view name) {
+    sqlite3_bind_text(stmt, index, name.data(), (int)name.size(), SQLITE_TRANSIENT);
+}
+
+}
+
+/**
+ * Constructs a writer and prepares all of its statements.
+ *
+ * \param db The database connection to write to. The writer does not take
+ *           ownership of it.
+ * \param batch_size The number of songs to insert per transaction. A value of
+ *                   0 is treated as 1.
+ * \param use_cache If \c true, an EntityCache is warmed from the database and
+ *                  used to answer getEntityId() without querying. This only
+ *                  pays off for writers that resolve many names.
+ *
+ * If any statement fails to prepare, the error is logged and isValid() returns
+ * \c false.
+ */
+DatabaseWriter::DatabaseWriter(sqlite3 *db, size_t batch_size, bool use_cache) {
+    const char *table_name, *column_name;
+    char *sql;
+
+    this->db = db;
+    this->batch_size = batch_size > 0 ? batch_size : 1;
+    pending_songs = 0;
+    in_transaction = false;
+    valid = true;
+    find_song = insert_song = update_song = relocate_song = delete_song = set_content_hash = nullptr;
+    insert_contributing_artist = insert_album_artist = insert_song_genre = nullptr;
+    delete_contributing_artists = delete_song_genres = delete_playlist_songs = nullptr;
+    insert_search = delete_search = bump_version = nullptr;
+    insert_skipped_file = delete_skipped_file = nullptr;
+    version_bumped = false;
+    interned_pool = 0;
+
+    for (int i = 0; i < ENTITY_TYPE_COUNT; i++) {
+        select_entity[i] = insert_entity[i] = nullptr;
+        getEntityTable((EntityType)i, &table_name, &column_name);
+        sql = sqlite3_mprintf("SELECT id FROM %s WHERE %s = ?1;", table_name, column_name);
+        prepare(sql, &select_entity[i]);
+        sqlite3_free(sql);
+        sql = sqlite3_mprintf("INSERT INTO %s (%s) VALUES (?1);", table_name, column_name);
+        prepare(sql, &insert_entity[i]);
+        sqlite3_free(sql);
+    }
+    prepare("SELECT id, file_size, mtime, inode, device FROM Songs WHERE location = ?1;", &find_song);
+    prepare("INSERT INTO Songs (title, track_number, disc_number, album_id, location, file_size, mtime, inode, device) VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8, ?9);", &insert_song);
+    prepare("UPDATE Songs SET title = ?1, track_number = ?2, disc_number = ?3, album_id = ?4, location = ?5, file_size = ?6, mtime = ?7, inode = ?8, device = ?9, content_hash = NULL WHERE id = ?10;", &update_song);
+    prepare("UPDATE Songs SET location = ?1, file_size = ?2, mtime = ?3, inode = ?4, device = ?5 WHERE id = ?6;", &relocate_song);
+    prepare("DELETE FROM Songs WHERE id = ?1;", &delete_song);
+    prepare("UPDATE Songs SET content_hash = ?1 WHERE location = ?2;", &set_content_hash);
+    prepare("INSERT OR IGNORE INTO ContributingArtists (song_id, artist_id) VALUES (?1, ?2);", &insert_contributing_artist);
+    prepare("INSERT OR IGNORE INTO AlbumArtists (album_id, artist_id) VALUES (?1, ?2);", &insert_album_artist);
+    prepare("INSERT OR IGNORE INTO SongGenreMap (song_id, genre_id) VALUES (?1, ?2);", &insert_song_genre);
+    prepare("DELETE FROM ContributingArtists WHERE song_id = ?1;", &delete_contributing_artists);
+    prepare("DELETE FROM SongGenreMap WHERE song_id = ?1;", &delete_song_genres);
+    prepare("DELETE FROM PlaylistSongs WHERE song_id = ?1;", &delete_playlist_songs);
+
+    // Databases created before the search index existed are written without
+    // it, until createSearchIndex() adds it.
+    search_enabled =
+        sqlite3_prepare_v3(db, "INSERT INTO SongSearch (rowid, title, album, artists, genres) VALUES (?1, ?2, ?3, ?4, ?5);", -1,
+                           SQLITE_PREPARE_PERSISTENT, &insert_search, NULL) == SQLITE_OK &&
+        sqlite3_prepare_v3(db, "DELETE FROM SongSearch WHERE rowid = ?1;", -1, SQLITE_PREPARE_PERSISTENT, &delete_search, NULL) == SQLITE_OK;
+
+    // Likewise for the library version, until addLibraryVersion() adds it.
+    if (sqlite3_prepare_v3(db, "UPDATE LibraryVersion SET version = version + 1;", -1, SQLITE_PREPARE_PERSISTENT, &bump_version,
+                           NULL) != SQLITE_OK)
+        bump_version = nullptr;
+
+    // And for skipped files, until addSkippedFiles() adds their table.
+    if (sqlite3_prepare_v3(db, "INSERT OR REPLACE INTO SkippedFiles (location, file_size, mtime) VALUES (?1, ?2, ?3);", -1,
+                           SQLITE_PREPARE_PERSISTENT, &insert_skipped_file, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v3(db, "DELETE FROM SkippedFiles WHERE location = ?1;", -1, SQLITE_PREPARE_PERSISTENT, &delete_skipped_file,
+                           NULL) != SQLITE_OK) {
+        sqlite3_finalize(insert_skipped_file);
+        insert_skipped_file = delete_skipped_file = nullptr;
+    }
+
+    cache_enabled = use_cache && valid && cache.warm(db) == 0;
+}
+
+/**
+ * Commits any open transaction and finalizes all statements.
+ */
+DatabaseWriter::~DatabaseWriter() {
+    commit();
+    for (int i = 0; i < ENTITY_TYPE_COUNT; i++) {
+        sqlite3_finalize(select_entity[i]);
+        sqlite3_finalize(insert_entity[i]);
+    }
+    sqlite3_finalize(find_song);
+    sqlite3_finalize(insert_song);
+    sqlite3_finalize(update_song);
+    sqlite3_finalize(relocate_song);
+    sqlite3_finalize(delete_song);
+    sqlite3_finalize(set_content_hash);
+    sqlite3_finalize(insert_contributing_artist);
+    sqlite3_finalize(insert_album_artist);
+    sqlite3_finalize(insert_song_genre);
+    sqlite3_finalize(delete_contributing_artists);
+    sqlite3_finalize(delete_song_genres);
+    sqlite3_finalize(delete_playlist_songs);
+    sqlite3_finalize(insert_search);
+    sqlite3_finalize(delete_search);
+    sqlite3_finalize(bump_version);
+    sqlite3_finalize(insert_skipped_file);
+    sqlite3_finalize(delete_skipped_file);
+}
+
+/**
+ * Checks if all statements were prepared successfully.
+ *
+ * \return \c true if the writer can be used and \c false otherwise.
+ */
+bool DatabaseWriter::isValid() const {
+    return valid;
+}
+
+/**
+ * Retrieves the ID of an entity, creating a new entry if it does not exist.
+ *
+ * \param entity_type The type of the entity.
+ * \param entity_name The name (or title, for albums) of the entity.
+ * \return The ID of the entity, or \c -1 if an error occurs.
+ *
+ * With the entity cache enabled, known names are answered from memory, and
+ * unknown names go straight to an insert. The lookup query is then only used
+ * if the insert hits a unique index, i.e. another connection created the
+ * entity after the cache was warmed. Without the unique indexes (see
+ * createTables()), such an entity is created a second time, so the cache is
+ * only meant for databases that have them.
+ *
+ * An entity created in the writer's own transaction is cached right away and
+ * dropped from the cache again if the transaction is rolled back. One
+ * created in the caller's transaction is not cached, since the writer cannot
+ * tell whether it is ever committed.
+ */
+int DatabaseWriter::getEntityId(EntityType entity_type, const std::string &entity_name) {
+    ScopedTimer timer(MetricStage::EntityLookup);
+    sqlite3_stmt *stmt;
+    int entity_id, rc;
+
+    if (!valid || (int)entity_type < 0 || (int)entity_type >= ENTITY_TYPE_COUNT)
+        return -1;
+    if (in_transaction && sqlite3_get_autocommit(db))
+        transactionLost();
+
+    if (cache_enabled) {
+        entity_id = cache.find(entity_type, entity_name);
+        if (entity_id >= 0) {
+            countMetric(MetricCounter::EntityCacheHits);
+            return entity_id;
+        }
+    } else {
+        countMetric(MetricCounter::EntityQueries);
+        entity_id = selectEntityId(entity_type, entity_name);
+        if (entity_id != 0)
+            return entity_id;
+    }
+
+    // If entity does not exist, create it
+    if (begin() != 0)
+        return -1;
+    stmt = insert_entity[entity_type];
+    sqlite3_bind_text(stmt, 1, entity_name.c_str(), (int)entity_name.size(), SQLITE_TRANSIENT);
+    rc = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    if (rc == SQLITE_DONE) {
+        entity_id = (int)sqlite3_last_insert_rowid(db);
+        countMetric(MetricCounter::EntitiesCreated);
+        // Catalog snapshots list every entity, linked to a song or not.
+        bumpLibraryVersion();
+    } else if (rc == SQLITE_CONSTRAINT) {
+        countMetric(MetricCounter::EntityQueries);
+        entity_id = selectEntityId(entity_type, entity_name);
+    } else
+        entity_id = 0;
+    if (entity_id <= 0) {
+        logAt(LogLevel::Error, "Error while executing query to create %s: %s\n", entity_name.c_str(), sqlite3_errmsg(db));
+        return -1;
+    }
+    if (cache_enabled && in_transaction) {
+        cache.put(entity_type, entity_name, entity_id);
+        created_entities.emplace_back(entity_type, entity_name);
+    }
+    return entity_id;
+}
+
+/**
+ * Retrieves the ID of an entity whose name is interned in a StringPool.
+ *
+ * \param entity_type The type of the entity.
+ * \param entity_name The ID of the name in pool.
+ * \param pool The pool the name is interned in.
+ * \return The ID of the entity, or \c -1 if an error occurs.
+ *
+ * The first lookup of a name goes through getEntityId(); its result is then
+ * kept by the name's ID, for as long as names from the same pool are
+ * written. Like the EntityCache, this relies on entities not being deleted
+ * while the writer is in use. Names looked up in the caller's transaction
+ * are not kept, and all are dropped if the writer's own transaction is
+ * rolled back.
+ */
+int DatabaseWriter::getEntityId(EntityType entity_type, uint32_t entity_name, const StringPool *pool) {
+    int entity_id;
+
+    if (!valid || (int)entity_type < 0 || (int)entity_type >= ENTITY_TYPE_COUNT)
+        return -1;
+    if (in_transaction && sqlite3_get_autocommit(db))
+        transactionLost();
+    if (pool->getSerial() != interned_pool) {
+        for (auto &ids : interned_entities)
+            ids.clear();
+        interned_pool = pool->getSerial();
+    }
+    std::vector<int> &ids = interned_entities[entity_type];
+    {
+        ScopedTimer timer(MetricStage::EntityLookup);
+        if (entity_name < ids.size() && ids[entity_name] > 0) {
+            countMetric(MetricCounter::EntityCacheHits);
+            return ids[entity_name];
+        }
+    }
+    entity_id = getEntityId(entity_type, std::string(pool->get(entity_name)));
+    if (entity_id > 0 && (in_transaction || sqlite3_get_autocommit(db))) {
+        if (entity_name >= ids.size())
+            ids.resize(std::max((size_t)entity_name + 1, ids.size() * 2));
+        ids[entity_name] = entity_id;
+    }
+    return entity_id;
+}
+
+/**
+ * Looks up the song stored for a file.
+ *
+ * \param location The path of the song's file.
+ * \param file_stat If not null, receives the size, mtime and identity the file
+ *                  had when the song was last written.
+ * \return The ID of the song, \c 0 if there is none, or \c -1 if an error occurs.
+ */
+int DatabaseWriter::findSong(const std::string &location, FileStat *file_stat) {
+    int song_id = 0, rc;
+
+    if (!valid)
+        return -1;
+    sqlite3_bind_text(find_song, 1, location.c_str(), (int)location.size(), SQLITE_TRANSIENT);
+    rc = sqlite3_step(find_song);
+    if (rc == SQLITE_ROW) {
+        song_id = sqlite3_column_int(find_song, 0);
+        if (file_stat != nullptr) {
+            file_stat->size = sqlite3_column_int64(find_song, 1);
+            file_stat->mtime = sqlite3_column_int64(find_song, 2);
+            file_stat->inode = (unsigned long long)sqlite3_column_int64(find_song, 3);
+            file_stat->device = (unsigned long long)sqlite3_column_int64(find_song, 4);
+        }
+    } else if (rc != SQLITE_DONE) {
+        logAt(LogLevel::Error, "Error while looking up song at %s: %s\n", location.c_str(), sqlite3_errmsg(db));
+        song_id = -1;
+    }
+    sqlite3_reset(find_song);
+    return song_id;
+}
+
+/**
+ * Inserts a song, along with its album, artists and genres.
+ *
+ * \param metadata The metadata of the song to insert.
+ * \return The ID of the new song, or \c -1 if an error occurs.
+ *
+ * The album, contributing artists, album artists and genres are created if
+ * they do not exist yet, and the song is added to the search index. If they
+ * cannot be linked to it, or it cannot be added there, the song is not
+ * inserted either. Once batch_size songs have been inserted, the current
+ * transaction is committed.
+ */
+int DatabaseWriter::insertSong(const Metadata &metadata) {
+    return insertMetadata(metadata, nullptr);
+}
+
+/**
+ * Inserts a song whose names are interned in a StringPool.
+ *
+ * \param metadata The metadata of the song to insert.
+ * \param pool The pool the names of metadata are interned in.
+ * \return The ID of the new song, or \c -1 if an error occurs.
+ *
+ * Same as the Metadata version, except that each name is looked up once per
+ * pool, after which its entity ID is found by the name's ID alone.
+ */
+int DatabaseWriter::insertSong(const CompactMetadata &metadata, const StringPool &pool) {
+    return insertMetadata(metadata, &pool);
+}
+
+/**
+ * Overwrites an existing song with new metadata.
+ *
+ * \param song_id The ID of the song to update.
+ * \param metadata The new metadata of the song.
+ * \return \c song_id on success, or \c -1 if an error occurs.
+ *
+ * The song keeps its ID, so its rating and playlist entries survive. Its
+ * contributing artists and genres are replaced by the ones in metadata, and
+ * its content hash is cleared until the file is hashed again. If the song is
+ * updated but its links or search entry cannot be rewritten, the size and
+ * mtime stored for its file are cleared, so a rescan updates it again, and
+ * \c -1 is returned.
+ */
+int DatabaseWriter::updateSong(int song_id, const Metadata &metadata) {
+    return updateMetadata(song_id, metadata, nullptr);
+}
+
+/**
+ * Overwrites an existing song with new metadata whose names are interned in a
+ * StringPool, as insertSong() does for new songs.
+ *
+ * \param song_id The ID of the song to update.
+ * \param metadata The new metadata of the song.
+ * \param pool The pool the names of metadata are interned in.
+ * \return \c song_id on success, or \c -1 if an error occurs.
+ */
+int DatabaseWriter::updateSong(int song_id, const CompactMetadata &metadata, const StringPool &pool) {
+    return updateMetadata(song_id, metadata, &pool);
+}
+
+/**
+ * Points an existing song at the new location of its file.
+ *
+ * \param song_id The ID of the song to update.
+ * \param location The new path of the song's file.
+ * \param file_stat The size, mtime and identity of the file at its new path.
+ * \return \c song_id on success, or \c -1 if an error occurs.
+ *
+ * This is used for files that were moved or renamed without being modified,
+ * so their tags do not have to be parsed again.
+ */
+int DatabaseWriter::relocateSong(int song_id, const std::string &location, const FileStat &file_stat) {
+    int rc;
+
+    if (!valid || begin() != 0)
+        return -1;
+    sqlite3_bind_text(relocate_song, 1, location.c_str(), (int)location.size(), SQLITE_TRANSIENT);
+    sqlite3_bind_int64(relocate_song, 2, file_stat.size);
+    sqlite3_bind_int64(relocate_song, 3, file_stat.mtime);
+    sqlite3_bind_int64(relocate_song, 4, (sqlite3_int64)file_stat.inode);
+    sqlite3_bind_int64(relocate_song, 5, (sqlite3_int64)file_stat.device);
+    sqlite3_bind_int(relocate_song, 6, song_id);
+    rc = sqlite3_step(relocate_song);
+    sqlite3_reset(relocate_song);
+    if (rc != SQLITE_DONE) {
+        logAt(LogLevel::Error, "Error while relocating song %d to %s: %s\n", song_id, location.c_str(), sqlite3_errmsg(db));
+        return -1;
+    }
+    libraryChanged(song_id);
+    songWritten();
+    return song_id;
+}
+
+/**
+ * Stores the audio fingerprint of a song.
+ *
+ * \param location The path of the song's file.
+ * \param content_hash The hash computed by hashAudioContent().
+ * \return \c 0 on success and \c -1 on failure. A location without a song is
+ *         not an error.
+ *
+ * The hash is stored as a signed 64-bit integer with the same bits.
+ */
+int DatabaseWriter::setContentHash(const std::string &location, uint64_t content_hash) {
+    int rc;
+
+    if (!valid || begin() != 0)
+        return -1;
+    sqlite3_bind_int64(set_content_hash, 1, (sqlite3_int64)content_hash);
+    sqlite3_bind_text(set_content_hash, 2, location.c_str(), (int)location.size(), SQLITE_TRANSIENT);
+    rc = sqlite3_step(set_content_hash);
+    sqlite3_reset(set_content_hash);
+    if (rc != SQLITE_DONE) {
+        logAt(LogLevel::Error, "Error while storing content hash of %s: %s\n", location.c_str(), sqlite3_errmsg(db));
+        return -1;
+    }
+    songWritten();
+    return 0;
+}
+
+/**
+ * Remembers a file whose tags could not be read, so it is not parsed again
+ * until it changes.
+ *
+ * \param location The path of the file.
+ * \param file_stat The size and mtime the file had when it was read.
+ * \return \c 0 on success and \c -1 on failure. Databases without the
+ *         SkippedFiles table remember nothing.
+ */
+int DatabaseWriter::recordSkippedFile(const std::string &location, const FileStat &file_stat) {
+    int rc;
+
+    if (!valid || begin() != 0)
+        return -1;
+    if (insert_skipped_file == nullptr)
+        return 0;
+    sqlite3_bind_text(insert_skipped_file, 1, location.c_str(), (int)location.size(), SQLITE_TRANSIENT);
+    sqlite3_bind_int64(insert_skipped_file, 2, file_stat.size);
+    sqlite3_bind_int64(insert_skipped_file, 3, file_stat.mtime);
+    rc = sqlite3_step(insert_skipped_file);
+    sqlite3_reset(insert_skipped_file);
+    if (rc != SQLITE_DONE) {
+        logAt(LogLevel::Error, "Error while recording skipped file %s: %s\n", location.c_str(), sqlite3_errmsg(db));
+        return -1;
+    }
+    songWritten();
+    return 0;
+}
+
+/**
+ * Forgets a file recorded by recordSkippedFile(), because it has been read
+ * since or no longer exists.
+ *
+ * \param location The path of the file.
+ * \return \c 0 on success and \c -1 on failure.
+ */
+int DatabaseWriter::forgetSkippedFile(const std::string &location) {
+    int rc;
+
+    if (!valid || begin() != 0)
+        return -1;
+    if (delete_skipped_file == nullptr)
+        return 0;
+    sqlite3_bind_text(delete_skipped_file, 1, location.c_str(), (int)location.size(), SQLITE_TRANSIENT);
+    rc = sqlite3_step(delete_skipped_file);
+    sqlite3_reset(delete_skipped_file);
+    if (rc != SQLITE_DONE) {
+        logAt(LogLevel::Error, "Error while forgetting skipped file %s: %s\n", location.c_str(), sqlite3_errmsg(db));
+        return -1;
+    }
+    songWritten();
+    return 0;
+}
+
+/**
+ * Deletes a song, along with its artist, genre, playlist and search entries.
+ *
+ * \param song_id The ID of the song to delete.
+ * \return \c 0 on success and \c -1 on failure.
+ */
+int DatabaseWriter::deleteSong(int song_id) {
+    if (!valid || begin() != 0)
+        return -1;
+    if (runForSong(delete_contributing_artists, song_id) != 0 || runForSong(delete_song_genres, song_id) != 0 ||
+        runForSong(delete_playlist_songs, song_id) != 0 || runForSong(delete_song, song_id) != 0)
+        return -1;
+    if (search_enabled && runForSong(delete_search, song_id) != 0)
+        return -1;
+    libraryChanged(song_id);
+    songWritten();
+    return 0;
+}
+
+/**
+ * Commits the current transaction, if the writer has one open.
+ *
+ * \return \c 0 on success and \c -1 on failure.
+ */
+int DatabaseWriter::commit() {
+    char *error_message;
+
+    if (!in_transaction)
+        return 0;
+    if (sqlite3_get_autocommit(db)) {
+        transactionLost();
+        return -1;
+    }
+    ScopedTimer timer(MetricStage::Commit);
+    countMetric(MetricCounter::Commits);
+    in_transaction = false;
+    version_bumped = false;
+    pending_songs = 0;
+    if (sqlite3_exec(db, "COMMIT;", NULL, NULL, &error_message) != SQLITE_OK) {
+        logAt(LogLevel::Error, "Error while committing transaction: %s\n", error_message);
+        sqlite3_free(error_message);
+        // A commit that fails, e.g. on SQLITE_BUSY, leaves the transaction open.
+        if (!sqlite3_get_autocommit(db))
+            sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+        forgetCreatedEntities();
+        return -1;
+    }
+    created_entities.clear();
+    return 0;
+}
+
+/**
+ * Hands over the IDs of the songs inserted, updated, relocated or deleted since
+ * the last call, in the order they were written. A song written twice is
+ * listed twice.
+ *
+ * \param song_ids Receives the IDs. Call commit() first if the songs are to
+ *                 be read through another connection.
+ */
+void DatabaseWriter::takeChangedSongs(std::vector<int> &song_ids) {
+    song_ids.clear();
+    song_ids.swap(changed_songs);
+}
+
+/**
+ * Prepares a statement, logging the error and invalidating the writer on failure.
+ */
+int DatabaseWriter::prepare(const char *sql, sqlite3_stmt **stmt) {
+    if (sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, stmt, NULL) != SQLITE_OK) {
+        logAt(LogLevel::Error, "Error while preparing statement \"%s\": %s\n", sql, sqlite3_errmsg(db));
+        valid = false;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Runs the lookup query for an entity.
+ *
+ * \return The ID of the entity, \c 0 if it does not exist, or \c -1 if an error occurs.
+ */
+int DatabaseWriter::selectEntityId(EntityType entity_type, const std::string &entity_name) {
+    sqlite3_stmt *stmt = select_entity[entity_type];
+    int entity_id = 0, rc;
+
+    sqlite3_bind_text(stmt, 1, entity_name.c_str(), (int)entity_name.size(), SQLITE_TRANSIENT);
+    rc = sqlite3_step(stmt);
+    if (rc == SQLITE_ROW)
+        entity_id = sqlite3_column_int(stmt, 0);
+    else if (rc != SQLITE_DONE) {
+        logAt(LogLevel::Error, "Error while executing query to get id of %s: %s\n", entity_name.c_str(), sqlite3_errmsg(db));
+        entity_id = -1;
+    }
+    sqlite3_reset(stmt);
+    return entity_id;
+}
+
+/**
+ * Opens a transaction, unless one is already open on the connection.
+ *
+ * If the caller already has a transaction open, the writes join it and the
+ * writer leaves committing to the caller.
+ */
+int DatabaseWriter::begin() {
+    char *error_message;
+
+    // An error such as SQLITE_FULL can make SQLite roll back the transaction on its own.
+    if (in_transaction && sqlite3_get_autocommit(db))
+        transactionLost();
+    if (!sqlite3_get_autocommit(db))
+        return 0;
+    // Takes the write lock up front. In WAL mode, a transaction that reads first and another connection
+    // commits before it writes fails at once instead of waiting out the busy timeout.
+    if (sqlite3_exec(db, "BEGIN IMMEDIATE;", NULL, NULL, &error_message) != SQLITE_OK) {
+        logAt(LogLevel::Error, "Error while starting transaction: %s\n", error_message);
+        sqlite3_free(error_message);
+        return -1;
+    }
+    in_transaction = true;
+    return 0;
+}
+
+/**
+ * Forgets a transaction SQLite rolled back on its own after an error, along
+ * with the songs written in it.
+ */
+void DatabaseWriter::transactionLost() {
+    logAt(LogLevel::Error, "Transaction was rolled back, losing %zu songs\n", pending_songs);
+    in_transaction = false;
+    version_bumped = false;
+    pending_songs = 0;
+    forgetCreatedEntities();
+}
+
+/**
+ * Drops the entities created in a transaction that was rolled back from the
+ * caches, so they are looked up, and created, again.
+ */
+void DatabaseWriter::forgetCreatedEntities() {
+    for (auto &entity : created_entities)
+        cache.erase(entity.first, entity.second);
+    created_entities.clear();
+    for (auto &ids : interned_entities)
+        ids.clear();
+}
+
+/**
+ * Inserts a song from a Metadata, or from a CompactMetadata and its pool.
+ */
+template <class SongMetadata> int DatabaseWriter::insertMetadata(const SongMetadata &metadata, const StringPool *pool) {
+    int album_id, song_id, rc;
+
+    if (!valid || begin() != 0)
+        return -1;
+
+    album_id = getEntityId(EntityType::Album, metadata.album, pool);
+    if (album_id < 0)
+        return -1;
+
+    bindSong(insert_song, metadata, pool, album_id);
+    rc = sqlite3_step(insert_song);
+    sqlite3_reset(insert_song);
+    if (rc != SQLITE_DONE) {
+        logAt(LogLevel::Error, "Error while inserting song %s: %s\n", metadata.file_location.c_str(), sqlite3_errmsg(db));
+        return -1;
+    }
+    song_id = (int)sqlite3_last_insert_rowid(db);
+
+    if (writeLinks(song_id, album_id, metadata, pool) != 0 || indexSong(song_id, metadata, pool) != 0) {
+        // Leaves no song behind that lacks links or that search cannot find, and that a rescan would take as written.
+        runForSong(delete_contributing_artists, song_id);
+        runForSong(delete_song_genres, song_id);
+        runForSong(delete_song, song_id);
+        return -1;
+    }
+    libraryChanged(song_id);
+    songWritten();
+    return song_id;
+}
+
+/**
+ * Updates a song from a Metadata, or from a CompactMetadata and its pool.
+ */
+template <class SongMetadata> int DatabaseWriter::updateMetadata(int song_id, const SongMetadata &metadata, const StringPool *pool) {
+    int album_id, rc;
+
+    if (!valid || begin() != 0)
+        return -1;
+
+    album_id = getEntityId(EntityType::Album, metadata.album, pool);
+    if (album_id < 0)
+        return -1;
+
+    bindSong(update_song, metadata, pool, album_id);
+    sqlite3_bind_int(update_song, 10, song_id);
+    rc = sqlite3_step(update_song);
+    sqlite3_reset(update_song);
+    if (rc != SQLITE_DONE) {
+        logAt(LogLevel::Error, "Error while updating song %s: %s\n", metadata.file_location.c_str(), sqlite3_errmsg(db));
+        return -1;
+    }
+    if (runForSong(delete_contributing_artists, song_id) != 0 || runForSong(delete_song_genres, song_id) != 0 ||
+        (search_enabled && runForSong(delete_search, song_id) != 0)) {
+        forgetFileStat(song_id, metadata.file_location);
+        return -1;
+    }
+
+    if (writeLinks(song_id, album_id, metadata, pool) != 0 || indexSong(song_id, metadata, pool) != 0) {
+        forgetFileStat(song_id, metadata.file_location);
+        return -1;
+    }
+    libraryChanged(song_id);
+    songWritten();
+    return song_id;
+}
+
+/**
+ * Binds the Songs columns shared by the insert and update statements.
+ */
+template <class SongMetadata>
+void DatabaseWriter::bindSong(sqlite3_stmt *stmt, const SongMetadata &metadata, const StringPool *pool, int album_id) {
+    bindName(stmt, 1, getName(metadata.title, pool));
+    sqlite3_bind_int64(stmt, 2, metadata.track_number);
+    sqlite3_bind_int64(stmt, 3, metadata.disc_number);
+    sqlite3_bind_int(stmt, 4, album_id);
+    sqlite3_bind_text(stmt, 5, metadata.file_location.c_str(), (int)metadata.file_location.size(), SQLITE_TRANSIENT);
+    sqlite3_bind_int64(stmt, 6, metadata.file_stat.size);
+    sqlite3_bind_int64(stmt, 7, metadata.file_stat.mtime);
+    sqlite3_bind_int64(stmt, 8, (sqlite3_int64)metadata.file_stat.inode);
+    sqlite3_bind_int64(stmt, 9, (sqlite3_int64)metadata.file_stat.device);
+}
+
+/**
+ * Links a song to its contributing artists and genres, and its album to its album artists.
+ *
+ * \return \c 0 on success, or \c -1 if a name cannot be resolved or a link cannot be written.
+ */
+template <class SongMetadata>
+int DatabaseWriter::writeLinks(int song_id, int album_id, const SongMetadata &metadata, const StringPool *pool) {
+    int entity_id;
+
+    for (auto &name : metadata.contributing_artists)
+        if ((entity_id = getEntityId(EntityType::Artist, name, pool)) < 0 || link(insert_contributing_artist, song_id, entity_id) != 0)
+            return -1;
+    for (auto &name : metadata.album_artists)
+        if ((entity_id = getEntityId(EntityType::Artist, name, pool)) < 0 || link(insert_album_artist, album_id, entity_id) != 0)
+            return -1;
+    for (auto &name : metadata.genres)
+        if ((entity_id = getEntityId(EntityType::Genre, name, pool)) < 0 || link(insert_song_genre, song_id, entity_id) != 0)
+            return -1;
+    return 0;
+}
+
+/**
+ * Adds a song to the search index, under its title, album, artist names and genres.
+ *
+ * \return \c 0 on success, or if the database has no search index, and \c -1 on failure.
+ */
+template <class SongMetadata>
+int DatabaseWriter::indexSong(int song_id, const SongMetadata &metadata, const StringPool *pool) {
+    std::string artists, genres;
+    int rc;
+
+    if (!search_enabled)
+        return 0;
+    for (auto *names : { &metadata.contributing_artists, &metadata.album_artists })
+        for (auto &name : *names) {
+            if (!artists.empty())
+                artists += ' ';
+            artists += getName(name, pool);
+        }
+    for (auto &name : metadata.genres) {
+        if (!genres.empty())
+            genres += ' ';
+        genres += getName(name, pool);
+    }
+    sqlite3_bind_int(insert_search, 1, song_id);
+    bindName(insert_search, 2, getName(metadata.title, pool));
+    bindName(insert_search, 3, getName(metadata.album, pool));
+    sqlite3_bind_text(insert_search, 4, artists.c_str(), (int)artists.size(), SQLITE_TRANSIENT);
+    sqlite3_bind_text(insert_search, 5, genres.c_str(), (int)genres.size(), SQLITE_TRANSIENT);
+    rc = sqlite3_step(insert_search);
+    sqlite3_reset(insert_search);
+    if (rc != SQLITE_DONE) {
+        logAt(LogLevel::Error, "Error while indexing song %s: %s\n", metadata.file_location.c_str(), sqlite3_errmsg(db));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Counts a written song towards the batch, committing once the batch is full.
+ */
+void DatabaseWriter::songWritten() {
+    if (++pending_songs >= batch_size)
+        commit();
+}
+
+/**
+ * Records a written song, and bumps LibraryVersion.
+ */
+void DatabaseWriter::libraryChanged(int song_id) {
+    changed_songs.push_back(song_id);
+    bumpLibraryVersion();
+}
+
+/**
+ * Bumps LibraryVersion unless it has been bumped in the current transaction
+ * already. Writes made in a transaction owned by the caller bump it each time.
+ */
+void DatabaseWriter::bumpLibraryVersion() {
+    int rc;
+
+    if (bump_version == nullptr || version_bumped)
+        return;
+    rc = sqlite3_step(bump_version);
+    sqlite3_reset(bump_version);
+    if (rc != SQLITE_DONE)
+        logAt(LogLevel::Error, "Error while bumping the library version: %s\n", sqlite3_errmsg(db));
+    else
+        version_bumped = in_transaction;
+}
+
+/**
+ * Clears the size, mtime and identity stored for the file of a song that was
+ * only partly updated, so the next rescan takes the file as changed and
+ * writes the song again.
+ */
+void DatabaseWriter::forgetFileStat(int song_id, const std::string &location) {
+    sqlite3_bind_text(relocate_song, 1, location.c_str(), (int)location.size(), SQLITE_TRANSIENT);
+    for (int i = 2; i <= 5; i++)
+        sqlite3_bind_int64(relocate_song, i, 0);
+    sqlite3_bind_int(relocate_song, 6, song_id);
+    if (sqlite3_step(relocate_song) != SQLITE_DONE)
+        logAt(LogLevel::Error, "Error while clearing the file stat of song %d: %s\n", song_id, sqlite3_errmsg(db));
+    sqlite3_reset(relocate_song);
+    libraryChanged(song_id);
+}
+
+/**
+ * Runs a statement whose only parameter is a song ID.
+ */
+int DatabaseWriter::runForSong(sqlite3_stmt *stmt, int song_id) {
+    int rc;
+
+    sqlite3_bind_int(stmt, 1, song_id);
+    rc = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    if (rc != SQLITE_DONE) {
+        logAt(LogLevel::Error, "Error while removing entries of song %d: %s\n", song_id, sqlite3_errmsg(db));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Runs one of the two-column link statements (song/album id, entity id).
+ */
+int DatabaseWriter::link(sqlite3_stmt *stmt, int owner_id, int entity_id) {
+    int rc;
+
+    sqlite3_bind_int(stmt, 1, owner_id);
+    sqlite3_bind_int(stmt, 2, entity_id);
+    rc = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    if (rc != SQLITE_DONE) {
+        logAt(LogLevel::Error, "Error while linking %d to %d: %s\n", owner_id, entity_id, sqlite3_errmsg(db));
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+#include <sqlite3.h>
+
+#include "database_functions.hpp"
+#include "entity_cache.hpp"
+
+struct Metadata;
+struct CompactMetadata;
+struct FileStat;
+class StringPool;
+
+/**
+ * A long-lived writer for one database connection.
+ *
+ * All statements are prepared once, when the writer is constructed, and reused
+ * with bound parameters for every call. Writes are grouped into transactions of
+ * batch_size songs (inserted, updated or deleted), so a large import pays for
+ * one commit per batch instead of one per statement. Any open transaction is
+ * committed by commit() and by the destructor. Entity lookups can optionally
+ * be served from an EntityCache, and names interned in a StringPool are
+ * resolved by ID after their first lookup. Entities the writer creates are
+ * only remembered while its transaction can still commit. Songs are kept in the SongSearch full-text
+ * index as they are written, and each transaction that adds, changes or
+ * removes songs bumps LibraryVersion once. The IDs of those songs are kept
+ * until takeChangedSongs(), so smart playlists can follow them.
+ */
+class DatabaseWriter {
+    public:
+        DatabaseWriter(sqlite3 *db, size_t batch_size = 1000, bool use_cache = false);
+        ~DatabaseWriter();
+
+        DatabaseWriter(const DatabaseWriter &) = delete;
+        DatabaseWriter &operator=(const DatabaseWriter &) = delete;
+
+        bool isValid() const;
+        int getEntityId(EntityType entity_type, const std::string &entity_name);
+        int findSong(const std::string &location, FileStat *file_stat);
+        int insertSong(const Metadata &metadata);
+        int insertSong(const CompactMetadata &metadata, const StringPool &pool);
+        int updateSong(int song_id, const Metadata &metadata);
+        int updateSong(int song_id, const CompactMetadata &metadata, const StringPool &pool);
+        int relocateSong(int song_id, const std::string &location, const FileStat &file_stat);
+        int setContentHash(const std::string &location, uint64_t content_hash);
+        int recordSkippedFile(const std::string &location, const FileStat &file_stat);
+        int forgetSkippedFile(const std::string &location);
+        int deleteSong(int song_id);
+        int commit();
+        void takeChangedSongs(std::vector<int> &song_ids);
+
+    private:
+        enum { ENTITY_TYPE_COUNT = 3 };
+
+        int prepare(const char *sql, sqlite3_stmt **stmt);
+        int selectEntityId(EntityType entity_type, const std::string &entity_name);
+        int getEntityId(EntityType entity_type, uint32_t entity_name, const StringPool *pool);
+        int getEntityId(EntityType entity_type, const std::string &entity_name, const StringPool *) { return getEntityId(entity_type, entity_name); }
+        int begin();
+        void transactionLost();
+        void forgetCreatedEntities();
+        template <class SongMetadata> int insertMetadata(const SongMetadata &metadata, const StringPool *pool);
+        template <class SongMetadata> int updateMetadata(int song_id, const SongMetadata &metadata, const StringPool *pool);
+        template <class SongMetadata> void bindSong(sqlite3_stmt *stmt, const SongMetadata &metadata, const StringPool *pool, int album_id);
+        template <class SongMetadata> int writeLinks(int song_id, int album_id, const SongMetadata &metadata, const StringPool *pool);
+        template <class SongMetadata> int indexSong(int song_id, const SongMetadata &metadata, const StringPool *pool);
+        void songWritten();
+        void libraryChanged(int song_id);
+        void bumpLibraryVersion();
+        void forgetFileStat(int song_id, const std::string &location);
+        int runForSong(sqlite3_stmt *stmt, int song_id);
+        int link(sqlite3_stmt *stmt, int owner_id, int entity_id);
+
+        sqlite3 *db;
+        size_t batch_size;
+        size_t pending_songs;
+        bool in_transaction;
+        bool valid;
+        bool cache_enabled;
+        bool search_enabled;
+        bool version_bumped;        // LibraryVersion was bumped in the current transaction
+        EntityCache cache;
+        uint64_t interned_pool;     // serial of the StringPool interned_entities maps, 0 if none
+        std::vector<int> interned_entities[ENTITY_TYPE_COUNT];      // entity IDs by pool ID, 0 until first looked up
+        std::vector<std::pair<EntityType, std::string>> created_entities;   // entities cached since the current transaction began
+        std::vector<int> changed_songs;                             // songs written since the last takeChangedSongs()
+
+        sqlite3_stmt *select_entity[ENTITY_TYPE_COUNT];
+        sqlite3_stmt *insert_entity[ENTITY_TYPE_COUNT];
+        sqlite3_stmt *find_song;
+        sqlite3_stmt *insert_song;
+        sqlite3_stmt *update_song;
+        sqlite3_stmt *relocate_song;
+        sqlite3_stmt *delete_song;
+        sqlite3_stmt *set_content_hash;
+        sqlite3_stmt *insert_contributing_artist;
+        sqlite3_stmt *insert_album_artist;
+        sqlite3_stmt *insert_song_genre;
+        sqlite3_stmt *delete_contributing_artists;
+        sqlite3_stmt *delete_song_genres;
+        sqlite3_stmt *delete_playlist_songs;
+        sqlite3_stmt *insert_search;
+        sqlite3_stmt *delete_search;
+        sqlite3_stmt *bump_version;
+        sqlite3_stmt *insert_skipped_file;
+        sqlite3_stmt *delete_skipped_file;
+};
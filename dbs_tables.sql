@@ -12,9 +12,18 @@ CREATE TABLE Songs (
 	rating SMALLINT DEFAULT 0,
 	album_id INTEGER,
 	location VARCHAR(2048),
+	file_size INTEGER,
+	mtime INTEGER,
+	inode INTEGER,
+	device INTEGER,
+	content_hash INTEGER,
+	play_count INTEGER NOT NULL DEFAULT 0,
 	FOREIGN KEY (album_id) REFERENCES Albums(id)
 );
 
+CREATE INDEX SongsLocationIndex ON Songs (location);
+CREATE INDEX SongsContentHashIndex ON Songs (content_hash);
+
 CREATE TABLE Artists (
 	id INTEGER PRIMARY KEY AUTOINCREMENT,
 	name VARCHAR(512),
@@ -64,6 +73,63 @@ CREATE TABLE PlaylistSongs (
 	FOREIGN KEY (song_id) REFERENCES Songs(id)
 );
 
+CREATE TABLE SmartPlaylists (
+	playlist_id INTEGER PRIMARY KEY,
+	rule VARCHAR(2048) NOT NULL,
+	member_count INTEGER NOT NULL DEFAULT 0,
+	FOREIGN KEY (playlist_id) REFERENCES Playlists(id)
+);
+
+CREATE INDEX PlaylistSongsPlaylistIndex ON PlaylistSongs (playlist_id, song_id);
+CREATE INDEX PlaylistSongsSongIndex ON PlaylistSongs (song_id);
+
+CREATE TABLE SkippedFiles (
+	location VARCHAR(2048) PRIMARY KEY,
+	file_size INTEGER,
+	mtime INTEGER
+);
+
+CREATE VIRTUAL TABLE SongSearch USING fts5(
+	title,
+	album,
+	artists,
+	genres,
+	tokenize = 'unicode61 remove_diacritics 2',
+	prefix = '2 3'
+);
+
+CREATE TABLE LibraryVersion (
+	version INTEGER NOT NULL
+);
+
+INSERT INTO LibraryVersion (version) VALUES (1);
+
+CREATE TRIGGER SongsRatingVersion AFTER UPDATE OF rating ON Songs BEGIN
+	UPDATE LibraryVersion SET version = version + 1;
+END;
+CREATE TRIGGER AlbumsDeleteVersion AFTER DELETE ON Albums BEGIN
+	UPDATE LibraryVersion SET version = version + 1;
+END;
+CREATE TRIGGER AlbumsUpdateVersion AFTER UPDATE OF title, album_art_location ON Albums BEGIN
+	UPDATE LibraryVersion SET version = version + 1;
+END;
+CREATE TRIGGER ArtistsDeleteVersion AFTER DELETE ON Artists BEGIN
+	UPDATE LibraryVersion SET version = version + 1;
+END;
+CREATE TRIGGER ArtistsUpdateVersion AFTER UPDATE OF name ON Artists BEGIN
+	UPDATE LibraryVersion SET version = version + 1;
+END;
+CREATE TRIGGER GenresDeleteVersion AFTER DELETE ON Genres BEGIN
+	UPDATE LibraryVersion SET version = version + 1;
+END;
+CREATE TRIGGER GenresUpdateVersion AFTER UPDATE OF name ON Genres BEGIN
+	UPDATE LibraryVersion SET version = version + 1;
+END;
+
+CREATE UNIQUE INDEX AlbumsTitleIndex ON Albums (title);
+CREATE UNIQUE INDEX ArtistsNameIndex ON Artists (name);
+CREATE UNIQUE INDEX GenresNameIndex ON Genres (name);
+
 INSERT INTO Albums (title, album_art_location) VALUES
 ("Tiger Zinda Hai", "1.jpg"),
 ("Dabangg", "2.jpg"),
@@ -116,4 +182,13 @@ INSERT INTO Playlists (title) VALUES
 
 INSERT INTO PlaylistSongs (playlist_id, song_id) VALUES
 (1, 3),
-(1, 4);
\ No newline at end of file
+(1, 4);
+
+INSERT INTO SongSearch (rowid, title, album, artists, genres)
+SELECT Songs.id, Songs.title, Albums.title,
+	(SELECT group_concat(name, ' ') FROM Artists WHERE id IN
+		(SELECT artist_id FROM ContributingArtists WHERE song_id = Songs.id
+		UNION SELECT artist_id FROM AlbumArtists WHERE album_id = Songs.album_id)),
+	(SELECT group_concat(Genres.name, ' ') FROM SongGenreMap JOIN Genres ON Genres.id = SongGenreMap.genre_id
+		WHERE SongGenreMap.song_id = Songs.id)
+FROM Songs LEFT JOIN Albums ON Albums.id = Songs.album_id;
\ No newline at end of file
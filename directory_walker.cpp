@@ -0,0 +1,395 @@
+#include "directory_walker.hpp"
+#include "metrics.hpp"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <iterator>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <utility>
+
+#ifdef _WIN32
+#include <filesystem>
+#else
+#include <cerrno>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#endif
+
+namespace {
+
+/**
+ * The extensions TagLib's FileRef opens files by, lowercase and sorted for a
+ * binary search. Filtering by them drops nothing TagLib could have read.
+ */
+const char *const AUDIO_EXTENSIONS[] = {
+    "3g2", "aac", "afc", "aif", "aifc", "aiff", "ape", "asf", "dff", "dsdiff", "dsf", "flac", "it", "m4a", "m4b",
+    "m4p", "m4r", "m4v", "mod", "module", "mp2", "mp3", "mp4", "mpc", "nst", "oga", "ogg", "opus", "s3m", "spx",
+    "tta", "wav", "wma", "wow", "wv", "xm"
+};
+
+/**
+ * Checks the extension of a file name, ignoring case.
+ */
+bool hasAudioExtension(const char *name, size_t length) {
+    char extension[8];
+    size_t dot = length;
+
+    while (dot > 0 && name[dot - 1] != '.' && name[dot - 1] != '/' && name[dot - 1] != '\\')
+        dot--;
+    if (dot == 0 || name[dot - 1] != '.' || length - dot == 0 || length - dot >= sizeof(extension))
+        return false;
+    for (size_t i = dot; i < length; i++) {
+        char c = name[i];
+        extension[i - dot] = c >= 'A' && c <= 'Z' ? (char)(c - 'A' + 'a') : c;
+    }
+    extension[length - dot] = '\0';
+    return std::binary_search(std::begin(AUDIO_EXTENSIONS), std::end(AUDIO_EXTENSIONS), (const char *)extension,
+                              [](const char *a, const char *b) { return strcmp(a, b) < 0; });
+}
+
+/**
+ * The state shared by the threads of one walk.
+ */
+struct Walk {
+    Walk(const std::string &root, const WalkOptions &options, const WalkFileCallback &on_file, const WalkDirectoryCallback &on_directory)
+        : root(root), options(options), on_file(on_file), on_directory(on_directory) {}
+
+    const std::string &root;
+    const WalkOptions &options;
+    const WalkFileCallback &on_file;
+    const WalkDirectoryCallback &on_directory;
+
+    std::mutex mutex;                       // guards everything below
+    std::condition_variable changed;
+    std::vector<std::string> directories;   // waiting to be read; taken from the back, so the walk stays mostly depth-first
+    unsigned int reading = 0;               // threads reading a directory
+    std::set<std::pair<unsigned long long, unsigned long long>> visited;     // device and inode of each directory read
+    WalkStats stats;
+
+    std::mutex callback_mutex;              // the callbacks are never called concurrently
+};
+
+/**
+ * A file found in a directory, waiting to be handed to the file callback.
+ */
+struct FoundFile {
+    std::string path;
+    FileStat file_stat;
+};
+
+/**
+ * Records a directory that could not be read. Its files are not reported.
+ */
+void addUnreadable(WalkStats &stats, const std::string &path, const char *reason) {
+    logAt(LogLevel::Warning, "Unable to read directory %s: %s\n", path.c_str(), reason);
+    stats.unreadable_directories.push_back(path);
+}
+
+/**
+ * Checks whether a directory that does not exist can be taken as empty: only
+ * a subdirectory removed since its parent was read can. A missing root is an
+ * error, because it may be an unmounted share or a mistyped path, and walking
+ * it as empty would make an incremental rescan remove every song under it.
+ */
+bool isGoneDirectory(const Walk &walk, const std::string &path) {
+    return path != walk.root || walk.options.missing_root_is_empty;
+}
+
+/**
+ * Asks the directory callback whether to read a directory.
+ */
+bool enterDirectory(Walk &walk, const std::string &path) {
+    if (!walk.on_directory)
+        return true;
+    std::lock_guard<std::mutex> lock(walk.callback_mutex);
+    return walk.on_directory(path);
+}
+
+/**
+ * Hands the files of one directory to the file callback, all under one lock,
+ * then calls the after_files hook with the lock released.
+ */
+void reportFiles(Walk &walk, std::vector<FoundFile> &files) {
+    if (files.empty() || !walk.on_file)
+        return;
+    {
+        std::lock_guard<std::mutex> lock(walk.callback_mutex);
+        for (auto &file : files)
+            walk.on_file(file.path, file.file_stat);
+    }
+    if (walk.options.after_files)
+        walk.options.after_files();
+}
+
+#ifdef _WIN32
+
+/**
+ * Lists a directory with std::filesystem, which takes entry types from the
+ * same FindNextFile call that returns the names. Symlinked directories are
+ * never followed, because there is no cheap identity to detect loops by.
+ */
+void readDirectory(Walk &walk, WalkStats &stats, const std::string &path, std::vector<std::string> &subdirectories) {
+    std::vector<FoundFile> files;
+    std::error_code ec;
+
+    std::filesystem::directory_iterator it(path, ec), end;
+    if (ec) {
+        if (ec != std::errc::no_such_file_or_directory || !isGoneDirectory(walk, path))
+            addUnreadable(stats, path, ec.message().c_str());
+        return;
+    }
+    if (!enterDirectory(walk, path))
+        return;
+    stats.directories++;
+    for (; !ec && it != end; it.increment(ec)) {
+        bool symlink = it->is_symlink(ec);
+        if (symlink && !walk.options.follow_symlinks)
+            continue;
+        if (it->is_directory(ec)) {
+            if (!symlink)
+                subdirectories.push_back(it->path().string());
+            continue;
+        }
+        if (!it->is_regular_file(ec))
+            continue;
+        FoundFile file;
+        file.path = it->path().string();
+        if (walk.options.audio_files_only && !isAudioFile(file.path))
+            continue;
+        if (walk.options.stat_files && getFileStat(file.path, file.file_stat) != 0)
+            continue;
+        files.push_back(std::move(file));
+    }
+    if (ec)
+        addUnreadable(stats, path, ec.message().c_str());
+    stats.files += files.size();
+    reportFiles(walk, files);
+}
+
+#else
+
+/**
+ * Lists a directory with readdir(), which gives the type of most entries for
+ * free. Only entries of unknown type, symlinks that are followed, and files
+ * whose FileStat was asked for are stat'ed, relative to the open directory so
+ * that the kernel does not walk the whole path again.
+ */
+void readDirectory(Walk &walk, WalkStats &stats, const std::string &path, std::vector<std::string> &subdirectories) {
+    std::vector<FoundFile> files;
+    std::string prefix(path);
+    struct stat st;
+
+    DIR *dir = opendir(path.c_str());
+    if (dir == nullptr) {
+        if (errno != ENOENT || !isGoneDirectory(walk, path))
+            addUnreadable(stats, path, strerror(errno));
+        return;
+    }
+    int fd = dirfd(dir);
+    if (fstat(fd, &st) != 0) {
+        addUnreadable(stats, path, strerror(errno));
+        closedir(dir);
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(walk.mutex);
+        if (!walk.visited.emplace((unsigned long long)st.st_dev, (unsigned long long)st.st_ino).second) {
+            stats.symlink_loops++;
+            closedir(dir);
+            return;
+        }
+    }
+    if (!enterDirectory(walk, path)) {
+        closedir(dir);
+        return;
+    }
+    stats.directories++;
+
+    if (prefix.back() != '/')
+        prefix += '/';
+    errno = 0;
+    for (struct dirent *entry; (entry = readdir(dir)) != nullptr; errno = 0) {
+        const char *name = entry->d_name;
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+            continue;
+        size_t length = strlen(name);
+        unsigned char type = entry->d_type;
+        FoundFile file;
+
+        if (type == DT_LNK && !walk.options.follow_symlinks)
+            continue;
+        if (type == DT_REG && walk.options.audio_files_only && !hasAudioExtension(name, length))
+            continue;
+        if (type == DT_UNKNOWN || type == DT_LNK || (type == DT_REG && walk.options.stat_files)) {
+            int flags = walk.options.follow_symlinks ? 0 : AT_SYMLINK_NOFOLLOW;
+            // A dangling symlink, or an entry removed since the listing.
+            if (fstatat(fd, name, &st, flags) != 0)
+                continue;
+            if (type != DT_REG)
+                stats.entries_statted++;
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+            if (type == DT_REG && walk.options.audio_files_only && !hasAudioExtension(name, length))
+                continue;
+            if (type == DT_REG && walk.options.stat_files)
+                fillFileStat(st, file.file_stat);
+        }
+        if (type == DT_DIR)
+            subdirectories.push_back(prefix + name);
+        else if (type == DT_REG) {
+            file.path = prefix + name;
+            files.push_back(std::move(file));
+        }
+    }
+    // The entries listed before the error are still reported, but the directory counts as unreadable.
+    if (errno != 0)
+        addUnreadable(stats, path, strerror(errno));
+    closedir(dir);
+    stats.files += files.size();
+    reportFiles(walk, files);
+}
+
+#endif
+
+/**
+ * Reads directories from the shared list until every directory has been read.
+ */
+void runWalker(Walk &walk) {
+    std::vector<std::string> subdirectories;
+    WalkStats stats;
+    std::unique_lock<std::mutex> lock(walk.mutex);
+
+    for (;;) {
+        walk.changed.wait(lock, [&] { return !walk.directories.empty() || walk.reading == 0; });
+        if (walk.directories.empty())
+            break;
+        std::string path = std::move(walk.directories.back());
+        walk.directories.pop_back();
+        walk.reading++;
+        lock.unlock();
+
+        subdirectories.clear();
+        readDirectory(walk, stats, path, subdirectories);
+
+        lock.lock();
+        walk.reading--;
+        for (auto &subdirectory : subdirectories)
+            walk.directories.push_back(std::move(subdirectory));
+        if (!subdirectories.empty() || walk.reading == 0)
+            walk.changed.notify_all();
+    }
+    walk.stats.files += stats.files;
+    walk.stats.directories += stats.directories;
+    walk.stats.entries_statted += stats.entries_statted;
+    walk.stats.symlink_loops += stats.symlink_loops;
+    walk.stats.unreadable_directories.insert(walk.stats.unreadable_directories.end(), stats.unreadable_directories.begin(),
+                                             stats.unreadable_directories.end());
+}
+
+}
+
+/**
+ * @brief Calls a function for every file in a directory and all its
+ *        subdirectories.
+ *
+ * @details Directories are read with readdir(), whose entries carry their
+ *          type, so most files and directories are told apart without a stat.
+ *          Files are filtered by extension before anything else is done with
+ *          them. With more than one thread, each thread takes the next
+ *          directory waiting to be read, which keeps several reads in flight
+ *          on network mounts and cold disks; the calling thread is one of
+ *          them.
+ *
+ *          The files of each directory are handed to on_file as soon as it
+ *          has been read, in one batch, and the callbacks are never called
+ *          concurrently, so they need no locking of their own. They may be
+ *          called from any of the walking threads and must not throw.
+ *          Anything that may block, like pushing to a bounded queue, belongs
+ *          in options.after_files instead: it is called after each batch,
+ *          without the lock, so a blocked thread does not hold up the others,
+ *          and may run on several threads at once.
+ *
+ *          Every directory is read at most once, so symlinks that point back
+ *          up the tree cannot make the walk loop. Directories that cannot be
+ *          read are logged, listed in stats and skipped. A subdirectory that
+ *          disappears during the walk is taken as empty; a root that does not
+ *          exist is not, unless options.missing_root_is_empty is set.
+ *
+ * @param[in] root The directory to walk. It is followed if it is a symlink.
+ * @param[in] options The number of threads, and which files to report.
+ * @param[in] on_file The function to call with the path of each file.
+ * @param[in] on_directory If set, the function to call with each directory,
+ *                         the root included, which can skip it.
+ * @param[out] stats If not null, receives counts of what the walk found.
+ *
+ * @return 0 on success, -1 if root does not exist or cannot be read.
+ */
+int walkDirectory(const std::string &root, const WalkOptions &options, const WalkFileCallback &on_file,
+                  const WalkDirectoryCallback &on_directory, WalkStats *stats) {
+    Walk walk(root, options, on_file, on_directory);
+    std::vector<std::thread> threads;
+
+    if (root.empty())
+        return -1;
+    walk.directories.push_back(root);
+    for (unsigned int i = 1; i < options.threads; i++)
+        threads.emplace_back(runWalker, std::ref(walk));
+    runWalker(walk);
+    for (auto &thread : threads)
+        thread.join();
+
+    countMetric(MetricCounter::DirectoriesRead, walk.stats.directories);
+    countMetric(MetricCounter::EntriesStatted, walk.stats.entries_statted);
+    bool root_read = std::find(walk.stats.unreadable_directories.begin(), walk.stats.unreadable_directories.end(), root) ==
+                     walk.stats.unreadable_directories.end();
+    if (stats != nullptr)
+        *stats = std::move(walk.stats);
+    return root_read ? 0 : -1;
+}
+
+/**
+ * @brief Checks whether a file has one of the extensions of the formats TagLib
+ *        can read, ignoring case.
+ *
+ * @param[in] path The path to the file.
+ *
+ * @return true if the extension is an audio one, false otherwise.
+ */
+bool isAudioFile(const std::string &path) {
+    return hasAudioExtension(path.c_str(), path.size());
+}
+
+/**
+ * @brief Finds all files in the given directory and all its subdirectories.
+ *
+ * @details This function returns a vector of strings, each containing the path
+ *          to a file found in the given root directory or its subdirectories.
+ *
+ * @param[in] root The root directory to search in.
+ *
+ * @return A vector of strings containing file paths.
+ */
+std::vector<std::string> getFiles(std::string root) {
+    std::vector<std::string> files;
+    forEachFile(root, [&files](const std::string &file) { files.push_back(file); });
+    return files;
+}
+
+/**
+ * @brief Calls a function for every file in the given directory and all its
+ *        subdirectories.
+ *
+ * @details Unlike getFiles(), the paths are handed to the callback as soon as
+ *          they are found, so the caller can start working on them before the
+ *          whole tree has been walked. See walkDirectory() for filtering and
+ *          walking with more than one thread.
+ *
+ * @param[in] root The root directory to search in.
+ * @param[in] callback The function to call with the path of each file.
+ */
+void forEachFile(const std::string &root, const std::function<void(const std::string &)> &callback) {
+    walkDirectory(root, WalkOptions(), [&callback](const std::string &path, const FileStat &) { callback(path); });
+}
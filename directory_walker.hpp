@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "misc.hpp"
+
+struct WalkOptions {
+    unsigned int threads = 1;           // threads reading directories; 1 walks on the calling thread alone
+    bool audio_files_only = false;      // only report files with an audio extension, see isAudioFile()
+    bool follow_symlinks = true;        // descend into symlinked directories and report symlinked files
+    bool stat_files = false;            // pass each file's FileStat to the callback
+    bool missing_root_is_empty = false; // walk a root that does not exist as an empty directory instead of failing
+    std::function<void()> after_files;  // if set, called after each batch of files, outside the file callback's lock
+};
+
+struct WalkStats {
+    size_t files = 0;                   // files handed to the callback
+    size_t directories = 0;             // directories read, the root included
+    size_t entries_statted = 0;         // entries whose type was not known from the directory listing alone
+    size_t symlink_loops = 0;           // directories reached again through a symlink or bind mount, and skipped
+    std::vector<std::string> unreadable_directories;
+};
+
+/**
+ * Receives a file found by walkDirectory(). file_stat is only filled in when
+ * WalkOptions::stat_files is set. The callback may move from path, which the
+ * walker does not use again.
+ */
+typedef std::function<void(std::string &path, const FileStat &file_stat)> WalkFileCallback;
+
+/**
+ * Receives a directory found by walkDirectory(), before its entries are read.
+ * Returning false skips the directory and everything below it.
+ */
+typedef std::function<bool(const std::string &path)> WalkDirectoryCallback;
+
+int walkDirectory(const std::string &root, const WalkOptions &options, const WalkFileCallback &on_file,
+                  const WalkDirectoryCallback &on_directory = WalkDirectoryCallback(), WalkStats *stats = nullptr);
+bool isAudioFile(const std::string &path);
+std::vector<std::string> getFiles(std::string root);
+void forEachFile(const std::string &root, const std::function<void(const std::string &)> &callback);
@@ -0,0 +1,99 @@
+#include "entity_cache.hpp"
+#include "misc.hpp"
+
+/**
+ * Loads every album, artist and genre from the database into the cache.
+ *
+ * \param db The database connection to read from.
+ * \return \c 0 on success and \c -1 on failure.
+ *
+ * Any entries already in the cache are discarded first.
+ */
+int EntityCache::warm(sqlite3 *db) {
+    const char *table_name, *column_name;
+    sqlite3_stmt *stmt;
+    char *sql;
+    int rc;
+
+    clear();
+    for (int i = 0; i < ENTITY_TYPE_COUNT; i++) {
+        getEntityTable((EntityType)i, &table_name, &column_name);
+        sql = sqlite3_mprintf("SELECT id, %s FROM %s;", column_name, table_name);
+        rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+        sqlite3_free(sql);
+        if (rc != SQLITE_OK) {
+            logAt(LogLevel::Error, "Error while loading %s into the entity cache: %s\n", table_name, sqlite3_errmsg(db));
+            return -1;
+        }
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+            const char *name = (const char *)sqlite3_column_text(stmt, 1);
+            if (name != nullptr)
+                ids[i].emplace(std::string(name, sqlite3_column_bytes(stmt, 1)), sqlite3_column_int(stmt, 0));
+        }
+        sqlite3_finalize(stmt);
+        if (rc != SQLITE_DONE) {
+            logAt(LogLevel::Error, "Error while loading %s into the entity cache: %s\n", table_name, sqlite3_errmsg(db));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Looks up the ID of an entity.
+ *
+ * \param entity_type The type of the entity.
+ * \param entity_name The name of the entity.
+ * \return The ID of the entity, or \c -1 if it is not in the cache.
+ */
+int EntityCache::find(EntityType entity_type, const std::string &entity_name) const {
+    if ((int)entity_type < 0 || (int)entity_type >= ENTITY_TYPE_COUNT)
+        return -1;
+    auto it = ids[entity_type].find(entity_name);
+    return it == ids[entity_type].end() ? -1 : it->second;
+}
+
+/**
+ * Adds or replaces the ID of an entity.
+ *
+ * \param entity_type The type of the entity.
+ * \param entity_name The name of the entity.
+ * \param entity_id The ID of the entity.
+ */
+void EntityCache::put(EntityType entity_type, const std::string &entity_name, int entity_id) {
+    if ((int)entity_type < 0 || (int)entity_type >= ENTITY_TYPE_COUNT)
+        return;
+    ids[entity_type][entity_name] = entity_id;
+}
+
+/**
+ * Removes the ID of an entity, if it is in the cache.
+ *
+ * \param entity_type The type of the entity.
+ * \param entity_name The name of the entity.
+ */
+void EntityCache::erase(EntityType entity_type, const std::string &entity_name) {
+    if ((int)entity_type < 0 || (int)entity_type >= ENTITY_TYPE_COUNT)
+        return;
+    ids[entity_type].erase(entity_name);
+}
+
+/**
+ * Removes every entry from the cache.
+ */
+void EntityCache::clear() {
+    for (int i = 0; i < ENTITY_TYPE_COUNT; i++)
+        ids[i].clear();
+}
+
+/**
+ * Returns the number of entities in the cache.
+ *
+ * \return The number of cached entities across all entity types.
+ */
+size_t EntityCache::getSize() const {
+    size_t size = 0;
+    for (int i = 0; i < ENTITY_TYPE_COUNT; i++)
+        size += ids[i].size();
+    return size;
+}
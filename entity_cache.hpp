@@ -0,0 +1,29 @@
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <sqlite3.h>
+
+#include "database_functions.hpp"
+
+/**
+ * An in-memory map from entity name to entity ID, one per EntityType.
+ *
+ * The cache is filled from the Albums, Artists and Genres tables in a single
+ * pass by warm(), and kept current by calling put() whenever an entity is
+ * inserted, so repeated lookups of the same name never reach the database.
+ */
+class EntityCache {
+    public:
+        int warm(sqlite3 *db);
+        int find(EntityType entity_type, const std::string &entity_name) const;
+        void put(EntityType entity_type, const std::string &entity_name, int entity_id);
+        void erase(EntityType entity_type, const std::string &entity_name);
+        void clear();
+        size_t getSize() const;
+
+    private:
+        enum { ENTITY_TYPE_COUNT = 3 };
+
+        std::unordered_map<std::string, int> ids[ENTITY_TYPE_COUNT];
+};
@@ -0,0 +1,8 @@
+#pragma once
+
+enum EntityType {
+    Album,
+    Artist,
+    Genre,
+    Song        // songs are not looked up by name, so Song stays after the name-keyed types
+};
@@ -0,0 +1,639 @@
+#include "fast_tags.hpp"
+#include "metrics.hpp"
+#include "misc.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string_view>
+#include <vector>
+
+namespace {
+
+const size_t READ_SIZE = 64 * 1024;                 // bytes read at a time, enough for most tag blocks
+const size_t MAX_TAG_SIZE = 16 * 1024 * 1024;       // larger blocks are left to TagLib
+
+/**
+ * Moves the position of a file, with a 64-bit offset even where long, which
+ * fseek() takes, has 32 bits.
+ */
+int seekFile(FILE *file, uint64_t offset, int origin) {
+#ifdef _WIN32
+    return _fseeki64(file, (__int64)offset, origin);
+#else
+    return fseeko(file, (off_t)offset, origin);
+#endif
+}
+
+/**
+ * Returns the position of a file, like ftell(), but with 64 bits.
+ */
+int64_t tellFile(FILE *file) {
+#ifdef _WIN32
+    return _ftelli64(file);
+#else
+    return ftello(file);
+#endif
+}
+
+/**
+ * A window over the head of a file. Bytes are read in chunks of READ_SIZE, so
+ * looking at consecutive small headers costs one read, and a block can be
+ * skipped without reading it. The buffer belongs to the thread and is reused
+ * from file to file, so only one FileHead may be open per thread.
+ */
+class FileHead {
+    public:
+        explicit FileHead(const std::string &path) : file(fopen(path.c_str(), "rb")), buffer(getThreadBuffer()), start(0), filled(0) {}
+        ~FileHead() {
+            if (file != nullptr)
+                fclose(file);
+            // A huge tag block should not pin its buffer for the rest of the thread's life.
+            if (buffer.size() > READ_SIZE) {
+                buffer.clear();
+                buffer.shrink_to_fit();
+            }
+        }
+
+        bool isOpen() const { return file != nullptr; }
+
+        /**
+         * Returns the size of the file, or 0 if it cannot be told.
+         */
+        size_t getSize() {
+            if (seekFile(file, 0, SEEK_END) != 0)
+                return 0;
+            int64_t size = tellFile(file);
+            return size > 0 ? (size_t)size : 0;
+        }
+
+        /**
+         * Returns a pointer to length bytes at offset, valid until the next
+         * call, or nullptr if the file ends before them.
+         */
+        const unsigned char *get(size_t offset, size_t length) {
+            if (offset >= start && offset + length <= start + filled)
+                return buffer.data() + (offset - start);
+            if (length > MAX_TAG_SIZE || seekFile(file, offset, SEEK_SET) != 0)
+                return nullptr;
+            size_t size = std::max(length, READ_SIZE);
+            // Only ever grown, so that a reused buffer is not cleared before every read.
+            if (buffer.size() < size)
+                buffer.resize(size);
+            filled = fread(buffer.data(), 1, size, file);
+            countMetric(MetricCounter::BytesRead, filled);
+            start = offset;
+            return filled >= length ? buffer.data() : nullptr;
+        }
+
+    private:
+        static std::vector<unsigned char> &getThreadBuffer() {
+            thread_local std::vector<unsigned char> thread_buffer;
+            return thread_buffer;
+        }
+
+        FILE *file;
+        std::vector<unsigned char> &buffer;
+        size_t start;
+        size_t filled;          // bytes of buffer read from the file, starting at start
+};
+
+/**
+ * The raw values of the tag fields readMetadata() uses. A field may be given
+ * more than once.
+ */
+struct TagFields {
+    std::vector<std::string> title, artist, album, album_artist, genre;
+    std::string track, disc, year;
+
+    void clear() {
+        for (auto *values : { &title, &artist, &album, &album_artist, &genre })
+            values->clear();
+        track.clear();
+        disc.clear();
+        year.clear();
+    }
+};
+
+uint32_t readLittleEndian32(const unsigned char *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+uint32_t readBigEndian(const unsigned char *p, int bytes) {
+    uint32_t value = 0;
+    for (int i = 0; i < bytes; i++)
+        value = (value << 8) | p[i];
+    return value;
+}
+
+uint32_t readSyncSafe(const unsigned char *p) {
+    return ((uint32_t)(p[0] & 0x7F) << 21) | ((uint32_t)(p[1] & 0x7F) << 14) | ((uint32_t)(p[2] & 0x7F) << 7) | (p[3] & 0x7F);
+}
+
+bool equalsIgnoreCase(std::string_view a, const char *b) {
+    size_t i = 0;
+    for (; i < a.size() && b[i] != '\0'; i++)
+        if ((a[i] >= 'a' && a[i] <= 'z' ? a[i] - 32 : a[i]) != b[i])
+            return false;
+    return i == a.size() && b[i] == '\0';
+}
+
+/**
+ * Returns the number a tag value starts with, as in "3/12" or "2004-05-01".
+ */
+unsigned int parseLeadingNumber(const std::string &s) {
+    unsigned int value = 0;
+    size_t i = 0;
+    while (i < s.size() && s[i] == ' ')
+        i++;
+    for (; i < s.size() && s[i] >= '0' && s[i] <= '9'; i++)
+        value = value * 10 + (unsigned int)(s[i] - '0');
+    return value;
+}
+
+void appendUtf8(std::string &out, uint32_t code_point) {
+    if (code_point < 0x80)
+        out += (char)code_point;
+    else if (code_point < 0x800) {
+        out += (char)(0xC0 | (code_point >> 6));
+        out += (char)(0x80 | (code_point & 0x3F));
+    } else if (code_point < 0x10000) {
+        out += (char)(0xE0 | (code_point >> 12));
+        out += (char)(0x80 | ((code_point >> 6) & 0x3F));
+        out += (char)(0x80 | (code_point & 0x3F));
+    } else {
+        out += (char)(0xF0 | (code_point >> 18));
+        out += (char)(0x80 | ((code_point >> 12) & 0x3F));
+        out += (char)(0x80 | ((code_point >> 6) & 0x3F));
+        out += (char)(0x80 | (code_point & 0x3F));
+    }
+}
+
+/**
+ * Parses a Vorbis comment block, as found in FLAC, Ogg Vorbis and Opus files.
+ */
+bool parseVorbisComment(const unsigned char *data, size_t size, TagFields &fields) {
+    size_t pos, count;
+
+    if (size < 8)
+        return false;
+    pos = 4 + (size_t)readLittleEndian32(data);
+    if (pos + 4 > size)
+        return false;
+    count = readLittleEndian32(data + pos);
+    pos += 4;
+    for (size_t i = 0; i < count; i++) {
+        if (pos + 4 > size)
+            return false;
+        size_t length = readLittleEndian32(data + pos);
+        pos += 4;
+        if (length > size - pos)
+            return false;
+        std::string_view field((const char *)data + pos, length);
+        pos += length;
+        size_t equals = field.find('=');
+        if (equals == std::string_view::npos)
+            continue;
+        std::string_view key = field.substr(0, equals), value = field.substr(equals + 1);
+        if (equalsIgnoreCase(key, "TITLE"))
+            fields.title.emplace_back(value);
+        else if (equalsIgnoreCase(key, "ARTIST"))
+            fields.artist.emplace_back(value);
+        else if (equalsIgnoreCase(key, "ALBUM"))
+            fields.album.emplace_back(value);
+        else if (equalsIgnoreCase(key, "ALBUMARTIST"))
+            fields.album_artist.emplace_back(value);
+        else if (equalsIgnoreCase(key, "GENRE"))
+            fields.genre.emplace_back(value);
+        else if (equalsIgnoreCase(key, "TRACKNUMBER") && fields.track.empty())
+            fields.track = value;
+        else if (equalsIgnoreCase(key, "DISCNUMBER") && fields.disc.empty())
+            fields.disc = value;
+        else if ((equalsIgnoreCase(key, "DATE") || equalsIgnoreCase(key, "YEAR")) && fields.year.empty())
+            fields.year = value;
+    }
+    return true;
+}
+
+/**
+ * Reads the VORBIS_COMMENT block of a FLAC stream starting at offset, without
+ * reading any other metadata block (such as embedded pictures).
+ */
+bool readFlac(FileHead &head, size_t offset, TagFields &fields) {
+    const unsigned char *p = head.get(offset, 4);
+    if (p == nullptr || memcmp(p, "fLaC", 4) != 0)
+        return false;
+    for (offset += 4;;) {
+        if ((p = head.get(offset, 4)) == nullptr)
+            return false;
+        bool last = (p[0] & 0x80) != 0;
+        int type = p[0] & 0x7F;
+        size_t length = readBigEndian(p + 1, 3);
+        offset += 4;
+        if (type == 4) {
+            if ((p = head.get(offset, length)) == nullptr)
+                return false;
+            return parseVorbisComment(p, length, fields);
+        }
+        // Type 127 is invalid, and a stream without comments may carry ID3 tags instead, which TagLib reads.
+        if (type == 127 || last)
+            return false;
+        offset += length;
+    }
+}
+
+/**
+ * Reads the first two packets of the first logical stream in an Ogg file and
+ * parses the comment header if the stream is Vorbis or Opus.
+ */
+bool readOgg(FileHead &head, TagFields &fields) {
+    std::string packets[2], current;
+    unsigned char lacing[255];
+    size_t offset = 0, packet_count = 0;
+    uint32_t serial = 0;
+
+    for (int page = 0; packet_count < 2; page++) {
+        const unsigned char *p = head.get(offset, 27);
+        if (p == nullptr || memcmp(p, "OggS", 4) != 0 || p[4] != 0)
+            return false;
+        size_t segments = p[26];
+        uint32_t page_serial = readLittleEndian32(p + 14);
+        if (page == 0)
+            serial = page_serial;
+        if ((p = head.get(offset + 27, segments)) == nullptr)
+            return false;
+        memcpy(lacing, p, segments);
+        size_t body_size = 0;
+        for (size_t i = 0; i < segments; i++)
+            body_size += lacing[i];
+        const unsigned char *body = head.get(offset + 27 + segments, body_size);
+        if (body == nullptr)
+            return false;
+        offset += 27 + segments + body_size;
+        if (page_serial != serial)
+            continue;
+        for (size_t i = 0, pos = 0; i < segments && packet_count < 2; pos += lacing[i], i++) {
+            current.append((const char *)body + pos, lacing[i]);
+            if (lacing[i] < 255) {
+                packets[packet_count++].swap(current);
+                current.clear();
+            }
+        }
+        if (current.size() > MAX_TAG_SIZE)
+            return false;
+    }
+
+    const unsigned char *comment = (const unsigned char *)packets[1].data();
+    size_t size = packets[1].size();
+    if (packets[0].compare(0, 7, "\x01vorbis") == 0 && size > 7 && memcmp(comment, "\x03vorbis", 7) == 0)
+        return parseVorbisComment(comment + 7, size - 7, fields);
+    if (packets[0].compare(0, 8, "OpusHead") == 0 && size > 8 && memcmp(comment, "OpusTags", 8) == 0)
+        return parseVorbisComment(comment + 8, size - 8, fields);
+    return false;
+}
+
+/**
+ * Removes the 0x00 bytes ID3v2 unsynchronisation inserts after every 0xFF.
+ */
+std::string removeUnsynchronisation(const unsigned char *data, size_t size) {
+    std::string out;
+    out.reserve(size);
+    for (size_t i = 0; i < size; i++) {
+        out += (char)data[i];
+        if (data[i] == 0xFF && i + 1 < size && data[i + 1] == 0x00)
+            i++;
+    }
+    return out;
+}
+
+/**
+ * Decodes the values of an ID3v2 text frame to UTF-8. Version 2.4 frames can
+ * hold several values separated by terminators.
+ */
+std::vector<std::string> decodeId3Text(const unsigned char *data, size_t size) {
+    std::vector<std::string> values(1);
+    if (size == 0)
+        return {};
+    int encoding = data[0];
+    data++;
+    size--;
+
+    if (encoding == 0 || encoding == 3) {
+        for (size_t i = 0; i < size; i++) {
+            if (data[i] == 0)
+                values.emplace_back();
+            else if (encoding == 3 || data[i] < 0x80)
+                values.back() += (char)data[i];
+            else
+                appendUtf8(values.back(), data[i]);
+        }
+    } else if (encoding == 1 || encoding == 2) {
+        bool big_endian = encoding == 2, at_start = true;
+        uint32_t high_surrogate = 0;
+        for (size_t i = 0; i + 1 < size; i += 2) {
+            uint32_t unit = big_endian ? (data[i] << 8) | data[i + 1] : data[i] | (data[i + 1] << 8);
+            if (encoding == 1 && at_start && (unit == 0xFEFF || unit == 0xFFFE)) {
+                // Each value of a UTF-16 frame starts with its own byte order mark.
+                if (unit == 0xFFFE)
+                    big_endian = !big_endian;
+                at_start = false;
+                continue;
+            }
+            at_start = false;
+            if (unit == 0) {
+                values.emplace_back();
+                at_start = true;
+            } else if (unit >= 0xD800 && unit < 0xDC00)
+                high_surrogate = unit;
+            else if (unit >= 0xDC00 && unit < 0xE000) {
+                appendUtf8(values.back(), high_surrogate ? 0x10000 + ((high_surrogate - 0xD800) << 10) + (unit - 0xDC00) : 0xFFFD);
+                high_surrogate = 0;
+            } else
+                appendUtf8(values.back(), unit);
+        }
+    } else
+        return {};
+    while (!values.empty() && values.back().empty())
+        values.pop_back();
+    return values;
+}
+
+/**
+ * Parses the frames of an ID3v2 tag of size bytes, fetching them with
+ * get(offset, length), where offsets count from the end of the tag header.
+ * Only the frames readMetadata() uses are fetched, so pictures and other
+ * large frames are skipped without being read. Returns false for tags that
+ * TagLib should handle: compressed or encrypted text frames, and genres given
+ * as ID3v1 genre numbers.
+ */
+template <class GetBytes>
+bool parseId3v2(GetBytes get, size_t size, int version, bool has_extended_header, TagFields &fields) {
+    size_t id_size = version == 2 ? 3 : 4, header_size = version == 2 ? 6 : 10, pos = 0;
+    static const char *ids[][2] = { { "TT2", "TIT2" }, { "TP1", "TPE1" }, { "TAL", "TALB" }, { "TP2", "TPE2" },
+                                    { "TCO", "TCON" }, { "TRK", "TRCK" }, { "TPA", "TPOS" }, { "TYE", "TYER" }, { "", "TDRC" } };
+    unsigned char header[10];
+    const unsigned char *p;
+    bool found = false;
+
+    if (has_extended_header && version > 2) {
+        if ((p = get(0, 4)) == nullptr)
+            return false;
+        pos = version == 3 ? 4 + readBigEndian(p, 4) : readSyncSafe(p);
+    }
+    while (pos + header_size <= size && (p = get(pos, header_size)) != nullptr && p[0] != 0) {
+        // p only lasts until the next get().
+        memcpy(header, p, header_size);
+        size_t frame_size = version == 2 ? readBigEndian(header + 3, 3) : version == 3 ? readBigEndian(header + 4, 4) : readSyncSafe(header + 4);
+        unsigned char format_flags = version == 2 ? 0 : header[9];
+        pos += header_size;
+        if (frame_size > size - pos)
+            break;
+        size_t data_offset = pos;
+        pos += frame_size;
+
+        int field = -1;
+        for (int i = 0; i < (int)(sizeof(ids) / sizeof(ids[0])) && field < 0; i++)
+            if (memcmp(header, ids[i][version == 2 ? 0 : 1], id_size) == 0 && ids[i][version == 2 ? 0 : 1][0] != '\0')
+                field = i;
+        if (field < 0)
+            continue;
+        const unsigned char *data = get(data_offset, frame_size);
+        if (data == nullptr)
+            return false;
+
+        std::string unsynchronised;
+        size_t data_size = frame_size;
+        if (version == 3) {
+            if (format_flags & 0xC0)                    // compressed or encrypted
+                return false;
+            if (format_flags & 0x20) {                  // group identifier byte
+                data++;
+                data_size = data_size > 0 ? data_size - 1 : 0;
+            }
+        } else if (version == 4) {
+            if (format_flags & 0x0C)                    // compressed or encrypted
+                return false;
+            size_t skip = ((format_flags & 0x40) ? 1 : 0) + ((format_flags & 0x01) ? 4 : 0);
+            if (skip > data_size)
+                continue;
+            data += skip;
+            data_size -= skip;
+            if (format_flags & 0x02) {
+                unsynchronised = removeUnsynchronisation(data, data_size);
+                data = (const unsigned char *)unsynchronised.data();
+                data_size = unsynchronised.size();
+            }
+        }
+
+        std::vector<std::string> values = decodeId3Text(data, data_size);
+        if (values.empty())
+            continue;
+        found = true;
+        switch (field) {
+            case 0: fields.title.insert(fields.title.end(), values.begin(), values.end()); break;
+            case 1: fields.artist.insert(fields.artist.end(), values.begin(), values.end()); break;
+            case 2: fields.album.insert(fields.album.end(), values.begin(), values.end()); break;
+            case 3: fields.album_artist.insert(fields.album_artist.end(), values.begin(), values.end()); break;
+            case 4:
+                for (auto &value : values)
+                    if (value.empty() || value[0] == '(' || (value[0] >= '0' && value[0] <= '9'))
+                        return false;
+                fields.genre.insert(fields.genre.end(), values.begin(), values.end());
+                break;
+            case 5: fields.track = values[0]; break;
+            case 6: fields.disc = values[0]; break;
+            default:
+                if (fields.year.empty())
+                    fields.year = values[0];
+                break;
+        }
+    }
+    return found;
+}
+
+/**
+ * Reads an ID3v2 tag at the head of the file. If a FLAC stream follows the
+ * tag, its Vorbis comments are read instead, as TagLib does; otherwise an
+ * MPEG frame must follow for the tag to be used.
+ */
+bool readId3v2(FileHead &head, TagFields &fields) {
+    const unsigned char *p = head.get(0, 10);
+    if (p == nullptr || memcmp(p, "ID3", 3) != 0 || p[3] < 2 || p[3] > 4)
+        return false;
+    int version = p[3];
+    unsigned char flags = p[5];
+    size_t size = readSyncSafe(p + 6), end = 10 + size + ((flags & 0x10) ? 10 : 0);
+
+    if ((p = head.get(end, 4)) != nullptr && memcmp(p, "fLaC", 4) == 0)
+        return readFlac(head, end, fields);
+    bool has_frame = false;
+    for (size_t i = 0; i < 4096 && !has_frame && (p = head.get(end + i, 2)) != nullptr; i++)
+        has_frame = p[0] == 0xFF && (p[1] & 0xE0) == 0xE0;
+    if (!has_frame)
+        return false;
+    // Before version 2.4, unsynchronisation covers the whole tag, frame headers included, so the tag is read in one piece.
+    if ((flags & 0x80) && version < 4) {
+        if ((p = head.get(10, size)) == nullptr)
+            return false;
+        std::string tag = removeUnsynchronisation(p, size);
+        auto get = [&tag](size_t offset, size_t length) -> const unsigned char * {
+            return offset <= tag.size() && length <= tag.size() - offset ? (const unsigned char *)tag.data() + offset : nullptr;
+        };
+        return parseId3v2(get, tag.size(), version, (flags & 0x40) != 0, fields);
+    }
+    auto get = [&head](size_t offset, size_t length) { return head.get(10 + offset, length); };
+    return parseId3v2(get, size, version, (flags & 0x40) != 0, fields);
+}
+
+/**
+ * Checks if a file ends in an ID3v1 tag or an APE tag, which may be followed
+ * by an ID3v1 tag.
+ */
+bool hasTrailingTag(FileHead &head) {
+    size_t size = head.getSize();
+    const unsigned char *p;
+
+    if (size >= 128 && (p = head.get(size - 128, 3)) != nullptr && memcmp(p, "TAG", 3) == 0)
+        return true;
+    for (size_t footer : { 32, 160 })
+        if (size >= footer && (p = head.get(size - footer, 8)) != nullptr && memcmp(p, "APETAGEX", 8) == 0)
+            return true;
+    return false;
+}
+
+/**
+ * Checks if a field of TagLib's Tag interface was not found.
+ */
+bool lacksTagField(const TagFields &fields) {
+    return fields.title.empty() || fields.artist.empty() || fields.album.empty() || fields.genre.empty() || fields.track.empty() ||
+           fields.year.empty();
+}
+
+std::string joinValues(const std::vector<std::string> &values) {
+    std::string joined;
+    for (size_t i = 0; i < values.size(); i++) {
+        if (i > 0)
+            joined += ' ';
+        joined += values[i];
+    }
+    return joined;
+}
+
+void splitValues(std::vector<std::string> &out, const std::vector<std::string> &values) {
+    out.clear();
+    for (auto &value : values) {
+        std::vector<std::string> parts = splitString(value);
+        out.insert(out.end(), std::make_move_iterator(parts.begin()), std::make_move_iterator(parts.end()));
+    }
+}
+
+/**
+ * Reads the tag fields of a file in one of the layouts this reader handles.
+ * The fields are cleared first, so one TagFields can be reused for many files.
+ */
+bool readTagFields(const std::string &file_location, TagFields &fields) {
+    FileHead head(file_location);
+    const unsigned char *magic;
+
+    bool read;
+
+    fields.clear();
+    if (!head.isOpen() || (magic = head.get(0, 4)) == nullptr)
+        return false;
+    if (memcmp(magic, "fLaC", 4) == 0)
+        read = readFlac(head, 0, fields);
+    else if (memcmp(magic, "OggS", 4) == 0)
+        return readOgg(head, fields);
+    else if (memcmp(magic, "ID3", 3) == 0)
+        read = readId3v2(head, fields);
+    else
+        return false;
+    // TagLib reads FLAC and MPEG files through the union of their tags, which fills a field the
+    // main tag lacks from an ID3v1 or APE tag at the end of the file. Such files are left to it.
+    return read && !(lacksTagField(fields) && hasTrailingTag(head));
+}
+
+/**
+ * Interns the values of a field that holds one string, joined as joinValues() does.
+ */
+uint32_t internJoined(const std::vector<std::string> &values, StringPool &pool) {
+    return values.size() == 1 ? pool.intern(values[0]) : pool.intern(joinValues(values));
+}
+
+}
+
+/**
+ * @brief Reads the tags of a music file without TagLib.
+ *
+ * @details Handles the tag layouts that can be read from the head of the file
+ *          without decoding any audio: Vorbis comments in FLAC metadata blocks
+ *          and in the first pages of Ogg Vorbis and Opus streams, and ID3v2
+ *          tags in front of MPEG audio. The file is read in large chunks, and
+ *          blocks and frames that are not needed, like embedded pictures, are
+ *          skipped without being read. Anything else is left to TagLib;
+ *          readMetadata() falls back to it when this function fails. So are
+ *          files whose tag lacks a field that an ID3v1 or APE tag at the end
+ *          of the file might hold.
+ *
+ *          A field given more than once is joined with spaces if it holds one
+ *          string (title and album), and split value by value if it holds
+ *          names (artists and genres), as readTagLibMetadata() does.
+ *
+ * @param[in] file_location The path to the music file.
+ * @param[out] metadata The struct to fill in. Left untouched on failure.
+ *
+ * @return 0 on success, -1 if the file is not in a layout this reader handles.
+ */
+int readFastTags(const std::string &file_location, Metadata &metadata) {
+    thread_local TagFields fields;
+
+    if (!readTagFields(file_location, fields))
+        return -1;
+    metadata.file_location = file_location;
+    metadata.title = joinValues(fields.title);
+    splitValues(metadata.contributing_artists, fields.artist);
+    metadata.album = joinValues(fields.album);
+    splitValues(metadata.album_artists, fields.album_artist);
+    splitValues(metadata.genres, fields.genre);
+    metadata.track_number = parseLeadingNumber(fields.track);
+    metadata.disc_number = parseLeadingNumber(fields.disc);
+    metadata.year = parseLeadingNumber(fields.year);
+    return 0;
+}
+
+/**
+ * @brief Reads the tags of a music file without TagLib, interning the names.
+ *
+ * @details Same as the Metadata version, but the names are split and interned
+ *          straight from the tag fields, without a string of their own.
+ *          metadata.file_location is left as it is.
+ *
+ * @param[in] file_location The path to the music file.
+ * @param[out] metadata The struct to fill in. Left untouched on failure.
+ * @param[in] pool The pool to intern the names in.
+ *
+ * @return 0 on success, -1 if the file is not in a layout this reader handles.
+ */
+int readFastTags(const std::string &file_location, CompactMetadata &metadata, StringPool &pool) {
+    // Kept from file to file, so its vectors are not allocated again for every song.
+    thread_local TagFields fields;
+
+    if (!readTagFields(file_location, fields))
+        return -1;
+    metadata.title = internJoined(fields.title, pool);
+    metadata.album = internJoined(fields.album, pool);
+    metadata.contributing_artists.clear();
+    metadata.album_artists.clear();
+    metadata.genres.clear();
+    for (auto &value : fields.artist)
+        internNames(value, metadata.contributing_artists, pool);
+    for (auto &value : fields.album_artist)
+        internNames(value, metadata.album_artists, pool);
+    for (auto &value : fields.genre)
+        internNames(value, metadata.genres, pool);
+    metadata.track_number = parseLeadingNumber(fields.track);
+    metadata.disc_number = parseLeadingNumber(fields.disc);
+    metadata.year = parseLeadingNumber(fields.year);
+    return 0;
+}
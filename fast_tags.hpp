@@ -0,0 +1,8 @@
+#pragma once
+
+#include <string>
+
+#include "tag_functions.hpp"
+
+int readFastTags(const std::string &file_location, Metadata &metadata);
+int readFastTags(const std::string &file_location, CompactMetadata &metadata, StringPool &pool);
@@ -0,0 +1,838 @@
+#include "ffi.hpp"
+#include "ingest.hpp"
+#include "album_art.hpp"
+#include "catalog.hpp"
+#include "database_functions.hpp"
+#include "columnar_result.hpp"
+#include "metrics.hpp"
+#include "smart_playlists.hpp"
+#include "song_updates.hpp"
+#include "misc.hpp"
+
+#include <sqlite3.h>
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <vector>
+
+/**
+ * A read-only connection with one prepared statement, kept open so the
+ * statement can be run repeatedly.
+ */
+struct FfiQuery {
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+    size_t last_row_count;      // sizes the buffers of the next run
+};
+
+/**
+ * An album art extractor started through the FFI.
+ */
+struct FfiArtExtractor {
+    AlbumArtExtractor extractor;
+
+    FfiArtExtractor(const char *db_path, const char *cache_directory, AlbumArtExtractor::Callback callback)
+        : extractor(db_path, cache_directory, ArtOptions(), callback) {}
+};
+
+/**
+ * A catalog snapshot mapped through the FFI.
+ */
+struct FfiCatalog {
+    CatalogSnapshot snapshot;
+
+    explicit FfiCatalog(const char *path) : snapshot(path) {}
+};
+
+/**
+ * A song update queue opened through the FFI.
+ */
+struct FfiSongUpdates {
+    SongUpdateQueue queue;
+
+    FfiSongUpdates(const char *db_path, const SongUpdateOptions &options) : queue(db_path, options) {}
+};
+
+namespace {
+
+/**
+ * Owns the buffers an FfiResult points into.
+ */
+struct FfiResultData {
+    ColumnarResult result;
+    std::vector<FfiColumn> columns;
+};
+
+const char *SONG_LIST_SQL =
+    "SELECT Songs.id, Songs.title, Songs.album_id, Albums.title AS album, Songs.track_number, Songs.disc_number, "
+    "Songs.rating, Songs.location FROM Songs LEFT JOIN Albums ON Albums.id = Songs.album_id ORDER BY Songs.id;";
+
+int runIngest(const char *db_path, const char *root, unsigned int parser_threads, bool incremental) {
+    sqlite3 *db;
+    IngestOptions options;
+    int rc;
+
+    rc = sqlite3_open(db_path, &db);
+    if (rc != SQLITE_OK) {
+        logAt(LogLevel::Error, "Can't open database %s: %s\n", db_path, sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return -1;
+    }
+    // The UI may be flushing song updates at the same time.
+    sqlite3_busy_timeout(db, 5000);
+    options.parser_threads = parser_threads;
+    options.incremental = incremental;
+    rc = ingestLibrary(db, root, options);
+    sqlite3_close(db);
+    return rc;
+}
+
+/**
+ * Opens a database, upgrading it to have smart playlists and play counts if
+ * needed, and runs callback on its playlists.
+ */
+int runOnSmartPlaylists(const char *db_path, const std::function<int(SmartPlaylists &)> &callback) {
+    sqlite3 *db;
+    int rc = -1;
+
+    if (sqlite3_open(db_path, &db) != SQLITE_OK) {
+        logAt(LogLevel::Error, "Can't open database %s: %s\n", db_path, sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return -1;
+    }
+    // Ingest may be writing at the same time.
+    sqlite3_busy_timeout(db, 5000);
+    if (addSmartPlaylists(db) == 0 && addPlayCountColumn(db) == 0) {
+        SmartPlaylists smart_playlists(db);
+        if (smart_playlists.isValid())
+            rc = callback(smart_playlists);
+    }
+    sqlite3_close(db);
+    return rc;
+}
+
+}
+
+/**
+ * @brief Scans a music library into an existing database.
+ *
+ * @details Opens the database at db_path and runs ingestLibrary() on it. Every
+ *          file is parsed and inserted as a new song.
+ *
+ * @param[in] db_path The path to the database file.
+ * @param[in] root The root directory of the music library.
+ * @param[in] parser_threads The number of tag parser threads, or 0 for one per
+ *                           hardware thread.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int ffiIngestLibrary(const char *db_path, const char *root, unsigned int parser_threads) {
+    return runIngest(db_path, root, parser_threads, false);
+}
+
+/**
+ * @brief Brings a database up to date with the music library on disk.
+ *
+ * @details Like ffiIngestLibrary(), but only new and changed files are parsed,
+ *          and songs whose files are gone are removed.
+ *
+ * @param[in] db_path The path to the database file.
+ * @param[in] root The root directory of the music library.
+ * @param[in] parser_threads The number of tag parser threads, or 0 for one per
+ *                           hardware thread.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int ffiRescanLibrary(const char *db_path, const char *root, unsigned int parser_threads) {
+    return runIngest(db_path, root, parser_threads, true);
+}
+
+/**
+ * @brief Sets the file that log messages are appended to.
+ *
+ * @param[in] path The path to the log file.
+ */
+void ffiSetLogPath(const char *path) {
+    setLogPath(path);
+}
+
+/**
+ * @brief Sets the lowest level of messages that are written to the log.
+ *
+ * @param[in] level 0 for debug, 1 for info, 2 for warnings and 3 for errors.
+ *
+ * @return 0 on success, -1 if level is out of range.
+ */
+int ffiSetLogLevel(int level) {
+    if (level < (int)LogLevel::Debug || level > (int)LogLevel::Error)
+        return -1;
+    setLogLevel((LogLevel)level);
+    return 0;
+}
+
+/**
+ * @brief Writes all queued log messages to the log file before returning.
+ */
+void ffiFlushLog() {
+    flushLog();
+}
+
+/**
+ * @brief Stops the background thread that writes the log, after writing all queued messages.
+ *
+ * @details Happens by itself at exit, but on Windows must be called before the
+ *          library is unloaded. Messages logged afterwards are still written,
+ *          synchronously.
+ */
+void ffiShutdownLog() {
+    shutdownLog();
+}
+
+/**
+ * @brief Searches the songs of a library by title, album, artists and genres.
+ *
+ * @details See searchSongs() for how the query is matched and ranked.
+ *
+ * @param[in] db_path The path to the database file.
+ * @param[in] query The words to search for, in UTF-8.
+ * @param[in] limit The maximum number of song IDs to return.
+ * @param[in] offset The number of best-ranked songs to skip, for later pages.
+ * @param[out] song_ids Receives the IDs of the matching songs, best first. Must
+ *                      have room for limit IDs.
+ *
+ * @return The number of song IDs written, or -1 on failure, including when
+ *         db_path, query or song_ids is NULL.
+ */
+int ffiSearchSongs(const char *db_path, const char *query, int limit, int offset, int *song_ids) {
+    std::vector<int> results;
+    sqlite3 *db;
+    int rc;
+
+    if (db_path == nullptr || query == nullptr || song_ids == nullptr || limit < 0 || offset < 0)
+        return -1;
+    if (sqlite3_open_v2(db_path, &db, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, NULL) != SQLITE_OK) {
+        logAt(LogLevel::Error, "Can't open database %s: %s\n", db_path, sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return -1;
+    }
+    rc = searchSongs(db, query, (size_t)limit, (size_t)offset, results);
+    sqlite3_close(db);
+    if (rc != 0)
+        return -1;
+    std::copy(results.begin(), results.end(), song_ids);
+    return (int)results.size();
+}
+
+/**
+ * @brief Opens a database read-only and prepares a query on it.
+ *
+ * @details The query can be run any number of times with ffiRunQuery(), with
+ *          new parameter values bound in between, and must be released with
+ *          ffiCloseQuery(). The connection is opened without SQLite's own
+ *          mutexes, which cost a lock per column read, so a handle must not
+ *          be used by two threads at once.
+ *
+ * @param[in] db_path The path to the database file.
+ * @param[in] sql A single SQL statement, optionally with ?NNN parameters.
+ *
+ * @return The query handle, or NULL if the database cannot be opened or the
+ *         statement cannot be prepared.
+ */
+FfiQuery *ffiPrepareQuery(const char *db_path, const char *sql) {
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+
+    if (sqlite3_open_v2(db_path, &db, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, NULL) != SQLITE_OK) {
+        logAt(LogLevel::Error, "Can't open database %s: %s\n", db_path, sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return nullptr;
+    }
+    if (sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, &stmt, NULL) != SQLITE_OK) {
+        logAt(LogLevel::Error, "Error while preparing statement \"%s\": %s\n", sql, sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return nullptr;
+    }
+    return new FfiQuery{db, stmt, 0};
+}
+
+/**
+ * @brief Prepares the query behind the song list view.
+ *
+ * @details The result has one row per song, ordered by ID, with the columns
+ *          id, title, album_id, album, track_number, disc_number, rating and
+ *          location. Artists are many-to-many, so they are best fetched with a
+ *          second query over ContributingArtists and joined by the caller.
+ *
+ * @param[in] db_path The path to the database file.
+ *
+ * @return The query handle, or NULL on failure.
+ */
+FfiQuery *ffiPrepareSongListQuery(const char *db_path) {
+    return ffiPrepareQuery(db_path, SONG_LIST_SQL);
+}
+
+/**
+ * @brief Prepares a query listing the songs that hold the same audio.
+ *
+ * @details The result has the columns content_hash and id, with one row per
+ *          song whose hash is shared by another song, ordered so that the
+ *          songs of each set of duplicates are adjacent. Only songs hashed
+ *          during an ingest with hashing enabled take part.
+ *
+ * @param[in] db_path The path to the database file.
+ *
+ * @return The query handle, or NULL on failure.
+ */
+FfiQuery *ffiPrepareDuplicatesQuery(const char *db_path) {
+    return ffiPrepareQuery(db_path, FIND_DUPLICATES);
+}
+
+/**
+ * @brief Binds an integer to a parameter of a query.
+ *
+ * @param[in] query The query handle.
+ * @param[in] index The index of the parameter, starting at 1.
+ * @param[in] value The value to bind.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int ffiBindInt(FfiQuery *query, int index, int64_t value) {
+    if (query == nullptr || sqlite3_bind_int64(query->stmt, index, value) != SQLITE_OK)
+        return -1;
+    return 0;
+}
+
+/**
+ * @brief Binds a UTF-8 string to a parameter of a query.
+ *
+ * @param[in] query The query handle.
+ * @param[in] index The index of the parameter, starting at 1.
+ * @param[in] value The value to bind. It is copied.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int ffiBindText(FfiQuery *query, int index, const char *value) {
+    if (query == nullptr || sqlite3_bind_text(query->stmt, index, value, -1, SQLITE_TRANSIENT) != SQLITE_OK)
+        return -1;
+    return 0;
+}
+
+/**
+ * @brief Runs a query and returns all of its rows at once, column by column.
+ *
+ * @details This is one call however many rows there are: integers land in
+ *          contiguous int64 arrays, and each text column in one offsets
+ *          array plus one UTF-8 buffer, so nothing has to be converted or
+ *          copied per row on the caller's side.
+ *
+ * @param[in] query The query handle.
+ * @param[out] result Receives the rows. Must be released with ffiFreeResult(),
+ *                    even when the call fails.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int ffiRunQuery(FfiQuery *query, FfiResult *result) {
+    if (result == nullptr)
+        return -1;
+    result->row_count = result->column_count = 0;
+    result->columns = nullptr;
+    result->internal = nullptr;
+    if (query == nullptr)
+        return -1;
+
+    FfiResultData *data = new FfiResultData();
+    result->internal = data;
+    if (fetchColumns(query->stmt, data->result, query->last_row_count) != 0)
+        return -1;
+    query->last_row_count = data->result.row_count;
+
+    for (auto &column : data->result.columns) {
+        FfiColumn ffi_column;
+        ffi_column.name = column.name.c_str();
+        ffi_column.type = column.is_text ? FFI_COLUMN_TEXT : FFI_COLUMN_INTEGER;
+        ffi_column.integers = column.integers.data();
+        ffi_column.offsets = column.offsets.data();
+        ffi_column.text = column.text.data();
+        ffi_column.is_null = column.is_null.data();
+        data->columns.push_back(ffi_column);
+    }
+    result->row_count = (int)data->result.row_count;
+    result->column_count = (int)data->columns.size();
+    result->columns = data->columns.data();
+    return 0;
+}
+
+/**
+ * @brief Releases the buffers of a result.
+ *
+ * @param[in] result The result filled in by ffiRunQuery(). Its fields are
+ *                   cleared, so freeing it twice is harmless.
+ */
+void ffiFreeResult(FfiResult *result) {
+    if (result == nullptr)
+        return;
+    delete (FfiResultData *)result->internal;
+    result->row_count = result->column_count = 0;
+    result->columns = nullptr;
+    result->internal = nullptr;
+}
+
+/**
+ * @brief Finalizes a query and closes its connection.
+ *
+ * @param[in] query The query handle. May be NULL.
+ */
+void ffiCloseQuery(FfiQuery *query) {
+    if (query == nullptr)
+        return;
+    sqlite3_finalize(query->stmt);
+    sqlite3_close(query->db);
+    delete query;
+}
+
+/**
+ * @brief Starts extracting album art into a cache directory in the background.
+ *
+ * @details See AlbumArtExtractor. Art is only extracted for albums that are
+ *          asked for with ffiGetAlbumArt(), ffiSetVisibleAlbums() or
+ *          ffiRequestMissingArt().
+ *
+ * @param[in] db_path The path to the database file.
+ * @param[in] cache_directory The directory to store images in.
+ * @param[in] callback If not NULL, called from a worker thread each time an
+ *                     album has been extracted.
+ * @param[in] user_data Passed to callback unchanged.
+ *
+ * @return The extractor, to be released with ffiStopArtExtractor(), or NULL if
+ *         it could not be started.
+ */
+FfiArtExtractor *ffiStartArtExtractor(const char *db_path, const char *cache_directory, FfiArtCallback callback, void *user_data) {
+    AlbumArtExtractor::Callback on_extracted;
+    if (callback != nullptr)
+        on_extracted = [callback, user_data](int album_id, const std::string &location) {
+            callback(album_id, location.c_str(), user_data);
+        };
+    FfiArtExtractor *extractor = new FfiArtExtractor(db_path, cache_directory, on_extracted);
+    if (!extractor->extractor.isValid()) {
+        delete extractor;
+        return nullptr;
+    }
+    return extractor;
+}
+
+/**
+ * @brief Looks up the art of an album without waiting, requesting it if needed.
+ *
+ * @param[in] extractor The extractor.
+ * @param[in] album_id The ID of the album.
+ * @param[out] location Receives the NUL-terminated path of the album's image,
+ *                      if it is available.
+ * @param[in] location_size The size of the location buffer.
+ *
+ * @return 1 if the art is available, 0 if it has been requested, -1 if the
+ *         album has no art, or -2 if location is too small.
+ */
+int ffiGetAlbumArt(FfiArtExtractor *extractor, int album_id, char *location, int location_size) {
+    std::string art_location;
+    if (extractor == nullptr)
+        return -1;
+    int rc = extractor->extractor.getArtLocation(album_id, art_location);
+    if (rc != 1)
+        return rc;
+    if (location_size <= 0 || art_location.size() >= (size_t)location_size)
+        return -2;
+    memcpy(location, art_location.c_str(), art_location.size() + 1);
+    return 1;
+}
+
+/**
+ * @brief Moves the albums on screen to the front of the extraction queue.
+ *
+ * @param[in] extractor The extractor.
+ * @param[in] album_ids The visible albums, in the order they should be served.
+ * @param[in] count The number of album IDs.
+ */
+void ffiSetVisibleAlbums(FfiArtExtractor *extractor, const int *album_ids, int count) {
+    if (extractor == nullptr || album_ids == nullptr)
+        return;
+    extractor->extractor.setVisibleAlbums(std::vector<int>(album_ids, album_ids + std::max(count, 0)));
+}
+
+/**
+ * @brief Queues every album that has not been searched for art yet, behind
+ *        the visible ones.
+ *
+ * @param[in] extractor The extractor.
+ *
+ * @return The number of albums queued, or -1 on failure.
+ */
+int ffiRequestMissingArt(FfiArtExtractor *extractor) {
+    if (extractor == nullptr)
+        return -1;
+    return extractor->extractor.requestMissingArt();
+}
+
+/**
+ * @brief Stops an extractor and releases it.
+ *
+ * @details Albums being extracted are finished first; queued ones are dropped.
+ *
+ * @param[in] extractor The extractor. May be NULL.
+ */
+void ffiStopArtExtractor(FfiArtExtractor *extractor) {
+    delete extractor;
+}
+
+/**
+ * @brief Rewrites a catalog snapshot of a library if the library has changed
+ *        since it was taken.
+ *
+ * @details See updateCatalog().
+ *
+ * @param[in] db_path The path to the database file.
+ * @param[in] catalog_path The path to the snapshot.
+ *
+ * @return 1 if the snapshot was rewritten, 0 if it was current, or -1 on failure.
+ */
+int ffiUpdateCatalog(const char *db_path, const char *catalog_path) {
+    sqlite3 *db;
+    int rc;
+
+    if (db_path == nullptr || catalog_path == nullptr)
+        return -1;
+    if (sqlite3_open(db_path, &db) != SQLITE_OK) {
+        logAt(LogLevel::Error, "Can't open database %s: %s\n", db_path, sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return -1;
+    }
+    // Ingest may be writing at the same time.
+    sqlite3_busy_timeout(db, 5000);
+    rc = updateCatalog(db, catalog_path);
+    sqlite3_close(db);
+    return rc;
+}
+
+/**
+ * @brief Brings a catalog snapshot up to date and maps it.
+ *
+ * @details The snapshot's records can then be read in place through
+ *          ffiGetCatalogSection(), with the layouts in catalog.hpp, until it
+ *          is passed to ffiCloseCatalog(). If the snapshot cannot be brought
+ *          up to date, the one on disk is used anyway.
+ *
+ * @param[in] db_path The path to the database file, or null to map the
+ *                    snapshot without checking it.
+ * @param[in] catalog_path The path to the snapshot.
+ *
+ * @return The snapshot, or null if there is no usable snapshot.
+ */
+FfiCatalog *ffiOpenCatalog(const char *db_path, const char *catalog_path) {
+    if (catalog_path == nullptr)
+        return nullptr;
+    if (db_path != nullptr)
+        ffiUpdateCatalog(db_path, catalog_path);
+    FfiCatalog *catalog = new FfiCatalog(catalog_path);
+    if (!catalog->snapshot.isValid()) {
+        delete catalog;
+        return nullptr;
+    }
+    return catalog;
+}
+
+/**
+ * @brief Returns one section of a mapped catalog snapshot.
+ *
+ * @param[in] catalog The snapshot.
+ * @param[in] section 0 for songs, 1 for albums, 2 for artists, 3 for genres,
+ *                    4 for links and 5 for strings, as in CatalogSectionId.
+ * @param[out] count Receives the number of records in the section.
+ *
+ * @return A pointer to the first record, or null if section is out of range.
+ */
+const void *ffiGetCatalogSection(FfiCatalog *catalog, int section, int64_t *count) {
+    if (catalog == nullptr || section < 0 || section >= CATALOG_SECTION_COUNT)
+        return nullptr;
+    if (count != nullptr)
+        *count = (int64_t)catalog->snapshot.getCount((CatalogSectionId)section);
+    return catalog->snapshot.getSection((CatalogSectionId)section);
+}
+
+/**
+ * @brief Unmaps a catalog snapshot.
+ *
+ * @param[in] catalog The snapshot. Pointers into it must not be used afterwards.
+ */
+void ffiCloseCatalog(FfiCatalog *catalog) {
+    delete catalog;
+}
+
+/**
+ * @brief Creates a smart playlist and fills it with the songs matching its rule.
+ *
+ * @details See compileRule() for the syntax of rules. The playlist is kept up
+ *          to date by every later ingest or rescan.
+ *
+ * @param[in] db_path The path to the database file.
+ * @param[in] title The title of the playlist, in UTF-8.
+ * @param[in] rule The rule, in UTF-8.
+ *
+ * @return The ID of the playlist, or -1 if the rule is not valid or the
+ *         playlist cannot be created.
+ */
+int ffiCreateSmartPlaylist(const char *db_path, const char *title, const char *rule) {
+    if (db_path == nullptr || title == nullptr || rule == nullptr)
+        return -1;
+    return runOnSmartPlaylists(db_path, [&](SmartPlaylists &smart_playlists) { return smart_playlists.createPlaylist(title, rule); });
+}
+
+/**
+ * @brief Replaces the rule of a smart playlist and fills it anew.
+ *
+ * @param[in] db_path The path to the database file.
+ * @param[in] playlist_id The ID of the playlist.
+ * @param[in] rule The new rule, in UTF-8.
+ *
+ * @return 0 on success, or -1 if the rule is not valid or the playlist is not
+ *         a smart playlist.
+ */
+int ffiSetSmartPlaylistRule(const char *db_path, int playlist_id, const char *rule) {
+    if (db_path == nullptr || rule == nullptr)
+        return -1;
+    return runOnSmartPlaylists(db_path, [&](SmartPlaylists &smart_playlists) { return smart_playlists.setRule(playlist_id, rule); });
+}
+
+/**
+ * @brief Deletes a smart playlist along with its songs.
+ *
+ * @param[in] db_path The path to the database file.
+ * @param[in] playlist_id The ID of the playlist.
+ *
+ * @return 0 on success, or -1 if the playlist is not a smart playlist.
+ */
+int ffiDeleteSmartPlaylist(const char *db_path, int playlist_id) {
+    if (db_path == nullptr)
+        return -1;
+    return runOnSmartPlaylists(db_path, [&](SmartPlaylists &smart_playlists) { return smart_playlists.deletePlaylist(playlist_id); });
+}
+
+/**
+ * @brief Reads the songs of a smart playlist, in the order its rule gives.
+ *
+ * @param[in] db_path The path to the database file.
+ * @param[in] playlist_id The ID of the playlist.
+ * @param[out] song_ids Receives the IDs of up to capacity songs. May be null
+ *                      if capacity is 0.
+ * @param[in] capacity The number of IDs song_ids has room for.
+ *
+ * @return The number of songs in the playlist, which may be more than were
+ *         written, or -1 on failure.
+ */
+int ffiGetSmartPlaylistSongs(const char *db_path, int playlist_id, int *song_ids, int capacity) {
+    std::vector<int> results;
+
+    if (db_path == nullptr || capacity < 0)
+        return -1;
+    if (runOnSmartPlaylists(db_path, [&](SmartPlaylists &smart_playlists) { return smart_playlists.getSongs(playlist_id, results); }) != 0)
+        return -1;
+    if (song_ids != nullptr)
+        std::copy(results.begin(), results.begin() + std::min(results.size(), (size_t)capacity), song_ids);
+    return (int)results.size();
+}
+
+/**
+ * @brief Opens a write-behind queue for song ratings and play counts.
+ *
+ * @details See SongUpdateQueue. Updates are held in memory and written in
+ *          one transaction at most flush_interval_ms after they are made, so
+ *          the UI can record them as often as it likes without waiting for
+ *          the disk. The database is switched to write-ahead logging.
+ *
+ * @param[in] db_path The path to the database file.
+ * @param[in] flush_interval_ms The longest an update waits before it is
+ *                              written, or 0 for the default.
+ *
+ * @return The queue, to be released with ffiCloseSongUpdates(), or NULL if it
+ *         could not be opened.
+ */
+FfiSongUpdates *ffiOpenSongUpdates(const char *db_path, unsigned int flush_interval_ms) {
+    return ffiOpenSongUpdatesWithCatalog(db_path, flush_interval_ms, nullptr);
+}
+
+/**
+ * @brief Opens a write-behind queue for song ratings and play counts that
+ *        keeps a catalog snapshot up to date.
+ *
+ * @details As ffiOpenSongUpdates(), but after each flush that changed a
+ *          rating the snapshot at catalog_path is rewritten, on the queue's
+ *          writer thread. See updateCatalog().
+ *
+ * @param[in] db_path The path to the database file.
+ * @param[in] flush_interval_ms The longest an update waits before it is
+ *                              written, or 0 for the default.
+ * @param[in] catalog_path The path to the snapshot, or NULL for none.
+ *
+ * @return The queue, to be released with ffiCloseSongUpdates(), or NULL if it
+ *         could not be opened.
+ */
+FfiSongUpdates *ffiOpenSongUpdatesWithCatalog(const char *db_path, unsigned int flush_interval_ms, const char *catalog_path) {
+    SongUpdateOptions options;
+
+    if (db_path == nullptr)
+        return nullptr;
+    if (flush_interval_ms != 0)
+        options.flush_interval_ms = flush_interval_ms;
+    if (catalog_path != nullptr) {
+        // Play counts are not in snapshots, so a flush of plays alone leaves the version, and the snapshot, as they were.
+        options.after_flush = [path = std::string(catalog_path)](sqlite3 *db) { updateCatalog(db, path); };
+    }
+    FfiSongUpdates *updates = new FfiSongUpdates(db_path, options);
+    if (!updates->queue.isValid()) {
+        delete updates;
+        return nullptr;
+    }
+    return updates;
+}
+
+/**
+ * @brief Queues a new rating for a song.
+ *
+ * @param[in] updates The queue.
+ * @param[in] song_id The ID of the song.
+ * @param[in] rating The rating.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int ffiSetRating(FfiSongUpdates *updates, int song_id, int rating) {
+    if (updates == nullptr)
+        return -1;
+    return updates->queue.setRating(song_id, rating);
+}
+
+/**
+ * @brief Queues plays of a song, to be added to its play count.
+ *
+ * @param[in] updates The queue.
+ * @param[in] song_id The ID of the song.
+ * @param[in] plays The number of plays to add.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int ffiAddPlays(FfiSongUpdates *updates, int song_id, int64_t plays) {
+    if (updates == nullptr)
+        return -1;
+    return updates->queue.addPlays(song_id, plays);
+}
+
+/**
+ * @brief Reads the rating of a song, including a rating not written yet.
+ *
+ * @param[in] updates The queue.
+ * @param[in] song_id The ID of the song.
+ * @param[out] rating Receives the rating.
+ *
+ * @return 0 on success, -1 if the song does not exist or an error occurs.
+ */
+int ffiGetRating(FfiSongUpdates *updates, int song_id, int *rating) {
+    if (updates == nullptr || rating == nullptr)
+        return -1;
+    return updates->queue.getRating(song_id, *rating);
+}
+
+/**
+ * @brief Reads the play count of a song, including plays not written yet.
+ *
+ * @param[in] updates The queue.
+ * @param[in] song_id The ID of the song.
+ * @param[out] play_count Receives the play count.
+ *
+ * @return 0 on success, -1 if the song does not exist or an error occurs.
+ */
+int ffiGetPlayCount(FfiSongUpdates *updates, int song_id, int64_t *play_count) {
+    if (updates == nullptr || play_count == nullptr)
+        return -1;
+    return updates->queue.getPlayCount(song_id, *play_count);
+}
+
+/**
+ * @brief Writes every queued update now, waiting for it to be committed.
+ *
+ * @param[in] updates The queue.
+ *
+ * @return 0 on success, -1 on failure, in which case the updates stay queued.
+ */
+int ffiFlushSongUpdates(FfiSongUpdates *updates) {
+    if (updates == nullptr)
+        return -1;
+    return updates->queue.flush();
+}
+
+/**
+ * @brief Writes the queued updates and releases a queue.
+ *
+ * @param[in] updates The queue. May be NULL.
+ */
+void ffiCloseSongUpdates(FfiSongUpdates *updates) {
+    delete updates;
+}
+
+/**
+ * @brief Turns collection of ingest and query metrics on or off.
+ *
+ * @details Collection is off by default, and costs next to nothing while off.
+ *
+ * @param[in] enabled Non-zero to collect.
+ */
+void ffiSetMetricsEnabled(int enabled) {
+    setMetricsEnabled(enabled != 0);
+}
+
+/**
+ * @brief Copies the metrics collected so far, as JSON, into a buffer.
+ *
+ * @details See Metrics::toJson() for the layout. Like snprintf(), the JSON is
+ *          cut short to fit, and the return value tells how big a buffer is
+ *          needed to hold all of it.
+ *
+ * @param[out] json Receives the NUL-terminated JSON. May be null if json_size is 0.
+ * @param[in] json_size The size of the json buffer.
+ *
+ * @return The length of the full JSON, not counting the terminator.
+ */
+int ffiGetMetrics(char *json, int json_size) {
+    std::string metrics = getMetricsJson();
+    if (json != nullptr && json_size > 0) {
+        size_t length = std::min(metrics.size(), (size_t)json_size - 1);
+        memcpy(json, metrics.data(), length);
+        json[length] = '\0';
+    }
+    return (int)metrics.size();
+}
+
+/**
+ * @brief Sets every metric back to zero.
+ */
+void ffiResetMetrics() {
+    resetMetrics();
+}
+
+/**
+ * @brief Starts recording a Chrome trace-event file of ingest and query stages.
+ *
+ * @param[in] path The file to write when the trace is stopped.
+ *
+ * @return 0 on success, -1 if a trace is running or the file cannot be created.
+ */
+int ffiStartTrace(const char *path) {
+    if (path == nullptr)
+        return -1;
+    return startTrace(path);
+}
+
+/**
+ * @brief Stops the running trace and writes its file.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int ffiStopTrace() {
+    return stopTrace();
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+/*
+ * C entry points of the for_ffi library. Everything declared here uses the C
+ * ABI, so it can be called from other languages without C++ name mangling.
+ */
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum FfiColumnType { FFI_COLUMN_INTEGER = 0, FFI_COLUMN_TEXT = 1 };
+
+/*
+ * One column of a query result. Integer columns have row_count values in
+ * integers. Text columns have every value back to back in text (UTF-8, no
+ * terminators), and row_count + 1 byte offsets, so row i is
+ * text[offsets[i]] up to text[offsets[i + 1]]. is_null flags NULL values,
+ * which read as 0 or an empty string.
+ */
+typedef struct FfiColumn {
+    const char *name;
+    int type;
+    const int64_t *integers;
+    const uint32_t *offsets;
+    const char *text;
+    const unsigned char *is_null;
+} FfiColumn;
+
+/*
+ * The rows returned by ffiRunQuery(). Its buffers stay valid until it is
+ * passed to ffiFreeResult().
+ */
+typedef struct FfiResult {
+    int row_count;
+    int column_count;
+    const FfiColumn *columns;
+    void *internal;
+} FfiResult;
+
+typedef struct FfiQuery FfiQuery;
+typedef struct FfiArtExtractor FfiArtExtractor;
+typedef struct FfiCatalog FfiCatalog;
+typedef struct FfiSongUpdates FfiSongUpdates;
+
+/*
+ * Called from a worker thread when an album's art has been extracted.
+ * location is the path of the cached image, or an empty string if the album
+ * has no art.
+ */
+typedef void (*FfiArtCallback)(int album_id, const char *location, void *user_data);
+
+int ffiIngestLibrary(const char *db_path, const char *root, unsigned int parser_threads);
+int ffiRescanLibrary(const char *db_path, const char *root, unsigned int parser_threads);
+void ffiSetLogPath(const char *path);
+int ffiSetLogLevel(int level);
+void ffiFlushLog();
+void ffiShutdownLog();
+int ffiSearchSongs(const char *db_path, const char *query, int limit, int offset, int *song_ids);
+
+FfiQuery *ffiPrepareQuery(const char *db_path, const char *sql);
+FfiQuery *ffiPrepareSongListQuery(const char *db_path);
+FfiQuery *ffiPrepareDuplicatesQuery(const char *db_path);
+int ffiBindInt(FfiQuery *query, int index, int64_t value);
+int ffiBindText(FfiQuery *query, int index, const char *value);
+int ffiRunQuery(FfiQuery *query, FfiResult *result);
+void ffiFreeResult(FfiResult *result);
+void ffiCloseQuery(FfiQuery *query);
+
+FfiArtExtractor *ffiStartArtExtractor(const char *db_path, const char *cache_directory, FfiArtCallback callback, void *user_data);
+int ffiGetAlbumArt(FfiArtExtractor *extractor, int album_id, char *location, int location_size);
+void ffiSetVisibleAlbums(FfiArtExtractor *extractor, const int *album_ids, int count);
+int ffiRequestMissingArt(FfiArtExtractor *extractor);
+void ffiStopArtExtractor(FfiArtExtractor *extractor);
+
+int ffiUpdateCatalog(const char *db_path, const char *catalog_path);
+FfiCatalog *ffiOpenCatalog(const char *db_path, const char *catalog_path);
+const void *ffiGetCatalogSection(FfiCatalog *catalog, int section, int64_t *count);
+void ffiCloseCatalog(FfiCatalog *catalog);
+
+int ffiCreateSmartPlaylist(const char *db_path, const char *title, const char *rule);
+int ffiSetSmartPlaylistRule(const char *db_path, int playlist_id, const char *rule);
+int ffiDeleteSmartPlaylist(const char *db_path, int playlist_id);
+int ffiGetSmartPlaylistSongs(const char *db_path, int playlist_id, int *song_ids, int capacity);
+
+FfiSongUpdates *ffiOpenSongUpdates(const char *db_path, unsigned int flush_interval_ms);
+FfiSongUpdates *ffiOpenSongUpdatesWithCatalog(const char *db_path, unsigned int flush_interval_ms, const char *catalog_path);
+int ffiSetRating(FfiSongUpdates *updates, int song_id, int rating);
+int ffiAddPlays(FfiSongUpdates *updates, int song_id, int64_t plays);
+int ffiGetRating(FfiSongUpdates *updates, int song_id, int *rating);
+int ffiGetPlayCount(FfiSongUpdates *updates, int song_id, int64_t *play_count);
+int ffiFlushSongUpdates(FfiSongUpdates *updates);
+void ffiCloseSongUpdates(FfiSongUpdates *updates);
+
+void ffiSetMetricsEnabled(int enabled);
+int ffiGetMetrics(char *json, int json_size);
+void ffiResetMetrics();
+int ffiStartTrace(const char *path);
+int ffiStopTrace();
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,479 @@
+#include "ingest.hpp"
+#include "bounded_queue.hpp"
+#include "content_hash.hpp"
+#include "database_writer.hpp"
+#include "directory_walker.hpp"
+#include "metrics.hpp"
+#include "smart_playlists.hpp"
+#include "tag_functions.hpp"
+#include "misc.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+
+/**
+ * A file found by the traversal stage that needs work from the later stages.
+ */
+struct ScanTask {
+    std::string path;
+    FileStat file_stat;
+    int song_id = 0;            // ID of the song already stored for this file, 0 if none
+    bool relocate = false;      // the file was moved; only its location needs updating
+    bool was_skipped = false;   // the file is recorded in SkippedFiles
+};
+
+/**
+ * A parsed song on its way to the writer stage. Its names are interned in the
+ * pool of the ingest run, so it is cheap to move and holds little memory
+ * while it waits in the queue.
+ */
+struct ParsedSong {
+    CompactMetadata metadata;
+    int song_id = 0;
+    bool relocate = false;
+    bool skipped = false;       // the tags could not be read; only the location and file_stat are set
+    bool was_skipped = false;
+};
+
+/**
+ * A song already in the database, as remembered by an incremental rescan.
+ */
+struct KnownFile {
+    int song_id;
+    FileStat file_stat;
+    bool seen;
+    bool hashed;                // the song has a content hash
+};
+
+/**
+ * A file an earlier ingest could not read tags from.
+ */
+struct SkippedFile {
+    int64_t size;
+    int64_t mtime;
+    bool seen;
+};
+
+/**
+ * The audio fingerprint of a file, waiting to be stored.
+ */
+struct HashedFile {
+    std::string path;
+    uint64_t content_hash;
+};
+
+/**
+ * Loads the location and file identity of every song in the database whose
+ * file lies under root.
+ */
+int loadKnownFiles(sqlite3 *db, const std::string &root, std::unordered_map<std::string, KnownFile> &known_files) {
+    sqlite3_stmt *stmt;
+    int rc;
+
+    rc = sqlite3_prepare_v2(db, "SELECT id, location, file_size, mtime, inode, device, content_hash FROM Songs;", -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+        logAt(LogLevel::Error, "Error while loading known files: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        const char *location = (const char *)sqlite3_column_text(stmt, 1);
+        if (location == nullptr || !isPathUnder(location, root))
+            continue;
+        KnownFile known_file;
+        known_file.song_id = sqlite3_column_int(stmt, 0);
+        known_file.file_stat.size = sqlite3_column_int64(stmt, 2);
+        known_file.file_stat.mtime = sqlite3_column_int64(stmt, 3);
+        known_file.file_stat.inode = (unsigned long long)sqlite3_column_int64(stmt, 4);
+        known_file.file_stat.device = (unsigned long long)sqlite3_column_int64(stmt, 5);
+        known_file.seen = false;
+        known_file.hashed = sqlite3_column_type(stmt, 6) != SQLITE_NULL;
+        known_files.emplace(location, known_file);
+    }
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE) {
+        logAt(LogLevel::Error, "Error while loading known files: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Loads the files under root that an earlier ingest could not read tags from.
+ */
+int loadSkippedFiles(sqlite3 *db, const std::string &root, std::unordered_map<std::string, SkippedFile> &skipped_files) {
+    sqlite3_stmt *stmt;
+    int rc;
+
+    rc = sqlite3_prepare_v2(db, "SELECT location, file_size, mtime FROM SkippedFiles;", -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+        logAt(LogLevel::Error, "Error while loading skipped files: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        const char *location = (const char *)sqlite3_column_text(stmt, 0);
+        if (location == nullptr || !isPathUnder(location, root))
+            continue;
+        skipped_files.emplace(location, SkippedFile{ sqlite3_column_int64(stmt, 1), sqlite3_column_int64(stmt, 2), false });
+    }
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE) {
+        logAt(LogLevel::Error, "Error while loading skipped files: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+    return 0;
+}
+
+}
+
+/**
+ * @brief Scans a music library and writes every song found in it to the database.
+ *
+ * @details The work is split into three stages that run concurrently and are
+ *          joined by bounded queues:
+ *          1. A traversal stage that walks the directory tree with
+ *             walkDirectory(), on options.traversal_threads threads, and
+ *             queues the path of every file it finds. With
+ *             options.audio_files_only set, files without an audio extension
+ *             are left out.
+ *          2. A pool of parser workers that read the tags of the queued files
+ *             with TagLib. Files that TagLib cannot read are skipped. Names
+ *             are interned in a StringPool shared by the run, and songs are
+ *             queued as CompactMetadata, so the many songs that share an
+ *             artist, album or genre share its string too.
+ *          3. A single writer (the calling thread) that owns the database
+ *             connection and inserts the parsed songs through a
+ *             DatabaseWriter, in transactions of options.batch_size songs,
+ *             with album, artist and genre IDs served from an EntityCache
+ *             the first time a name is seen, and by its pool ID after that.
+ *          Because the queues are bounded, a slow stage holds back the stages
+ *          in front of it instead of letting memory grow without limit.
+ *
+ *          With options.incremental set, the traversal stage compares the
+ *          size, mtime, inode and device of each file with the values stored
+ *          in Songs, and only queues files that are new or have changed.
+ *          Changed files are updated in place, files that were moved are
+ *          relocated without being parsed again, and songs whose files are
+ *          gone are deleted, unless they were under a directory that could not
+ *          be read. Only songs stored under root are considered, so a
+ *          subdirectory of the library can be rescanned on its own. A root
+ *          that does not exist or cannot be read fails the scan and removes
+ *          nothing, unless options.missing_root_is_empty is set.
+ *
+ *          Files whose tags cannot be read are recorded in SkippedFiles with
+ *          their size and mtime, and an incremental rescan leaves them alone
+ *          until either changes.
+ *
+ *          With options.hash_content set, a pool of options.hasher_threads
+ *          hashers fingerprints the audio of every new or changed file, and
+ *          of unchanged files that have no hash yet, with hashAudioContent().
+ *          They are fed by the traversal stage through a queue of
+ *          options.hash_queue_capacity files that is never waited on, so
+ *          hashing never holds back tag parsing: a file that finds it full
+ *          keeps no hash, and the next incremental scan queues it again.
+ *          Their results are stored once the songs have been written.
+ *
+ *          Once everything is written, smart playlists are brought up to
+ *          date with the songs that were added, changed or removed (see
+ *          SmartPlaylists::songsChanged()).
+ *
+ *          Databases without the file stat columns, the SongSearch
+ *          full-text index, the content_hash column, the LibraryVersion table, the
+ *          SmartPlaylists table or the play_count column are upgraded
+ *          first, and switched to write-ahead logging (see
+ *          enableWriteAheadLog()).
+ *
+ * @param[in] db A pointer to the SQLite database connection.
+ * @param[in] root The root directory of the music library.
+ * @param[in] options The number of parser threads, the queue capacity, the
+ *                    transaction batch size and whether to rescan incrementally.
+ * @param[out] stats If not null, receives counts of the work done by each stage.
+ *
+ * @return 0 on success, -1 if the database cannot be upgraded or the root
+ *         directory cannot be scanned.
+ */
+int ingestLibrary(sqlite3 *db, const std::string &root, const IngestOptions &options, IngestStats *stats) {
+    unsigned int parser_threads = options.parser_threads;
+    if (parser_threads == 0)
+        parser_threads = std::max(1u, std::thread::hardware_concurrency());
+
+    // Older databases are upgraded before the writer prepares its statements.
+    if (addFileStatColumns(db) != 0 || createSearchIndex(db) != 0 || addContentHashColumn(db) != 0 || addLibraryVersion(db) != 0 || addSmartPlaylists(db) != 0 ||
+        addPlayCountColumn(db) != 0 || addSkippedFiles(db) != 0)
+        return -1;
+    // Lets the UI read, and queued song updates be flushed, while the import writes. Not fatal: the
+    // import works the same with a rollback journal.
+    enableWriteAheadLog(db);
+
+    std::unordered_map<std::string, KnownFile> known_files;
+    std::unordered_map<unsigned long long, std::vector<std::string>> known_inodes;
+    if (options.incremental) {
+        if (loadKnownFiles(db, root, known_files) != 0)
+            return -1;
+        for (auto &known_file : known_files)
+            if (known_file.second.file_stat.inode != 0)
+                known_inodes[known_file.second.file_stat.inode].push_back(known_file.first);
+    }
+    std::unordered_map<std::string, SkippedFile> skipped_files;
+    if (loadSkippedFiles(db, root, skipped_files) != 0)
+        return -1;
+
+    BoundedQueue<ScanTask> path_queue(options.queue_capacity);
+    BoundedQueue<ParsedSong> metadata_queue(options.queue_capacity);
+    // Slow hashing must not stall the traversal and with it the parsers, so a file that finds the queue full is
+    // not hashed by this scan. Its content_hash stays NULL, which makes the next incremental scan queue it again.
+    BoundedQueue<std::string> hash_queue(options.hash_queue_capacity);
+    std::vector<HashedFile> hashed_files;
+    std::mutex hashed_files_mutex;
+    std::vector<ScanTask> scanned_files;        // found by the walker and not yet queued for the parsers
+    std::mutex scanned_files_mutex;
+    std::atomic<size_t> files_found(0), files_unchanged(0), files_parsed(0), files_skipped(0), files_hashed(0),
+        files_hash_deferred(0);
+    std::atomic<bool> traversal_failed(false);
+    std::atomic<unsigned int> parsers_running(parser_threads);
+    // Parsers intern every name here, so a name repeated across the library is stored once.
+    StringPool pool;
+    WalkOptions walk_options;
+    WalkStats walk_stats;
+    IngestStats local_stats;
+
+    walk_options.threads = std::max(1u, options.traversal_threads);
+    walk_options.audio_files_only = options.audio_files_only;
+    walk_options.stat_files = true;
+    walk_options.missing_root_is_empty = options.missing_root_is_empty;
+    // Waiting for room in path_queue inside the file callback would hold the walker's callback lock, and stall
+    // every walking thread behind the slowest parser. The files of each directory are queued here instead.
+    walk_options.after_files = [&] {
+        std::vector<ScanTask> tasks;
+        {
+            std::lock_guard<std::mutex> lock(scanned_files_mutex);
+            tasks.swap(scanned_files);
+        }
+        for (auto &task : tasks) {
+            path_queue.push(std::move(task));
+            sampleQueueDepth(MetricQueue::PathQueue, [&] { return path_queue.size(); });
+        }
+    };
+
+    // Only the walking threads touch known_files and skipped_files until the traversal has been joined. The walker
+    // never calls the file callback concurrently.
+    std::thread traversal([&] {
+        ScopedTimer timer(MetricStage::Traverse);
+        int rc = walkDirectory(root, walk_options, [&](std::string &file, const FileStat &file_stat) {
+            ScanTask task;
+            bool relocated_hashed = false;
+            files_found++;
+            countMetric(MetricCounter::FilesFound);
+            task.file_stat = file_stat;
+            auto skipped = skipped_files.find(file);
+            if (skipped != skipped_files.end()) {
+                skipped->second.seen = true;
+                task.was_skipped = true;
+                // Reading its tags again would fail again, until the file changes.
+                if (options.incremental && skipped->second.size == file_stat.size && skipped->second.mtime == file_stat.mtime) {
+                    auto known = known_files.find(file);
+                    if (known != known_files.end())
+                        known->second.seen = true;
+                    files_unchanged++;
+                    countMetric(MetricCounter::FilesUnchanged);
+                    return;
+                }
+            }
+            if (options.incremental) {
+                auto known = known_files.find(file);
+                if (known != known_files.end()) {
+                    known->second.seen = true;
+                    if (known->second.file_stat == task.file_stat) {
+                        files_unchanged++;
+                        countMetric(MetricCounter::FilesUnchanged);
+                        if (options.hash_content && !known->second.hashed) {
+                            if (!hash_queue.tryPush(file))
+                                files_hash_deferred++;
+                            sampleQueueDepth(MetricQueue::HashQueue, [&] { return hash_queue.size(); });
+                        }
+                        return;
+                    }
+                    task.song_id = known->second.song_id;
+                } else {
+                    // A new path with the identity of a known file whose old path is gone was moved.
+                    auto inode = known_inodes.find(task.file_stat.inode);
+                    for (size_t i = 0; inode != known_inodes.end() && i < inode->second.size(); i++) {
+                        KnownFile &candidate = known_files[inode->second[i]];
+                        FileStat old_stat;
+                        if (!candidate.seen && candidate.file_stat == task.file_stat &&
+                            getFileStat(inode->second[i], old_stat) != 0) {
+                            candidate.seen = true;
+                            task.song_id = candidate.song_id;
+                            task.relocate = true;
+                            relocated_hashed = candidate.hashed;
+                            break;
+                        }
+                    }
+                }
+            }
+            // A moved file keeps the hash of its song; anything else is new or has changed.
+            if (options.hash_content && !relocated_hashed) {
+                if (!hash_queue.tryPush(file))
+                    files_hash_deferred++;
+                sampleQueueDepth(MetricQueue::HashQueue, [&] { return hash_queue.size(); });
+            }
+            task.path = std::move(file);
+            std::lock_guard<std::mutex> lock(scanned_files_mutex);
+            scanned_files.push_back(std::move(task));
+        }, WalkDirectoryCallback(), &walk_stats);
+        if (rc != 0) {
+            logAt(LogLevel::Error, "Error while scanning %s\n", root.c_str());
+            traversal_failed = true;
+        }
+        path_queue.close();
+        hash_queue.close();
+    });
+
+    std::vector<std::thread> hashers;
+    for (unsigned int i = 0; options.hash_content && i < std::max(1u, options.hasher_threads); i++) {
+        hashers.emplace_back([&] {
+            std::string path;
+            while (hash_queue.pop(path)) {
+                uint64_t content_hash;
+                if (hashAudioContent(path, content_hash) != 0)
+                    continue;
+                files_hashed++;
+                countMetric(MetricCounter::FilesHashed);
+                std::lock_guard<std::mutex> lock(hashed_files_mutex);
+                hashed_files.push_back({ std::move(path), content_hash });
+            }
+        });
+    }
+
+    std::vector<std::thread> parsers;
+    for (unsigned int i = 0; i < parser_threads; i++) {
+        parsers.emplace_back([&] {
+            ScanTask task;
+            while (path_queue.pop(task)) {
+                ParsedSong parsed;
+                parsed.song_id = task.song_id;
+                parsed.relocate = task.relocate;
+                parsed.was_skipped = task.was_skipped;
+                parsed.metadata.file_location = std::move(task.path);
+                if (!task.relocate) {
+                    int rc;
+                    {
+                        ScopedTimer timer(MetricStage::ParseTags);
+                        rc = readMetadata(parsed.metadata.file_location, parsed.metadata, pool);
+                    }
+                    if (rc != 0) {
+                        files_skipped++;
+                        countMetric(MetricCounter::FilesSkipped);
+                        parsed.skipped = true;
+                    } else {
+                        files_parsed++;
+                        countMetric(MetricCounter::FilesParsed);
+                    }
+                }
+                parsed.metadata.file_stat = task.file_stat;
+                metadata_queue.push(std::move(parsed));
+                sampleQueueDepth(MetricQueue::MetadataQueue, [&] { return metadata_queue.size(); });
+            }
+            // The last parser to finish tells the writer that no more songs are coming.
+            if (--parsers_running == 0)
+                metadata_queue.close();
+        });
+    }
+
+    DatabaseWriter writer(db, options.batch_size, true);
+    auto writeFailed = [&] {
+        local_stats.write_errors++;
+        countMetric(MetricCounter::WriteErrors);
+    };
+    ParsedSong parsed;
+    while (metadata_queue.pop(parsed)) {
+        ScopedTimer timer(MetricStage::WriteSong);
+        int rc;
+        if (parsed.skipped) {
+            if (writer.recordSkippedFile(parsed.metadata.file_location, parsed.metadata.file_stat) != 0)
+                writeFailed();
+            continue;
+        }
+        if (parsed.was_skipped && writer.forgetSkippedFile(parsed.metadata.file_location) != 0)
+            writeFailed();
+        if (parsed.relocate)
+            rc = writer.relocateSong(parsed.song_id, parsed.metadata.file_location, parsed.metadata.file_stat);
+        else if (parsed.song_id > 0)
+            rc = writer.updateSong(parsed.song_id, parsed.metadata, pool);
+        else
+            rc = writer.insertSong(parsed.metadata, pool);
+        if (rc < 0)
+            writeFailed();
+        else if (parsed.song_id > 0) {
+            local_stats.songs_updated++;
+            countMetric(MetricCounter::SongsUpdated);
+        } else {
+            local_stats.songs_written++;
+            countMetric(MetricCounter::SongsWritten);
+        }
+    }
+
+    traversal.join();
+    for (auto &parser : parsers)
+        parser.join();
+
+    // Hashes are stored by location, so they wait until every song has been written.
+    for (auto &hasher : hashers)
+        hasher.join();
+    for (auto &hashed_file : hashed_files)
+        if (writer.setContentHash(hashed_file.path, hashed_file.content_hash) != 0)
+            writeFailed();
+
+    // Songs whose files were not found during a complete scan no longer exist. Those under a
+    // directory that could not be read may still be there.
+    if (options.incremental && !traversal_failed) {
+        auto isUnreadable = [&](const std::string &path) {
+            for (auto &directory : walk_stats.unreadable_directories)
+                if (isPathUnder(path, directory))
+                    return true;
+            return false;
+        };
+        for (auto &known_file : known_files) {
+            if (known_file.second.seen || isUnreadable(known_file.first))
+                continue;
+            if (writer.deleteSong(known_file.second.song_id) != 0)
+                writeFailed();
+            else {
+                local_stats.songs_removed++;
+                countMetric(MetricCounter::SongsRemoved);
+            }
+        }
+        for (auto &skipped_file : skipped_files)
+            if (!skipped_file.second.seen && !isUnreadable(skipped_file.first) && writer.forgetSkippedFile(skipped_file.first) != 0)
+                writeFailed();
+    }
+    writer.commit();
+
+    std::vector<int> changed_songs;
+    writer.takeChangedSongs(changed_songs);
+    if (!changed_songs.empty()) {
+        SmartPlaylists smart_playlists(db);
+        if (smart_playlists.isValid())
+            smart_playlists.songsChanged(changed_songs);
+    }
+
+    local_stats.files_found = files_found;
+    local_stats.files_unchanged = files_unchanged;
+    local_stats.files_parsed = files_parsed;
+    local_stats.files_skipped = files_skipped;
+    local_stats.files_hashed = files_hashed;
+    log("Ingested %s: %zu files found, %zu unchanged, %zu parsed, %zu skipped, %zu hashed, %zu songs written, %zu updated, %zu removed, %zu write errors\n",
+        root.c_str(), local_stats.files_found, local_stats.files_unchanged, local_stats.files_parsed, local_stats.files_skipped, local_stats.files_hashed,
+        local_stats.songs_written, local_stats.songs_updated, local_stats.songs_removed, local_stats.write_errors);
+    if (files_hash_deferred > 0)
+        log("%zu files found the hash queue full and are left for the next scan to hash\n", files_hash_deferred.load());
+    if (stats != nullptr)
+        *stats = local_stats;
+    return traversal_failed ? -1 : 0;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <string>
+#include <sqlite3.h>
+
+struct IngestOptions {
+    unsigned int parser_threads = 0;    // 0 picks one parser per hardware thread
+    unsigned int traversal_threads = 4; // threads reading directories, which mostly wait on the disk
+    bool audio_files_only = true;       // only consider files with an audio extension, see isAudioFile()
+    size_t queue_capacity = 1024;       // capacity of each queue between stages
+    size_t batch_size = 1000;           // songs written per database transaction
+    bool incremental = false;           // only parse new or changed files, and remove missing ones
+    bool hash_content = false;          // fingerprint the audio of new, changed and unhashed files
+    unsigned int hasher_threads = 2;    // threads hashing files alongside the parsers
+    size_t hash_queue_capacity = 65536; // files waiting to be hashed; more are left for the next scan
+    bool missing_root_is_empty = false; // a root that does not exist holds no songs, instead of failing the scan
+};
+
+struct IngestStats {
+    size_t files_found = 0;
+    size_t files_unchanged = 0;
+    size_t files_parsed = 0;
+    size_t files_skipped = 0;
+    size_t files_hashed = 0;
+    size_t songs_written = 0;
+    size_t songs_updated = 0;
+    size_t songs_removed = 0;
+    size_t write_errors = 0;
+};
+
+int ingestLibrary(sqlite3 *db, const std::string &root, const IngestOptions &options = IngestOptions(), IngestStats *stats = nullptr);
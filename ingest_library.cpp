@@ -0,0 +1,157 @@
+#include "ingest.hpp"
+#include "library_watcher.hpp"
+#include "database_functions.hpp"
+#include "catalog.hpp"
+#include "metrics.hpp"
+#include "misc.hpp"
+
+#include <iostream>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <csignal>
+#include <filesystem>
+
+#define MAX_PARSER_THREADS 1024
+
+static LibraryWatcher *active_watcher = nullptr;
+
+static void stopWatching(int) {
+    if (active_watcher != nullptr)
+        active_watcher->stop();
+}
+
+int main(int argc, char **argv) {
+    sqlite3 *db;
+    IngestOptions options;
+    IngestStats stats;
+    bool watch = false, print_stats = false;
+    const char *program = argv[0], *trace_path = nullptr, *catalog_path = nullptr;
+    bool bad_option = false;
+
+    for (; argc > 1 && strncmp(argv[1], "--", 2) == 0; argv++, argc--) {
+        if (strcmp(argv[1], "--watch") == 0)
+            watch = true;
+        else if (strcmp(argv[1], "--hash") == 0)
+            options.hash_content = true;
+        else if (strcmp(argv[1], "--stats") == 0)
+            print_stats = true;
+        else if (strcmp(argv[1], "--trace") == 0 && argc > 2) {
+            trace_path = argv[2];
+            argv++;
+            argc--;
+        } else if (strcmp(argv[1], "--catalog") == 0 && argc > 2) {
+            catalog_path = argv[2];
+            argv++;
+            argc--;
+        } else {
+            std::cout << "Unknown or incomplete option " << argv[1] << std::endl;
+            bad_option = true;
+            break;
+        }
+    }
+    // 0 picks one parser thread per hardware thread.
+    if (!bad_option && argc > 3) {
+        char *end;
+        unsigned long parser_threads = strtoul(argv[3], &end, 10);
+        if (!isdigit((unsigned char)argv[3][0]) || *end != '\0' || parser_threads > MAX_PARSER_THREADS) {
+            std::cout << "The number of parser threads must be between 0 and " << MAX_PARSER_THREADS << std::endl;
+            bad_option = true;
+        } else
+            options.parser_threads = (unsigned int)parser_threads;
+    }
+    if (bad_option || argc < 3) {
+        std::cout << "Usage: " << program << " [--watch] [--hash] [--stats] [--trace <trace file>] [--catalog <snapshot file>] <database> <library root> [parser threads]" << std::endl;
+        return 1;
+    }
+    if (print_stats)
+        setMetricsEnabled(true);
+    if (trace_path != nullptr && startTrace(trace_path) != 0) {
+        std::cout << "Unable to create trace file " << trace_path << std::endl;
+        shutdownLog();
+        return 1;
+    }
+
+    // An existing library is rescanned incrementally, a new one is built from scratch.
+    if (std::filesystem::exists(argv[1]))
+        options.incremental = true;
+    else if (createDatabase(argv[1]) != 0) {
+        std::cout << "Unable to create database " << argv[1] << std::endl;
+        shutdownLog();
+        return 1;
+    }
+    if (sqlite3_open(argv[1], &db) != SQLITE_OK) {
+        std::cout << "Unable to open database " << argv[1] << ": " << sqlite3_errmsg(db) << std::endl;
+        sqlite3_close(db);
+        shutdownLog();
+        return 1;
+    }
+    // Other connections, like the UI's song updates, may hold the write lock for a moment, during the ingest and
+    // while watching.
+    sqlite3_busy_timeout(db, 5000);
+    int rc = ingestLibrary(db, argv[2], options, &stats);
+
+    std::cout << "Files found: " << stats.files_found << std::endl;
+    std::cout << "Files unchanged: " << stats.files_unchanged << std::endl;
+    std::cout << "Files parsed: " << stats.files_parsed << std::endl;
+    std::cout << "Files skipped: " << stats.files_skipped << std::endl;
+    std::cout << "Files hashed: " << stats.files_hashed << std::endl;
+    std::cout << "Songs written: " << stats.songs_written << std::endl;
+    std::cout << "Songs updated: " << stats.songs_updated << std::endl;
+    std::cout << "Songs removed: " << stats.songs_removed << std::endl;
+    std::cout << "Write errors: " << stats.write_errors << std::endl;
+
+    // The snapshot is only rewritten if the ingest changed anything.
+    if (catalog_path != nullptr && rc == 0) {
+        int catalog_rc = updateCatalog(db, catalog_path);
+        if (catalog_rc < 0)
+            std::cout << "Unable to write catalog snapshot " << catalog_path << std::endl;
+        else
+            std::cout << "Catalog snapshot: " << (catalog_rc == 1 ? "rewritten" : "up to date") << std::endl;
+    }
+
+    if (options.hash_content) {
+        std::vector<std::vector<int>> duplicates;
+        if (findDuplicateSongs(db, duplicates) == 0)
+            std::cout << "Sets of duplicate songs: " << duplicates.size() << std::endl;
+    }
+
+    // Keep the database in sync with the library until interrupted.
+    if (watch && rc == 0) {
+        WatchOptions watch_options;
+        watch_options.parser_threads = options.parser_threads;
+        if (catalog_path != nullptr) {
+            watch_options.after_commit = [catalog_path](sqlite3 *watch_db) {
+                if (updateCatalog(watch_db, catalog_path) < 0)
+                    logAt(LogLevel::Warning, "Unable to write catalog snapshot %s\n", catalog_path);
+            };
+        }
+        LibraryWatcher watcher(db, argv[2], watch_options);
+        if (!watcher.isValid()) {
+            std::cout << "Unable to watch " << argv[2] << std::endl;
+            rc = -1;
+        } else {
+            active_watcher = &watcher;
+            signal(SIGINT, stopWatching);
+            signal(SIGTERM, stopWatching);
+            std::cout << "Watching " << argv[2] << " for changes, press Ctrl+C to stop" << std::endl;
+            rc = watcher.run();
+            active_watcher = nullptr;
+
+            WatchStats watch_stats = watcher.getStats();
+            std::cout << "Songs written while watching: " << watch_stats.songs_written << std::endl;
+            std::cout << "Songs updated while watching: " << watch_stats.songs_updated << std::endl;
+            std::cout << "Songs moved while watching: " << watch_stats.songs_moved << std::endl;
+            std::cout << "Songs removed while watching: " << watch_stats.songs_removed << std::endl;
+            std::cout << "Rescans: " << watch_stats.rescans << std::endl;
+        }
+    }
+    sqlite3_close(db);
+
+    if (trace_path != nullptr && stopTrace() != 0)
+        std::cout << "Unable to write trace file " << trace_path << std::endl;
+    if (print_stats)
+        std::cout << getMetricsJson() << std::endl;
+    shutdownLog();
+    return rc == 0 ? 0 : 1;
+}
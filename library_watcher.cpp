@@ -0,0 +1,456 @@
+#include "library_watcher.hpp"
+#include "directory_walker.hpp"
+#include "ingest.hpp"
+#include "tag_functions.hpp"
+#include "misc.hpp"
+
+#include <algorithm>
+#include <filesystem>
+#include <vector>
+
+#ifdef __linux__
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+#ifdef __linux__
+const uint32_t WATCH_MASK = IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE |
+                            IN_DELETE_SELF | IN_ONLYDIR | IN_EXCL_UNLINK;
+#endif
+
+/**
+ * Returns the deepest directory containing both paths.
+ */
+std::string getCommonDirectory(const std::string &a, const std::string &b) {
+    std::filesystem::path path_a(a), path_b(b), common;
+    auto part_a = path_a.begin(), part_b = path_b.begin();
+    for (; part_a != path_a.end() && part_b != path_b.end() && *part_a == *part_b; ++part_a, ++part_b)
+        common /= *part_a;
+    return common.string();
+}
+
+}
+
+/**
+ * Constructs a watcher and starts watching every directory under root.
+ *
+ * \param db The database connection to write to. The watcher does not take
+ *           ownership of it, and nothing else may use it while run() is active.
+ * \param root The root directory of the music library, spelled the same way
+ *             as when the library was ingested.
+ * \param options The debounce delay, batch size, retry interval and parser
+ *                thread count.
+ *
+ * If inotify cannot be initialized, the error is logged and isValid() returns
+ * \c false.
+ */
+LibraryWatcher::LibraryWatcher(sqlite3 *db, const std::string &root, const WatchOptions &options)
+    : db(db), root(root), options(options), writer(db, options.batch_size, true), smart_playlists(db), inotify_fd(-1), root_removed(false) {
+    stop_fds[0] = stop_fds[1] = -1;
+    next_retry = Clock::now() + std::chrono::seconds(options.retry_interval);
+#ifdef __linux__
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0 || pipe2(stop_fds, O_NONBLOCK | O_CLOEXEC) != 0) {
+        logAt(LogLevel::Error, "Unable to start watching %s: %s\n", root.c_str(), strerror(errno));
+        return;
+    }
+    addWatches(root);
+    if (watches.empty())
+        logAt(LogLevel::Error, "Unable to watch %s\n", root.c_str());
+#else
+    logAt(LogLevel::Error, "Unable to watch %s: library watching is only supported on Linux\n", root.c_str());
+#endif
+}
+
+/**
+ * Stops watching and closes the inotify descriptor.
+ */
+LibraryWatcher::~LibraryWatcher() {
+#ifdef __linux__
+    if (inotify_fd >= 0)
+        close(inotify_fd);
+    if (stop_fds[0] >= 0) {
+        close(stop_fds[0]);
+        close(stop_fds[1]);
+    }
+#endif
+}
+
+/**
+ * Checks if the watcher was set up successfully.
+ *
+ * \return \c true if run() can be called and \c false otherwise.
+ */
+bool LibraryWatcher::isValid() const {
+    return inotify_fd >= 0 && stop_fds[0] >= 0 && !watches.empty() && writer.isValid();
+}
+
+/**
+ * Processes filesystem events until stop() is called or the root directory is
+ * removed. Changes that are still waiting for their debounce delay when the
+ * watcher stops are processed before returning.
+ *
+ * \return \c 0 after stop() was called, or \c -1 if the watcher is not valid,
+ *         the events cannot be read or the root directory was removed.
+ */
+int LibraryWatcher::run() {
+#ifdef __linux__
+    struct pollfd fds[2];
+    int rc = 0;
+
+    if (!isValid())
+        return -1;
+    fds[0].fd = inotify_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = stop_fds[0];
+    fds[1].events = POLLIN;
+    while (true) {
+        if (poll(fds, 2, getTimeout()) < 0 && errno != EINTR) {
+            logAt(LogLevel::Error, "Error while waiting for changes in %s: %s\n", root.c_str(), strerror(errno));
+            rc = -1;
+            break;
+        }
+        // Events that arrived before a stop request are still read, so they are not lost.
+        if ((fds[0].revents & POLLIN) && readEvents() != 0) {
+            rc = -1;
+            break;
+        }
+        if (fds[1].revents & POLLIN) {
+            if (readEvents() != 0)
+                rc = -1;
+            break;
+        }
+        if (!unwatched.empty() && Clock::now() >= next_retry) {
+            for (auto &directory : unwatched)
+                schedule(directory, std::string(), true);
+            unwatched.clear();
+            next_retry = Clock::now() + std::chrono::seconds(options.retry_interval);
+        }
+        processDue(false);
+    }
+    processDue(true);
+    writer.commit();
+    log("Stopped watching %s: %zu songs written, %zu updated, %zu moved, %zu removed, %zu skipped, %zu rescans, %zu write errors\n",
+        root.c_str(), stats.songs_written, stats.songs_updated, stats.songs_moved, stats.songs_removed, stats.files_skipped,
+        stats.rescans, stats.write_errors);
+    return rc;
+#else
+    return -1;
+#endif
+}
+
+/**
+ * Makes run() return. Only writes to a pipe, so it may be called from another
+ * thread or from a signal handler.
+ */
+void LibraryWatcher::stop() {
+#ifdef __linux__
+    char byte = 0;
+    if (stop_fds[1] >= 0 && write(stop_fds[1], &byte, 1) < 0) {
+        // The pipe is full, so a stop request is already pending.
+    }
+#endif
+}
+
+/**
+ * Returns counts of the work done so far. Must not be called while run() is active.
+ */
+WatchStats LibraryWatcher::getStats() const {
+    return stats;
+}
+
+/**
+ * Watches a directory and every directory below it. Directories that cannot
+ * be watched because of the watch limit are remembered for a periodic rescan.
+ */
+void LibraryWatcher::addWatches(const std::string &directory) {
+#ifdef __linux__
+    WalkOptions walk_options;
+    bool limit_reached = false;
+
+    // Symlinked directories are not watched: inotify gives a directory one watch, which can only map back to one path.
+    walk_options.follow_symlinks = false;
+    // A directory created and removed again before it could be watched has nothing to watch.
+    walk_options.missing_root_is_empty = true;
+    walkDirectory(directory, walk_options, WalkFileCallback(), [&](const std::string &current) {
+        int wd = inotify_add_watch(inotify_fd, current.c_str(), WATCH_MASK);
+        if (wd < 0) {
+            if (errno == ENOSPC) {
+                limit_reached = true;
+                unwatched.insert(current);
+            } else if (errno != ENOENT && errno != ENOTDIR)
+                logAt(LogLevel::Warning, "Unable to watch %s: %s\n", current.c_str(), strerror(errno));
+            return false;
+        }
+        watches[wd] = current;
+        unwatched.erase(current);
+        return true;
+    });
+    if (limit_reached)
+        logAt(LogLevel::Warning, "The inotify watch limit was reached under %s; %zu directories will be rescanned every %u seconds instead\n",
+              directory.c_str(), unwatched.size(), options.retry_interval);
+#endif
+}
+
+/**
+ * Stops watching a directory that has gone, along with every directory below it.
+ */
+void LibraryWatcher::removeWatches(const std::string &directory) {
+#ifdef __linux__
+    for (auto it = watches.begin(); it != watches.end();) {
+        if (it->second == directory || isPathUnder(it->second, directory)) {
+            inotify_rm_watch(inotify_fd, it->first);
+            it = watches.erase(it);
+        } else
+            ++it;
+    }
+#endif
+}
+
+/**
+ * Reads all available events and turns them into pending changes.
+ *
+ * \return \c 0 on success, or \c -1 if the events cannot be read or the root
+ *         directory was removed.
+ */
+int LibraryWatcher::readEvents() {
+#ifdef __linux__
+    alignas(struct inotify_event) char buffer[64 * 1024];
+
+    while (true) {
+        ssize_t length = read(inotify_fd, buffer, sizeof(buffer));
+        if (length < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            if (errno == EINTR)
+                continue;
+            logAt(LogLevel::Error, "Error while reading changes in %s: %s\n", root.c_str(), strerror(errno));
+            return -1;
+        }
+        for (char *ptr = buffer; ptr < buffer + length;) {
+            const struct inotify_event *event = (const struct inotify_event *)ptr;
+            ptr += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                logAt(LogLevel::Warning, "Changes in %s were lost, rescanning\n", root.c_str());
+                schedule(root, std::string(), true);
+                continue;
+            }
+            auto watch = watches.find(event->wd);
+            if (watch == watches.end())
+                continue;
+            if (event->mask & IN_IGNORED) {
+                watches.erase(watch);
+                continue;
+            }
+            if (event->mask & IN_DELETE_SELF) {
+                if (watch->second == root)
+                    root_removed = true;
+                continue;
+            }
+            if (event->len == 0)
+                continue;
+
+            std::string path = (std::filesystem::path(watch->second) / event->name).string();
+            std::string moved_from;
+            // Ingest leaves out the same files, so a file renamed to a name without an audio extension is
+            // removed when its MOVED_FROM is processed on its own.
+            if (!(event->mask & IN_ISDIR) && !isAudioFile(path))
+                continue;
+            if (event->mask & IN_MOVED_FROM)
+                move_sources[event->cookie] = path;
+            if (event->mask & IN_MOVED_TO) {
+                // A rename within the library arrives as a MOVED_FROM and a MOVED_TO with the same cookie.
+                auto source = move_sources.find(event->cookie);
+                if (source != move_sources.end()) {
+                    moved_from = source->second;
+                    move_sources.erase(source);
+                    pending.erase(moved_from);
+                }
+            }
+            if (event->mask & IN_ISDIR) {
+                if (event->mask & (IN_CREATE | IN_MOVED_TO))
+                    addWatches(path);
+                // A rescan covering both the old and the new place of a moved directory relocates its songs.
+                schedule(moved_from.empty() ? path : getCommonDirectory(path, moved_from), std::string(), true);
+            } else
+                schedule(path, moved_from, false);
+        }
+    }
+    if (root_removed) {
+        logAt(LogLevel::Error, "Stopped watching %s: the directory was removed\n", root.c_str());
+        return -1;
+    }
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+/**
+ * Records a change to a path, restarting its debounce delay.
+ */
+void LibraryWatcher::schedule(const std::string &path, const std::string &moved_from, bool rescan) {
+    PendingChange &change = pending[path];
+    change.due = Clock::now() + std::chrono::milliseconds(options.debounce_ms);
+    if (!moved_from.empty())
+        change.moved_from = moved_from;
+    change.rescan = change.rescan || rescan;
+}
+
+/**
+ * Returns how long run() may wait for events before something becomes due,
+ * in milliseconds, or -1 to wait indefinitely.
+ */
+int LibraryWatcher::getTimeout() const {
+    Clock::time_point now = Clock::now(), next = Clock::time_point::max();
+
+    for (auto &change : pending)
+        next = std::min(next, change.second.due);
+    if (!unwatched.empty())
+        next = std::min(next, next_retry);
+    if (next == Clock::time_point::max())
+        return -1;
+    if (next <= now)
+        return 0;
+    return (int)std::chrono::duration_cast<std::chrono::milliseconds>(next - now).count() + 1;
+}
+
+/**
+ * Processes the changes whose debounce delay has passed, or all of them.
+ * Files are written in transactions of options.batch_size, and smart playlists
+ * updated with them; directories are rescanned afterwards, skipping any that
+ * lie inside another one being rescanned. If anything was processed,
+ * options.after_commit is called last.
+ */
+void LibraryWatcher::processDue(bool all) {
+    Clock::time_point now = Clock::now();
+    std::vector<std::string> directories;
+    std::vector<int> changed_songs;
+    size_t batched = 0;
+
+    for (auto it = pending.begin(); it != pending.end();) {
+        if (!all && it->second.due > now) {
+            ++it;
+            continue;
+        }
+        if (it->second.rescan)
+            directories.push_back(it->first);
+        else {
+            processFile(it->first, it->second.moved_from);
+            if (++batched % std::max<size_t>(options.batch_size, 1) == 0)
+                writer.commit();
+        }
+        it = pending.erase(it);
+    }
+    writer.commit();
+    writer.takeChangedSongs(changed_songs);
+    if (smart_playlists.isValid())
+        smart_playlists.songsChanged(changed_songs);
+    if (pending.empty())
+        move_sources.clear();
+
+    std::sort(directories.begin(), directories.end());
+    std::vector<std::string> rescanned;
+    for (auto &directory : directories) {
+        bool covered = false;
+        for (auto &done : rescanned)
+            covered = covered || isPathUnder(directory, done);
+        if (covered)
+            continue;
+        rescan(directory);
+        rescanned.push_back(directory);
+    }
+    if ((batched > 0 || !rescanned.empty()) && options.after_commit)
+        options.after_commit(db);
+}
+
+/**
+ * Brings the song stored for one file up to date with the file on disk.
+ *
+ * \param path The path of the file.
+ * \param moved_from The file's previous path if it was renamed, or an empty string.
+ */
+void LibraryWatcher::processFile(const std::string &path, const std::string &moved_from) {
+    std::error_code ec;
+    FileStat file_stat, stored_stat;
+    Metadata metadata;
+    int song_id;
+
+    song_id = writer.findSong(path, &stored_stat);
+    if (song_id < 0) {
+        stats.write_errors++;
+        return;
+    }
+    if (!std::filesystem::is_regular_file(path, ec) || getFileStat(path, file_stat) != 0) {
+        if (song_id > 0) {
+            if (writer.deleteSong(song_id) != 0)
+                stats.write_errors++;
+            else
+                stats.songs_removed++;
+        }
+        return;
+    }
+    if (song_id > 0 && stored_stat == file_stat)
+        return;
+
+    if (song_id == 0 && !moved_from.empty()) {
+        int old_song_id = writer.findSong(moved_from, &stored_stat);
+        if (old_song_id > 0 && stored_stat == file_stat) {
+            if (writer.relocateSong(old_song_id, path, file_stat) < 0)
+                stats.write_errors++;
+            else
+                stats.songs_moved++;
+            return;
+        }
+        // The file was changed as well as renamed, so it is parsed again as a new song.
+        if (old_song_id > 0 && writer.deleteSong(old_song_id) != 0)
+            stats.write_errors++;
+    }
+
+    if (readMetadata(path, metadata) != 0) {
+        stats.files_skipped++;
+        return;
+    }
+    metadata.file_stat = file_stat;
+    if ((song_id > 0 ? writer.updateSong(song_id, metadata) : writer.insertSong(metadata)) < 0)
+        stats.write_errors++;
+    else if (song_id > 0)
+        stats.songs_updated++;
+    else
+        stats.songs_written++;
+}
+
+/**
+ * Rescans a directory incrementally, watching any subdirectories that are not
+ * watched yet. A directory below the root that no longer exists has all its
+ * songs removed, as long as the root is still there; a root that has gone,
+ * which may just be an unmounted share, keeps its songs.
+ */
+void LibraryWatcher::rescan(const std::string &directory) {
+    std::error_code ec;
+    IngestOptions ingest_options;
+    IngestStats ingest_stats;
+
+    if (std::filesystem::is_directory(directory, ec))
+        addWatches(directory);
+    else
+        removeWatches(directory);
+    ingest_options.parser_threads = options.parser_threads;
+    ingest_options.incremental = true;
+    ingest_options.missing_root_is_empty = directory != root && std::filesystem::is_directory(root, ec);
+    if (ingestLibrary(db, directory, ingest_options, &ingest_stats) != 0)
+        stats.write_errors++;
+    stats.rescans++;
+    stats.songs_written += ingest_stats.songs_written;
+    stats.songs_updated += ingest_stats.songs_updated;
+    stats.songs_removed += ingest_stats.songs_removed;
+    stats.files_skipped += ingest_stats.files_skipped;
+    stats.write_errors += ingest_stats.write_errors;
+}
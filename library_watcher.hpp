@@ -0,0 +1,100 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <sqlite3.h>
+
+#include "database_writer.hpp"
+#include "smart_playlists.hpp"
+
+struct WatchOptions {
+    unsigned int debounce_ms = 1000;        // how long a path must stay quiet before it is processed
+    size_t batch_size = 64;                 // files written per database transaction
+    unsigned int retry_interval = 300;      // seconds between rescans of directories that could not be watched
+    unsigned int parser_threads = 0;        // parser threads for rescans, 0 picks one per hardware thread
+    std::function<void(sqlite3 *db)> after_commit;  // called after each round of changes is in the database
+};
+
+struct WatchStats {
+    size_t songs_written = 0;
+    size_t songs_updated = 0;
+    size_t songs_moved = 0;
+    size_t songs_removed = 0;
+    size_t files_skipped = 0;
+    size_t rescans = 0;
+    size_t write_errors = 0;
+};
+
+/**
+ * Keeps the database in sync with a music library while the library changes.
+ *
+ * On Linux, every directory under the root is watched with inotify. Events
+ * are collected per path and only acted on once the path has been quiet for
+ * options.debounce_ms, so a file that is still being copied is parsed once,
+ * after the copy is done. Changed files are then parsed and written through a
+ * DatabaseWriter, options.batch_size per transaction; renamed files are
+ * relocated without being parsed again, and deleted files are removed. Smart
+ * playlists are updated with the songs written after each round of changes,
+ * and then options.after_commit is called, if set, to let the caller refresh
+ * anything derived from the database, such as a catalog snapshot.
+ *
+ * Directory-level changes (a directory created, moved or deleted) and lost
+ * events (the kernel queue overflowed) are handled by an incremental
+ * ingestLibrary() rescan of just the affected directory. Directories that
+ * cannot be watched because the inotify watch limit was reached are rescanned
+ * every options.retry_interval seconds instead, until a watch can be added.
+ *
+ * On other platforms the watcher is never valid and run() fails.
+ */
+class LibraryWatcher {
+    public:
+        LibraryWatcher(sqlite3 *db, const std::string &root, const WatchOptions &options = WatchOptions());
+        ~LibraryWatcher();
+
+        LibraryWatcher(const LibraryWatcher &) = delete;
+        LibraryWatcher &operator=(const LibraryWatcher &) = delete;
+
+        bool isValid() const;
+        int run();
+        void stop();
+        WatchStats getStats() const;
+
+    private:
+        typedef std::chrono::steady_clock Clock;
+
+        struct PendingChange {
+            Clock::time_point due;
+            std::string moved_from;     // the file's previous path, if it was renamed within the library
+            bool rescan = false;        // a directory changed; rescan everything under the path
+        };
+
+        void addWatches(const std::string &directory);
+        void removeWatches(const std::string &directory);
+        int readEvents();
+        void schedule(const std::string &path, const std::string &moved_from, bool rescan);
+        int getTimeout() const;
+        void processDue(bool all);
+        void processFile(const std::string &path, const std::string &moved_from);
+        void rescan(const std::string &directory);
+
+        sqlite3 *db;
+        std::string root;
+        WatchOptions options;
+        WatchStats stats;
+        DatabaseWriter writer;
+        SmartPlaylists smart_playlists;
+        int inotify_fd;
+        int stop_fds[2];
+        bool root_removed;
+
+        std::unordered_map<int, std::string> watches;       // watch descriptor -> directory
+        std::set<std::string> unwatched;                    // directories over the watch limit
+        Clock::time_point next_retry;
+        std::map<std::string, PendingChange> pending;
+        std::unordered_map<uint32_t, std::string> move_sources;  // rename cookie -> old path
+};
@@ -0,0 +1,306 @@
+#include "logger.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <ctime>
+#include <functional>
+
+namespace {
+
+/**
+ * Formats "[YYYY-MM-DD HH:MM:SS] " followed by the message into out.
+ */
+void formatRecord(std::string &out, const char *fmt, va_list args) {
+    char time_string[64];
+    char buffer[512];
+    struct tm local_time;
+    time_t now;
+    va_list args_copy;
+    int length;
+
+    time(&now);
+#ifdef _WIN32
+    localtime_s(&local_time, &now);
+#else
+    localtime_r(&now, &local_time);
+#endif
+    strftime(time_string, sizeof(time_string), "%Y-%m-%d %H:%M:%S", &local_time);
+    out.assign("[");
+    out.append(time_string);
+    out.append("] ");
+
+    va_copy(args_copy, args);
+    length = vsnprintf(buffer, sizeof(buffer), fmt, args_copy);
+    va_end(args_copy);
+    if (length < 0)
+        return;
+    if ((size_t)length < sizeof(buffer)) {
+        out.append(buffer, (size_t)length);
+    } else {
+        size_t start = out.size();
+        out.resize(start + (size_t)length + 1);
+        vsnprintf(&out[start], (size_t)length + 1, fmt, args);
+        out.resize(start + (size_t)length);
+    }
+}
+
+std::atomic<bool> logger_created(false);
+
+/**
+ * Shuts the logger down when the program exits, or the library is unloaded,
+ * unless shutdownLog() did so already, so queued messages are never lost.
+ */
+struct ShutdownGuard {
+    ~ShutdownGuard() {
+        if (logger_created)
+            Logger::getInstance().shutdown();
+    }
+};
+
+ShutdownGuard shutdown_guard;
+
+}
+
+/**
+ * Returns the logger, creating it and starting its flusher on first use.
+ */
+Logger &Logger::getInstance() {
+    static Logger *instance = new Logger();
+    return *instance;
+}
+
+Logger::Logger() : min_level((int)LogLevel::Info), next_sequence(0), running(true), path(LOG_LOCATION), file(nullptr), wake_requested(false) {
+    for (auto &shard : shards)
+        shard.ring.resize(SHARD_CAPACITY);
+    flusher = std::thread(&Logger::run, this);
+    logger_created = true;
+}
+
+/**
+ * Sets the lowest level that is written. Messages below it are discarded
+ * before they are formatted.
+ */
+void Logger::setLevel(LogLevel level) {
+    min_level.store((int)level, std::memory_order_relaxed);
+}
+
+/**
+ * Switches the log file. Messages logged before the call go to the old file.
+ */
+void Logger::setPath(const std::string &new_path) {
+    drain();
+    std::lock_guard<std::mutex> lock(file_mutex);
+    if (file != nullptr) {
+        fclose(file);
+        file = nullptr;
+    }
+    path = new_path;
+}
+
+/**
+ * Formats a message and queues it for the flusher.
+ */
+void Logger::write(const char *fmt, va_list args) {
+    Shard &shard = getShard();
+    std::unique_lock<std::mutex> lock(shard.mutex);
+
+    while (shard.count == SHARD_CAPACITY && running) {
+        {
+            std::lock_guard<std::mutex> wake_lock(wake_mutex);
+            wake_requested = true;
+        }
+        wake.notify_one();
+        shard.not_full.wait(lock);
+    }
+    if (!running) {
+        // The flusher is gone (the program is exiting), so write synchronously.
+        std::vector<Record> records(1);
+        formatRecord(records[0].text, fmt, args);
+        lock.unlock();
+        drain();
+        std::lock_guard<std::mutex> file_lock(file_mutex);
+        writeRecords(records);
+        return;
+    }
+    Record &record = shard.ring[(shard.head + shard.count) % SHARD_CAPACITY];
+    formatRecord(record.text, fmt, args);
+    record.sequence = next_sequence.fetch_add(1, std::memory_order_relaxed);
+    shard.count++;
+}
+
+/**
+ * Writes every queued message to the log file before returning.
+ */
+void Logger::flush() {
+    drain();
+}
+
+/**
+ * Stops the flusher and writes out the remaining messages. Called by
+ * shutdownLog(), or at exit.
+ */
+void Logger::shutdown() {
+    if (!running.exchange(false))
+        return;
+    {
+        std::lock_guard<std::mutex> lock(wake_mutex);
+        wake_requested = true;
+    }
+    wake.notify_one();
+    for (auto &shard : shards) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.not_full.notify_all();
+    }
+    if (flusher.joinable())
+        flusher.join();
+    drain();
+}
+
+/**
+ * Picks the shard for the calling thread.
+ */
+Logger::Shard &Logger::getShard() {
+    thread_local size_t index = std::hash<std::thread::id>()(std::this_thread::get_id()) % SHARD_COUNT;
+    return shards[index];
+}
+
+/**
+ * Moves every queued message out of the shards and appends them to the file
+ * in the order they were logged.
+ */
+void Logger::drain() {
+    std::lock_guard<std::mutex> file_lock(file_mutex);
+    size_t used = 0;
+
+    for (auto &shard : shards) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        if (batch.size() < used + shard.count)
+            batch.resize(used + shard.count);
+        for (; shard.count > 0; shard.count--) {
+            Record &record = shard.ring[shard.head];
+            batch[used].sequence = record.sequence;
+            batch[used].text.swap(record.text);      // hands the string buffers back and forth instead of copying
+            used++;
+            shard.head = (shard.head + 1) % SHARD_CAPACITY;
+        }
+        shard.not_full.notify_all();
+    }
+    if (used == 0)
+        return;
+    std::vector<Record> records;
+    records.swap(batch);
+    std::sort(records.begin(), records.begin() + used, [](const Record &a, const Record &b) { return a.sequence < b.sequence; });
+    records.resize(used);
+    writeRecords(records);
+    batch.swap(records);
+}
+
+/**
+ * Appends records to the log file, opening it if needed. Expects file_mutex to be held.
+ */
+void Logger::writeRecords(std::vector<Record> &records) {
+    if (file == nullptr)
+        file = fopen(path.c_str(), "a+");
+    if (file == nullptr)
+        return;
+    for (auto &record : records)
+        fwrite(record.text.data(), 1, record.text.size(), file);
+    fflush(file);
+}
+
+/**
+ * The flusher thread: drains the shards periodically, or sooner when a
+ * writer finds its shard full.
+ */
+void Logger::run() {
+    while (running) {
+        {
+            std::unique_lock<std::mutex> lock(wake_mutex);
+            wake.wait_for(lock, std::chrono::milliseconds(200), [this] { return wake_requested; });
+            wake_requested = false;
+        }
+        drain();
+    }
+}
+
+/**
+ * @brief Logs a formatted message with a timestamp at the Info level.
+ *
+ * @details The message is queued and written to the log file (LOG_LOCATION,
+ *          unless changed with setLogPath()) by a background thread. The
+ *          message is formatted similarly to printf, using variadic arguments
+ *          to specify the format and the values to include in the log entry.
+ *
+ * @param[in] fmt The format string, followed by any additional arguments
+ *                required by the format specifiers.
+ */
+void log(const char *fmt, ...) {
+    Logger &logger = Logger::getInstance();
+    va_list args;
+
+    if (!logger.isEnabled(LogLevel::Info))
+        return;
+    va_start(args, fmt);
+    logger.write(fmt, args);
+    va_end(args);
+}
+
+/**
+ * @brief Logs a formatted message with a timestamp at the given level.
+ *
+ * @details Messages below the level set with setLogLevel() are discarded
+ *          before any formatting is done.
+ *
+ * @param[in] level The severity of the message.
+ * @param[in] fmt The format string, followed by any additional arguments
+ *                required by the format specifiers.
+ */
+void logAt(LogLevel level, const char *fmt, ...) {
+    Logger &logger = Logger::getInstance();
+    va_list args;
+
+    if (!logger.isEnabled(level))
+        return;
+    va_start(args, fmt);
+    logger.write(fmt, args);
+    va_end(args);
+}
+
+/**
+ * @brief Sets the lowest level of messages that are written to the log.
+ *
+ * @param[in] level The lowest level to write. The default is Info.
+ */
+void setLogLevel(LogLevel level) {
+    Logger::getInstance().setLevel(level);
+}
+
+/**
+ * @brief Sets the file that log messages are appended to.
+ *
+ * @param[in] path The path to the log file. The default is LOG_LOCATION.
+ */
+void setLogPath(const char *path) {
+    Logger::getInstance().setPath(path);
+}
+
+/**
+ * @brief Writes all queued log messages to the log file before returning.
+ */
+void flushLog() {
+    Logger::getInstance().flush();
+}
+
+/**
+ * @brief Stops the background thread that writes the log, after writing all queued messages.
+ *
+ * @details Happens by itself when the program exits or the library is
+ *          unloaded, but calling it first lets the program choose the moment,
+ *          before its other threads stop logging. On Windows, a DLL must call
+ *          it before it is unloaded with FreeLibrary(), since the flusher
+ *          cannot be joined while the DLL is detaching. Messages logged
+ *          afterwards are written to the file before log() returns.
+ */
+void shutdownLog() {
+    Logger::getInstance().shutdown();
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "misc.hpp"
+
+/**
+ * The process-wide log writer behind log() and logAt().
+ *
+ * Callers format their message and append it to one of several in-memory
+ * ring buffers (picked per thread, so threads rarely contend for a lock), and
+ * return without touching the file. A background thread drains the buffers,
+ * restores the original order of the messages using a global sequence number,
+ * and appends them to the log file, which it keeps open. If a buffer is full,
+ * the caller waits for the flusher rather than dropping the message.
+ *
+ * The logger is never destroyed. The flusher is stopped by shutdownLog(), or
+ * at the latest when the program exits or the library is unloaded, and
+ * whatever is left is written out; any message logged after that is written
+ * straight to the file.
+ */
+class Logger {
+    public:
+        static Logger &getInstance();
+
+        bool isEnabled(LogLevel level) const {
+            return (int)level >= min_level.load(std::memory_order_relaxed);
+        }
+        void setLevel(LogLevel level);
+        void setPath(const std::string &path);
+        void write(const char *fmt, va_list args);
+        void flush();
+        void shutdown();
+
+    private:
+        enum { SHARD_COUNT = 8, SHARD_CAPACITY = 512 };
+
+        struct Record {
+            uint64_t sequence;
+            std::string text;
+        };
+
+        struct Shard {
+            std::mutex mutex;
+            std::condition_variable not_full;
+            std::vector<Record> ring;
+            size_t head = 0;
+            size_t count = 0;
+        };
+
+        Logger();
+        Logger(const Logger &) = delete;
+        Logger &operator=(const Logger &) = delete;
+
+        Shard &getShard();
+        void drain();
+        void writeRecords(std::vector<Record> &records);
+        void run();
+
+        std::atomic<int> min_level;
+        std::atomic<uint64_t> next_sequence;
+        std::atomic<bool> running;
+        Shard shards[SHARD_COUNT];
+
+        std::mutex file_mutex;          // serializes draining and file access
+        std::string path;
+        FILE *file;
+        std::vector<Record> batch;
+
+        std::mutex wake_mutex;
+        std::condition_variable wake;
+        bool wake_requested;
+        std::thread flusher;
+};
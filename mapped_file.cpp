@@ -0,0 +1,62 @@
+#include "mapped_file.hpp"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/**
+ * Maps a whole file.
+ *
+ * \param path The path to the file.
+ * \param sequential If \c true, the file is expected to be read once, front to
+ *                   back, and the system is asked to read ahead further.
+ */
+MappedFile::MappedFile(const std::string &path, bool sequential) : data(nullptr), size(0) {
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                              sequential ? FILE_FLAG_SEQUENTIAL_SCAN : FILE_ATTRIBUTE_NORMAL, NULL);
+    LARGE_INTEGER file_size;
+    if (file == INVALID_HANDLE_VALUE)
+        return;
+    if (GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0) {
+        HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping != NULL) {
+            data = (const unsigned char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            if (data != nullptr)
+                size = (size_t)file_size.QuadPart;
+            CloseHandle(mapping);
+        }
+    }
+    CloseHandle(file);
+#else
+    struct stat st;
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void *address = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (address != MAP_FAILED) {
+            if (sequential)
+                madvise(address, (size_t)st.st_size, MADV_SEQUENTIAL);
+            data = (const unsigned char *)address;
+            size = (size_t)st.st_size;
+        }
+    }
+    close(fd);
+#endif
+}
+
+MappedFile::~MappedFile() {
+    if (data == nullptr)
+        return;
+#ifdef _WIN32
+    UnmapViewOfFile(data);
+#else
+    munmap((void *)data, size);
+#endif
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+/**
+ * A file mapped read-only into memory. data is null if the file could not be
+ * mapped, or is empty.
+ */
+class MappedFile {
+    public:
+        explicit MappedFile(const std::string &path, bool sequential = false);
+        ~MappedFile();
+
+        MappedFile(const MappedFile &) = delete;
+        MappedFile &operator=(const MappedFile &) = delete;
+
+        const unsigned char *data;
+        size_t size;
+};
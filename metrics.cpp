@@ -0,0 +1,422 @@
+#include "metrics.hpp"
+#include "logger.hpp"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdarg>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace {
+
+const char *const COUNTER_NAMES[METRIC_COUNTER_COUNT] = {
+    "directories_read", "entries_statted", "files_found", "files_unchanged", "files_parsed", "files_skipped",
+    "files_hashed", "bytes_read", "bytes_hashed", "songs_written", "songs_updated", "songs_removed", "write_errors",
+    "entity_cache_hits", "entity_queries", "entities_created", "commits",
+    "playlists_evaluated", "playlist_statements_prepared", "song_updates_queued", "song_updates_written"
+};
+
+const char *const STAGE_NAMES[METRIC_STAGE_COUNT] = {
+    "traverse", "parse_tags", "taglib_fallback", "split_string", "entity_lookup", "write_song", "commit",
+    "hash_content", "extract_art", "search", "fetch_columns", "build_catalog",
+    "refresh_playlists", "flush_song_updates"
+};
+
+const char *const QUEUE_NAMES[METRIC_QUEUE_COUNT] = { "path", "metadata", "hash" };
+
+// Caps the memory a forgotten trace can take, at about 6 MB per thread.
+const size_t MAX_EVENTS_PER_THREAD = 256 * 1024;
+
+/**
+ * Returns the index of the highest set bit of a non-zero value.
+ */
+unsigned int getHighestBit(uint64_t value) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanReverse64(&index, value);
+    return (unsigned int)index;
+#else
+    return 63u - (unsigned int)__builtin_clzll(value);
+#endif
+}
+
+/**
+ * Raises an atomic maximum to value, if it is lower.
+ */
+void raiseMaximum(std::atomic<uint64_t> &maximum, uint64_t value) {
+    uint64_t current = maximum.load(std::memory_order_relaxed);
+    while (current < value && !maximum.compare_exchange_weak(current, value, std::memory_order_relaxed))
+        ;
+}
+
+/**
+ * Appends printf-style formatted text to out.
+ */
+void appendFormat(std::string &out, const char *fmt, ...) {
+    char buffer[256];
+    va_list args;
+
+    va_start(args, fmt);
+    int length = vsnprintf(buffer, sizeof(buffer), fmt, args);
+    va_end(args);
+    if (length > 0)
+        out.append(buffer, std::min((size_t)length, sizeof(buffer) - 1));
+}
+
+}
+
+std::atomic<unsigned int> Metrics::mode(0);
+
+/**
+ * Lets a thread's trace buffer be freed once the thread has exited.
+ */
+struct Metrics::TraceBufferOwner {
+    TraceBuffer *buffer = nullptr;
+
+    ~TraceBufferOwner() {
+        if (buffer != nullptr) {
+            std::lock_guard<std::mutex> lock(buffer->mutex);
+            buffer->orphaned = true;
+        }
+    }
+};
+
+/**
+ * Returns the metrics registry, creating it on first use.
+ */
+Metrics &Metrics::getInstance() {
+    // Never destroyed, so threads still running at exit can keep recording.
+    static Metrics *instance = new Metrics();
+    return *instance;
+}
+
+Metrics::Metrics() : trace_file(nullptr), trace_start_ns(0), next_thread_id(1) {
+    reset();
+}
+
+/**
+ * Turns collection of counters, latencies and queue depths on or off. A trace
+ * that is running is not affected.
+ */
+void Metrics::setEnabled(bool enabled) {
+    if (enabled)
+        mode.fetch_or(ENABLED, std::memory_order_relaxed);
+    else
+        mode.fetch_and(~(unsigned int)ENABLED, std::memory_order_relaxed);
+}
+
+/**
+ * Sets every counter, histogram and queue sample back to zero.
+ */
+void Metrics::reset() {
+    for (auto &counter : counters)
+        counter.store(0, std::memory_order_relaxed);
+    for (auto &histogram : stages) {
+        histogram.count.store(0, std::memory_order_relaxed);
+        histogram.total_ns.store(0, std::memory_order_relaxed);
+        histogram.max_ns.store(0, std::memory_order_relaxed);
+        for (auto &bucket : histogram.buckets)
+            bucket.store(0, std::memory_order_relaxed);
+    }
+    for (auto &samples : queues) {
+        samples.count.store(0, std::memory_order_relaxed);
+        samples.total.store(0, std::memory_order_relaxed);
+        samples.max.store(0, std::memory_order_relaxed);
+    }
+}
+
+/**
+ * Adds to a counter. Prefer countMetric(), which skips the call while
+ * collection is off.
+ */
+void Metrics::add(MetricCounter counter, uint64_t amount) {
+    if (mode.load(std::memory_order_relaxed) & ENABLED)
+        counters[(size_t)counter].fetch_add(amount, std::memory_order_relaxed);
+}
+
+/**
+ * Records one execution of a stage, in its histogram and, while a trace is
+ * running, as a trace event. Prefer ScopedTimer, which skips the call while
+ * collection is off.
+ *
+ * \param stage The stage that ran.
+ * \param start_ns When it started, as returned by now().
+ * \param end_ns When it finished, as returned by now().
+ */
+void Metrics::record(MetricStage stage, uint64_t start_ns, uint64_t end_ns) {
+    unsigned int current_mode = mode.load(std::memory_order_relaxed);
+    uint64_t duration_ns = end_ns > start_ns ? end_ns - start_ns : 0;
+
+    if (current_mode & ENABLED) {
+        Histogram &histogram = stages[(size_t)stage];
+        histogram.count.fetch_add(1, std::memory_order_relaxed);
+        histogram.total_ns.fetch_add(duration_ns, std::memory_order_relaxed);
+        histogram.buckets[getBucket(duration_ns)].fetch_add(1, std::memory_order_relaxed);
+        raiseMaximum(histogram.max_ns, duration_ns);
+    }
+    if (current_mode & TRACING) {
+        TraceBuffer &buffer = getTraceBuffer();
+        std::lock_guard<std::mutex> lock(buffer.mutex);
+        if (buffer.events.size() < MAX_EVENTS_PER_THREAD)
+            buffer.events.push_back({ stage, start_ns, duration_ns });
+        else
+            buffer.dropped_events++;
+    }
+}
+
+/**
+ * Records how many items a queue held at one moment. Prefer
+ * sampleQueueDepth(), which skips the call while collection is off.
+ */
+void Metrics::sampleQueue(MetricQueue queue, size_t depth) {
+    if (mode.load(std::memory_order_relaxed) & ENABLED) {
+        QueueSamples &samples = queues[(size_t)queue];
+        samples.count.fetch_add(1, std::memory_order_relaxed);
+        samples.total.fetch_add(depth, std::memory_order_relaxed);
+        raiseMaximum(samples.max, depth);
+    }
+}
+
+/**
+ * Renders everything collected so far as a JSON object.
+ *
+ * \return An object with a "counters" object of plain numbers, a "stages"
+ *         object with the count, total milliseconds and mean, p50, p90, p99
+ *         and maximum microseconds of each stage, and a "queues" object with
+ *         the number of samples and the mean and maximum depth of each queue.
+ *
+ * Values are read one by one while other threads may be recording, so they
+ * are not an exact snapshot of a single moment.
+ */
+std::string Metrics::toJson() const {
+    std::string json = "{\"counters\":{";
+
+    for (size_t i = 0; i < METRIC_COUNTER_COUNT; i++)
+        appendFormat(json, "%s\"%s\":%" PRIu64, i > 0 ? "," : "", COUNTER_NAMES[i],
+                     counters[i].load(std::memory_order_relaxed));
+    json += "},\"stages\":{";
+    for (size_t i = 0; i < METRIC_STAGE_COUNT; i++) {
+        const Histogram &histogram = stages[i];
+        uint64_t count = histogram.count.load(std::memory_order_relaxed);
+        uint64_t total_ns = histogram.total_ns.load(std::memory_order_relaxed);
+        appendFormat(json, "%s\"%s\":{\"count\":%" PRIu64 ",\"total_ms\":%.3f,\"mean_us\":%.3f", i > 0 ? "," : "",
+                     STAGE_NAMES[i], count, total_ns / 1e6, count > 0 ? total_ns / 1e3 / count : 0.0);
+        appendFormat(json, ",\"p50_us\":%.3f,\"p90_us\":%.3f,\"p99_us\":%.3f,\"max_us\":%.3f}",
+                     getPercentile(histogram, 0.5) / 1e3, getPercentile(histogram, 0.9) / 1e3,
+                     getPercentile(histogram, 0.99) / 1e3, histogram.max_ns.load(std::memory_order_relaxed) / 1e3);
+    }
+    json += "},\"queues\":{";
+    for (size_t i = 0; i < METRIC_QUEUE_COUNT; i++) {
+        const QueueSamples &samples = queues[i];
+        uint64_t count = samples.count.load(std::memory_order_relaxed);
+        appendFormat(json, "%s\"%s\":{\"samples\":%" PRIu64 ",\"mean_depth\":%.2f,\"max_depth\":%" PRIu64 "}",
+                     i > 0 ? "," : "", QUEUE_NAMES[i], count,
+                     count > 0 ? (double)samples.total.load(std::memory_order_relaxed) / count : 0.0,
+                     samples.max.load(std::memory_order_relaxed));
+    }
+    json += "}}";
+    return json;
+}
+
+/**
+ * Starts recording every timed stage into a Chrome trace-event file, which
+ * can be opened in chrome://tracing or Perfetto.
+ *
+ * \param path The file to write. It is created, or truncated, right away and
+ *             written by stopTrace().
+ * \return \c 0 on success, or \c -1 if a trace is already running or the file
+ *         cannot be created.
+ *
+ * Events are buffered in memory, up to a fixed number per thread. Further
+ * events are dropped and counted in the file's metadata.
+ */
+int Metrics::startTrace(const char *path) {
+    std::lock_guard<std::mutex> lock(trace_mutex);
+
+    if (trace_file != nullptr) {
+        logAt(LogLevel::Warning, "Unable to start a trace in %s: a trace is already running\n", path);
+        return -1;
+    }
+    trace_file = fopen(path, "w");
+    if (trace_file == nullptr) {
+        logAt(LogLevel::Error, "Unable to create trace file %s\n", path);
+        return -1;
+    }
+    for (TraceBuffer *buffer : trace_buffers) {
+        std::lock_guard<std::mutex> buffer_lock(buffer->mutex);
+        buffer->events.clear();
+        buffer->dropped_events = 0;
+    }
+    trace_start_ns = now();
+    mode.fetch_or(TRACING, std::memory_order_relaxed);
+    return 0;
+}
+
+/**
+ * Stops the running trace and writes its events to the file given to
+ * startTrace().
+ *
+ * \return \c 0 on success, or \c -1 if no trace is running or the file cannot
+ *         be written.
+ */
+int Metrics::stopTrace() {
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    size_t written = 0, dropped = 0;
+    bool first = true;
+
+    if (trace_file == nullptr)
+        return -1;
+    mode.fetch_and(~(unsigned int)TRACING, std::memory_order_relaxed);
+
+    fputs("{\"traceEvents\":[\n", trace_file);
+    for (auto it = trace_buffers.begin(); it != trace_buffers.end();) {
+        TraceBuffer *buffer = *it;
+        std::unique_lock<std::mutex> buffer_lock(buffer->mutex);
+        fprintf(trace_file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%" PRIu64 ",\"args\":{\"name\":\"thread %" PRIu64 "\"}}",
+                first ? "" : ",\n", buffer->thread_id, buffer->thread_id);
+        first = false;
+        for (auto &event : buffer->events) {
+            // Scopes that began before the trace started are left out.
+            if (event.start_ns < trace_start_ns)
+                continue;
+            fprintf(trace_file, ",\n{\"name\":\"%s\",\"cat\":\"dbs\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%" PRIu64 "}",
+                    STAGE_NAMES[(size_t)event.stage], (event.start_ns - trace_start_ns) / 1e3, event.duration_ns / 1e3, buffer->thread_id);
+            written++;
+        }
+        dropped += buffer->dropped_events;
+        buffer->events.clear();
+        buffer->events.shrink_to_fit();
+        buffer->dropped_events = 0;
+        if (buffer->orphaned) {
+            buffer_lock.unlock();
+            delete buffer;
+            it = trace_buffers.erase(it);
+        } else
+            ++it;
+    }
+    fprintf(trace_file, "\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"dropped_events\":%zu}}\n", dropped);
+
+    bool failed = ferror(trace_file) != 0;
+    failed = fclose(trace_file) != 0 || failed;
+    trace_file = nullptr;
+    if (failed) {
+        logAt(LogLevel::Error, "Unable to write trace file\n");
+        return -1;
+    }
+    log("Wrote trace of %zu events, %zu dropped\n", written, dropped);
+    return 0;
+}
+
+/**
+ * Returns the calling thread's trace buffer, registering one on first use.
+ */
+Metrics::TraceBuffer &Metrics::getTraceBuffer() {
+    thread_local TraceBufferOwner owner;
+
+    if (owner.buffer == nullptr) {
+        TraceBuffer *buffer = new TraceBuffer();
+        buffer->dropped_events = 0;
+        buffer->orphaned = false;
+        std::lock_guard<std::mutex> lock(trace_mutex);
+        buffer->thread_id = next_thread_id++;
+        trace_buffers.push_back(buffer);
+        owner.buffer = buffer;
+    }
+    return *owner.buffer;
+}
+
+/**
+ * Maps a duration to its histogram bucket. Durations below 4 ns get a bucket
+ * each; every power of two above that is split into SUB_BUCKETS equal parts.
+ */
+size_t Metrics::getBucket(uint64_t ns) {
+    if (ns < SUB_BUCKETS)
+        return (size_t)ns;
+    unsigned int exponent = getHighestBit(ns);
+    size_t sub_bucket = (size_t)(ns >> (exponent - 2)) & (SUB_BUCKETS - 1);
+    return (exponent - 1) * SUB_BUCKETS + sub_bucket;
+}
+
+/**
+ * Returns the largest duration that falls into a bucket.
+ */
+uint64_t Metrics::getBucketLimit(size_t bucket) {
+    if (bucket < SUB_BUCKETS)
+        return bucket;
+    unsigned int exponent = (unsigned int)(bucket / SUB_BUCKETS) + 1;
+    uint64_t sub_bucket = bucket % SUB_BUCKETS;
+    if (exponent == 63 && sub_bucket == SUB_BUCKETS - 1)
+        return UINT64_MAX;
+    return ((SUB_BUCKETS + sub_bucket + 1) << (exponent - 2)) - 1;
+}
+
+/**
+ * Estimates a percentile of a stage's durations as the upper limit of the
+ * bucket it falls in, capped at the largest duration seen.
+ */
+uint64_t Metrics::getPercentile(const Histogram &histogram, double fraction) const {
+    uint64_t count = 0, seen = 0, rank;
+
+    for (auto &bucket : histogram.buckets)
+        count += bucket.load(std::memory_order_relaxed);
+    if (count == 0)
+        return 0;
+    rank = std::max<uint64_t>(1, (uint64_t)(fraction * (double)count + 0.999999));
+    for (size_t i = 0; i < BUCKET_COUNT; i++) {
+        seen += histogram.buckets[i].load(std::memory_order_relaxed);
+        if (seen >= rank)
+            return std::min(getBucketLimit(i), histogram.max_ns.load(std::memory_order_relaxed));
+    }
+    return histogram.max_ns.load(std::memory_order_relaxed);
+}
+
+/**
+ * @brief Turns collection of metrics on or off for the whole process.
+ *
+ * @details While off, which is the default, instrumented code pays one
+ *          relaxed atomic load per instrumentation point and nothing else.
+ *          Turning collection off keeps what was collected.
+ *
+ * @param[in] enabled Whether to collect.
+ */
+void setMetricsEnabled(bool enabled) {
+    Metrics::getInstance().setEnabled(enabled);
+}
+
+/**
+ * @brief Sets every metric back to zero.
+ */
+void resetMetrics() {
+    Metrics::getInstance().reset();
+}
+
+/**
+ * @brief Returns the metrics collected so far as JSON.
+ *
+ * @return A JSON object, see Metrics::toJson().
+ */
+std::string getMetricsJson() {
+    return Metrics::getInstance().toJson();
+}
+
+/**
+ * @brief Starts recording a Chrome trace-event file of every timed stage.
+ *
+ * @param[in] path The file to write when the trace is stopped.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int startTrace(const char *path) {
+    return Metrics::getInstance().startTrace(path);
+}
+
+/**
+ * @brief Stops the running trace and writes its file.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int stopTrace() {
+    return Metrics::getInstance().stopTrace();
+}
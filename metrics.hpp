@@ -0,0 +1,196 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+
+enum class MetricCounter {
+    DirectoriesRead,
+    EntriesStatted,         // directory entries whose type the listing did not give
+    FilesFound,
+    FilesUnchanged,
+    FilesParsed,
+    FilesSkipped,
+    FilesHashed,
+    BytesRead,              // read by the fast tag reader; TagLib's own reads are not counted
+    BytesHashed,
+    SongsWritten,
+    SongsUpdated,
+    SongsRemoved,
+    WriteErrors,
+    EntityCacheHits,
+    EntityQueries,          // lookups that had to ask the database
+    EntitiesCreated,
+    Commits,
+    PlaylistsEvaluated,     // smart playlists evaluated over the whole library
+    PlaylistStatementsPrepared,
+    SongUpdatesQueued,      // ratings and plays given to the write-behind queue
+    SongUpdatesWritten,     // songs written by its flushes, after updates to the same song were merged
+    Count
+};
+
+const size_t METRIC_COUNTER_COUNT = (size_t)MetricCounter::Count;
+
+enum class MetricStage {
+    Traverse,               // one sample per walk of the library
+    ParseTags,              // includes SplitString, and TagLibFallback when the fast reader gives up
+    TagLibFallback,
+    SplitString,
+    EntityLookup,
+    WriteSong,              // includes EntityLookup, and Commit when a batch fills up
+    Commit,
+    HashContent,
+    ExtractArt,
+    Search,
+    FetchColumns,
+    BuildCatalog,
+    RefreshPlaylists,
+    FlushSongUpdates,
+    Count
+};
+
+const size_t METRIC_STAGE_COUNT = (size_t)MetricStage::Count;
+
+enum class MetricQueue {
+    PathQueue,
+    MetadataQueue,
+    HashQueue,
+    Count
+};
+
+const size_t METRIC_QUEUE_COUNT = (size_t)MetricQueue::Count;
+
+/**
+ * Process-wide counters, latency histograms and queue depth samples, plus an
+ * optional Chrome trace of every timed stage.
+ *
+ * Everything is off by default. While off, each instrumentation point costs
+ * one relaxed atomic load and a branch. While on, recording is lock-free:
+ * counters and histogram buckets are relaxed atomics. Latencies go into
+ * log-linear histograms (four buckets per power of two, so percentiles are
+ * within about 19%). Trace events are appended to a per-thread buffer and
+ * only gathered when the trace is written.
+ */
+class Metrics {
+    public:
+        static Metrics &getInstance();
+
+        static bool isActive() { return mode.load(std::memory_order_relaxed) != 0; }
+        static bool isTracing() { return (mode.load(std::memory_order_relaxed) & TRACING) != 0; }
+
+        void setEnabled(bool enabled);
+        void reset();
+        void add(MetricCounter counter, uint64_t amount);
+        void record(MetricStage stage, uint64_t start_ns, uint64_t end_ns);
+        void sampleQueue(MetricQueue queue, size_t depth);
+        std::string toJson() const;
+        int startTrace(const char *path);
+        int stopTrace();
+
+        static uint64_t now() {
+            return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+
+    private:
+        enum { ENABLED = 1, TRACING = 2 };
+        enum { SUB_BUCKETS = 4, BUCKET_COUNT = 64 * SUB_BUCKETS };
+
+        struct alignas(64) Histogram {
+            std::atomic<uint64_t> count;
+            std::atomic<uint64_t> total_ns;
+            std::atomic<uint64_t> max_ns;
+            std::atomic<uint64_t> buckets[BUCKET_COUNT];
+        };
+
+        struct alignas(64) QueueSamples {
+            std::atomic<uint64_t> count;
+            std::atomic<uint64_t> total;
+            std::atomic<uint64_t> max;
+        };
+
+        struct TraceEvent {
+            MetricStage stage;
+            uint64_t start_ns;
+            uint64_t duration_ns;
+        };
+
+        struct TraceBuffer {
+            std::mutex mutex;                       // guards everything below
+            uint64_t thread_id;
+            std::vector<TraceEvent> events;
+            size_t dropped_events;
+            bool orphaned;                          // its thread has exited
+        };
+
+        struct TraceBufferOwner;                    // the per-thread handle of a TraceBuffer
+
+        Metrics();
+        Metrics(const Metrics &) = delete;
+        Metrics &operator=(const Metrics &) = delete;
+
+        TraceBuffer &getTraceBuffer();
+        static size_t getBucket(uint64_t ns);
+        static uint64_t getBucketLimit(size_t bucket);
+        uint64_t getPercentile(const Histogram &histogram, double fraction) const;
+
+        static std::atomic<unsigned int> mode;
+
+        alignas(64) std::atomic<uint64_t> counters[METRIC_COUNTER_COUNT];
+        Histogram stages[METRIC_STAGE_COUNT];
+        QueueSamples queues[METRIC_QUEUE_COUNT];
+
+        std::mutex trace_mutex;                     // guards everything below
+        FILE *trace_file;
+        uint64_t trace_start_ns;
+        uint64_t next_thread_id;
+        std::vector<TraceBuffer *> trace_buffers;   // one per thread that has traced
+};
+
+/**
+ * Times the enclosing scope as one sample of a stage, if metrics are on.
+ */
+class ScopedTimer {
+    public:
+        explicit ScopedTimer(MetricStage stage) : stage(stage), start_ns(Metrics::isActive() ? Metrics::now() : 0) {}
+        ~ScopedTimer() {
+            if (start_ns != 0)
+                Metrics::getInstance().record(stage, start_ns, Metrics::now());
+        }
+
+        ScopedTimer(const ScopedTimer &) = delete;
+        ScopedTimer &operator=(const ScopedTimer &) = delete;
+
+    private:
+        MetricStage stage;
+        uint64_t start_ns;
+};
+
+/**
+ * Adds to a counter, if metrics are on.
+ */
+inline void countMetric(MetricCounter counter, uint64_t amount = 1) {
+    if (Metrics::isActive())
+        Metrics::getInstance().add(counter, amount);
+}
+
+/**
+ * Records how full a queue is, if metrics are on. depth is only evaluated
+ * when they are, since it usually takes the queue's lock.
+ */
+template <typename DepthFunction>
+inline void sampleQueueDepth(MetricQueue queue, DepthFunction depth) {
+    if (Metrics::isActive())
+        Metrics::getInstance().sampleQueue(queue, depth());
+}
+
+void setMetricsEnabled(bool enabled);
+void resetMetrics();
+std::string getMetricsJson();
+int startTrace(const char *path);
+int stopTrace();
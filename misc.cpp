@@ -1,89 +1,222 @@
 #include "misc.hpp"
-#include <regex>
-#include <filesystem>
-#include <stack>
-#include <stdarg.h>
+#include "metrics.hpp"
+#include <sys/stat.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#define SPLIT_USE_SSE2
+#endif
+
+namespace {
+
+inline bool isSplitWhitespace(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+/**
+ * Returns the index of the first delimiter at or after pos, or size if there is none.
+ */
+inline size_t findDelimiter(const char *data, size_t size, size_t pos, const SplitDelimiters &delimiters) {
+#ifdef SPLIT_USE_SSE2
+    size_t count = delimiters.getVectorCount();
+    if (count > 0) {
+        while (pos + 16 <= size) {
+            __m128i block = _mm_loadu_si128((const __m128i *)(data + pos));
+            __m128i hits = _mm_setzero_si128();
+            for (size_t j = 0; j < count; j++)
+                hits = _mm_or_si128(hits, _mm_cmpeq_epi8(block, _mm_set1_epi8(delimiters.getVectorChar(j))));
+            int mask = _mm_movemask_epi8(hits);
+            if (mask != 0)
+                return pos + (size_t)__builtin_ctz((unsigned int)mask);
+            pos += 16;
+        }
+    }
+#endif
+    while (pos < size && !delimiters.contains((unsigned char)data[pos]))
+        pos++;
+    return pos;
+}
+
+}
+
+/**
+ * @brief Builds a delimiter set from the characters of a string.
+ *
+ * @param[in] chars The delimiter characters. The default is "&;,".
+ */
+SplitDelimiters::SplitDelimiters(const char *chars) {
+    bool too_large = false;
+
+    for (int i = 0; i < 256; i++)
+        table[i] = false;
+    count = 0;
+    for (; *chars != '\0'; chars++) {
+        unsigned char c = (unsigned char)*chars;
+        if (!table[c]) {
+            if (count < sizeof(list))
+                list[count++] = (char)c;
+            else
+                too_large = true;
+        }
+        table[c] = true;
+    }
+    // Sets too large for the vector scan fall back to the table alone.
+    if (too_large)
+        count = 0;
+}
+
+/**
+ * @brief Returns the delimiter set used for tag values, "&;,".
+ *
+ * @return A set that lives for the whole program, so it is only built once.
+ */
+const SplitDelimiters &getDefaultSplitDelimiters() {
+    static const SplitDelimiters delimiters("&;,");
+    return delimiters;
+}
 
 /**
  * @brief Splits a string on each occurrence of a delimiter and returns a vector
  *        of strings.
  *
- * @details The delimiters are specified by the regular expression "[&;,]".
- *          The function removes any leading or trailing whitespace from the
- *          resulting strings.
+ * @details The delimiters are the characters "&;,". The function removes any
+ *          leading or trailing whitespace from the resulting strings, and
+ *          drops the ones that end up empty. See splitStringView() for a
+ *          version that does not allocate.
  *
  * @param[in] s The string to split.
  *
  * @return A vector of strings.
  */
 std::vector<std::string> splitString(const std::string& s) {
+    ScopedTimer timer(MetricStage::SplitString);
+    std::vector<std::string_view> parts;
     std::vector<std::string> result;
-    std::regex re("[&;,]");
-    std::sregex_token_iterator it(s.begin(), s.end(), re, -1);
-    std::sregex_token_iterator end;
-    for (; it != end; ++it) {
-        std::string str = *it;
-        str.erase(0, str.find_first_not_of(" \t\r\n")); // remove leading whitespaces
-        str.erase(str.find_last_not_of(" \t\r\n") + 1); // remove trailing whitespaces
-        if (str != "")
-            result.push_back(str);
-    }
+    splitStringView(s, parts, getDefaultSplitDelimiters());
+    result.reserve(parts.size());
+    for (auto &part : parts)
+        result.emplace_back(part);
     return result;
 }
 
 /**
- * @brief Finds all files in the given directory and all its subdirectories.
+ * @brief Splits a string on each occurrence of a delimiter, without copying it.
  *
- * @details This function returns a vector of strings, each containing the path
- *          to a file found in the given root directory or its subdirectories.
+ * @details The parts are appended to the given vector as views into s, with
+ *          leading and trailing whitespace (" \t\r\n") trimmed off and empty
+ *          parts dropped, exactly like splitString(). The views are only valid
+ *          as long as s is.
  *
- * @param[in] root The root directory to search in.
+ *          Delimiters are found with a 256-entry lookup table. Where SSE2 is
+ *          available, runs of 16 bytes that contain no delimiter are skipped
+ *          with a few vector compares.
  *
- * @return A vector of strings containing file paths.
+ * @param[in] s The string to split.
+ * @param[out] parts The vector to append the parts to.
+ * @param[in] delimiters The delimiter set, for example getDefaultSplitDelimiters().
+ *
+ * @return The number of parts appended.
  */
-std::vector<std::string> getFiles(std::string root) {
-    std::vector<std::string> files;
-    std::filesystem::path curr_path(root);
-    std::stack<std::filesystem::path> directories;
-    if (std::filesystem::exists(curr_path) && std::filesystem::is_directory(curr_path))
-        directories.push(curr_path);
-    while (!directories.empty()) {
-        curr_path = directories.top();
-        directories.pop();
-        if (std::filesystem::exists(curr_path)) {
-            if (std::filesystem::is_directory(curr_path)) {
-                for (const auto& entry : std::filesystem::directory_iterator(curr_path))
-                    directories.push(entry.path());
-            } else if (std::filesystem::is_regular_file(curr_path))
-                files.push_back(curr_path.string());
+size_t splitStringView(std::string_view s, std::vector<std::string_view> &parts, const SplitDelimiters &delimiters) {
+    const char *data = s.data();
+    size_t size = s.size(), start = 0, end, i = 0, found = 0;
+
+    while (start <= size) {
+        end = findDelimiter(data, size, i, delimiters);
+        size_t first = start, last = end;
+        while (first < last && isSplitWhitespace(data[first]))
+            first++;
+        while (last > first && isSplitWhitespace(data[last - 1]))
+            last--;
+        if (last > first) {
+            parts.emplace_back(data + first, last - first);
+            found++;
         }
+        start = i = end + 1;
     }
-    return files;
+    return found;
 }
 
 /**
- * @brief Logs a formatted message with a timestamp to a specified log file.
+ * @brief Converts a name into the form used as a key in search indexes.
+ *
+ * @details ASCII letters are lowercased, so that searches ignore case. All
+ *          other bytes, including multi-byte UTF-8 sequences, are kept as is.
  *
- * @details This function appends a timestamped message to the log file 
- *          located at LOG_LOCATION. The message is formatted similarly to 
- *          printf, using variadic arguments to specify the format and the 
- *          values to include in the log entry. LOG_LOCATION is a macro defined
- *          in cxx_functions.hpp.
+ * @param[in] s The name to convert.
  *
- * @param[in] fmt The format string, followed by any additional arguments 
- *                required by the format specifiers.
+ * @return The search key for the name.
  */
-void log(const char *fmt, ...) {
-    va_list args;
-    FILE *fptr;
-    char time_string[64];
-    time_t now;
-    time(&now);
-    fptr = fopen(LOG_LOCATION, "a+");
-    strftime(time_string, sizeof(time_string), "%Y-%m-%d %H:%M:%S", localtime(&now));
-    fprintf(fptr, "[%s] ", time_string);
-    va_start(args, fmt);
-    vfprintf(fptr, fmt, args);
-    va_end(args);
-    fclose(fptr);
+std::string toSearchKey(const std::string &s) {
+    std::string key(s);
+    for (auto &c : key)
+        if (c >= 'A' && c <= 'Z')
+            c = (char)(c - 'A' + 'a');
+    return key;
+}
+
+/**
+ * @brief Reads the size, modification time and identity of a file.
+ *
+ * @details These are the values an incremental rescan compares to decide
+ *          whether a file has changed since it was last parsed. The inode and
+ *          device numbers are 0 on platforms that do not provide them.
+ *
+ * @param[in] path The path to the file.
+ * @param[out] file_stat Receives the file's size, mtime, inode and device.
+ *
+ * @return 0 on success, -1 if the file cannot be stat'ed.
+ */
+int getFileStat(const std::string &path, FileStat &file_stat) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+        return -1;
+    fillFileStat(st, file_stat);
+    return 0;
+}
+
+/**
+ * @brief Copies the fields getFileStat() reads out of a stat structure.
+ *
+ * @details Lets callers that already have a stat structure, such as the
+ *          directory walker, skip a second stat of the same file.
+ *
+ * @param[in] st The stat structure.
+ * @param[out] file_stat Receives the file's size, mtime, inode and device.
+ */
+void fillFileStat(const struct stat &st, FileStat &file_stat) {
+    file_stat.size = (long long)st.st_size;
+#ifdef __linux__
+    file_stat.mtime = (long long)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+#else
+    file_stat.mtime = (long long)st.st_mtime * 1000000000LL;
+#endif
+    file_stat.inode = (unsigned long long)st.st_ino;
+    file_stat.device = (unsigned long long)st.st_dev;
+}
+
+/**
+ * @brief Checks whether a path lies inside a directory.
+ *
+ * @details The check is lexical: path must start with directory, followed by
+ *          a path separator. Both paths are expected to be spelled the same
+ *          way, as they are when one was found by walking the other.
+ *
+ * @param[in] path The path to check.
+ * @param[in] directory The directory to check against.
+ *
+ * @return true if path is inside directory (at any depth), false otherwise.
+ */
+bool isPathUnder(const std::string &path, const std::string &directory) {
+    auto isSeparator = [](char c) {
+#ifdef _WIN32
+        return c == '/' || c == '\\';
+#else
+        return c == '/';
+#endif
+    };
+
+    if (directory.empty() || path.size() <= directory.size() || path.compare(0, directory.size(), directory) != 0)
+        return false;
+    return isSeparator(directory.back()) || isSeparator(path[directory.size()]);
 }
\ No newline at end of file
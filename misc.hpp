@@ -2,9 +2,57 @@
 
 #include <vector>
 #include <string>
+#include <string_view>
+#include <functional>
 
 #define LOG_LOCATION "./log.txt"
 
+struct stat;
+
+enum class LogLevel { Debug, Info, Warning, Error };
+
+struct FileStat {
+    long long size = 0;
+    long long mtime = 0;                // nanoseconds since the epoch, where available
+    unsigned long long inode = 0;
+    unsigned long long device = 0;
+
+    bool operator==(const FileStat &other) const {
+        return size == other.size && mtime == other.mtime && inode == other.inode && device == other.device;
+    }
+    bool operator!=(const FileStat &other) const { return !(*this == other); }
+};
+
+/**
+ * A set of delimiter characters for splitStringView().
+ *
+ * Membership is answered by a 256-entry table. Up to 8 distinct characters are
+ * also kept in a list, which the vectorised scan compares against.
+ */
+class SplitDelimiters {
+    public:
+        explicit SplitDelimiters(const char *chars);
+
+        bool contains(unsigned char c) const { return table[c]; }
+        size_t getVectorCount() const { return count; }
+        char getVectorChar(size_t i) const { return list[i]; }
+
+    private:
+        bool table[256];
+        char list[8];
+        size_t count;       // 0 if the set is too large to scan as vectors
+};
+
 std::vector<std::string> splitString(const std::string& s);
-std::vector<std::string> getFiles(std::string root);
-void log(const char *fmt, ...);
\ No newline at end of file
+const SplitDelimiters &getDefaultSplitDelimiters();
+size_t splitStringView(std::string_view s, std::vector<std::string_view> &parts, const SplitDelimiters &delimiters = getDefaultSplitDelimiters());
+std::string toSearchKey(const std::string &s);
+int getFileStat(const std::string &path, FileStat &file_stat);
+void fillFileStat(const struct stat &st, FileStat &file_stat);
+bool isPathUnder(const std::string &path, const std::string &directory);
+void log(const char *fmt, ...);
+void logAt(LogLevel level, const char *fmt, ...);
+void setLogLevel(LogLevel level);
+void setLogPath(const char *path);
+void flushLog();
+void shutdownLog();
\ No newline at end of file
@@ -7,5 +7,6 @@ int main(int argc, char **argv) {
     }
     Metadata metadata = getMetadata(argv[1]);
     std::cout << metadata << std::endl;
+    shutdownLog();
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,923 @@
+#include "smart_playlists.hpp"
+#include "metrics.hpp"
+#include "misc.hpp"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+namespace {
+
+enum class FieldType { Text, Number, Linked };
+
+/**
+ * A field rules can test and sort by. A song can have several values of a
+ * linked field, one per row linked to it; a test of column is placed at the
+ * end of exists to match songs where any of them passes.
+ */
+struct RuleField {
+    const char *name;
+    FieldType type;
+    const char *column;
+    const char *exists;         // for linked fields, an EXISTS subquery missing its last test and ")"
+    const char *sort;
+};
+
+const RuleField RULE_FIELDS[] = {
+    { "title", FieldType::Text, "IFNULL(Songs.title, '')", nullptr, "Songs.title COLLATE NOCASE" },
+    { "path", FieldType::Text, "IFNULL(Songs.location, '')", nullptr, "Songs.location" },
+    { "album", FieldType::Linked, "Albums.title", "EXISTS (SELECT 1 FROM Albums WHERE Albums.id = Songs.album_id AND ",
+      "(SELECT Albums.title FROM Albums WHERE Albums.id = Songs.album_id) COLLATE NOCASE" },
+    { "artist", FieldType::Linked, "Artists.name",
+      "EXISTS (SELECT 1 FROM ContributingArtists JOIN Artists ON Artists.id = ContributingArtists.artist_id "
+      "WHERE ContributingArtists.song_id = Songs.id AND ",
+      "(SELECT MIN(Artists.name COLLATE NOCASE) FROM ContributingArtists JOIN Artists ON Artists.id = ContributingArtists.artist_id "
+      "WHERE ContributingArtists.song_id = Songs.id) COLLATE NOCASE" },
+    { "genre", FieldType::Linked, "Genres.name",
+      "EXISTS (SELECT 1 FROM SongGenreMap JOIN Genres ON Genres.id = SongGenreMap.genre_id "
+      "WHERE SongGenreMap.song_id = Songs.id AND ",
+      "(SELECT MIN(Genres.name COLLATE NOCASE) FROM SongGenreMap JOIN Genres ON Genres.id = SongGenreMap.genre_id "
+      "WHERE SongGenreMap.song_id = Songs.id) COLLATE NOCASE" },
+    { "rating", FieldType::Number, "Songs.rating", nullptr, "Songs.rating" },
+    { "track", FieldType::Number, "Songs.track_number", nullptr, "Songs.track_number" },
+    { "disc", FieldType::Number, "Songs.disc_number", nullptr, "Songs.disc_number" },
+    { "size", FieldType::Number, "Songs.file_size", nullptr, "Songs.file_size" },
+    { "modified", FieldType::Number, "Songs.mtime", nullptr, "Songs.mtime" },
+    { "plays", FieldType::Number, "Songs.play_count", nullptr, "Songs.play_count" }
+};
+
+// Symbols, longest first so "<=" is not read as "<" and "=".
+const char *const RULE_SYMBOLS[] = { "<=", ">=", "!=", "!~", "..", "=", "<", ">", "~", "(", ")", "," };
+
+// Characters that end a bare word.
+const char *const WORD_DELIMITERS = " \t\r\n\"()=!<>~,";
+
+const char *CHANGED_SONGS = "(SELECT song_id FROM temp.ChangedSongs)";
+
+struct RuleToken {
+    enum Type { End, Word, String, Symbol } type;
+    std::string text;
+};
+
+bool equalsIgnoreCase(const std::string &a, const char *b) {
+    size_t i = 0;
+    for (; i < a.size() && b[i] != '\0'; i++)
+        if ((a[i] >= 'A' && a[i] <= 'Z' ? a[i] + 32 : a[i]) != b[i])
+            return false;
+    return i == a.size() && b[i] == '\0';
+}
+
+bool toInteger(const std::string &text, int64_t &value) {
+    char *end;
+
+    if (text.empty())
+        return false;
+    errno = 0;
+    value = strtoll(text.c_str(), &end, 10);
+    return *end == '\0' && errno == 0;
+}
+
+/**
+ * Escapes the wildcards of LIKE, with \ as the escape character.
+ */
+std::string escapeLike(const std::string &text) {
+    std::string escaped;
+    for (char c : text) {
+        if (c == '%' || c == '_' || c == '\\')
+            escaped += '\\';
+        escaped += c;
+    }
+    return escaped;
+}
+
+/**
+ * Splits a rule into words, quoted strings and symbols.
+ */
+bool lexRule(const std::string &rule, std::vector<RuleToken> &tokens, std::string &error) {
+    size_t i = 0;
+
+    while (true) {
+        while (i < rule.size() && strchr(" \t\r\n", rule[i]) != nullptr && rule[i] != '\0')
+            i++;
+        if (i == rule.size())
+            break;
+        RuleToken token;
+        if (rule[i] == '"') {
+            // A doubled quote stands for one quote.
+            token.type = RuleToken::String;
+            for (i++;; i++) {
+                if (i == rule.size()) {
+                    error = "unterminated string";
+                    return false;
+                }
+                if (rule[i] == '"' && (i + 1 == rule.size() || rule[i + 1] != '"'))
+                    break;
+                if (rule[i] == '"')
+                    i++;
+                token.text += rule[i];
+            }
+            i++;
+        } else {
+            for (const char *symbol : RULE_SYMBOLS)
+                if (rule.compare(i, strlen(symbol), symbol) == 0) {
+                    token.type = RuleToken::Symbol;
+                    token.text = symbol;
+                    break;
+                }
+            if (token.text.empty()) {
+                size_t start = i;
+                while (i < rule.size() && (strchr(WORD_DELIMITERS, rule[i]) == nullptr || rule[i] == '\0') &&
+                       rule.compare(i, 2, "..") != 0)
+                    i++;
+                if (i == start) {
+                    error = std::string("unexpected \"") + rule[i] + "\"";
+                    return false;
+                }
+                token.type = RuleToken::Word;
+                token.text = rule.substr(start, i - start);
+            } else
+                i += token.text.size();
+        }
+        tokens.push_back(std::move(token));
+    }
+    tokens.push_back({ RuleToken::End, std::string() });
+    return true;
+}
+
+/**
+ * A recursive descent parser for the grammar described at compileRule().
+ * Each condition is compiled to SQL as it is parsed.
+ */
+class RuleParser {
+    public:
+        RuleParser(const std::vector<RuleToken> &tokens, CompiledRule &compiled) : tokens(tokens), position(0), compiled(compiled) {}
+
+        bool parse();
+        const std::string &getError() const { return error; }
+
+    private:
+        bool parseAny(std::string &sql);
+        bool parseAll(std::string &sql);
+        bool parseFactor(std::string &sql);
+        bool parseCondition(std::string &sql);
+        bool parseOrder();
+        bool parseInteger(int64_t &value);
+        const RuleField *parseField(const char *context);
+        std::string addValue(const RuleValue &value);
+        std::string addInteger(int64_t integer);
+        std::string addText(const std::string &text);
+
+        const RuleToken &peek() const { return tokens[position]; }
+        void next() { position++; }
+        bool isKeyword(const char *keyword) const { return peek().type == RuleToken::Word && equalsIgnoreCase(peek().text, keyword); }
+        bool isSymbol(const char *symbol) const { return peek().type == RuleToken::Symbol && peek().text == symbol; }
+        bool fail(const std::string &message) {
+            error = message;
+            return false;
+        }
+        std::string describe() const { return peek().type == RuleToken::End ? "the end of the rule" : "\"" + peek().text + "\""; }
+
+        const std::vector<RuleToken> &tokens;
+        size_t position;
+        CompiledRule &compiled;
+        std::string error;
+};
+
+bool RuleParser::parse() {
+    std::string condition = "1";
+
+    if (peek().type != RuleToken::End && !isKeyword("order") && !isKeyword("limit") && !parseAny(condition))
+        return false;
+    if (isKeyword("order")) {
+        next();
+        if (!isKeyword("by"))
+            return fail("expected \"by\" after \"order\"");
+        next();
+        if (!parseOrder())
+            return false;
+    }
+    if (isKeyword("limit")) {
+        next();
+        if (!parseInteger(compiled.limit) || compiled.limit < 0)
+            return fail("expected a number of songs after \"limit\"");
+        compiled.has_limit = true;
+    }
+    if (peek().type != RuleToken::End)
+        return fail("unexpected " + describe());
+    compiled.condition = condition;
+    return true;
+}
+
+bool RuleParser::parseAny(std::string &sql) {
+    std::string term;
+
+    if (!parseAll(sql))
+        return false;
+    while (isKeyword("or")) {
+        next();
+        if (!parseAll(term))
+            return false;
+        sql += " OR " + term;
+    }
+    return true;
+}
+
+bool RuleParser::parseAll(std::string &sql) {
+    std::string factor;
+
+    if (!parseFactor(sql))
+        return false;
+    while (isKeyword("and")) {
+        next();
+        if (!parseFactor(factor))
+            return false;
+        sql += " AND " + factor;
+    }
+    return true;
+}
+
+bool RuleParser::parseFactor(std::string &sql) {
+    std::string inner;
+
+    if (isKeyword("not")) {
+        next();
+        if (!parseFactor(inner))
+            return false;
+        sql = "NOT " + inner;
+        return true;
+    }
+    if (isSymbol("(")) {
+        next();
+        if (!parseAny(inner))
+            return false;
+        if (!isSymbol(")"))
+            return fail("expected \")\" instead of " + describe());
+        next();
+        sql = "(" + inner + ")";
+        return true;
+    }
+    return parseCondition(sql);
+}
+
+/**
+ * Parses one test of a field, compiling it to SQL in parentheses.
+ */
+bool RuleParser::parseCondition(std::string &sql) {
+    const RuleField *field = parseField("a condition");
+    int64_t low, high;
+
+    if (field == nullptr)
+        return false;
+    if (isKeyword("in")) {
+        next();
+        if (field->type != FieldType::Number)
+            return fail(std::string("\"in\" needs a numeric field, and ") + field->name + " is not one");
+        if (!parseInteger(low) || !isSymbol(".."))
+            return fail("expected a range such as 1..5 after \"in\"");
+        next();
+        if (!parseInteger(high))
+            return fail("expected a range such as 1..5 after \"in\"");
+        std::string first = addInteger(low);
+        sql = std::string("(") + field->column + " BETWEEN " + first + " AND " + addInteger(high) + ")";
+        return true;
+    }
+
+    if (peek().type != RuleToken::Symbol || isSymbol("..") || isSymbol("(") || isSymbol(")") || isSymbol(","))
+        return fail(std::string("expected a comparison after ") + field->name + " instead of " + describe());
+    std::string op = peek().text;
+    next();
+    if (peek().type != RuleToken::Word && peek().type != RuleToken::String)
+        return fail("expected a value after \"" + op + "\" instead of " + describe());
+    const RuleToken &value = peek();
+    next();
+
+    if (field->type == FieldType::Number) {
+        int64_t number;
+        if (op == "~" || op == "!~")
+            return fail(std::string("\"") + op + "\" needs a text field, and " + field->name + " is not one");
+        if (value.type != RuleToken::Word || !toInteger(value.text, number))
+            return fail(std::string(field->name) + " is compared with numbers, not \"" + value.text + "\"");
+        sql = std::string("(") + field->column + " " + (op == "!=" ? "<>" : op) + " " + addInteger(number) + ")";
+        return true;
+    }
+    if (op != "=" && op != "!=" && op != "~" && op != "!~")
+        return fail(std::string(field->name) + " is compared with =, !=, ~ and !~, not \"" + op + "\"");
+    std::string test = field->column;
+    if (op == "=" || op == "!=")
+        test += " = " + addText(value.text) + " COLLATE NOCASE";
+    else
+        test += " LIKE " + addText("%" + escapeLike(value.text) + "%") + " ESCAPE '\\'";
+    if (field->exists != nullptr)
+        test = field->exists + test + ")";
+    sql = (op[0] == '!' ? "(NOT " : "(") + test + ")";
+    return true;
+}
+
+bool RuleParser::parseOrder() {
+    if (isKeyword("random")) {
+        next();
+        compiled.random = true;
+        return true;
+    }
+    while (true) {
+        const RuleField *field = parseField("\"order by\"");
+        if (field == nullptr)
+            return false;
+        if (!compiled.order.empty())
+            compiled.order += ", ";
+        compiled.order += field->sort;
+        if (isKeyword("desc")) {
+            next();
+            compiled.order += " DESC";
+        } else if (isKeyword("asc"))
+            next();
+        if (!isSymbol(","))
+            return true;
+        next();
+    }
+}
+
+bool RuleParser::parseInteger(int64_t &value) {
+    if (peek().type != RuleToken::Word || !toInteger(peek().text, value))
+        return false;
+    next();
+    return true;
+}
+
+const RuleField *RuleParser::parseField(const char *context) {
+    if (peek().type == RuleToken::Word)
+        for (auto &field : RULE_FIELDS)
+            if (equalsIgnoreCase(peek().text, field.name)) {
+                next();
+                return &field;
+            }
+    fail(std::string("expected a field for ") + context + " instead of " + describe());
+    return nullptr;
+}
+
+/**
+ * Adds a value to the rule and returns the parameter it is bound to.
+ */
+std::string RuleParser::addValue(const RuleValue &value) {
+    compiled.values.push_back(value);
+    return "?" + std::to_string(compiled.values.size() + 2);
+}
+
+std::string RuleParser::addInteger(int64_t integer) {
+    RuleValue value;
+    value.integer = integer;
+    return addValue(value);
+}
+
+std::string RuleParser::addText(const std::string &text) {
+    RuleValue value;
+    value.is_text = true;
+    value.text = text;
+    return addValue(value);
+}
+
+/**
+ * Returns the ORDER BY terms a rule sorts songs by.
+ */
+std::string getOrder(const CompiledRule &rule) {
+    if (rule.random)
+        return "random()";
+    return rule.order.empty() ? "Songs.id" : rule.order + ", Songs.id";
+}
+
+}
+
+/**
+ * @brief Compiles a smart playlist rule to SQL.
+ *
+ * @details A rule is a condition, optionally followed by "order by" and
+ *          "limit" clauses. Keywords and field names are not case sensitive.
+ *
+ *              rule      := [ condition ] [ "order by" ordering ] [ "limit" N ]
+ *              condition := term { "or" term }
+ *              term      := factor { "and" factor }
+ *              factor    := "not" factor | "(" condition ")" | field op value
+ *                         | field "in" N ".." N
+ *              ordering  := "random" | key { "," key }
+ *              key       := field [ "asc" | "desc" ]
+ *
+ *          Text fields are title, path, album, artist and genre. They take
+ *          = and != (ignoring case) and ~ and !~ (contains). A song matches a
+ *          test of artist or genre if any of its artists or genres does.
+ *          Numeric fields are rating, track, disc, size, modified (mtime)
+ *          and plays, and take =, !=, <, <=, >, >= and "in", an inclusive
+ *          range. Values are words, numbers, or strings in double quotes, in
+ *          which a doubled quote stands for one. A rule without a condition
+ *          matches every song. An example: genre = Rock and rating >= 4 and
+ *          track in 1..5 order by random limit 100.
+ *
+ * @param[in] rule The text of the rule.
+ * @param[out] compiled Receives the compiled rule.
+ *
+ * @return 0 on success, -1 if the rule is not valid. The reason is logged.
+ */
+int compileRule(const std::string &rule, CompiledRule &compiled) {
+    std::vector<RuleToken> tokens;
+    std::string error;
+
+    compiled = CompiledRule();
+    if (lexRule(rule, tokens, error)) {
+        RuleParser parser(tokens, compiled);
+        if (parser.parse())
+            return 0;
+        error = parser.getError();
+    }
+    logAt(LogLevel::Warning, "Invalid smart playlist rule \"%s\": %s\n", rule.c_str(), error.c_str());
+    return -1;
+}
+
+/**
+ * Constructs the playlists of a database and prepares their fixed statements.
+ *
+ * \param db The database connection to use. The object does not take
+ *           ownership of it.
+ *
+ * If the database has no SmartPlaylists table, or a statement fails to
+ * prepare, isValid() returns \c false. Only the latter is logged.
+ */
+SmartPlaylists::SmartPlaylists(sqlite3 *db) {
+    sqlite3_stmt *stmt;
+    char *error_message;
+
+    this->db = db;
+    valid = false;
+    select_playlists = select_playlist = insert_playlist = insert_rule = update_rule = set_member_count = count_members = nullptr;
+    clear_songs = delete_rule = delete_playlist = insert_changed = clear_changed = nullptr;
+
+    if (sqlite3_prepare_v2(db, "SELECT playlist_id FROM SmartPlaylists LIMIT 0;", -1, &stmt, NULL) != SQLITE_OK)
+        return;
+    sqlite3_finalize(stmt);
+    // The songs songsChanged() is given, so rule statements can join against them.
+    if (sqlite3_exec(db, "CREATE TEMP TABLE IF NOT EXISTS ChangedSongs ( song_id INTEGER PRIMARY KEY );", NULL, NULL,
+                     &error_message) != SQLITE_OK) {
+        logAt(LogLevel::Error, "Error while creating the changed songs table: %s\n", error_message);
+        sqlite3_free(error_message);
+        return;
+    }
+    valid = true;
+    prepare("SELECT playlist_id, rule, member_count FROM SmartPlaylists ORDER BY playlist_id;", &select_playlists);
+    prepare("SELECT playlist_id, rule, member_count FROM SmartPlaylists WHERE playlist_id = ?1;", &select_playlist);
+    prepare("INSERT INTO Playlists (title) VALUES (?1);", &insert_playlist);
+    prepare("INSERT INTO SmartPlaylists (playlist_id, rule) VALUES (?1, ?2);", &insert_rule);
+    prepare("UPDATE SmartPlaylists SET rule = ?2 WHERE playlist_id = ?1;", &update_rule);
+    prepare("UPDATE SmartPlaylists SET member_count = ?2 WHERE playlist_id = ?1;", &set_member_count);
+    prepare("UPDATE SmartPlaylists SET member_count = (SELECT COUNT(*) FROM PlaylistSongs WHERE playlist_id = ?1) WHERE playlist_id = ?1;",
+            &count_members);
+    prepare("DELETE FROM PlaylistSongs WHERE playlist_id = ?1;", &clear_songs);
+    prepare("DELETE FROM SmartPlaylists WHERE playlist_id = ?1;", &delete_rule);
+    prepare("DELETE FROM Playlists WHERE id = ?1;", &delete_playlist);
+    prepare("INSERT OR IGNORE INTO temp.ChangedSongs (song_id) VALUES (?1);", &insert_changed);
+    prepare("DELETE FROM temp.ChangedSongs;", &clear_changed);
+}
+
+/**
+ * Finalizes all statements.
+ */
+SmartPlaylists::~SmartPlaylists() {
+    for (auto &statement : statements)
+        sqlite3_finalize(statement.second);
+    sqlite3_finalize(select_playlists);
+    sqlite3_finalize(select_playlist);
+    sqlite3_finalize(insert_playlist);
+    sqlite3_finalize(insert_rule);
+    sqlite3_finalize(update_rule);
+    sqlite3_finalize(set_member_count);
+    sqlite3_finalize(count_members);
+    sqlite3_finalize(clear_songs);
+    sqlite3_finalize(delete_rule);
+    sqlite3_finalize(delete_playlist);
+    sqlite3_finalize(insert_changed);
+    sqlite3_finalize(clear_changed);
+}
+
+/**
+ * Checks if the database has smart playlists and all statements were prepared.
+ *
+ * \return \c true if the playlists can be used and \c false otherwise.
+ */
+bool SmartPlaylists::isValid() const {
+    return valid;
+}
+
+/**
+ * Creates a smart playlist and fills it with the songs matching its rule.
+ *
+ * \param title The title of the playlist.
+ * \param rule The rule, as described at compileRule().
+ * \return The ID of the new playlist, or \c -1 if the rule is not valid or an
+ *         error occurs.
+ */
+int SmartPlaylists::createPlaylist(const std::string &title, const std::string &rule) {
+    const CompiledRule *compiled;
+    int playlist_id = -1, rc;
+
+    if (!valid || (compiled = getRule(rule)) == nullptr)
+        return -1;
+    ScopedTimer timer(MetricStage::RefreshPlaylists);
+    if (begin("create_smart_playlist") != 0)
+        return -1;
+    sqlite3_bind_text(insert_playlist, 1, title.c_str(), (int)title.size(), SQLITE_TRANSIENT);
+    rc = step(insert_playlist);
+    if (rc == 0) {
+        playlist_id = (int)sqlite3_last_insert_rowid(db);
+        sqlite3_bind_int(insert_rule, 1, playlist_id);
+        sqlite3_bind_text(insert_rule, 2, rule.c_str(), (int)rule.size(), SQLITE_TRANSIENT);
+        rc = step(insert_rule);
+    }
+    if (rc == 0)
+        rc = evaluate(playlist_id, *compiled);
+    return end("create_smart_playlist", rc) == 0 ? playlist_id : -1;
+}
+
+/**
+ * Replaces the rule of a smart playlist and fills it anew.
+ *
+ * \param playlist_id The ID of the playlist.
+ * \param rule The new rule, as described at compileRule().
+ * \return \c 0 on success, or \c -1 if the rule is not valid, the playlist is
+ *         not a smart playlist or an error occurs.
+ */
+int SmartPlaylists::setRule(int playlist_id, const std::string &rule) {
+    const CompiledRule *compiled;
+    int rc;
+
+    if (!valid || (compiled = getRule(rule)) == nullptr)
+        return -1;
+    ScopedTimer timer(MetricStage::RefreshPlaylists);
+    if (begin("set_smart_playlist_rule") != 0)
+        return -1;
+    sqlite3_bind_int(update_rule, 1, playlist_id);
+    sqlite3_bind_text(update_rule, 2, rule.c_str(), (int)rule.size(), SQLITE_TRANSIENT);
+    rc = step(update_rule);
+    if (rc == 0 && sqlite3_changes(db) == 0) {
+        logAt(LogLevel::Error, "Playlist %d is not a smart playlist\n", playlist_id);
+        rc = -1;
+    }
+    if (rc == 0)
+        rc = evaluate(playlist_id, *compiled);
+    return end("set_smart_playlist_rule", rc);
+}
+
+/**
+ * Deletes a smart playlist along with its songs.
+ *
+ * \param playlist_id The ID of the playlist.
+ * \return \c 0 on success, or \c -1 if the playlist is not a smart playlist
+ *         or an error occurs.
+ */
+int SmartPlaylists::deletePlaylist(int playlist_id) {
+    int rc;
+
+    if (!valid || begin("delete_smart_playlist") != 0)
+        return -1;
+    sqlite3_bind_int(delete_rule, 1, playlist_id);
+    rc = step(delete_rule);
+    if (rc == 0 && sqlite3_changes(db) == 0) {
+        logAt(LogLevel::Error, "Playlist %d is not a smart playlist\n", playlist_id);
+        rc = -1;
+    }
+    for (sqlite3_stmt *stmt : { clear_songs, delete_playlist }) {
+        if (rc != 0)
+            break;
+        sqlite3_bind_int(stmt, 1, playlist_id);
+        rc = step(stmt);
+    }
+    return end("delete_smart_playlist", rc);
+}
+
+/**
+ * Evaluates the rule of a smart playlist over the whole library.
+ *
+ * \param playlist_id The ID of the playlist.
+ * \return \c 0 on success, or \c -1 if the playlist is not a smart playlist
+ *         or an error occurs.
+ */
+int SmartPlaylists::refresh(int playlist_id) {
+    std::vector<SmartPlaylist> playlists;
+    const CompiledRule *rule;
+    int rc;
+
+    if (!valid || loadPlaylists(playlists, playlist_id) != 0)
+        return -1;
+    if (playlists.empty()) {
+        logAt(LogLevel::Error, "Playlist %d is not a smart playlist\n", playlist_id);
+        return -1;
+    }
+    if ((rule = getRule(playlists[0].rule)) == nullptr)
+        return -1;
+    ScopedTimer timer(MetricStage::RefreshPlaylists);
+    if (begin("refresh_smart_playlist") != 0)
+        return -1;
+    rc = evaluate(playlist_id, *rule);
+    return end("refresh_smart_playlist", rc);
+}
+
+/**
+ * Evaluates the rules of every smart playlist over the whole library, in one
+ * transaction. Playlists whose rules are not valid are skipped.
+ *
+ * \return \c 0 on success and \c -1 on failure.
+ */
+int SmartPlaylists::refreshAll() {
+    std::vector<SmartPlaylist> playlists;
+    int rc = 0;
+
+    if (!valid || loadPlaylists(playlists, 0) != 0)
+        return -1;
+    ScopedTimer timer(MetricStage::RefreshPlaylists);
+    if (begin("refresh_smart_playlists") != 0)
+        return -1;
+    for (auto &playlist : playlists) {
+        const CompiledRule *rule = getRule(playlist.rule);
+        if (rule != nullptr && (rc = evaluate(playlist.playlist_id, *rule)) != 0)
+            break;
+    }
+    return end("refresh_smart_playlists", rc);
+}
+
+/**
+ * Brings every smart playlist up to date with songs that were written.
+ *
+ * \param song_ids The IDs of the songs that were inserted, updated, moved or
+ *                 deleted, such as those DatabaseWriter::takeChangedSongs()
+ *                 returns. Duplicates are allowed.
+ * \return \c 0 on success and \c -1 on failure.
+ *
+ * Only the given songs are tested against each rule: songs that match are
+ * added to the playlist, and songs that no longer do are removed. Playlists
+ * with a limit are evaluated in full, but only if one of the songs matches
+ * the rule or was in the playlist, or a song of the playlist was deleted. If
+ * more than FULL_REFRESH_SONGS songs changed, as after a first import, every
+ * playlist is evaluated in full instead. Everything is done in one
+ * transaction, and playlists whose rules are not valid are skipped.
+ */
+int SmartPlaylists::songsChanged(const std::vector<int> &song_ids) {
+    std::vector<SmartPlaylist> playlists;
+    bool full = song_ids.size() > (size_t)FULL_REFRESH_SONGS;
+    int rc = 0;
+
+    if (!valid)
+        return -1;
+    if (song_ids.empty())
+        return 0;
+    ScopedTimer timer(MetricStage::RefreshPlaylists);
+    if (loadPlaylists(playlists, 0) != 0)
+        return -1;
+    if (playlists.empty())
+        return 0;
+    if (begin("update_smart_playlists") != 0)
+        return -1;
+    for (size_t i = 0; !full && rc == 0 && i < song_ids.size(); i++) {
+        sqlite3_bind_int(insert_changed, 1, song_ids[i]);
+        rc = step(insert_changed);
+    }
+    for (auto &playlist : playlists) {
+        const CompiledRule *rule = getRule(playlist.rule);
+        if (rc != 0)
+            break;
+        if (rule != nullptr)
+            rc = full ? evaluate(playlist.playlist_id, *rule) : update(playlist, *rule);
+    }
+    if (!full && rc == 0)
+        rc = step(clear_changed);
+    return end("update_smart_playlists", rc);
+}
+
+/**
+ * Reads the songs of a smart playlist, in the order its rule gives.
+ *
+ * \param playlist_id The ID of the playlist.
+ * \param song_ids Receives the IDs of the songs. Songs of playlists ordered
+ *                 by random come in the order they were added in.
+ * \return \c 0 on success, or \c -1 if the playlist is not a smart playlist
+ *         or an error occurs.
+ */
+int SmartPlaylists::getSongs(int playlist_id, std::vector<int> &song_ids) {
+    std::vector<SmartPlaylist> playlists;
+    const CompiledRule *rule;
+    sqlite3_stmt *stmt;
+    int rc;
+
+    song_ids.clear();
+    if (!valid || loadPlaylists(playlists, playlist_id) != 0)
+        return -1;
+    if (playlists.empty()) {
+        logAt(LogLevel::Error, "Playlist %d is not a smart playlist\n", playlist_id);
+        return -1;
+    }
+    if ((rule = getRule(playlists[0].rule)) == nullptr)
+        return -1;
+    stmt = getStatement("SELECT PlaylistSongs.song_id FROM PlaylistSongs JOIN Songs ON Songs.id = PlaylistSongs.song_id "
+                        "WHERE PlaylistSongs.playlist_id = ?1 ORDER BY " +
+                            (rule->random ? std::string("PlaylistSongs.id") : getOrder(*rule) + ", PlaylistSongs.id") + ";",
+                        *rule, playlist_id, 0);
+    if (stmt == nullptr)
+        return -1;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+        song_ids.push_back(sqlite3_column_int(stmt, 0));
+    sqlite3_reset(stmt);
+    if (rc != SQLITE_DONE) {
+        logAt(LogLevel::Error, "Error while reading the songs of playlist %d: %s\n", playlist_id, sqlite3_errmsg(db));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Prepares a fixed statement, logging the error and invalidating the object on failure.
+ */
+int SmartPlaylists::prepare(const char *sql, sqlite3_stmt **stmt) {
+    if (sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, stmt, NULL) != SQLITE_OK) {
+        logAt(LogLevel::Error, "Error while preparing statement \"%s\": %s\n", sql, sqlite3_errmsg(db));
+        valid = false;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Returns the cached statement for some SQL built from a rule, preparing it
+ * on first use, with the playlist ID bound to ?1, second to ?2 and the rule's
+ * values from ?3 on. Returns null if the statement cannot be prepared.
+ */
+sqlite3_stmt *SmartPlaylists::getStatement(const std::string &sql, const CompiledRule &rule, int playlist_id, int64_t second) {
+    sqlite3_stmt *stmt;
+    auto cached = statements.find(sql);
+
+    if (cached != statements.end())
+        stmt = cached->second;
+    else {
+        if (statements.size() >= MAX_STATEMENTS) {
+            for (auto &statement : statements)
+                sqlite3_finalize(statement.second);
+            statements.clear();
+        }
+        if (sqlite3_prepare_v3(db, sql.c_str(), -1, SQLITE_PREPARE_PERSISTENT, &stmt, NULL) != SQLITE_OK) {
+            logAt(LogLevel::Error, "Error while preparing statement \"%s\": %s\n", sql.c_str(), sqlite3_errmsg(db));
+            return nullptr;
+        }
+        countMetric(MetricCounter::PlaylistStatementsPrepared);
+        statements.emplace(sql, stmt);
+    }
+    // Statements that do not use ?1 or ?2 reject them, which is harmless.
+    sqlite3_bind_int(stmt, 1, playlist_id);
+    sqlite3_bind_int64(stmt, 2, second);
+    for (size_t i = 0; i < rule.values.size(); i++) {
+        const RuleValue &value = rule.values[i];
+        if (value.is_text)
+            sqlite3_bind_text(stmt, (int)i + 3, value.text.c_str(), (int)value.text.size(), SQLITE_TRANSIENT);
+        else
+            sqlite3_bind_int64(stmt, (int)i + 3, value.integer);
+    }
+    return stmt;
+}
+
+/**
+ * Returns a rule compiled, compiling it on first use, or null if it is not valid.
+ */
+const CompiledRule *SmartPlaylists::getRule(const std::string &rule) {
+    auto compiled = rules.find(rule);
+
+    if (compiled == rules.end()) {
+        CompiledRule new_rule;
+        if (compileRule(rule, new_rule) != 0)
+            return nullptr;
+        compiled = rules.emplace(rule, std::move(new_rule)).first;
+    }
+    return &compiled->second;
+}
+
+/**
+ * Reads the smart playlist with the given ID, or all of them if it is 0.
+ */
+int SmartPlaylists::loadPlaylists(std::vector<SmartPlaylist> &playlists, int playlist_id) {
+    sqlite3_stmt *stmt = playlist_id > 0 ? select_playlist : select_playlists;
+    int rc;
+
+    if (playlist_id > 0)
+        sqlite3_bind_int(stmt, 1, playlist_id);
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        const char *rule = (const char *)sqlite3_column_text(stmt, 1);
+        playlists.push_back({ sqlite3_column_int(stmt, 0), rule != nullptr ? rule : "", sqlite3_column_int64(stmt, 2) });
+    }
+    sqlite3_reset(stmt);
+    if (rc != SQLITE_DONE) {
+        logAt(LogLevel::Error, "Error while reading smart playlists: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Replaces the songs of a playlist with every song matching its rule, and
+ * records how many there are.
+ */
+int SmartPlaylists::evaluate(int playlist_id, const CompiledRule &rule) {
+    sqlite3_stmt *stmt;
+
+    countMetric(MetricCounter::PlaylistsEvaluated);
+    sqlite3_bind_int(clear_songs, 1, playlist_id);
+    if (step(clear_songs) != 0)
+        return -1;
+    stmt = getStatement("INSERT INTO PlaylistSongs (playlist_id, song_id) SELECT ?1, Songs.id FROM Songs WHERE " + rule.condition +
+                            " ORDER BY " + getOrder(rule) + " LIMIT ?2;",
+                        rule, playlist_id, rule.limit);
+    if (stmt == nullptr || step(stmt) != 0)
+        return -1;
+    sqlite3_bind_int(set_member_count, 1, playlist_id);
+    sqlite3_bind_int64(set_member_count, 2, sqlite3_changes(db));
+    return step(set_member_count);
+}
+
+/**
+ * Brings a playlist up to date with the songs in temp.ChangedSongs. The
+ * member count of a playlist without a limit is counted again afterwards, as
+ * deleting a song also takes it out of its playlists.
+ */
+int SmartPlaylists::update(const SmartPlaylist &playlist, const CompiledRule &rule) {
+    std::string changed_matches = " FROM Songs WHERE Songs.id IN " + std::string(CHANGED_SONGS) + " AND (" + rule.condition + ")";
+    sqlite3_stmt *stmt;
+    int rc;
+
+    if (rule.has_limit) {
+        // Which songs make the cut depends on every match, so any change to a match or a member means starting over.
+        stmt = getStatement("SELECT EXISTS (SELECT 1" + changed_matches + ") OR EXISTS (SELECT 1 FROM PlaylistSongs WHERE playlist_id = ?1 "
+                            "AND song_id IN " + CHANGED_SONGS + ") OR (SELECT COUNT(*) FROM PlaylistSongs WHERE playlist_id = ?1) <> ?2;",
+                            rule, playlist.playlist_id, playlist.member_count);
+        if (stmt == nullptr)
+            return -1;
+        rc = sqlite3_step(stmt);
+        bool affected = rc == SQLITE_ROW && sqlite3_column_int(stmt, 0) != 0;
+        sqlite3_reset(stmt);
+        if (rc != SQLITE_ROW) {
+            logAt(LogLevel::Error, "Error while checking smart playlist %d: %s\n", playlist.playlist_id, sqlite3_errmsg(db));
+            return -1;
+        }
+        return affected ? evaluate(playlist.playlist_id, rule) : 0;
+    }
+
+    stmt = getStatement("DELETE FROM PlaylistSongs WHERE playlist_id = ?1 AND song_id IN " + std::string(CHANGED_SONGS) +
+                            " AND song_id NOT IN (SELECT Songs.id" + changed_matches + ");",
+                        rule, playlist.playlist_id, 0);
+    if (stmt == nullptr || step(stmt) != 0)
+        return -1;
+    stmt = getStatement("INSERT INTO PlaylistSongs (playlist_id, song_id) SELECT ?1, Songs.id" + changed_matches +
+                            " AND NOT EXISTS (SELECT 1 FROM PlaylistSongs WHERE playlist_id = ?1 AND song_id = Songs.id) ORDER BY " + getOrder(rule) + ";",
+                        rule, playlist.playlist_id, 0);
+    if (stmt == nullptr || step(stmt) != 0)
+        return -1;
+    sqlite3_bind_int(count_members, 1, playlist.playlist_id);
+    return step(count_members);
+}
+
+/**
+ * Runs a statement that returns no rows, and resets it.
+ */
+int SmartPlaylists::step(sqlite3_stmt *stmt) {
+    int rc = sqlite3_step(stmt);
+
+    sqlite3_reset(stmt);
+    if (rc != SQLITE_DONE) {
+        logAt(LogLevel::Error, "Error while updating smart playlists: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Opens a savepoint, so the work that follows is undone as a whole on failure,
+ * inside a transaction of the caller's or on its own.
+ */
+int SmartPlaylists::begin(const char *name) {
+    char *error_message;
+
+    if (sqlite3_exec(db, ("SAVEPOINT " + std::string(name) + ";").c_str(), NULL, NULL, &error_message) != SQLITE_OK) {
+        logAt(LogLevel::Error, "Error while starting a transaction: %s\n", error_message);
+        sqlite3_free(error_message);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Releases a savepoint opened by begin() if rc is 0, or rolls back to it.
+ * Returns rc, or -1 if the release fails.
+ */
+int SmartPlaylists::end(const char *name, int rc) {
+    std::string savepoint(name);
+    char *error_message;
+
+    if (rc == 0 && sqlite3_exec(db, ("RELEASE " + savepoint + ";").c_str(), NULL, NULL, &error_message) != SQLITE_OK) {
+        logAt(LogLevel::Error, "Error while committing smart playlists: %s\n", error_message);
+        sqlite3_free(error_message);
+        rc = -1;
+    }
+    if (rc != 0)
+        sqlite3_exec(db, ("ROLLBACK TO " + savepoint + "; RELEASE " + savepoint + ";").c_str(), NULL, NULL, NULL);
+    return rc;
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <sqlite3.h>
+
+/**
+ * A value of a smart playlist rule, bound to the rule's SQL as a parameter.
+ */
+struct RuleValue {
+    bool is_text = false;
+    int64_t integer = 0;
+    std::string text;
+};
+
+/**
+ * A smart playlist rule compiled by compileRule().
+ *
+ * The SQL fragments only depend on the shape of the rule: its fields,
+ * operators and ordering. The values it compares against are kept apart, as
+ * parameters ?3 and up, so rules of the same shape share prepared statements.
+ */
+struct CompiledRule {
+    std::string condition;          // over Songs, "1" if the rule matches every song
+    std::string order;              // ORDER BY terms; songs are sorted by Songs.id last
+    bool random = false;            // ordered by random() when materialized, and kept in that order
+    bool has_limit = false;
+    int64_t limit = -1;             // -1 when the rule has no limit
+    std::vector<RuleValue> values;
+};
+
+int compileRule(const std::string &rule, CompiledRule &compiled);
+
+/**
+ * Rule-based playlists, materialized into PlaylistSongs.
+ *
+ * A smart playlist is a row of Playlists with a rule in SmartPlaylists, such
+ * as "genre = Rock and rating >= 4 and track in 1..5 order by random limit
+ * 100" (see compileRule() for the syntax). The songs matching the rule are
+ * stored in PlaylistSongs, like the songs of any other playlist, and kept
+ * there as songs change: songsChanged() only looks at the songs it is given,
+ * so keeping the playlists current after an ingest costs in proportion to
+ * what the ingest changed, not to the size of the library. Playlists with a
+ * limit are evaluated again in full, but only when one of the changed songs
+ * matches the rule or was in the playlist.
+ *
+ * Statements are prepared once per rule shape and cached, so rules that only
+ * differ in the values they compare against share them. Databases created
+ * before smart playlists existed have no SmartPlaylists table until
+ * addSmartPlaylists() adds it; isValid() returns \c false for them.
+ */
+class SmartPlaylists {
+    public:
+        explicit SmartPlaylists(sqlite3 *db);
+        ~SmartPlaylists();
+
+        SmartPlaylists(const SmartPlaylists &) = delete;
+        SmartPlaylists &operator=(const SmartPlaylists &) = delete;
+
+        bool isValid() const;
+        int createPlaylist(const std::string &title, const std::string &rule);
+        int setRule(int playlist_id, const std::string &rule);
+        int deletePlaylist(int playlist_id);
+        int refresh(int playlist_id);
+        int refreshAll();
+        int songsChanged(const std::vector<int> &song_ids);
+        int getSongs(int playlist_id, std::vector<int> &song_ids);
+
+    private:
+        enum {
+            MAX_STATEMENTS = 64,            // cached rule statements; all are dropped when the cache fills up
+            FULL_REFRESH_SONGS = 4096       // changed songs past which evaluating every playlist anew is cheaper
+        };
+
+        struct SmartPlaylist {
+            int playlist_id;
+            std::string rule;
+            int64_t member_count;
+        };
+
+        int prepare(const char *sql, sqlite3_stmt **stmt);
+        sqlite3_stmt *getStatement(const std::string &sql, const CompiledRule &rule, int playlist_id, int64_t second);
+        const CompiledRule *getRule(const std::string &rule);
+        int loadPlaylists(std::vector<SmartPlaylist> &playlists, int playlist_id);
+        int evaluate(int playlist_id, const CompiledRule &rule);
+        int update(const SmartPlaylist &playlist, const CompiledRule &rule);
+        int step(sqlite3_stmt *stmt);
+        int begin(const char *name);
+        int end(const char *name, int rc);
+
+        sqlite3 *db;
+        bool valid;
+        std::unordered_map<std::string, sqlite3_stmt *> statements;    // rule statements by SQL
+        std::unordered_map<std::string, CompiledRule> rules;            // compiled rules by rule text
+
+        sqlite3_stmt *select_playlists;
+        sqlite3_stmt *select_playlist;
+        sqlite3_stmt *insert_playlist;
+        sqlite3_stmt *insert_rule;
+        sqlite3_stmt *update_rule;
+        sqlite3_stmt *set_member_count;
+        sqlite3_stmt *count_members;
+        sqlite3_stmt *clear_songs;
+        sqlite3_stmt *delete_rule;
+        sqlite3_stmt *delete_playlist;
+        sqlite3_stmt *insert_changed;
+        sqlite3_stmt *clear_changed;
+};
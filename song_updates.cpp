@@ -0,0 +1,371 @@
+#include "song_updates.hpp"
+#include "database_functions.hpp"
+#include "metrics.hpp"
+#include "smart_playlists.hpp"
+#include "misc.hpp"
+
+#include <vector>
+
+/**
+ * Constructs a queue, opens its connections to the database and starts the
+ * thread that writes updates out.
+ *
+ * \param db_path The path to the database file.
+ * \param options How long updates may wait in memory, and how many songs may
+ *                have updates waiting, before they are written.
+ *
+ * The database is given a play_count column and smart playlists if it lacks
+ * them, and switched to write-ahead logging. If it cannot be opened or
+ * upgraded, the error is logged and isValid() returns \c false.
+ */
+SongUpdateQueue::SongUpdateQueue(const std::string &db_path, const SongUpdateOptions &options)
+    : options(options), db(nullptr), read_db(nullptr), set_rating(nullptr), add_plays(nullptr), select_song(nullptr),
+      stopping(false) {
+    // The database must exist already: the queue only ever updates songs in it.
+    if (sqlite3_open_v2(db_path.c_str(), &db, SQLITE_OPEN_READWRITE, NULL) != SQLITE_OK) {
+        logAt(LogLevel::Error, "Can't open database %s: %s\n", db_path.c_str(), sqlite3_errmsg(db));
+        sqlite3_close(db);
+        db = nullptr;
+        return;
+    }
+    // An import may be writing at the same time.
+    sqlite3_busy_timeout(db, 5000);
+    // Not fatal: with a rollback journal, flushes only wait longer for readers and imports.
+    enableWriteAheadLog(db);
+    if (addPlayCountColumn(db) != 0 || addSmartPlaylists(db) != 0 ||
+        sqlite3_prepare_v3(db, "UPDATE Songs SET rating = ?2 WHERE id = ?1 AND rating IS NOT ?2;", -1, SQLITE_PREPARE_PERSISTENT,
+                           &set_rating, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v3(db, "UPDATE Songs SET play_count = play_count + ?2 WHERE id = ?1;", -1, SQLITE_PREPARE_PERSISTENT,
+                           &add_plays, NULL) != SQLITE_OK) {
+        logAt(LogLevel::Error, "Error while preparing song update statements: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(set_rating);
+        sqlite3_finalize(add_plays);
+        set_rating = add_plays = nullptr;
+        sqlite3_close(db);
+        db = nullptr;
+        return;
+    }
+    // Reads have a connection of their own, so they are never held up by a flush waiting for the write lock,
+    // and never see a flush before it commits.
+    if (sqlite3_open_v2(db_path.c_str(), &read_db, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, NULL) != SQLITE_OK ||
+        sqlite3_busy_timeout(read_db, 5000) != SQLITE_OK ||
+        sqlite3_prepare_v3(read_db, "SELECT rating, play_count FROM Songs WHERE id = ?1;", -1, SQLITE_PREPARE_PERSISTENT,
+                           &select_song, NULL) != SQLITE_OK) {
+        logAt(LogLevel::Error, "Error while preparing song read statement: %s\n", sqlite3_errmsg(read_db));
+        sqlite3_close(read_db);
+        read_db = nullptr;
+        sqlite3_finalize(set_rating);
+        sqlite3_finalize(add_plays);
+        set_rating = add_plays = nullptr;
+        sqlite3_close(db);
+        db = nullptr;
+        return;
+    }
+    smart_playlists.reset(new SmartPlaylists(db));
+    worker = std::thread(&SongUpdateQueue::work, this);
+}
+
+/**
+ * Writes the updates still queued, stops the writer thread and closes the
+ * database connections.
+ */
+SongUpdateQueue::~SongUpdateQueue() {
+    stop();
+    smart_playlists.reset();
+    sqlite3_finalize(set_rating);
+    sqlite3_finalize(add_plays);
+    sqlite3_finalize(select_song);
+    sqlite3_close(read_db);
+    sqlite3_close(db);
+}
+
+/**
+ * Checks if the queue was started successfully.
+ *
+ * \return \c true if the queue can be used and \c false otherwise.
+ */
+bool SongUpdateQueue::isValid() const {
+    return db != nullptr;
+}
+
+/**
+ * Queues a new rating for a song, replacing any rating queued for it before.
+ *
+ * \param song_id The ID of the song.
+ * \param rating The rating.
+ * \return \c 0 on success, or \c -1 if the queue is not valid.
+ *
+ * This never waits for the database. A song that does not exist is not
+ * reported; its update is dropped when it is written.
+ */
+int SongUpdateQueue::setRating(int song_id, int rating) {
+    if (!isValid())
+        return -1;
+    std::lock_guard<std::mutex> lock(mutex);
+    SongUpdate &update = pending[song_id];
+    update.has_rating = true;
+    update.rating = rating;
+    queued();
+    return 0;
+}
+
+/**
+ * Queues plays of a song, to be added to its play count.
+ *
+ * \param song_id The ID of the song.
+ * \param plays The number of plays to add. May be negative.
+ * \return \c 0 on success, or \c -1 if the queue is not valid.
+ *
+ * This never waits for the database. Plays queued for the same song add up.
+ */
+int SongUpdateQueue::addPlays(int song_id, int64_t plays) {
+    if (!isValid())
+        return -1;
+    std::lock_guard<std::mutex> lock(mutex);
+    pending[song_id].plays += plays;
+    queued();
+    return 0;
+}
+
+/**
+ * Reads the rating of a song, as it stands with the updates queued for it.
+ *
+ * \param song_id The ID of the song.
+ * \param rating Receives the rating.
+ * \return \c 0 on success, or \c -1 if the song does not exist or an error
+ *         occurs.
+ *
+ * A song with a rating queued is answered from memory.
+ */
+int SongUpdateQueue::getRating(int song_id, int &rating) {
+    int64_t play_count;
+
+    if (!isValid())
+        return -1;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const UpdateMap *updates : { &pending, &writing }) {
+            auto found = updates->find(song_id);
+            if (found != updates->end() && found->second.has_rating) {
+                rating = found->second.rating;
+                return 0;
+            }
+        }
+    }
+    return readSong(song_id, rating, play_count);
+}
+
+/**
+ * Reads the play count of a song, with the plays queued for it added.
+ *
+ * \param song_id The ID of the song.
+ * \param play_count Receives the play count.
+ * \return \c 0 on success, or \c -1 if the song does not exist or an error
+ *         occurs.
+ */
+int SongUpdateQueue::getPlayCount(int song_id, int64_t &play_count) {
+    int rating;
+
+    if (!isValid())
+        return -1;
+    return readSong(song_id, rating, play_count);
+}
+
+/**
+ * Writes every update queued so far, and waits for them to be committed.
+ *
+ * \return \c 0 on success, or \c -1 if the updates could not be written. They
+ *         stay queued, to be tried again.
+ */
+int SongUpdateQueue::flush() {
+    if (!isValid())
+        return -1;
+    return writePending();
+}
+
+/**
+ * Stops the writer thread, writing the updates still queued first. Updates
+ * queued afterwards are only written by flush().
+ */
+void SongUpdateQueue::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    if (worker.joinable()) {
+        worker.join();
+        writePending();
+    }
+}
+
+/**
+ * Wakes the writer thread if the update just queued is the first one waiting,
+ * so it can time the flush, or if enough songs have updates waiting to flush
+ * them now. Must be called with mutex held.
+ */
+void SongUpdateQueue::queued() {
+    countMetric(MetricCounter::SongUpdatesQueued);
+    if (pending.size() == 1) {
+        deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(options.flush_interval_ms);
+        wake.notify_one();
+    } else if (pending.size() == options.max_pending) {
+        wake.notify_one();
+    }
+}
+
+/**
+ * The loop of the writer thread: writes the queued updates out whenever the
+ * oldest has waited long enough or enough songs have updates, until stopped.
+ */
+void SongUpdateQueue::work() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stopping) {
+        if (pending.empty()) {
+            wake.wait(lock);
+        } else if (pending.size() < options.max_pending && std::chrono::steady_clock::now() < deadline) {
+            wake.wait_until(lock, deadline);
+        } else {
+            lock.unlock();
+            int rc = writePending();
+            lock.lock();
+            // However many updates pile up, a failed flush is not tried again before the interval is over.
+            if (rc != 0)
+                wake.wait_for(lock, std::chrono::milliseconds(options.flush_interval_ms), [this] { return stopping; });
+        }
+    }
+}
+
+/**
+ * Moves the queued updates to writing and writes them in one transaction,
+ * then calls options.after_flush. If that fails, they are queued again, under
+ * any updates queued since, and the next flush is due an interval later.
+ */
+int SongUpdateQueue::writePending() {
+    std::lock_guard<std::mutex> db_lock(db_mutex);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (pending.empty())
+            return 0;
+        writing.swap(pending);
+    }
+    int rc = write();
+    if (rc == 0 && options.after_flush)
+        options.after_flush(db);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (rc != 0) {
+        if (pending.empty())
+            deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(options.flush_interval_ms);
+        for (auto &entry : writing) {
+            SongUpdate &update = pending[entry.first];
+            if (!update.has_rating) {
+                update.has_rating = entry.second.has_rating;
+                update.rating = entry.second.rating;
+            }
+            update.plays += entry.second.plays;
+        }
+    }
+    writing.clear();
+    return rc;
+}
+
+/**
+ * Writes the updates in writing in one transaction, along with the changes
+ * they make to smart playlists. Must be called with db_mutex held.
+ *
+ * The commit happens with read_mutex held and writing is emptied before it is
+ * released, so a read sees each update either in the database or in writing.
+ */
+int SongUpdateQueue::write() {
+    ScopedTimer timer(MetricStage::FlushSongUpdates);
+    std::vector<int> song_ids;
+    char *error_message;
+    int rc = SQLITE_DONE;
+
+    // Takes the write lock up front, waiting for an import's transaction to end if need be.
+    if (sqlite3_exec(db, "BEGIN IMMEDIATE;", NULL, NULL, &error_message) != SQLITE_OK) {
+        logAt(LogLevel::Error, "Error while starting song update transaction: %s\n", error_message);
+        sqlite3_free(error_message);
+        return -1;
+    }
+    song_ids.reserve(writing.size());
+    for (auto &entry : writing) {
+        const SongUpdate &update = entry.second;
+        bool changed = false;
+
+        if (update.has_rating) {
+            sqlite3_bind_int(set_rating, 1, entry.first);
+            sqlite3_bind_int(set_rating, 2, update.rating);
+            rc = sqlite3_step(set_rating);
+            sqlite3_reset(set_rating);
+            if (rc != SQLITE_DONE)
+                break;
+            changed = sqlite3_changes(db) > 0;
+        }
+        if (update.plays != 0) {
+            sqlite3_bind_int(add_plays, 1, entry.first);
+            sqlite3_bind_int64(add_plays, 2, update.plays);
+            rc = sqlite3_step(add_plays);
+            sqlite3_reset(add_plays);
+            if (rc != SQLITE_DONE)
+                break;
+            changed = changed || sqlite3_changes(db) > 0;
+        }
+        if (changed)
+            song_ids.push_back(entry.first);
+    }
+    if (rc != SQLITE_DONE) {
+        logAt(LogLevel::Error, "Error while writing song updates: %s\n", sqlite3_errmsg(db));
+        sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+        return -1;
+    }
+    // Ratings and play counts can be rule fields. A failure is logged, and leaves the playlists as they were.
+    smart_playlists->songsChanged(song_ids);
+
+    std::lock_guard<std::mutex> read_lock(read_mutex);
+    if (sqlite3_exec(db, "COMMIT;", NULL, NULL, &error_message) != SQLITE_OK) {
+        logAt(LogLevel::Error, "Error while committing song updates: %s\n", error_message);
+        sqlite3_free(error_message);
+        sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+        return -1;
+    }
+    countMetric(MetricCounter::SongUpdatesWritten, writing.size());
+    std::lock_guard<std::mutex> lock(mutex);
+    writing.clear();
+    return 0;
+}
+
+/**
+ * Reads the rating and play count of a song from the database, and applies
+ * the updates queued for it or being written.
+ */
+int SongUpdateQueue::readSong(int song_id, int &rating, int64_t &play_count) {
+    std::lock_guard<std::mutex> read_lock(read_mutex);
+    int rc;
+
+    sqlite3_bind_int(select_song, 1, song_id);
+    rc = sqlite3_step(select_song);
+    if (rc == SQLITE_ROW) {
+        rating = sqlite3_column_int(select_song, 0);
+        play_count = sqlite3_column_int64(select_song, 1);
+    }
+    sqlite3_reset(select_song);
+    if (rc != SQLITE_ROW) {
+        if (rc != SQLITE_DONE)
+            logAt(LogLevel::Error, "Error while reading song %d: %s\n", song_id, sqlite3_errmsg(read_db));
+        return -1;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    // writing holds the older updates, so pending is applied last.
+    for (const UpdateMap *updates : { &writing, &pending }) {
+        auto found = updates->find(song_id);
+        if (found == updates->end())
+            continue;
+        if (found->second.has_rating)
+            rating = found->second.rating;
+        play_count += found->second.plays;
+    }
+    return 0;
+}
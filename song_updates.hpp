@@ -0,0 +1,89 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <sqlite3.h>
+
+class SmartPlaylists;
+
+struct SongUpdateOptions {
+    unsigned int flush_interval_ms = 2000;  // longest an update waits in memory before it is written
+    size_t max_pending = 256;               // songs with updates waiting that make a flush start at once
+    std::function<void(sqlite3 *db)> after_flush;   // called after each flush is committed, on the thread that flushed
+};
+
+/**
+ * A write-behind queue for the song fields the UI changes as it is used: the
+ * rating and the play count.
+ *
+ * Updates land in an in-memory map, one entry per song, so rating a song
+ * five times or playing it twice costs one row written. A background thread
+ * writes the map out in a single transaction once the oldest update has
+ * waited options.flush_interval_ms, or as soon as options.max_pending songs
+ * have updates waiting, and then brings smart playlists up to date with the
+ * songs it wrote. Once a flush is committed, options.after_flush is called, if
+ * set, with the queue's connection. Nothing a caller does waits for the disk,
+ * except flush().
+ *
+ * Reads go through the queue, so they see updates that have not been written
+ * yet; other connections see them once they are flushed. The queue's
+ * connection switches the database to write-ahead logging, so flushes, an
+ * import and the UI's readers do not lock each other out.
+ */
+class SongUpdateQueue {
+    public:
+        explicit SongUpdateQueue(const std::string &db_path, const SongUpdateOptions &options = SongUpdateOptions());
+        ~SongUpdateQueue();
+
+        SongUpdateQueue(const SongUpdateQueue &) = delete;
+        SongUpdateQueue &operator=(const SongUpdateQueue &) = delete;
+
+        bool isValid() const;
+        int setRating(int song_id, int rating);
+        int addPlays(int song_id, int64_t plays);
+        int getRating(int song_id, int &rating);
+        int getPlayCount(int song_id, int64_t &play_count);
+        int flush();
+        void stop();
+
+    private:
+        struct SongUpdate {
+            bool has_rating = false;
+            int rating = 0;
+            int64_t plays = 0;              // added to the stored count
+        };
+
+        typedef std::unordered_map<int, SongUpdate> UpdateMap;
+
+        void queued();
+        void work();
+        int writePending();
+        int write();
+        int readSong(int song_id, int &rating, int64_t &play_count);
+
+        SongUpdateOptions options;
+        sqlite3 *db;
+        sqlite3 *read_db;
+        sqlite3_stmt *set_rating;
+        sqlite3_stmt *add_plays;
+        sqlite3_stmt *select_song;
+        std::unique_ptr<SmartPlaylists> smart_playlists;
+        std::mutex db_mutex;                // guards db, its statements and smart_playlists; taken first
+        std::mutex read_mutex;              // guards read_db and select_song, and is held across each commit
+
+        std::mutex mutex;                   // guards everything below; taken last
+        std::condition_variable wake;
+        bool stopping;
+        UpdateMap pending;                  // updates not written yet
+        UpdateMap writing;                  // updates being written; only changed with db_mutex held too
+        std::chrono::steady_clock::time_point deadline;     // when pending must be written by, if not empty
+        std::thread worker;
+};
@@ -0,0 +1,179 @@
+#include "string_pool.hpp"
+#include "metrics.hpp"
+#include "misc.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <functional>
+
+namespace {
+
+std::atomic<uint64_t> next_serial(1);
+
+}
+
+/**
+ * Creates a pool holding only the empty string, as ID 0.
+ */
+StringPool::StringPool() : serial(next_serial++), count(1), slots(1024, Slot{ 0, 0 }), chunk_next(nullptr), chunk_left(0), bytes(0) {
+    blocks[0].reset(new std::string_view[1 << BLOCK_BITS]);
+    blocks[0][0] = std::string_view("", 0);
+}
+
+/**
+ * Interns a string.
+ *
+ * \param s The string to intern. It is copied if the pool does not hold it yet.
+ * \return The ID of the string, \c 0 for the empty string, or \c 0 as well if
+ *         the pool is full.
+ */
+uint32_t StringPool::intern(std::string_view s) {
+    if (s.empty())
+        return 0;
+    uint32_t hash = (uint32_t)std::hash<std::string_view>()(s);
+    std::lock_guard<std::mutex> lock(mutex);
+
+    size_t mask = slots.size() - 1, i = hash & mask;
+    for (; slots[i].id != 0; i = (i + 1) & mask)
+        if (slots[i].hash == hash && get(slots[i].id) == s)
+            return slots[i].id;
+
+    if (count == (uint32_t)MAX_BLOCKS << BLOCK_BITS) {
+        logAt(LogLevel::Error, "The string pool is full, %s is stored as an empty string\n", std::string(s).c_str());
+        return 0;
+    }
+    uint32_t id = count++;
+    std::unique_ptr<std::string_view[]> &block = blocks[id >> BLOCK_BITS];
+    if (!block)
+        block.reset(new std::string_view[1 << BLOCK_BITS]);
+    block[id & BLOCK_MASK] = std::string_view(store(s), s.size());
+    slots[i] = Slot{ id, hash };
+    if ((size_t)count * 2 > slots.size())
+        grow();
+    return id;
+}
+
+/**
+ * Returns the number of strings in the pool, the empty string included.
+ */
+size_t StringPool::getSize() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return count;
+}
+
+/**
+ * Returns the number of bytes the pool has allocated for strings and tables.
+ */
+size_t StringPool::getBytes() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    size_t block_count = ((size_t)count + BLOCK_MASK) >> BLOCK_BITS;
+    return bytes + slots.size() * sizeof(Slot) + block_count * (sizeof(std::string_view) << BLOCK_BITS);
+}
+
+/**
+ * Copies a string, NUL-terminated, into the current chunk. Strings too large
+ * to share a chunk get one of their own.
+ */
+const char *StringPool::store(std::string_view s) {
+    char *p;
+
+    if (s.size() + 1 > CHUNK_SIZE / 4) {
+        chunks.emplace_back(new char[s.size() + 1]);
+        bytes += s.size() + 1;
+        p = chunks.back().get();
+    } else {
+        if (chunk_left < s.size() + 1) {
+            chunks.emplace_back(new char[CHUNK_SIZE]);
+            bytes += CHUNK_SIZE;
+            chunk_next = chunks.back().get();
+            chunk_left = CHUNK_SIZE;
+        }
+        p = chunk_next;
+        chunk_next += s.size() + 1;
+        chunk_left -= s.size() + 1;
+    }
+    memcpy(p, s.data(), s.size());
+    p[s.size()] = '\0';
+    return p;
+}
+
+/**
+ * Doubles the hash table, placing each slot by the hash it keeps.
+ */
+void StringPool::grow() {
+    std::vector<Slot> grown(slots.size() * 2, Slot{ 0, 0 });
+    size_t mask = grown.size() - 1;
+
+    for (auto &slot : slots) {
+        if (slot.id == 0)
+            continue;
+        size_t i = slot.hash & mask;
+        while (grown[i].id != 0)
+            i = (i + 1) & mask;
+        grown[i] = slot;
+    }
+    slots.swap(grown);
+}
+
+/**
+ * Takes over another list, leaving it empty.
+ */
+InternedList::InternedList(InternedList &&other) noexcept
+    : count(other.count), capacity(other.capacity), heap(std::move(other.heap)) {
+    if (!heap)
+        std::copy(other.inline_ids, other.inline_ids + count, inline_ids);
+    other.count = 0;
+    other.capacity = INLINE_CAPACITY;
+}
+
+/**
+ * Takes over another list, leaving it empty.
+ */
+InternedList &InternedList::operator=(InternedList &&other) noexcept {
+    if (this != &other) {
+        count = other.count;
+        capacity = other.capacity;
+        heap = std::move(other.heap);
+        if (!heap)
+            std::copy(other.inline_ids, other.inline_ids + count, inline_ids);
+        other.count = 0;
+        other.capacity = INLINE_CAPACITY;
+    }
+    return *this;
+}
+
+/**
+ * Appends an ID, moving the list to the heap once it outgrows INLINE_CAPACITY.
+ */
+void InternedList::push_back(uint32_t id) {
+    if (count == capacity) {
+        std::unique_ptr<uint32_t[]> grown(new uint32_t[capacity * 2]);
+        std::copy(begin(), end(), grown.get());
+        heap = std::move(grown);
+        capacity *= 2;
+    }
+    (heap ? heap.get() : inline_ids)[count++] = id;
+}
+
+/**
+ * @brief Splits a tag value into names and interns each of them.
+ *
+ * @details Splits like splitString(), but on views of s, so a name is only
+ *          copied when it is new to the pool. The IDs are appended to names,
+ *          so the values of a field given more than once can be collected in
+ *          one list.
+ *
+ * @param[in] s The tag value to split.
+ * @param[in,out] names The list to append the IDs of the names to.
+ * @param[in] pool The pool to intern the names in.
+ */
+void internNames(std::string_view s, InternedList &names, StringPool &pool) {
+    thread_local std::vector<std::string_view> parts;
+    ScopedTimer timer(MetricStage::SplitString);
+
+    parts.clear();
+    splitStringView(s, parts);
+    for (auto &part : parts)
+        names.push_back(pool.intern(part));
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <vector>
+
+/**
+ * A set of strings, each stored once and named by a small integer ID.
+ *
+ * Interning the same string twice gives the same ID, so the names a library
+ * repeats on song after song, like artists, albums and genres, take memory
+ * once and can be told apart by ID alone. ID 0 is the empty string. Strings
+ * are copied into large chunks that are never moved or freed while the pool
+ * exists, so the views get() returns stay valid, and interning a new string
+ * costs no allocation of its own.
+ *
+ * intern() may be called from several threads at once. get() takes no lock,
+ * and may run alongside intern() for any ID the calling thread got from
+ * intern() or through a hand-off that synchronises, like a BoundedQueue.
+ */
+class StringPool {
+    public:
+        StringPool();
+
+        StringPool(const StringPool &) = delete;
+        StringPool &operator=(const StringPool &) = delete;
+
+        uint32_t intern(std::string_view s);
+
+        /**
+         * Returns the string with the given ID. The view stays valid, and its
+         * data NUL-terminated, for the lifetime of the pool.
+         */
+        std::string_view get(uint32_t id) const { return blocks[id >> BLOCK_BITS][id & BLOCK_MASK]; }
+
+        size_t getSize() const;
+        size_t getBytes() const;
+
+        /**
+         * Returns a number no other pool created by this process has, so that
+         * IDs cached for one pool are not mistaken for another's.
+         */
+        uint64_t getSerial() const { return serial; }
+
+    private:
+        enum {
+            BLOCK_BITS = 12,
+            BLOCK_MASK = (1 << BLOCK_BITS) - 1,
+            MAX_BLOCKS = 4096,              // 16M strings
+            CHUNK_SIZE = 64 * 1024
+        };
+
+        /**
+         * A slot of the hash table, with the low bits of the string's hash
+         * kept next to its ID so most probes never look at the string.
+         */
+        struct Slot {
+            uint32_t id;                    // 0 if the slot is empty
+            uint32_t hash;
+        };
+
+        const char *store(std::string_view s);
+        void grow();
+
+        const uint64_t serial;
+        mutable std::mutex mutex;           // guards everything but the strings already stored
+        std::unique_ptr<std::string_view[]> blocks[MAX_BLOCKS];
+        uint32_t count;
+        std::vector<Slot> slots;            // open addressing, a power of two in size, at most half full
+        std::vector<std::unique_ptr<char[]>> chunks;
+        char *chunk_next;
+        size_t chunk_left;
+        size_t bytes;
+};
+
+/**
+ * A short list of interned string IDs. Up to INLINE_CAPACITY IDs are kept in
+ * the list itself, so the artists and genres of nearly every song need no
+ * allocation; longer lists move to the heap. Lists are moved, never copied.
+ */
+class InternedList {
+    public:
+        enum { INLINE_CAPACITY = 4 };
+
+        InternedList() : count(0), capacity(INLINE_CAPACITY) {}
+        InternedList(InternedList &&other) noexcept;
+        InternedList &operator=(InternedList &&other) noexcept;
+
+        InternedList(const InternedList &) = delete;
+        InternedList &operator=(const InternedList &) = delete;
+
+        void push_back(uint32_t id);
+        void clear() { count = 0; }
+        size_t size() const { return count; }
+        bool empty() const { return count == 0; }
+        const uint32_t *begin() const { return heap ? heap.get() : inline_ids; }
+        const uint32_t *end() const { return begin() + count; }
+        uint32_t operator[](size_t i) const { return begin()[i]; }
+
+    private:
+        uint32_t count;
+        uint32_t capacity;
+        uint32_t inline_ids[INLINE_CAPACITY];
+        std::unique_ptr<uint32_t[]> heap;
+};
+
+void internNames(std::string_view s, InternedList &names, StringPool &pool);
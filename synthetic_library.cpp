@@ -0,0 +1,308 @@
+#include "synthetic_library.hpp"
+#include "misc.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <random>
+
+#include <taglib/tag.h>
+#include <taglib/fileref.h>
+#include <taglib/tpropertymap.h>
+
+namespace {
+
+void putLittleEndian(std::string &out, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; i++)
+        out += (char)((value >> (8 * i)) & 0xFF);
+}
+
+void putBigEndian(std::string &out, uint64_t value, int bytes) {
+    for (int i = bytes - 1; i >= 0; i--)
+        out += (char)((value >> (8 * i)) & 0xFF);
+}
+
+/**
+ * A FLAC stream with only a STREAMINFO block, followed by audio_bytes of
+ * filler standing in for the frames.
+ */
+std::string makeFlac(size_t audio_bytes) {
+    std::string out = "fLaC";
+    uint64_t samples = 44100ULL * 180;
+
+    out += (char)0x80;                      // last metadata block, type STREAMINFO
+    putBigEndian(out, 34, 3);
+    putBigEndian(out, 4096, 2);             // minimum and maximum block size
+    putBigEndian(out, 4096, 2);
+    putBigEndian(out, 0, 3);                // minimum and maximum frame size, unknown
+    putBigEndian(out, 0, 3);
+    // 20 bits sample rate, 3 bits channels - 1, 5 bits bits per sample - 1, 36 bits total samples
+    putBigEndian(out, (44100ULL << 44) | (1ULL << 41) | (15ULL << 36) | samples, 8);
+    out.append(16, '\0');                   // MD5 of the decoded audio, unknown
+    out.append(audio_bytes, '\0');
+    return out;
+}
+
+/**
+ * Silent MPEG-1 Layer III frames at 128 kbit/s and 44.1 kHz.
+ */
+std::string makeMp3(size_t audio_bytes) {
+    const size_t frame_size = 144 * 128000 / 44100;
+    std::string out;
+
+    for (size_t i = 0; i == 0 || out.size() + frame_size <= audio_bytes; i++) {
+        out.append("\xFF\xFB\x90\x00", 4);
+        out.append(frame_size - 4, '\0');
+    }
+    return out;
+}
+
+uint32_t oggCrc(const std::string &data) {
+    static uint32_t table[256];
+    static bool initialized = false;
+    uint32_t crc = 0;
+
+    if (!initialized) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t r = i << 24;
+            for (int j = 0; j < 8; j++)
+                r = (r & 0x80000000U) ? (r << 1) ^ 0x04C11DB7U : (r << 1);
+            table[i] = r;
+        }
+        initialized = true;
+    }
+    for (unsigned char c : data)
+        crc = (crc << 8) ^ table[((crc >> 24) & 0xFF) ^ c];
+    return crc;
+}
+
+/**
+ * Appends an Ogg page holding the given complete packets.
+ */
+void putOggPage(std::string &out, const std::vector<std::string> &packets, unsigned char flags, uint64_t granule, uint32_t sequence) {
+    std::string page = "OggS";
+    std::string lacing, body;
+
+    for (auto &packet : packets) {
+        size_t size = packet.size();
+        for (; size >= 255; size -= 255)
+            lacing += (char)255;
+        lacing += (char)size;
+        body += packet;
+    }
+    page += (char)0;                        // stream structure version
+    page += (char)flags;
+    putLittleEndian(page, granule, 8);
+    putLittleEndian(page, 0x5EED, 4);       // stream serial number
+    putLittleEndian(page, sequence, 4);
+    putLittleEndian(page, 0, 4);            // CRC, filled in below
+    page += (char)lacing.size();
+    page += lacing;
+    page += body;
+    uint32_t crc = oggCrc(page);
+    for (int i = 0; i < 4; i++)
+        page[22 + i] = (char)((crc >> (8 * i)) & 0xFF);
+    out += page;
+}
+
+/**
+ * An Ogg Vorbis stream with valid identification, comment and setup headers,
+ * followed by filler audio packets.
+ */
+std::string makeOggVorbis(size_t audio_bytes) {
+    std::string identification = "\x01vorbis", comment = "\x03vorbis", setup = "\x05vorbis", out;
+    const char *vendor = "project_dbs bench";
+    const size_t packet_size = 4000;
+    uint32_t sequence = 0;
+    uint64_t granule = 0;
+
+    putLittleEndian(identification, 0, 4);              // Vorbis version
+    identification += (char)2;                          // channels
+    putLittleEndian(identification, 44100, 4);
+    putLittleEndian(identification, 0, 4);              // maximum, nominal and minimum bitrate
+    putLittleEndian(identification, 128000, 4);
+    putLittleEndian(identification, 0, 4);
+    identification += (char)0xB8;                       // block sizes 256 and 2048
+    identification += (char)1;                          // framing bit
+    putLittleEndian(comment, std::char_traits<char>::length(vendor), 4);
+    comment += vendor;
+    putLittleEndian(comment, 0, 4);                     // no comments yet
+    comment += (char)1;
+    setup.append(32, '\0');
+
+    putOggPage(out, {identification}, 0x02, 0, sequence++);
+    putOggPage(out, {comment, setup}, 0x00, 0, sequence++);
+    for (size_t written = 0; written == 0 || written + packet_size <= audio_bytes; written += packet_size) {
+        granule += 44100;
+        bool last = written + 2 * packet_size > audio_bytes;
+        putOggPage(out, {std::string(packet_size, '\0')}, last ? 0x04 : 0x00, granule, sequence++);
+    }
+    return out;
+}
+
+std::string joinNames(const std::vector<std::string> &names, const char *separator) {
+    std::string joined;
+    for (size_t i = 0; i < names.size(); i++) {
+        if (i > 0)
+            joined += separator;
+        joined += names[i];
+    }
+    return joined;
+}
+
+}
+
+/**
+ * @brief Writes a minimal, untagged audio file that TagLib can open and tag.
+ *
+ * @details The file has valid stream headers for its format, but the audio
+ *          itself is silence or filler, so it is only useful for tagging,
+ *          scanning and benchmarks.
+ *
+ * @param[in] path The path of the file to write.
+ * @param[in] format The container format.
+ * @param[in] audio_bytes Roughly how many bytes of audio data to write.
+ *
+ * @return 0 on success, -1 if the file cannot be written.
+ */
+int writeAudioSkeleton(const std::string &path, AudioFormat format, size_t audio_bytes) {
+    std::string data;
+    FILE *file;
+
+    switch (format) {
+        case Flac:
+            data = makeFlac(audio_bytes);
+            break;
+        case Mp3:
+            data = makeMp3(audio_bytes);
+            break;
+        case OggVorbis:
+            data = makeOggVorbis(audio_bytes);
+            break;
+    }
+    file = fopen(path.c_str(), "wb");
+    if (file == nullptr) {
+        logAt(LogLevel::Error, "Can't create %s\n", path.c_str());
+        return -1;
+    }
+    size_t written = fwrite(data.data(), 1, data.size(), file);
+    if (fclose(file) != 0 || written != data.size()) {
+        logAt(LogLevel::Error, "Error while writing %s\n", path.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Writes an audio file and tags it with TagLib.
+ *
+ * @param[in] path The path of the file to write.
+ * @param[in] format The container format.
+ * @param[in] metadata The tags to write. Multiple artists are joined with
+ *                     " & " and multiple genres with "; ", so that
+ *                     readMetadata() splits them back apart.
+ * @param[in] audio_bytes Roughly how many bytes of audio data to write.
+ *
+ * @return 0 on success, -1 if the file cannot be written or tagged.
+ */
+int writeSyntheticSong(const std::string &path, AudioFormat format, const Metadata &metadata, size_t audio_bytes) {
+    if (writeAudioSkeleton(path, format, audio_bytes) != 0)
+        return -1;
+
+    TagLib::FileRef file_ref(path.c_str(), false);
+    if (file_ref.isNull()) {
+        logAt(LogLevel::Error, "Unable to open %s for tagging\n", path.c_str());
+        return -1;
+    }
+    TagLib::PropertyMap props;
+    props["TITLE"] = TagLib::StringList(TagLib::String(metadata.title, TagLib::String::UTF8));
+    props["ARTIST"] = TagLib::StringList(TagLib::String(joinNames(metadata.contributing_artists, " & "), TagLib::String::UTF8));
+    props["ALBUM"] = TagLib::StringList(TagLib::String(metadata.album, TagLib::String::UTF8));
+    props["ALBUMARTIST"] = TagLib::StringList(TagLib::String(joinNames(metadata.album_artists, " & "), TagLib::String::UTF8));
+    props["GENRE"] = TagLib::StringList(TagLib::String(joinNames(metadata.genres, "; "), TagLib::String::UTF8));
+    props["TRACKNUMBER"] = TagLib::StringList(TagLib::String(std::to_string(metadata.track_number)));
+    props["DISCNUMBER"] = TagLib::StringList(TagLib::String(std::to_string(metadata.disc_number)));
+    props["DATE"] = TagLib::StringList(TagLib::String(std::to_string(metadata.year)));
+    file_ref.setProperties(props);
+    if (!file_ref.save()) {
+        logAt(LogLevel::Error, "Unable to save tags to %s\n", path.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Generates a library of tagged audio files for benchmarks.
+ *
+ * @details Songs are laid out as root/<album artist>/<album>/<track> - <title>,
+ *          ten tracks to an album, cycling through FLAC, MP3 and Ogg Vorbis.
+ *          Names are drawn from a fixed vocabulary, so they share prefixes the
+ *          way real library names do, and some songs credit several artists
+ *          or genres. The same seed always produces the same library.
+ *
+ * @param[in] root The directory to create the library in.
+ * @param[in] song_count The number of songs to write.
+ * @param[in] seed The seed for the random names and file sizes.
+ * @param[out] files If not null, receives the path of every file written.
+ *
+ * @return 0 on success, -1 if any file cannot be written.
+ */
+int generateSyntheticLibrary(const std::string &root, size_t song_count, unsigned int seed, std::vector<std::string> *files) {
+    const char *words[] = { "Love", "Night", "Highway", "Tune", "Dil", "Diyan", "Gallan", "Safari", "Chori", "Kiya",
+                            "Jiya", "Mast", "Nain", "Fleet", "Ocean", "Golden", "Echo", "River", "Sapne", "Raat" };
+    const char *genres[] = { "Pop", "Rock", "Jazz", "Hip-Hop", "Classical", "Bollywood", "Electronic", "Folk" };
+    const char *extensions[] = { ".flac", ".mp3", ".ogg" };
+    const size_t word_count = sizeof(words) / sizeof(words[0]);
+    const size_t genre_count = sizeof(genres) / sizeof(genres[0]);
+    size_t artist_count = song_count / 25 + 1;
+    std::mt19937 rng(seed);
+    std::error_code ec;
+    Metadata metadata;
+
+    auto makeName = [&](size_t length) {
+        std::string name;
+        for (size_t i = 0; i < length; i++) {
+            if (i > 0)
+                name += ' ';
+            name += words[rng() % word_count];
+        }
+        return name;
+    };
+    std::vector<std::string> artists;
+    for (size_t i = 0; i < artist_count; i++)
+        artists.push_back(makeName(1 + rng() % 2) + " " + std::to_string(i));
+
+    std::string directory;
+    for (size_t i = 0; i < song_count; i++) {
+        size_t track = i % 10 + 1;
+        if (track == 1) {
+            metadata.album_artists = { artists[rng() % artist_count] };
+            metadata.album = makeName(1 + rng() % 3) + " " + std::to_string(i / 10);
+            metadata.genres = { genres[rng() % genre_count] };
+            if (rng() % 4 == 0)
+                metadata.genres.push_back(genres[rng() % genre_count]);
+            metadata.disc_number = 1;
+            metadata.year = 1970 + rng() % 55;
+            directory = (std::filesystem::path(root) / metadata.album_artists[0] / metadata.album).string();
+            std::filesystem::create_directories(directory, ec);
+            if (ec) {
+                logAt(LogLevel::Error, "Can't create %s: %s\n", directory.c_str(), ec.message().c_str());
+                return -1;
+            }
+        }
+        metadata.title = makeName(1 + rng() % 4);
+        metadata.contributing_artists = metadata.album_artists;
+        if (rng() % 3 == 0)
+            metadata.contributing_artists.push_back(artists[rng() % artist_count]);
+        metadata.track_number = (unsigned int)track;
+
+        AudioFormat format = (AudioFormat)(i % 3);
+        std::string name = (track < 10 ? "0" : "") + std::to_string(track) + " - " + metadata.title + extensions[format];
+        std::string path = (std::filesystem::path(directory) / name).string();
+        if (writeSyntheticSong(path, format, metadata, 16 * 1024 + rng() % (48 * 1024)) != 0)
+            return -1;
+        if (files != nullptr)
+            files->push_back(path);
+    }
+    return 0;
+}
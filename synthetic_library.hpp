@@ -0,0 +1,12 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "tag_functions.hpp"
+
+enum AudioFormat { Flac, Mp3, OggVorbis };
+
+int writeAudioSkeleton(const std::string &path, AudioFormat format, size_t audio_bytes);
+int writeSyntheticSong(const std::string &path, AudioFormat format, const Metadata &metadata, size_t audio_bytes);
+int generateSyntheticLibrary(const std::string &root, size_t song_count, unsigned int seed, std::vector<std::string> *files = nullptr);
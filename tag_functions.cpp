@@ -1,9 +1,66 @@
 #include "tag_functions.hpp"
+#include "fast_tags.hpp"
+#include "metrics.hpp"
 #include "misc.hpp"
 
+#include <iterator>
+
+#include <taglib/taglib.h>
 #include <taglib/tag.h>
 #include <taglib/fileref.h>
 #include <taglib/tpropertymap.h>
+#if TAGLIB_MAJOR_VERSION >= 2
+#include <taglib/tvariant.h>
+#endif
+
+namespace {
+
+/**
+ * Returns the values of a property. Where the properties lack it, fallback is
+ * used: what the file's union of tags (ID3v2, APE and ID3v1 in an MP3 file,
+ * say) has for the field.
+ */
+TagLib::StringList getValues(TagLib::PropertyMap &props, const char *key, const TagLib::String &fallback = TagLib::String()) {
+    const TagLib::StringList &values = props[key];
+    if (values.isEmpty() && !fallback.isEmpty())
+        return TagLib::StringList(fallback);
+    return values;
+}
+
+/**
+ * Joins the values of a field that holds one string with spaces, as readFastTags() does.
+ */
+std::string joinValues(const TagLib::StringList &values) {
+    std::string joined;
+    for (auto it = values.begin(); it != values.end(); ++it) {
+        if (it != values.begin())
+            joined += ' ';
+        joined += it->to8Bit(true);
+    }
+    return joined;
+}
+
+/**
+ * Splits each value of a field that holds names on its own, as readFastTags() does.
+ */
+void splitValues(std::vector<std::string> &names, const TagLib::StringList &values) {
+    names.clear();
+    for (auto &value : values) {
+        std::vector<std::string> parts = splitString(value.to8Bit(true));
+        names.insert(names.end(), std::make_move_iterator(parts.begin()), std::make_move_iterator(parts.end()));
+    }
+}
+
+/**
+ * Interns the names in each value of a field, as readFastTags() does.
+ */
+void internValues(InternedList &names, const TagLib::StringList &values, StringPool &pool) {
+    names.clear();
+    for (auto &value : values)
+        internNames(value.to8Bit(true), names, pool);
+}
+
+}
 
 /**
  * @brief Gets metadata from a music file.
@@ -17,20 +74,151 @@
  * @return A Metadata struct containing music metadata.
  */
 Metadata getMetadata(std::string file_location) {
-    TagLib::FileRef file_ref(file_location.c_str());
+    Metadata metadata;
+    if (readMetadata(file_location, metadata) != 0)
+        metadata.file_location = file_location;
+    return metadata;
+}
+
+/**
+ * @brief Reads metadata from a music file into an existing Metadata struct.
+ *
+ * @details Same as getMetadata(), but reports files that cannot be read
+ *          (non-audio files, unsupported formats, unreadable files) instead of
+ *          dereferencing a null tag, which makes it safe to call on every file
+ *          of a library scan. FLAC, Ogg Vorbis, Opus and ID3v2-tagged MP3
+ *          files are read by readFastTags(); everything else, and any file
+ *          the fast reader gives up on, goes through TagLib.
+ *
+ * @param[in] file_location The path to the music file.
+ * @param[out] metadata The struct to fill in.
+ *
+ * @return 0 on success, -1 if the file does not contain readable tags.
+ */
+int readMetadata(const std::string &file_location, Metadata &metadata) {
+    if (readFastTags(file_location, metadata) == 0)
+        return 0;
+    return readTagLibMetadata(file_location, metadata);
+}
+
+/**
+ * @brief Reads metadata from a music file with TagLib.
+ *
+ * @details This is the fallback of readMetadata(). Audio properties are not
+ *          read, since only the tags are needed. A field given more than once
+ *          is read like readFastTags() reads it: titles and albums are joined
+ *          with spaces, and each artist or genre value is split on its own.
+ *
+ * @param[in] file_location The path to the music file.
+ * @param[out] metadata The struct to fill in.
+ *
+ * @return 0 on success, -1 if TagLib cannot open the file or it has no tag.
+ */
+int readTagLibMetadata(const std::string &file_location, Metadata &metadata) {
+    ScopedTimer timer(MetricStage::TagLibFallback);
+    TagLib::FileRef file_ref(file_location.c_str(), false);
+    if (file_ref.isNull() || file_ref.tag() == nullptr)
+        return -1;
     TagLib::Tag *file_tag = file_ref.tag();
     TagLib::PropertyMap props = file_ref.properties();
-    Metadata metadata;
     metadata.file_location = file_location;
-    metadata.title = file_tag->title().to8Bit(true);
-    metadata.contributing_artists = splitString(file_tag->artist().to8Bit(true));
-    metadata.album = file_tag->album().to8Bit(true);
-    metadata.album_artists = splitString(props["ALBUMARTIST"].toString().to8Bit(true));
-    metadata.genres = splitString(file_tag->genre().to8Bit(true));
+    metadata.title = joinValues(getValues(props, "TITLE", file_tag->title()));
+    splitValues(metadata.contributing_artists, getValues(props, "ARTIST", file_tag->artist()));
+    metadata.album = joinValues(getValues(props, "ALBUM", file_tag->album()));
+    splitValues(metadata.album_artists, getValues(props, "ALBUMARTIST"));
+    splitValues(metadata.genres, getValues(props, "GENRE", file_tag->genre()));
     metadata.track_number = file_tag->track();
     metadata.disc_number = props["DISCNUMBER"].toString().toInt();
     metadata.year = file_tag->year();
-    return metadata;
+    return 0;
+}
+
+/**
+ * @brief Reads metadata from a music file, interning the names in a pool.
+ *
+ * @details Same as the Metadata version, but the result holds IDs from pool
+ *          instead of strings, which is how the ingest pipeline passes songs
+ *          around. metadata.file_location is left as it is, so that a caller
+ *          that owns the path can move it in instead of copying it.
+ *
+ * @param[in] file_location The path to the music file.
+ * @param[out] metadata The struct to fill in.
+ * @param[in] pool The pool to intern the names in.
+ *
+ * @return 0 on success, -1 if the file does not contain readable tags.
+ */
+int readMetadata(const std::string &file_location, CompactMetadata &metadata, StringPool &pool) {
+    if (readFastTags(file_location, metadata, pool) == 0)
+        return 0;
+    return readTagLibMetadata(file_location, metadata, pool);
+}
+
+/**
+ * @brief Reads metadata from a music file with TagLib, interning the names in
+ *        a pool.
+ *
+ * @param[in] file_location The path to the music file.
+ * @param[out] metadata The struct to fill in.
+ * @param[in] pool The pool to intern the names in.
+ *
+ * @return 0 on success, -1 if TagLib cannot open the file or it has no tag.
+ */
+int readTagLibMetadata(const std::string &file_location, CompactMetadata &metadata, StringPool &pool) {
+    ScopedTimer timer(MetricStage::TagLibFallback);
+    TagLib::FileRef file_ref(file_location.c_str(), false);
+    if (file_ref.isNull() || file_ref.tag() == nullptr)
+        return -1;
+    TagLib::Tag *file_tag = file_ref.tag();
+    TagLib::PropertyMap props = file_ref.properties();
+    metadata.title = pool.intern(joinValues(getValues(props, "TITLE", file_tag->title())));
+    metadata.album = pool.intern(joinValues(getValues(props, "ALBUM", file_tag->album())));
+    internValues(metadata.contributing_artists, getValues(props, "ARTIST", file_tag->artist()), pool);
+    internValues(metadata.album_artists, getValues(props, "ALBUMARTIST"), pool);
+    internValues(metadata.genres, getValues(props, "GENRE", file_tag->genre()), pool);
+    metadata.track_number = file_tag->track();
+    metadata.disc_number = props["DISCNUMBER"].toString().toInt();
+    metadata.year = file_tag->year();
+    return 0;
+}
+
+/**
+ * @brief Reads the embedded cover picture of a music file.
+ *
+ * @details Pictures are read through TagLib's complex properties, which cover
+ *          ID3v2 APIC frames, FLAC and Xiph picture blocks and MP4 cover atoms
+ *          alike. The front cover is preferred; without one, the first
+ *          picture is used. Complex properties are new in TagLib 2.0, so when
+ *          built against TagLib 1.x no file can be read this way.
+ *
+ * @param[in] file_location The path to the music file.
+ * @param[out] picture Receives the encoded image, as stored in the file.
+ *
+ * @return 0 on success, 1 if the file has no picture, -1 if the file cannot
+ *         be read.
+ */
+int readPicture(const std::string &file_location, std::string &picture) {
+#if TAGLIB_MAJOR_VERSION >= 2
+    TagLib::FileRef file_ref(file_location.c_str(), false);
+    if (file_ref.isNull())
+        return -1;
+    TagLib::List<TagLib::VariantMap> pictures = file_ref.complexProperties("PICTURE");
+    if (pictures.isEmpty())
+        return 1;
+
+    const TagLib::VariantMap *chosen = &pictures.front();
+    for (auto &candidate : pictures)
+        if (candidate.value("pictureType").toString() == "Front Cover") {
+            chosen = &candidate;
+            break;
+        }
+    TagLib::ByteVector data = chosen->value("data").toByteVector();
+    if (data.isEmpty())
+        return 1;
+    picture.assign(data.data(), data.size());
+    return 0;
+#else
+    return -1;
+#endif
 }
 
 std::ostream &operator<<(std::ostream &s, const Metadata &m) {
@@ -4,6 +4,9 @@
 #include <string>
 #include <iostream>
 
+#include "misc.hpp"
+#include "string_pool.hpp"
+
 struct Metadata {
     std::string file_location;
     std::string title;
@@ -11,10 +14,39 @@ struct Metadata {
     std::string album;
     std::vector<std::string> album_artists;
     std::vector<std::string> genres;
-    unsigned int track_number;
-    unsigned int disc_number;
-    unsigned int year;
+    unsigned int track_number = 0;
+    unsigned int disc_number = 0;
+    unsigned int year = 0;
+    FileStat file_stat;     // filled in by the ingest pipeline, not by readMetadata()
+};
+
+/**
+ * The fields of Metadata with every name interned in a StringPool, which is
+ * what the ingest pipeline hands from stage to stage. Apart from the file
+ * location and the rare list longer than InternedList::INLINE_CAPACITY, it
+ * owns no heap memory, and it is moved, never copied.
+ */
+struct CompactMetadata {
+    std::string file_location;
+    uint32_t title = 0;
+    uint32_t album = 0;
+    InternedList contributing_artists;
+    InternedList album_artists;
+    InternedList genres;
+    unsigned int track_number = 0;
+    unsigned int disc_number = 0;
+    unsigned int year = 0;
+    FileStat file_stat;     // filled in by the ingest pipeline, not by readMetadata()
+
+    CompactMetadata() = default;
+    CompactMetadata(CompactMetadata &&) = default;
+    CompactMetadata &operator=(CompactMetadata &&) = default;
 };
 
 Metadata getMetadata(std::string file_location);
+int readMetadata(const std::string &file_location, Metadata &metadata);
+int readTagLibMetadata(const std::string &file_location, Metadata &metadata);
+int readMetadata(const std::string &file_location, CompactMetadata &metadata, StringPool &pool);
+int readTagLibMetadata(const std::string &file_location, CompactMetadata &metadata, StringPool &pool);
+int readPicture(const std::string &file_location, std::string &picture);
 std::ostream &operator<<(std::ostream &s, const Metadata &m);
@@ -1,8 +1,344 @@
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <regex>
 #include <string>
 #include <vector>
 
+#include "content_hash.hpp"
 #include "database_functions.hpp"
+#include "fast_tags.hpp"
+#include "misc.hpp"
+#include "smart_playlists.hpp"
+#include "trie.hpp"
+
+namespace {
+
+int failures = 0;
+
+/**
+ * Prints whether a check passed, counting the ones that did not.
+ */
+void report(const std::string &name, bool passed) {
+    std::cout << name << ": " << (passed ? "ok" : "FAILED") << std::endl;
+    if (!passed)
+        failures++;
+}
+
+std::string littleEndian32(size_t value) {
+    std::string bytes;
+    for (int i = 0; i < 4; i++)
+        bytes += (char)((value >> (8 * i)) & 0xFF);
+    return bytes;
+}
+
+std::string bigEndian(size_t value, int length) {
+    std::string bytes;
+    for (int i = length - 1; i >= 0; i--)
+        bytes += (char)((value >> (8 * i)) & 0xFF);
+    return bytes;
+}
+
+std::string syncSafe(size_t value) {
+    std::string bytes;
+    for (int i = 3; i >= 0; i--)
+        bytes += (char)((value >> (7 * i)) & 0x7F);
+    return bytes;
+}
+
+/**
+ * Builds an ID3v2.3 text frame holding a Latin-1 value.
+ */
+std::string id3Frame(const char *id, const std::string &text) {
+    return std::string(id) + bigEndian(text.size() + 1, 4) + std::string(2, '\0') + '\0' + text;
+}
+
+/**
+ * Builds an ID3v2.3 tag of the given frames, followed by the start of an MPEG frame.
+ */
+std::string id3Tag(const std::string &frames) {
+    return std::string("ID3\x03\x00\x00", 6) + syncSafe(frames.size()) + frames + std::string("\xFF\xFB\x90\x00", 4) + std::string(400, '\0');
+}
+
+/**
+ * Builds a FLAC stream whose only metadata block is a Vorbis comment block of the given fields.
+ */
+std::string flacStream(const std::vector<std::string> &comments) {
+    std::string block = littleEndian32(6) + "vendor" + littleEndian32(comments.size());
+    for (auto &comment : comments)
+        block += littleEndian32(comment.size()) + comment;
+    return "fLaC" + std::string(1, '\x84') + bigEndian(block.size(), 3) + block;
+}
+
+/**
+ * Builds the Metadata readFastTags() is expected to return.
+ */
+Metadata expectedTags(const std::string &title, const std::vector<std::string> &artists, const std::string &album,
+                      const std::vector<std::string> &genres, unsigned int track_number, unsigned int year) {
+    Metadata metadata;
+    metadata.title = title;
+    metadata.contributing_artists = artists;
+    metadata.album = album;
+    metadata.genres = genres;
+    metadata.track_number = track_number;
+    metadata.year = year;
+    return metadata;
+}
+
+/**
+ * Writes a file and reads it with readFastTags(), checking the return code
+ * and, for a file that should be read, every tag field.
+ */
+void checkFastTags(const char *name, const std::string &bytes, int expected_rc, const Metadata *expected = nullptr) {
+    std::string path = (std::filesystem::temp_directory_path() / "project_dbs_test_tags").string();
+    Metadata read;
+
+    std::ofstream(path, std::ios::binary) << bytes;
+    int rc = readFastTags(path, read);
+    std::filesystem::remove(path);
+    bool passed = rc == expected_rc;
+    if (passed && expected != nullptr) {
+        passed = read.title == expected->title && read.contributing_artists == expected->contributing_artists &&
+                 read.album == expected->album && read.album_artists == expected->album_artists &&
+                 read.genres == expected->genres && read.track_number == expected->track_number &&
+                 read.disc_number == expected->disc_number && read.year == expected->year;
+    }
+    report(std::string("readFastTags, ") + name, passed);
+}
+
+/**
+ * Reads well-formed, truncated and malformed tags with the fast tag reader.
+ */
+void testFastTags() {
+    std::string frames = id3Frame("TIT2", "Title") + id3Frame("TPE1", "A; B") + id3Frame("TALB", "Album") +
+                         id3Frame("TCON", "Rock") + id3Frame("TRCK", "3/12") + id3Frame("TYER", "2004");
+    std::string picture = std::string("APIC") + bigEndian(200000, 4) + std::string(2, '\0') + std::string(200000, 'p');
+    Metadata expected = expectedTags("Title", { "A", "B" }, "Album", { "Rock" }, 3, 2004);
+
+    checkFastTags("empty file", "", -1);
+    checkFastTags("ID3v2 tag", id3Tag(frames + picture), 0, &expected);
+    checkFastTags("ID3v2 tag without album, and an ID3v1 tag", id3Tag(id3Frame("TIT2", "Title")) + "TAG" + std::string(125, '\0'), -1);
+    checkFastTags("truncated ID3v2 header", "ID3\x03", -1);
+    checkFastTags("ID3v2 tag larger than the file", std::string("ID3\x03\x00\x00", 6) + syncSafe(100000) + frames, -1);
+    checkFastTags("ID3v2 frame larger than the tag", id3Tag(std::string("TIT2") + bigEndian(100000, 4) + std::string(3, '\0') + "Title"), -1);
+    checkFastTags("ID3v2 tag without MPEG audio", std::string("ID3\x03\x00\x00", 6) + syncSafe(frames.size()) + frames, -1);
+
+    // Repeated fields that hold one string are joined with a space, as TagLib joins them.
+    expected = expectedTags("One Two", { "A", "B", "C" }, "", {}, 7, 0);
+    checkFastTags("FLAC stream", flacStream({ "TITLE=One", "TITLE=Two", "ARTIST=A", "ARTIST=B & C", "TRACKNUMBER=7" }), 0, &expected);
+    std::string flac = flacStream({ "TITLE=One" });
+    checkFastTags("truncated FLAC block", flac.substr(0, flac.size() - 4), -1);
+    checkFastTags("FLAC comment count past the block", "fLaC" + std::string(1, '\x84') + bigEndian(14, 3) + littleEndian32(6) + "vendor" +
+                  littleEndian32(0xFFFFFFFF), -1);
+    checkFastTags("truncated Ogg page", std::string("OggS\0\x02", 6) + std::string(21, '\0'), -1);
+}
+
+
+/**
+ * The splitter splitString() used before splitStringView(), kept as the
+ * reference the new one must agree with.
+ */
+std::vector<std::string> regexSplit(const std::string &s) {
+    std::vector<std::string> result;
+    std::regex re("[&;,]");
+    std::sregex_token_iterator it(s.begin(), s.end(), re, -1);
+    std::sregex_token_iterator end;
+    for (; it != end; ++it) {
+        std::string str = *it;
+        str.erase(0, str.find_first_not_of(" \t\r\n"));
+        str.erase(str.find_last_not_of(" \t\r\n") + 1);
+        if (str != "")
+            result.push_back(str);
+    }
+    return result;
+}
+
+/**
+ * Checks that splitString() and splitStringView() split a string as the old
+ * regex splitter did.
+ */
+bool splitsLikeRegex(const std::string &s) {
+    std::vector<std::string_view> views;
+    splitStringView(s, views);
+    std::vector<std::string> expected = regexSplit(s);
+    return splitString(s) == expected && std::vector<std::string>(views.begin(), views.end()) == expected;
+}
+
+/**
+ * Splits tag values, short ones and ones long enough for the vectorized scan,
+ * and compares the results with the old regex splitter.
+ */
+void testSplitString() {
+    const char *cases[] = {
+        "", "a", ",", "&;,", " , ; & ", "a,b", ",a", "a,", ",,a,,", "a,,b", "a;;;b&&&c", "  a  ,\tb\r\n", "a & b ; c",
+        "Simon & Garfunkel", "Beyonc\xC3\xA9, Bj\xC3\xB6rk & \xE5\x9D\x82\xE6\x9C\xAC\xE9\xBE\x8D\xE4\xB8\x80",
+        "\xE6\x97\xA5\xE6\x9C\xAC\xE8\xAA\x9E;\xED\x95\x9C\xEA\xB5\xAD\xEC\x96\xB4", "\xF0\x9F\x8E\xB5,\xF0\x9F\x8E\xB8",
+        "0123456789abcde,0123456789abcdef;0123456789abcdefg",
+        ",,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,", "                                        ",
+        "\xC3\xA9\xC3\xA9\xC3\xA9\xC3\xA9\xC3\xA9\xC3\xA9\xC3\xA9\xC3\xA9&\xC3\xA9\xC3\xA9\xC3\xA9\xC3\xA9\xC3\xA9\xC3\xA9\xC3\xA9\xC3\xA9",
+    };
+    for (const char *value : cases) {
+        std::string name;
+        for (const char *c = value; *c != '\0'; c++)
+            name += *c == '\t' ? "\\t" : *c == '\r' ? "\\r" : *c == '\n' ? "\\n" : std::string(1, *c);
+        report("splitStringView, \"" + name + "\"", splitsLikeRegex(value));
+    }
+
+    // Every delimiter and whitespace character, and UTF-8 lead and continuation bytes, at every offset of a 32-byte scan.
+    const char alphabet[] = "ab &;,\t\r\n \xC3\xA9\xE2\x82\xAC";
+    uint64_t state = 88172645463325252ULL;
+    bool passed = true;
+    for (int i = 0; i < 2000 && passed; i++) {
+        std::string value;
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        size_t length = state % 80;
+        for (size_t j = 0; j < length; j++) {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            value += alphabet[state % (sizeof(alphabet) - 1)];
+        }
+        passed = splitsLikeRegex(value);
+    }
+    report("splitStringView, 2000 generated values", passed);
+}
+
+/**
+ * Checks that a hash is the expected one.
+ */
+void checkHash(const char *name, uint64_t hash, uint64_t expected) {
+    report(std::string("xxHash64, ") + name, hash == expected);
+}
+
+/**
+ * Checks XXH64 against the reference implementation's sanity vectors, and
+ * hashAudioContent() against copies of a file with different tags.
+ */
+void testContentHash() {
+    // The reference sanity buffer: bytes taken from the top of a running product.
+    std::string buffer;
+    uint64_t generator = 2654435761ULL;
+    for (int i = 0; i < 222; i++) {
+        buffer += (char)(generator >> 56);
+        generator *= 11400714785074694797ULL;
+    }
+    checkHash("empty", xxHash64("", 0), 0xEF46DB3751D8E999ULL);
+    checkHash("\"a\"", xxHash64("a", 1), 0xD24EC4F1A98C6E5BULL);
+    checkHash("\"abc\"", xxHash64("abc", 3), 0x44BC2CF5AD770999ULL);
+    checkHash("1 byte", xxHash64(buffer.data(), 1), 0xE934A84ADB052768ULL);
+    checkHash("222 bytes", xxHash64(buffer.data(), 222), 0xB641AE8CB691C174ULL);
+    checkHash("222 bytes, seeded", xxHash64(buffer.data(), 222, 2654435761ULL), 0x20CB8AB7AE10C14AULL);
+    XxHash64 hasher;
+    for (size_t i = 0; i < buffer.size(); i += 7)
+        hasher.update(buffer.data() + i, std::min((size_t)7, buffer.size() - i));
+    hasher.update(nullptr, 0);
+    checkHash("222 bytes, in pieces", hasher.digest(), 0xB641AE8CB691C174ULL);
+
+    std::string path = (std::filesystem::temp_directory_path() / "project_dbs_test_hash").string();
+    uint64_t first = 0, second = 1;
+    std::ofstream(path, std::ios::binary | std::ios::trunc) << id3Tag(id3Frame("TIT2", "One")) + buffer;
+    int rc = hashAudioContent(path, first);
+    std::ofstream(path, std::ios::binary | std::ios::trunc) << id3Tag(id3Frame("TIT2", "Another title")) + buffer + "TAG" + std::string(125, 'x');
+    rc |= hashAudioContent(path, second);
+    std::filesystem::remove(path);
+    report("hashAudioContent, retagged copy", rc == 0 && first == second);
+}
+
+/**
+ * Compiles a rule, checking the return code and, for a valid rule, the SQL
+ * and values it compiles to. Values are given as text in single quotes, and
+ * as numbers without.
+ */
+void checkRule(const std::string &rule, int expected_rc, const std::string &condition = "1", const std::string &order = "",
+               bool random = false, int64_t limit = -1, const std::vector<std::string> &values = {}) {
+    CompiledRule compiled;
+    std::vector<std::string> compiled_values;
+
+    int rc = compileRule(rule, compiled);
+    for (auto &value : compiled.values)
+        compiled_values.push_back(value.is_text ? "'" + value.text + "'" : std::to_string(value.integer));
+    bool passed = rc == expected_rc;
+    if (passed && rc == 0) {
+        passed = compiled.condition == condition && compiled.order == order && compiled.random == random &&
+                 compiled.has_limit == (limit >= 0) && compiled.limit == limit && compiled_values == values;
+    }
+    report("compileRule, \"" + rule + "\"", passed);
+}
+
+/**
+ * Compiles valid and invalid smart playlist rules.
+ */
+void testCompileRule() {
+    std::string genre_is = "EXISTS (SELECT 1 FROM SongGenreMap JOIN Genres ON Genres.id = SongGenreMap.genre_id "
+                           "WHERE SongGenreMap.song_id = Songs.id AND Genres.name = ";
+    std::string artist_is = "EXISTS (SELECT 1 FROM ContributingArtists JOIN Artists ON Artists.id = ContributingArtists.artist_id "
+                            "WHERE ContributingArtists.song_id = Songs.id AND Artists.name = ";
+
+    checkRule("", 0);
+    // "and" binds tighter than "or", in the rule as in SQL.
+    checkRule("rating >= 4 or genre = Rock and track in 1..5", 0,
+              "(Songs.rating >= ?3) OR (" + genre_is + "?4 COLLATE NOCASE)) AND (Songs.track_number BETWEEN ?5 AND ?6)", "", false, -1,
+              { "4", "'Rock'", "1", "5" });
+    checkRule("(rating >= 4 or genre = Rock) and track in 1..5", 0,
+              "((Songs.rating >= ?3) OR (" + genre_is + "?4 COLLATE NOCASE))) AND (Songs.track_number BETWEEN ?5 AND ?6)", "", false, -1,
+              { "4", "'Rock'", "1", "5" });
+    checkRule("NOT (title ~ love OR plays > 10)", 0, "NOT ((IFNULL(Songs.title, '') LIKE ?3 ESCAPE '\\') OR (Songs.play_count > ?4))", "", false, -1,
+              { "'%love%'", "10" });
+    checkRule("not not disc != 2", 0, "NOT NOT (Songs.disc_number <> ?3)", "", false, -1, { "2" });
+    checkRule("artist != \"Daft \"\"Punk\"\"\"", 0, "(NOT " + artist_is + "?3 COLLATE NOCASE))", "", false, -1, { "'Daft \"Punk\"'" });
+    checkRule("album ~ 50%_off", 0,
+              "(EXISTS (SELECT 1 FROM Albums WHERE Albums.id = Songs.album_id AND Albums.title LIKE ?3 ESCAPE '\\'))", "", false, -1,
+              { "'%50\\%\\_off%'" });
+    checkRule("genre = Jazz order by rating desc, title limit 20", 0, "(" + genre_is + "?3 COLLATE NOCASE))",
+              "Songs.rating DESC, Songs.title COLLATE NOCASE", false, 20, { "'Jazz'" });
+    checkRule("order by random limit 5", 0, "1", "", true, 5);
+    checkRule("limit 0", 0, "1", "", false, 0);
+
+    checkRule("rating", -1);
+    checkRule("rating = x", -1);
+    checkRule("title < b", -1);
+    checkRule("plays ~ 3", -1);
+    checkRule("title in 1..3", -1);
+    checkRule("track in 1..", -1);
+    checkRule("(rating = 1", -1);
+    checkRule("rating = 1 and", -1);
+    checkRule("foo = 1", -1);
+    checkRule("title = \"open", -1);
+    checkRule("rating = 1 order by", -1);
+    checkRule("rating = 1 limit -1", -1);
+    checkRule("rating = 1 limit 5 order by title", -1);
+    checkRule("rating = 1 extra", -1);
+}
+
+/**
+ * Checks that a smart playlist without a limit keeps its member count as songs
+ * change and are deleted.
+ */
+void testSmartPlaylistCount(sqlite3 *db) {
+    SmartPlaylists playlists(db);
+    int64_t count = -1;
+    sqlite3_stmt *stmt;
+
+    sqlite3_exec(db, "INSERT INTO Songs (id, title, rating) VALUES (101, 'One', 5), (102, 'Two', 1), (103, 'Three', 1);", NULL, NULL, NULL);
+    int playlist_id = playlists.createPlaylist("Favourites", "rating >= 4");
+    sqlite3_exec(db, "UPDATE Songs SET rating = 4 WHERE id IN (102, 103);", NULL, NULL, NULL);
+    playlists.songsChanged({ 102, 103 });
+    sqlite3_exec(db, "DELETE FROM PlaylistSongs WHERE song_id = 101; DELETE FROM Songs WHERE id = 101;", NULL, NULL, NULL);
+    playlists.songsChanged({ 101 });
+    if (sqlite3_prepare_v2(db, "SELECT member_count FROM SmartPlaylists WHERE playlist_id = ?1;", -1, &stmt, NULL) == SQLITE_OK) {
+        sqlite3_bind_int(stmt, 1, playlist_id);
+        if (sqlite3_step(stmt) == SQLITE_ROW)
+            count = sqlite3_column_int64(stmt, 0);
+        sqlite3_finalize(stmt);
+    }
+    report("SmartPlaylists, member count after incremental updates", playlist_id > 0 && count == 2);
+}
+
+}
 
 int main(int argc, char **argv) {
     sqlite3 *db;
@@ -10,6 +346,23 @@ int main(int argc, char **argv) {
     sqlite3_open("test.sqlite", &db);
     std::cout << getEntityId(db, EntityType::Artist, "Kendrick Lamar") << std::endl;
     std::cout << getEntityId(db, EntityType::Artist, "Shreya Ghoshal") << std::endl;
-    sqlite3_close(db);
+    std::cout << getEntityId(db, EntityType::Artist, "Sunny \"The Kid\" Day") << std::endl;
+    Trie trie;
+    loadSearchTrie(db, trie);
+    for (auto &match : trie.completePrefix("s", 5))
+        std::cout << match.word << " (" << match.entry.id << ")" << std::endl;
+    for (auto &match : trie.fuzzySearch("shreya goshal", 2, 5))
+        std::cout << match.word << " (distance " << match.distance << ")" << std::endl;
+    testSmartPlaylistCount(db);
+    closeDatabase(db);
+    testFastTags();
+    testContentHash();
+    testCompileRule();
+    testSplitString();
+    shutdownLog();
+    if (failures > 0) {
+        std::cout << failures << " checks FAILED" << std::endl;
+        return 1;
+    }
     return 0;
 }
\ No newline at end of file
@@ -1,38 +1,23 @@
 #include "trie.hpp"
+
+#include <algorithm>
 #include <queue>
-#include <stack>
 
 /**
  * Constructs an empty Trie.
  */
 Trie::Trie() {
-    root = new TrieNode();
+    newNode(0, 0);
     size = 0;
 }
 
 /**
  * Destroys the Trie and frees its memory.
  *
- * This function is needed to destroy the Trie when it is
- * no longer needed. It frees the memory of all TrieNodes
- * in the Trie by using a queue to visit all the
- * TrieNodes. This uses a Breadth-First Search (BFS)
- * algorithm, which ensures that all TrieNodes are
- * visited.
+ * All nodes live in a single arena, so this releases a few contiguous
+ * buffers instead of visiting every node.
  */
 Trie::~Trie() {
-    std::queue<TrieNode*> q;
-    if (root != nullptr)
-        q.push(root);
-    while (!q.empty()) {
-        for (int i = 0; i < 256; i++) {
-            if (q.front()->children[i] != nullptr) {
-                q.push(q.front()->children[i]);
-            }
-        }
-        delete q.front();
-        q.pop();
-    }
 }
 
 /**
@@ -50,62 +35,103 @@ bool Trie::isEmpty() const {
  * \param word The word to be inserted.
  * \return \c 0 on success and a non-zero value on failure.
  *
- * This function inserts a word into the Trie. It starts at the root
- * TrieNode and traverses down the Trie, creating new TrieNodes
- * if necessary, until it reaches the end of the word. At the end
- * of the word, it sets the is_end_of_word flag to \c true and
- * increments the size of the Trie.
- */
-int Trie::insert(std::string word) {
-    TrieNode* node = root;
-    for (size_t i = 0; i < word.size(); i++) {
-        if (node->children[(unsigned char)word[i]] == nullptr)
-            node->children[(unsigned char)word[i]] = new TrieNode();
-        node = node->children[(unsigned char)word[i]];
-    }
-    node->is_end_of_word = true;
-    size++;
+ * This function starts at the root and follows the edges whose labels match
+ * the word. If the word ends or diverges in the middle of an edge, that edge
+ * is split in two. Whatever is left of the word once no edge matches becomes
+ * the label of a single new leaf. The node where the word ends is marked as
+ * the end of a word, and the size grows if the word was not already present.
+ */
+int Trie::insert(const std::string &word) {
+    insertPath(word, nullptr);
     return 0;
 }
 
 /**
- * Removes a word from the Trie.
+ * Inserts a word into the Trie, together with a payload.
  *
- * \param word The word to be removed.
+ * \param word The word to be inserted.
+ * \param entry The payload to store with the word.
  * \return \c 0 on success and a non-zero value on failure.
  *
- * This function removes a word from the Trie. It starts at the root
- * TrieNode and traverses down the Trie, popping off the nodes of the
- * stack until it finds a node that has other children or is the end
- * of a word. It then deletes the nodes below that node and decrements
- * the size of the Trie.
- */
-int Trie::remove(std::string word) {
-    std::stack<TrieNode*> node_stack;
-    TrieNode* node = root;
-    for (size_t i = 0; i < word.size(); i++) {
-        if (node->children[(unsigned char)word[i]] == nullptr)
-            return -1;
-        node = node->children[(unsigned char)word[i]];
-        node_stack.push(node);
-    }
-    node->is_end_of_word = false;
-    bool found = false;
-    TrieNode *last = nullptr;
-    while (!node_stack.empty() && !found) {
-        TrieNode* temp = node_stack.top();
-        node_stack.pop();
-        for (int i = 0; i < 256; i++) {
-            if (!(temp->children[i] == nullptr || temp->children[i] == last) || temp->is_end_of_word) {
-                found = true;
-                break;
-            }
+ * If the word already carries a payload with the same id and type, its
+ * score is replaced. Otherwise the payload is added to the word's payloads.
+ * The subtree scores along the path to the word are updated either way.
+ */
+int Trie::insert(const std::string &word, const TrieEntry &entry) {
+    std::vector<uint32_t> path;
+    uint32_t node = insertPath(word, &path), slot;
+
+    for (slot = nodes[node].first_entry; slot != NIL; slot = entries[slot].next)
+        if (entries[slot].entry.id == entry.id && entries[slot].entry.type == entry.type)
+            break;
+    if (slot == NIL) {
+        if (!free_entries.empty()) {
+            slot = free_entries.back();
+            free_entries.pop_back();
+        } else {
+            slot = (uint32_t)entries.size();
+            entries.emplace_back();
         }
-        if (!found)
-            delete temp;
-        last = temp;
+        entries[slot].next = nodes[node].first_entry;
+        nodes[node].first_entry = slot;
     }
-    size--;
+    entries[slot].entry = entry;
+    updateMaxScores(path);
+    return 0;
+}
+
+/**
+ * Removes a word from the Trie.
+ *
+ * \param word The word to be removed.
+ * \return \c 0 on success and a non-zero value on failure.
+ *
+ * This function finds the node where the word ends, clears its end of word
+ * flag and drops its payloads. A node left without children is unlinked and
+ * returned to the arena, and a node left with a single child and no word of
+ * its own is merged with that child, so the trie stays fully path-compressed.
+ */
+int Trie::remove(const std::string &word) {
+    std::vector<uint32_t> path;
+    uint32_t prev;
+
+    if (findPath(word, path, &prev) != 0)
+        return -1;
+    removeWord(path, prev);
+    return 0;
+}
+
+/**
+ * Removes one payload from a word.
+ *
+ * \param word The word that carries the payload.
+ * \param id The id of the payload to remove.
+ * \param type The type of the payload to remove.
+ * \return \c 0 on success and a non-zero value if the word or payload is not found.
+ *
+ * When the last payload of a word is removed, the word itself is removed.
+ */
+int Trie::remove(const std::string &word, int id, EntityType type) {
+    std::vector<uint32_t> path;
+    uint32_t prev, slot, before = NIL;
+
+    if (findPath(word, path, &prev) != 0)
+        return -1;
+    TrieNode &node = nodes[path.back()];
+    for (slot = node.first_entry; slot != NIL; before = slot, slot = entries[slot].next)
+        if (entries[slot].entry.id == id && entries[slot].entry.type == type)
+            break;
+    if (slot == NIL)
+        return -1;
+    if (before == NIL)
+        node.first_entry = entries[slot].next;
+    else
+        entries[before].next = entries[slot].next;
+    free_entries.push_back(slot);
+    if (node.first_entry == NIL)
+        removeWord(path, prev);
+    else
+        updateMaxScores(path);
     return 0;
 }
 
@@ -115,19 +141,137 @@ int Trie::remove(std::string word) {
  * \param word The word to check.
  * \return \c true if the word is contained in the Trie and \c false otherwise.
  *
- * This function traverses down the Trie, following the path defined by
- * the characters of the word. If it reaches the end of the word and the
- * node is marked as the end of a word, then the word is contained in the
- * Trie. Otherwise, the word is not contained in the Trie.
+ * This function follows the edges whose labels match the word. If the whole
+ * word is consumed exactly at the end of an edge, and that node is marked as
+ * the end of a word, then the word is contained in the Trie.
  */
-bool Trie::contains(std::string word) {
-    TrieNode* node = root;
-    for (size_t i = 0; i < word.size(); i++) {
-        if (node->children[(unsigned char)word[i]] == nullptr)
+bool Trie::contains(const std::string &word) const {
+    uint32_t node = 0, prev;
+    size_t pos = 0;
+
+    while (pos < word.size()) {
+        node = findChild(node, (unsigned char)word[pos], &prev);
+        if (node == NIL || matchLabel(node, word, pos) != nodes[node].label_length)
             return false;
-        node = node->children[(unsigned char)word[i]];
+        pos += nodes[node].label_length;
     }
-    return node->is_end_of_word;
+    return nodes[node].is_end_of_word;
+}
+
+/**
+ * Finds the highest scoring words that start with a prefix.
+ *
+ * \param prefix The prefix to complete.
+ * \param k The maximum number of results.
+ * \return Up to \c k matches, best score first. Words with equal scores are
+ *         ordered alphabetically. Only words inserted with a payload are
+ *         returned, once per payload.
+ *
+ * This function walks down to the node where the prefix ends, then explores
+ * its subtree best-first: a priority queue holds subtrees keyed by their
+ * maximum score, and individual payloads keyed by their own score. Because a
+ * subtree can never contain a payload that beats its maximum score, every
+ * payload popped from the queue is the next best result, and the search stops
+ * after \c k of them without visiting the rest of the subtree.
+ */
+std::vector<TrieMatch> Trie::completePrefix(const std::string &prefix, size_t k) const {
+    struct Candidate {
+        int32_t score;
+        uint32_t node;
+        uint32_t slot;          // NIL for a subtree, otherwise a single payload of node
+        std::string word;
+
+        bool operator<(const Candidate &other) const {
+            if (score != other.score)
+                return score < other.score;
+            return word > other.word;
+        }
+    };
+    std::vector<TrieMatch> matches;
+    std::priority_queue<Candidate> queue;
+    std::string word;
+    uint32_t node = 0, prev;
+    size_t pos = 0, matched;
+
+    if (k == 0)
+        return matches;
+    while (pos < prefix.size()) {
+        node = findChild(node, (unsigned char)prefix[pos], &prev);
+        if (node == NIL)
+            return matches;
+        matched = matchLabel(node, prefix, pos);
+        if (matched < nodes[node].label_length && pos + matched < prefix.size())
+            return matches;
+        word.append(labels, nodes[node].label_offset, nodes[node].label_length);
+        pos += matched;
+    }
+
+    if (nodes[node].max_score != NO_SCORE)
+        queue.push({ nodes[node].max_score, node, NIL, word });
+    while (!queue.empty() && matches.size() < k) {
+        Candidate candidate = queue.top();
+        queue.pop();
+        if (candidate.slot != NIL) {
+            matches.push_back({ candidate.word, entries[candidate.slot].entry });
+            continue;
+        }
+        const TrieNode &n = nodes[candidate.node];
+        for (uint32_t slot = n.first_entry; slot != NIL; slot = entries[slot].next)
+            queue.push({ entries[slot].entry.score, candidate.node, slot, candidate.word });
+        for (uint32_t child = n.first_child; child != NIL; child = nodes[child].next_sibling)
+            if (nodes[child].max_score != NO_SCORE)
+                queue.push({ nodes[child].max_score, child, NIL,
+                             candidate.word + labels.substr(nodes[child].label_offset, nodes[child].label_length) });
+    }
+    return matches;
+}
+
+/**
+ * Finds the words within an edit distance of a query.
+ *
+ * \param word The query.
+ * \param max_distance The largest edit distance to accept.
+ * \param limit The maximum number of results, or \c 0 for no limit.
+ * \return The matching words, closest first. Words at the same distance are
+ *         ordered by their best payload score, then alphabetically.
+ *
+ * The distance is the Levenshtein distance between the sequences of UTF-8
+ * code points of the query and a word, so "Ghoshal" and "Goshal" are one edit
+ * apart however the letters are encoded. The trie is walked depth-first while
+ * keeping one row of the edit distance table per code point of the path, and
+ * a subtree is skipped as soon as every entry of its row exceeds
+ * max_distance, since extending the path can never bring the distance down.
+ */
+std::vector<TrieFuzzyMatch> Trie::fuzzySearch(const std::string &word, int max_distance, size_t limit) const {
+    std::vector<TrieFuzzyMatch> matches;
+    std::vector<uint32_t> query;
+    std::vector<int> row;
+    std::string path, pending;
+    size_t pos = 0;
+
+    if (max_distance < 0)
+        return matches;
+    while (pos < word.size())
+        query.push_back(decodeUtf8(word, pos));
+    for (size_t i = 0; i <= query.size(); i++)
+        row.push_back((int)i);
+    fuzzyVisit(0, query, max_distance, path, row, pending, matches);
+
+    std::sort(matches.begin(), matches.end(), [this](const TrieFuzzyMatch &a, const TrieFuzzyMatch &b) {
+        if (a.distance != b.distance)
+            return a.distance < b.distance;
+        int a_score = NO_SCORE, b_score = NO_SCORE;
+        for (auto &entry : a.entries)
+            a_score = std::max(a_score, entry.score);
+        for (auto &entry : b.entries)
+            b_score = std::max(b_score, entry.score);
+        if (a_score != b_score)
+            return a_score > b_score;
+        return a.word < b.word;
+    });
+    if (limit > 0 && matches.size() > limit)
+        matches.resize(limit);
+    return matches;
 }
 
 /**
@@ -137,4 +281,395 @@ bool Trie::contains(std::string word) {
  */
 size_t Trie::getSize() const {
     return size;
-}
\ No newline at end of file
+}
+
+/**
+ * Returns the number of bytes allocated for the Trie's nodes, payloads and labels.
+ *
+ * \return The memory used by the Trie, in bytes.
+ */
+size_t Trie::getMemoryUsage() const {
+    return sizeof(*this) + nodes.capacity() * sizeof(TrieNode) + free_nodes.capacity() * sizeof(uint32_t) +
+           entries.capacity() * sizeof(EntrySlot) + free_entries.capacity() * sizeof(uint32_t) + labels.capacity();
+}
+
+/**
+ * Rewrites the arena so that it holds no free nodes or stale labels.
+ *
+ * Nodes are renumbered in breadth-first order, which puts the children of
+ * every node next to each other in memory, and the label pool is rebuilt in
+ * the same order. Calling this after a bulk load makes lookups touch fewer
+ * cache lines.
+ */
+void Trie::compact() {
+    std::vector<TrieNode> new_nodes;
+    std::vector<uint32_t> order;
+    std::vector<uint32_t> new_index(nodes.size(), NIL);
+    std::string new_labels;
+
+    order.reserve(nodes.size() - free_nodes.size());
+    order.push_back(0);
+    new_index[0] = 0;
+    for (size_t i = 0; i < order.size(); i++) {
+        for (uint32_t child = nodes[order[i]].first_child; child != NIL; child = nodes[child].next_sibling) {
+            new_index[child] = (uint32_t)order.size();
+            order.push_back(child);
+        }
+    }
+
+    new_nodes.reserve(order.size());
+    new_labels.reserve(labels.size());
+    for (uint32_t old_node : order) {
+        TrieNode node = nodes[old_node];
+        new_labels.append(labels, node.label_offset, node.label_length);
+        node.label_offset = (uint32_t)(new_labels.size() - node.label_length);
+        node.first_child = node.first_child == NIL ? NIL : new_index[node.first_child];
+        node.next_sibling = node.next_sibling == NIL ? NIL : new_index[node.next_sibling];
+        new_nodes.push_back(node);
+    }
+
+    nodes.swap(new_nodes);
+    labels.swap(new_labels);
+    free_nodes.clear();
+    free_nodes.shrink_to_fit();
+}
+
+/**
+ * Takes a node from the arena, reusing a freed one if possible.
+ */
+uint32_t Trie::newNode(uint32_t label_offset, uint32_t label_length) {
+    uint32_t node;
+
+    if (!free_nodes.empty()) {
+        node = free_nodes.back();
+        free_nodes.pop_back();
+    } else {
+        node = (uint32_t)nodes.size();
+        nodes.emplace_back();
+    }
+    nodes[node].label_offset = label_offset;
+    nodes[node].label_length = label_length;
+    nodes[node].first_child = NIL;
+    nodes[node].next_sibling = NIL;
+    nodes[node].first_entry = NIL;
+    nodes[node].max_score = NO_SCORE;
+    nodes[node].first_byte = label_length > 0 ? (unsigned char)labels[label_offset] : 0;
+    nodes[node].is_end_of_word = false;
+    return node;
+}
+
+/**
+ * Returns a node to the arena.
+ */
+void Trie::freeNode(uint32_t node) {
+    free_nodes.push_back(node);
+}
+
+/**
+ * Finds the child of node whose label starts with byte.
+ *
+ * \param prev Receives the sibling before the child (or before the place the
+ *             child would be inserted), or NIL if there is none.
+ * \return The child, or NIL if there is none.
+ */
+uint32_t Trie::findChild(uint32_t node, unsigned char byte, uint32_t *prev) const {
+    uint32_t child = nodes[node].first_child;
+
+    *prev = NIL;
+    while (child != NIL && nodes[child].first_byte < byte) {
+        *prev = child;
+        child = nodes[child].next_sibling;
+    }
+    return (child != NIL && nodes[child].first_byte == byte) ? child : NIL;
+}
+
+/**
+ * Adds child to the children of parent, keeping them sorted by first byte.
+ */
+void Trie::linkChild(uint32_t parent, uint32_t child) {
+    uint32_t prev;
+
+    findChild(parent, nodes[child].first_byte, &prev);
+    if (prev == NIL) {
+        nodes[child].next_sibling = nodes[parent].first_child;
+        nodes[parent].first_child = child;
+    } else {
+        nodes[child].next_sibling = nodes[prev].next_sibling;
+        nodes[prev].next_sibling = child;
+    }
+}
+
+/**
+ * Removes child from the children of parent, given the sibling before it.
+ */
+void Trie::unlinkChild(uint32_t parent, uint32_t child, uint32_t prev) {
+    if (prev == NIL)
+        nodes[parent].first_child = nodes[child].next_sibling;
+    else
+        nodes[prev].next_sibling = nodes[child].next_sibling;
+}
+
+/**
+ * Merges a node that has no word of its own with its only child.
+ *
+ * The node keeps its place among its siblings and takes over the child's
+ * children, payloads and end of word flag. The concatenated label is appended to the
+ * label pool.
+ */
+void Trie::mergeWithOnlyChild(uint32_t node) {
+    uint32_t child = nodes[node].first_child;
+    uint32_t label_offset = (uint32_t)labels.size();
+
+    std::string merged = labels.substr(nodes[node].label_offset, nodes[node].label_length) +
+                         labels.substr(nodes[child].label_offset, nodes[child].label_length);
+    labels += merged;
+    nodes[node].label_offset = label_offset;
+    nodes[node].label_length += nodes[child].label_length;
+    nodes[node].first_child = nodes[child].first_child;
+    nodes[node].first_entry = nodes[child].first_entry;
+    nodes[node].max_score = nodes[child].max_score;
+    nodes[node].is_end_of_word = nodes[child].is_end_of_word;
+    freeNode(child);
+}
+
+/**
+ * Counts how many bytes of the node's label match the word, starting at pos.
+ */
+size_t Trie::matchLabel(uint32_t node, const std::string &word, size_t pos) const {
+    const TrieNode &n = nodes[node];
+    size_t i = 0;
+
+    while (i < n.label_length && pos + i < word.size() && labels[n.label_offset + i] == word[pos + i])
+        i++;
+    return i;
+}
+
+/**
+ * Follows word from the root, splitting edges and adding a leaf as needed,
+ * and marks the node where it ends as the end of a word.
+ *
+ * \param path If not null, receives the nodes from the root to the end of the word.
+ * \return The node where the word ends.
+ */
+uint32_t Trie::insertPath(const std::string &word, std::vector<uint32_t> *path) {
+    uint32_t node = 0, child, prev, mid;
+    size_t pos = 0, matched;
+
+    if (path != nullptr)
+        path->push_back(node);
+    while (pos < word.size()) {
+        child = findChild(node, (unsigned char)word[pos], &prev);
+        if (child == NIL) {
+            labels.append(word, pos, std::string::npos);
+            child = newNode((uint32_t)(labels.size() - (word.size() - pos)), (uint32_t)(word.size() - pos));
+            linkChild(node, child);
+            node = child;
+            if (path != nullptr)
+                path->push_back(node);
+            break;
+        }
+        matched = matchLabel(child, word, pos);
+        if (matched < nodes[child].label_length) {
+            // Split the edge: mid takes the matched part of the label and child keeps the rest.
+            mid = newNode(nodes[child].label_offset, (uint32_t)matched);
+            nodes[mid].next_sibling = nodes[child].next_sibling;
+            nodes[mid].first_child = child;
+            nodes[mid].max_score = nodes[child].max_score;
+            if (prev == NIL)
+                nodes[node].first_child = mid;
+            else
+                nodes[prev].next_sibling = mid;
+            nodes[child].label_offset += (uint32_t)matched;
+            nodes[child].label_length -= (uint32_t)matched;
+            nodes[child].first_byte = (unsigned char)labels[nodes[child].label_offset];
+            nodes[child].next_sibling = NIL;
+            child = mid;
+        }
+        node = child;
+        pos += matched;
+        if (path != nullptr)
+            path->push_back(node);
+    }
+    if (!nodes[node].is_end_of_word) {
+        nodes[node].is_end_of_word = true;
+        size++;
+    }
+    return node;
+}
+
+/**
+ * Finds the nodes from the root to the end of a word that is in the Trie.
+ *
+ * \param path Receives the nodes from the root to the end of the word.
+ * \param prev Receives the sibling before the last node in path, or NIL.
+ * \return \c 0 if the word is in the Trie and \c -1 otherwise.
+ */
+int Trie::findPath(const std::string &word, std::vector<uint32_t> &path, uint32_t *prev) const {
+    uint32_t node = 0, child;
+    size_t pos = 0;
+
+    *prev = NIL;
+    path.push_back(node);
+    while (pos < word.size()) {
+        child = findChild(node, (unsigned char)word[pos], prev);
+        if (child == NIL || matchLabel(child, word, pos) != nodes[child].label_length)
+            return -1;
+        node = child;
+        pos += nodes[child].label_length;
+        path.push_back(node);
+    }
+    return nodes[node].is_end_of_word ? 0 : -1;
+}
+
+/**
+ * Removes the word that ends at the last node of path, along with its
+ * payloads, and restores path compression around it.
+ */
+void Trie::removeWord(std::vector<uint32_t> &path, uint32_t prev) {
+    uint32_t node = path.back(), parent;
+
+    nodes[node].is_end_of_word = false;
+    freeEntries(node);
+    size--;
+
+    if (node != 0) {
+        parent = path[path.size() - 2];
+        if (nodes[node].first_child == NIL) {
+            unlinkChild(parent, node, prev);
+            freeNode(node);
+            path.pop_back();
+            if (parent != 0 && !nodes[parent].is_end_of_word && nodes[parent].first_child != NIL &&
+                nodes[nodes[parent].first_child].next_sibling == NIL)
+                mergeWithOnlyChild(parent);
+        } else if (nodes[nodes[node].first_child].next_sibling == NIL)
+            mergeWithOnlyChild(node);
+    }
+    updateMaxScores(path);
+}
+
+/**
+ * Returns all payloads of a node to the entry arena.
+ */
+void Trie::freeEntries(uint32_t node) {
+    for (uint32_t slot = nodes[node].first_entry; slot != NIL; slot = entries[slot].next)
+        free_entries.push_back(slot);
+    nodes[node].first_entry = NIL;
+}
+
+/**
+ * Recomputes the subtree scores of the nodes in path, from the bottom up.
+ */
+void Trie::updateMaxScores(const std::vector<uint32_t> &path) {
+    for (size_t i = path.size(); i-- > 0;) {
+        TrieNode &node = nodes[path[i]];
+        int32_t max_score = NO_SCORE;
+        for (uint32_t slot = node.first_entry; slot != NIL; slot = entries[slot].next)
+            max_score = std::max(max_score, (int32_t)entries[slot].entry.score);
+        for (uint32_t child = node.first_child; child != NIL; child = nodes[child].next_sibling)
+            max_score = std::max(max_score, nodes[child].max_score);
+        node.max_score = max_score;
+    }
+}
+
+/**
+ * Visits a node during fuzzySearch().
+ *
+ * \param word The path from the root to the parent of node; restored on return.
+ * \param row The edit distance row for the code points of word.
+ * \param pending The bytes of a code point whose UTF-8 sequence continues in
+ *                node's label.
+ */
+void Trie::fuzzyVisit(uint32_t node, const std::vector<uint32_t> &query, int max_distance, std::string &word,
+                      std::vector<int> &row, std::string &pending, std::vector<TrieFuzzyMatch> &matches) const {
+    const TrieNode &n = nodes[node];
+    std::vector<int> current(row), next(row.size());
+    std::string current_pending(pending);
+    size_t word_length = word.size();
+
+    // Feeds the pending bytes into the row, returning false once no extension can match.
+    auto flush = [&](std::vector<int> &r, std::string &p) {
+        size_t pos = 0;
+        int row_min = 0;
+        while (pos < p.size()) {
+            uint32_t code_point = decodeUtf8(p, pos);
+            next[0] = r[0] + 1;
+            row_min = next[0];
+            for (size_t j = 1; j < r.size(); j++) {
+                next[j] = std::min({ r[j] + 1, next[j - 1] + 1, r[j - 1] + (query[j - 1] == code_point ? 0 : 1) });
+                row_min = std::min(row_min, next[j]);
+            }
+            r.swap(next);
+        }
+        p.clear();
+        return row_min <= max_distance;
+    };
+
+    for (uint32_t i = 0; i < n.label_length; i++) {
+        unsigned char byte = (unsigned char)labels[n.label_offset + i];
+        if (!current_pending.empty() && (byte & 0xC0) != 0x80 && !flush(current, current_pending))
+            return;
+        current_pending.push_back((char)byte);
+        if (current_pending.size() >= utf8SequenceLength((unsigned char)current_pending[0]) && !flush(current, current_pending))
+            return;
+    }
+
+    word.append(labels, n.label_offset, n.label_length);
+    if (n.is_end_of_word) {
+        std::vector<int> final_row(current);
+        std::string final_pending(current_pending);
+        flush(final_row, final_pending);
+        if (final_row.back() <= max_distance) {
+            TrieFuzzyMatch match;
+            match.word = word;
+            match.distance = final_row.back();
+            for (uint32_t slot = n.first_entry; slot != NIL; slot = entries[slot].next)
+                match.entries.push_back(entries[slot].entry);
+            matches.push_back(std::move(match));
+        }
+    }
+    for (uint32_t child = n.first_child; child != NIL; child = nodes[child].next_sibling)
+        fuzzyVisit(child, query, max_distance, word, current, current_pending, matches);
+    word.resize(word_length);
+}
+
+/**
+ * Returns the length of the UTF-8 sequence that starts with the given byte,
+ * or 1 for bytes that cannot start a sequence.
+ */
+size_t Trie::utf8SequenceLength(unsigned char byte) {
+    if (byte >= 0xF0 && byte <= 0xF4)
+        return 4;
+    if (byte >= 0xE0)
+        return byte <= 0xEF ? 3 : 1;
+    if (byte >= 0xC2)
+        return 2;
+    return 1;
+}
+
+/**
+ * Decodes the code point that starts at pos and advances pos past it.
+ *
+ * Malformed sequences decode one byte at a time, to values above the
+ * Unicode range so they can never equal a real code point.
+ */
+uint32_t Trie::decodeUtf8(const std::string &s, size_t &pos) {
+    unsigned char lead = (unsigned char)s[pos];
+    size_t length = utf8SequenceLength(lead), i;
+    uint32_t code_point;
+
+    if (length == 1 || pos + length > s.size()) {
+        pos++;
+        return lead < 0x80 ? lead : 0x110000u + lead;
+    }
+    code_point = lead & (0xFF >> (length + 1));
+    for (i = 1; i < length; i++) {
+        unsigned char byte = (unsigned char)s[pos + i];
+        if ((byte & 0xC0) != 0x80) {
+            pos++;
+            return 0x110000u + lead;
+        }
+        code_point = (code_point << 6) | (byte & 0x3F);
+    }
+    pos += length;
+    return code_point;
+}
@@ -1,30 +1,106 @@
 #pragma once
 
 #include <string>
+#include <vector>
+#include <cstdint>
 
+#include "entity_type.hpp"
+
+/**
+ * The payload stored with a word: which entity the word names, and how
+ * highly it should rank among completions.
+ */
+struct TrieEntry {
+    int id;
+    EntityType type;
+    int score;
+};
+
+struct TrieMatch {
+    std::string word;
+    TrieEntry entry;
+};
+
+struct TrieFuzzyMatch {
+    std::string word;
+    int distance;                       // edit distance from the query, in code points
+    std::vector<TrieEntry> entries;
+};
+
+/**
+ * A set of strings stored as a radix (path-compressed) trie.
+ *
+ * Each node stands for an edge labelled with one or more bytes, so chains of
+ * single-child nodes collapse into a single node. Nodes live in one contiguous
+ * arena and refer to each other by index, and all edge labels live in one
+ * shared byte pool, so the whole trie is a handful of allocations regardless
+ * of how many words it holds.
+ *
+ * A word can carry any number of TrieEntry payloads (an artist and an album
+ * may share a name). Every node remembers the highest score found in its
+ * subtree, which lets completePrefix() visit nodes best-first and stop as
+ * soon as it has k results. fuzzySearch() finds words within an edit
+ * distance of a query, counting UTF-8 code points rather than bytes.
+ */
 class Trie {
     public:
         Trie();
         ~Trie();
 
         bool isEmpty() const;
-        int insert(std::string word);
-        int remove(std::string word);
-        bool contains(std::string word);
+        int insert(const std::string &word);
+        int insert(const std::string &word, const TrieEntry &entry);
+        int remove(const std::string &word);
+        int remove(const std::string &word, int id, EntityType type);
+        bool contains(const std::string &word) const;
+        std::vector<TrieMatch> completePrefix(const std::string &prefix, size_t k) const;
+        std::vector<TrieFuzzyMatch> fuzzySearch(const std::string &word, int max_distance, size_t limit) const;
         size_t getSize() const;
+        size_t getMemoryUsage() const;
+        void compact();
 
     private:
+        static constexpr uint32_t NIL = UINT32_MAX;
+        static constexpr int32_t NO_SCORE = INT32_MIN;
 
         struct TrieNode {
-            TrieNode* children[256];
+            uint32_t label_offset;      // start of the edge label in labels
+            uint32_t label_length;      // length of the edge label, 0 only for the root
+            uint32_t first_child;       // children are kept sorted by first_byte
+            uint32_t next_sibling;
+            uint32_t first_entry;       // payloads of the word ending here, linked through entries
+            int32_t max_score;          // best entry score in this subtree, NO_SCORE if it has none
+            unsigned char first_byte;   // copy of the first label byte, to scan siblings without touching labels
             bool is_end_of_word;
-            TrieNode() {
-                for (int i = 0; i < 256; i++)
-                    children[i] = NULL;
-                is_end_of_word = false;
-            }
         };
 
-        TrieNode* root;
+        struct EntrySlot {
+            TrieEntry entry;
+            uint32_t next;
+        };
+
+        uint32_t insertPath(const std::string &word, std::vector<uint32_t> *path);
+        int findPath(const std::string &word, std::vector<uint32_t> &path, uint32_t *prev) const;
+        void removeWord(std::vector<uint32_t> &path, uint32_t prev);
+        void freeEntries(uint32_t node);
+        void updateMaxScores(const std::vector<uint32_t> &path);
+        static size_t utf8SequenceLength(unsigned char byte);
+        static uint32_t decodeUtf8(const std::string &s, size_t &pos);
+        void fuzzyVisit(uint32_t node, const std::vector<uint32_t> &query, int max_distance, std::string &word,
+                        std::vector<int> &row, std::string &pending, std::vector<TrieFuzzyMatch> &matches) const;
+
+        uint32_t newNode(uint32_t label_offset, uint32_t label_length);
+        void freeNode(uint32_t node);
+        uint32_t findChild(uint32_t node, unsigned char byte, uint32_t *prev) const;
+        void linkChild(uint32_t parent, uint32_t child);
+        void unlinkChild(uint32_t parent, uint32_t child, uint32_t prev);
+        void mergeWithOnlyChild(uint32_t node);
+        size_t matchLabel(uint32_t node, const std::string &word, size_t pos) const;
+
+        std::vector<TrieNode> nodes;
+        std::vector<uint32_t> free_nodes;
+        std::vector<EntrySlot> entries;
+        std::vector<uint32_t> free_entries;
+        std::string labels;
         size_t size;
-};
\ No newline at end of file
+};
@@ -0,0 +1,157 @@
+#include "trie.hpp"
+
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+/**
+ * The node layout Trie used before it became a radix trie: one heap-allocated
+ * node per byte, each holding 256 child pointers. Kept here only so the two
+ * layouts can be compared on the same input.
+ */
+class LegacyTrie {
+    public:
+        LegacyTrie() : root(new TrieNode()), node_count(1) {}
+        ~LegacyTrie() {
+            std::vector<TrieNode *> stack{root};
+            while (!stack.empty()) {
+                TrieNode *node = stack.back();
+                stack.pop_back();
+                for (int i = 0; i < 256; i++)
+                    if (node->children[i] != nullptr)
+                        stack.push_back(node->children[i]);
+                delete node;
+            }
+        }
+
+        void insert(const std::string &word) {
+            TrieNode *node = root;
+            for (size_t i = 0; i < word.size(); i++) {
+                if (node->children[(unsigned char)word[i]] == nullptr) {
+                    node->children[(unsigned char)word[i]] = new TrieNode();
+                    node_count++;
+                }
+                node = node->children[(unsigned char)word[i]];
+            }
+            node->is_end_of_word = true;
+        }
+
+        bool contains(const std::string &word) const {
+            TrieNode *node = root;
+            for (size_t i = 0; i < word.size(); i++) {
+                if (node->children[(unsigned char)word[i]] == nullptr)
+                    return false;
+                node = node->children[(unsigned char)word[i]];
+            }
+            return node->is_end_of_word;
+        }
+
+        size_t getMemoryUsage() const {
+            return node_count * sizeof(TrieNode);
+        }
+
+    private:
+        struct TrieNode {
+            TrieNode *children[256] = {};
+            bool is_end_of_word = false;
+        };
+
+        TrieNode *root;
+        size_t node_count;
+};
+
+/**
+ * Builds count artist/album/title-like strings from a small vocabulary, so
+ * that words share prefixes the way real library strings do.
+ */
+std::vector<std::string> makeWords(size_t count) {
+    const char *parts[] = { "The ", "Love ", "Night", "Shreya ", "Ghoshal", "Greta ", "Van ", "Fleet",
+                            "Dil ", "Diyan ", "Gallan", "Safari ", "Song", "Highway ", "Tune", "Remix",
+                            " (Live)", " - Remastered", "Chori ", "Kiya ", "Re ", "Jiya", "Mast ", "Nain" };
+    std::mt19937 rng(42);
+    std::vector<std::string> words;
+    words.reserve(count);
+    for (size_t i = 0; i < count; i++) {
+        std::string word;
+        int length = 2 + rng() % 4;
+        for (int j = 0; j < length; j++)
+            word += parts[rng() % (sizeof(parts) / sizeof(parts[0]))];
+        word += " " + std::to_string(i % 997);
+        words.push_back(word);
+    }
+    return words;
+}
+
+/**
+ * Times fuzzySearch() on misspelled copies of some of the words: one byte of
+ * each is replaced.
+ */
+double microsecondsPerFuzzySearch(const Trie &trie, const std::vector<std::string> &words, int max_distance, size_t &found) {
+    std::mt19937 rng(7);
+    std::vector<std::string> queries;
+    for (size_t i = 0; i < 200 && i < words.size(); i++) {
+        std::string query = words[rng() % words.size()];
+        if (!query.empty())
+            query[rng() % query.size()] = 'x';
+        queries.push_back(query);
+    }
+    auto start = std::chrono::steady_clock::now();
+    for (auto &query : queries)
+        found += trie.fuzzySearch(query, max_distance, 10).empty() ? 0 : 1;
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::micro>(end - start).count() / queries.size();
+}
+
+template <typename T>
+double nanosecondsPerLookup(T &trie, const std::vector<std::string> &words, size_t &found) {
+    auto start = std::chrono::steady_clock::now();
+    for (int round = 0; round < 5; round++)
+        for (auto &word : words)
+            found += trie.contains(word);
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count() / (5.0 * words.size());
+}
+
+int main(int argc, char **argv) {
+    std::vector<std::string> words;
+
+    if (argc > 1 && std::string(argv[1]) == "-f" && argc > 2) {
+        std::ifstream in(argv[2]);
+        std::string line;
+        while (std::getline(in, line))
+            words.push_back(line);
+    } else
+        words = makeWords(argc > 1 ? (size_t)atol(argv[1]) : 200000);
+    if (words.empty()) {
+        std::cout << "Usage: " << argv[0] << " [word count] | -f <file with one word per line>" << std::endl;
+        return 1;
+    }
+
+    size_t found = 0;
+    Trie trie;
+    for (auto &word : words)
+        trie.insert(word);
+    trie.compact();
+    double trie_ns = nanosecondsPerLookup(trie, words, found);
+    size_t fuzzy_found = 0;
+    double fuzzy_1_us = microsecondsPerFuzzySearch(trie, words, 1, fuzzy_found);
+    double fuzzy_2_us = microsecondsPerFuzzySearch(trie, words, 2, fuzzy_found);
+
+    std::cout << "Words: " << words.size() << " (" << trie.getSize() << " distinct)" << std::endl;
+    // The legacy layout needs about 16 KB per word, so it is skipped where it would not fit in memory.
+    if (words.size() <= 200000) {
+        LegacyTrie legacy;
+        for (auto &word : words)
+            legacy.insert(word);
+        double legacy_ns = nanosecondsPerLookup(legacy, words, found);
+        std::cout << "Legacy trie memory: " << legacy.getMemoryUsage() << " bytes, lookup: " << legacy_ns << " ns" << std::endl;
+    } else
+        found += 5 * words.size();
+    std::cout << "Radix trie memory:  " << trie.getMemoryUsage() << " bytes, lookup: " << trie_ns << " ns" << std::endl;
+    std::cout << "Fuzzy search: " << fuzzy_1_us << " us at distance 1, " << fuzzy_2_us << " us at distance 2" << std::endl;
+    return found == 10 * words.size() ? 0 : 1;
+}